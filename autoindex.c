@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "autoindex.h"
+#include "utils.h"
+#include "logger.h"
+
+#define MAX_TIME_STR 32
+
+#define AUTOINDEX_HEAD "<!DOCTYPE html>\n<html>\n    <head>\n" \
+    "        <title>Index of "
+#define AUTOINDEX_TITLE_END "</title>\n    </head>\n    <body>\n" \
+    "        <h1>Index of "
+#define AUTOINDEX_H1_END "</h1>\n        <pre>\n"
+#define AUTOINDEX_FOOTER "        </pre>\n    </body>\n</html>\n"
+
+/*
+ * Listings are rendered once into <cache_dir>/<hash>.html and the file gets
+ * the directory's mtime. Any entry added, removed or renamed bumps the
+ * directory mtime, so a differing mtime means the listing is stale. Being
+ * plain files, the cache is shared by all workers and survives restarts.
+ */
+
+static unsigned long long listing_hash(char *root, char *url)
+{
+    unsigned long long hash = 14695981039346656037ull;
+
+    for (char *c = root; *c; ++c)
+	hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+
+    hash = (hash ^ '\n') * 1099511628211ull;
+
+    for (char *c = url; *c; ++c)
+	hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+
+    return hash;
+}
+
+static void html_escape(FILE *fp, char *str)
+{
+    for (; *str; ++str)
+    {
+	switch (*str)
+	{
+	    case '&':
+		fputs("&amp;", fp);
+		break;
+	    case '<':
+		fputs("&lt;", fp);
+		break;
+	    case '>':
+		fputs("&gt;", fp);
+		break;
+	    case '"':
+		fputs("&quot;", fp);
+		break;
+	    default:
+		fputc(*str, fp);
+		break;
+	}
+    }
+}
+
+static void url_escape(FILE *fp, char *str)
+{
+    for (; *str; ++str)
+    {
+	if ((*str >= 'a' && *str <= 'z') || (*str >= 'A' && *str <= 'Z') ||
+	    (*str >= '0' && *str <= '9') || strchr("-._~/", *str))
+	{
+	    fputc(*str, fp);
+	}
+	else
+	{
+	    fprintf(fp, "%%%02X", (unsigned char)*str);
+	}
+    }
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+static int read_names(DIR *dir, char ***names, int *names_num)
+{
+    struct dirent *entry;
+    char **tmp;
+    int size = 0;
+
+    *names = NULL;
+    *names_num = 0;
+
+    while ((entry = readdir(dir)))
+    {
+	/* Hidden entries are not listed, "." and ".." included */
+	if (entry->d_name[0] == '.')
+	    continue;
+
+	if (*names_num == size)
+	{
+	    size = size ? size * 2 : 64;
+
+	    if (!(tmp = realloc(*names, size * sizeof(char *))))
+		return -1;
+
+	    *names = tmp;
+	}
+
+	if (!((*names)[*names_num] = strdup(entry->d_name)))
+	    return -1;
+
+	(*names_num)++;
+    }
+
+    qsort(*names, *names_num, sizeof(char *), compare_names);
+
+    return 0;
+}
+
+static int write_listing(FILE *fp, DIR *dir, char *url)
+{
+    char **names = NULL, time_str[MAX_TIME_STR], *slash;
+    int names_num = 0, rv = -1;
+    struct stat statbuf;
+
+    slash = url[strlen(url) - 1] == '/' ? "" : "/";
+
+    if (read_names(dir, &names, &names_num))
+    {
+	log_message(LOG_LEVEL_ERROR, "autoindex: reading directory");
+	goto Exit;
+    }
+
+    fputs(AUTOINDEX_HEAD, fp);
+    html_escape(fp, url);
+    fputs(AUTOINDEX_TITLE_END, fp);
+    html_escape(fp, url);
+    fputs(AUTOINDEX_H1_END, fp);
+
+    fputs("<a href=\"", fp);
+    url_escape(fp, url);
+    fprintf(fp, "%s../\">../</a>\n", slash);
+
+    for (int i = 0; i < names_num; ++i)
+    {
+	if (fstatat(dirfd(dir), names[i], &statbuf, 0))
+	    continue;
+
+	strftime(time_str, MAX_TIME_STR, "%d-%m-%Y %H:%M",
+	    localtime(&statbuf.st_mtime));
+
+	fputs("<a href=\"", fp);
+	url_escape(fp, url);
+	fputs(slash, fp);
+	url_escape(fp, names[i]);
+	fputs(S_ISDIR(statbuf.st_mode) ? "/\">" : "\">", fp);
+	html_escape(fp, names[i]);
+	fprintf(fp, "%s</a> %s %lld\n", S_ISDIR(statbuf.st_mode) ? "/" : "",
+	    time_str, (long long)statbuf.st_size);
+    }
+
+    fputs(AUTOINDEX_FOOTER, fp);
+
+    rv = ferror(fp) ? -1 : 0;
+
+Exit:
+    for (int i = 0; i < names_num; ++i)
+	free(names[i]);
+    free(names);
+
+    return rv;
+}
+
+/* Render into a temporary file and rename, readers never see it partial */
+static int render_listing(int dir_fd, struct stat *dir_stat, char *url,
+    char *listing_path)
+{
+    char *tmp_path = NULL;
+    struct timespec times[2] = {
+	{ .tv_nsec = UTIME_OMIT },
+	dir_stat->st_mtim
+    };
+    DIR *dir = NULL;
+    FILE *fp = NULL;
+    int fd, rv = -1;
+
+    /* Own fd for readdir, dir_fd belongs to the caller */
+    if ((fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+	!(dir = fdopendir(fd)))
+    {
+	log_message(LOG_LEVEL_WARNING, "autoindex: opendir");
+	if (fd != -1)
+	    close(fd);
+	return -1;
+    }
+
+    if (snprintf_with_alloc(&tmp_path, "%s.%d", listing_path, getpid()) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "snprintf_with_alloc failed");
+	goto Exit;
+    }
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	0644)) == -1 || !(fp = fdopen(fd, "w")))
+    {
+	log_message(LOG_LEVEL_ERROR, "autoindex: creating listing");
+	if (fd != -1)
+	    close(fd);
+	goto Exit;
+    }
+
+    if (write_listing(fp, dir, url) || fflush(fp) ||
+	futimens(fileno(fp), times))
+    {
+	log_message(LOG_LEVEL_ERROR, "autoindex: writing listing");
+	goto Exit;
+    }
+
+    if (rename(tmp_path, listing_path))
+    {
+	log_message(LOG_LEVEL_ERROR, "autoindex: rename");
+	goto Exit;
+    }
+
+    rv = 0;
+
+Exit:
+    if (fp)
+	fclose(fp);
+    if (dir)
+	closedir(dir);
+    if (rv && tmp_path)
+	unlink(tmp_path);
+    free(tmp_path);
+
+    return rv;
+}
+
+int autoindex_init(char *cache_dir)
+{
+    if (mkdir(cache_dir, 0755) && errno != EEXIST)
+    {
+	log_message(LOG_LEVEL_ERROR, "autoindex: creating cache directory");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Listings are keyed by route root and the normalized url */
+int autoindex_get(char *cache_dir, int dir_fd, char *root,
+    struct stat *dir_stat, char *url, char **listing_path,
+    struct stat *listing_stat)
+{
+    *listing_path = NULL;
+
+    if (snprintf_with_alloc(listing_path, "%s/%016llx.html", cache_dir,
+	listing_hash(root, url)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "snprintf_with_alloc failed");
+	return -1;
+    }
+
+    if (!stat(*listing_path, listing_stat) &&
+	listing_stat->st_mtim.tv_sec == dir_stat->st_mtim.tv_sec &&
+	listing_stat->st_mtim.tv_nsec == dir_stat->st_mtim.tv_nsec)
+    {
+	LOG_DEBUG("autoindex: cached listing");
+	return 0;
+    }
+
+    if (render_listing(dir_fd, dir_stat, url, *listing_path) ||
+	stat(*listing_path, listing_stat))
+    {
+	free(*listing_path);
+	*listing_path = NULL;
+	return -1;
+    }
+
+    LOG_DEBUG("autoindex: rendered listing");
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _AUTOINDEX_H_
+#define _AUTOINDEX_H_
+
+#include <sys/stat.h>
+
+int autoindex_init(char *cache_dir);
+int autoindex_get(char *cache_dir, int dir_fd, char *root,
+    struct stat *dir_stat, char *url, char **listing_path,
+    struct stat *listing_stat);
+
+#endif
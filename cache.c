@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "cache.h"
+#include "logger.h"
+
+#define CACHE_WAIT_NS 10000000
+
+typedef enum {
+    ENTRY_FREE = 0,
+    /* A worker is fetching it, lookups for the key wait */
+    ENTRY_FILLING,
+    ENTRY_VALID,
+    /* The backend's answer wasn't cacheable, don't make others wait */
+    ENTRY_PASS,
+    /* Replaced or evicted while being sent, freed by its last reader */
+    ENTRY_RETIRED
+} entry_state_t;
+
+typedef struct {
+    entry_state_t state;
+    int linked;
+    int next;
+    unsigned int hash;
+    int key_len;
+    char key[CACHE_KEY_MAX];
+    pid_t filler;
+    int updating;
+    int readers;
+    /* stored is backdated by the age the response arrived with */
+    time_t stored;
+    time_t expires;
+    time_t stale_until;
+    off_t offset;
+    long size;
+    int head_len;
+    int body_len;
+} cache_entry_t;
+
+/*
+ * The index is shared by every worker and mapped before the first fork:
+ * hash buckets chaining into a fixed array of entries, behind a single
+ * lock held for pointer work only, never across I/O. Bodies live in an
+ * unlinked slab file used as a ring, the oldest regions are overwritten
+ * first unless someone is still sending them.
+ */
+typedef struct {
+    unsigned char lock;
+    int free;
+    off_t next;
+} cache_header_t;
+
+static cache_header_t *cache;
+static int *buckets;
+static cache_entry_t *entries;
+static int slab_fd = -1;
+static cache_opts_t cache_opts;
+static char cache_path[PATH_MAX];
+
+static void cache_lock()
+{
+    while (__atomic_test_and_set(&cache->lock, __ATOMIC_ACQUIRE))
+	sched_yield();
+}
+
+static void cache_unlock()
+{
+    __atomic_clear(&cache->lock, __ATOMIC_RELEASE);
+}
+
+static unsigned int key_hash(char *key, int key_len)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < key_len; ++i)
+    {
+	hash ^= (unsigned char)key[i];
+	hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int entry_find(char *key, int key_len, unsigned int hash)
+{
+    cache_entry_t *entry;
+
+    for (int i = buckets[hash % cache_opts.entries]; i != -1; i = entry->next)
+    {
+	entry = &entries[i];
+
+	if (entry->hash == hash && entry->key_len == key_len &&
+	    !memcmp(entry->key, key, key_len))
+	{
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+static void entry_link(int i)
+{
+    int *bucket = &buckets[entries[i].hash % cache_opts.entries];
+
+    entries[i].next = *bucket;
+    entries[i].linked = 1;
+    *bucket = i;
+}
+
+static void entry_unlink(int i)
+{
+    int *link = &buckets[entries[i].hash % cache_opts.entries];
+
+    while (*link != i)
+	link = &entries[*link].next;
+
+    *link = entries[i].next;
+    entries[i].linked = 0;
+}
+
+static void entry_free(int i)
+{
+    entries[i].state = ENTRY_FREE;
+    entries[i].size = 0;
+    entries[i].readers = 0;
+    entries[i].next = cache->free;
+    cache->free = i;
+}
+
+/* Out of the index at once, out of the slab once nobody sends it */
+static void entry_retire(int i)
+{
+    if (entries[i].linked)
+	entry_unlink(i);
+
+    if (entries[i].readers)
+	entries[i].state = ENTRY_RETIRED;
+    else
+	entry_free(i);
+}
+
+/* A full index makes room by dropping whatever expires first */
+static int entry_alloc(char *key, int key_len, unsigned int hash)
+{
+    cache_entry_t *entry;
+    int i, victim = -1;
+
+    if (cache->free == -1)
+    {
+	for (i = 0; i < cache_opts.entries; ++i)
+	{
+	    entry = &entries[i];
+
+	    if ((entry->state == ENTRY_VALID || entry->state == ENTRY_PASS) &&
+		!entry->readers && (victim == -1 ||
+		entry->expires < entries[victim].expires))
+	    {
+		victim = i;
+	    }
+	}
+
+	if (victim == -1)
+	    return -1;
+
+	entry_retire(victim);
+    }
+
+    i = cache->free;
+    entry = &entries[i];
+    cache->free = entry->next;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->state = ENTRY_FILLING;
+    entry->hash = hash;
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    entry->filler = getpid();
+
+    return i;
+}
+
+/*
+ * Takes the next size bytes of the ring, evicting what was there. A
+ * region still being sent or written is stepped over instead.
+ */
+static int region_alloc(int i, long size)
+{
+    cache_entry_t *entry;
+    off_t start, end, pinned;
+
+    if (size > cache_opts.size)
+	return -1;
+
+    for (int tries = 0; tries < cache_opts.entries; ++tries)
+    {
+	if (cache->next + size > cache_opts.size)
+	    cache->next = 0;
+
+	start = cache->next;
+	end = start + size;
+	pinned = -1;
+
+	for (int j = 0; j < cache_opts.entries; ++j)
+	{
+	    entry = &entries[j];
+
+	    if (entry->size && entry->offset < end &&
+		entry->offset + entry->size > start && entry->readers &&
+		entry->offset + entry->size > pinned)
+	    {
+		pinned = entry->offset + entry->size;
+	    }
+	}
+
+	if (pinned != -1)
+	{
+	    cache->next = pinned;
+	    continue;
+	}
+
+	for (int j = 0; j < cache_opts.entries; ++j)
+	{
+	    entry = &entries[j];
+
+	    if (entry->size && entry->offset < end &&
+		entry->offset + entry->size > start)
+	    {
+		entry_retire(j);
+	    }
+	}
+
+	entries[i].offset = start;
+	entries[i].size = size;
+	cache->next = end;
+
+	return 0;
+    }
+
+    return -1;
+}
+
+static int filler_alive(cache_entry_t *entry)
+{
+    return kill(entry->filler, 0) == 0 || errno != ESRCH;
+}
+
+static void object_set(cache_object_t *object, int i, time_t now)
+{
+    cache_entry_t *entry = &entries[i];
+
+    entry->readers++;
+    object->entry = i;
+    object->fd = slab_fd;
+    object->offset = entry->offset;
+    object->head_len = entry->head_len;
+    object->body_len = entry->body_len;
+    object->age = now - entry->stored;
+}
+
+static int write_all(int fd, char *buffer, int len, off_t offset)
+{
+    ssize_t written;
+
+    while (len)
+    {
+	if ((written = pwrite(fd, buffer, len, offset)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    return -1;
+	}
+
+	buffer += written;
+	offset += written;
+	len -= written;
+    }
+
+    return 0;
+}
+
+/* Mapped once before the first fork, a reload only retunes limits */
+int cache_init(cache_opts_t *opts)
+{
+    char *path = opts->path && *opts->path ? opts->path : NULL;
+
+    if (cache)
+    {
+	if (!path || strcmp(path, cache_path) ||
+	    opts->size != cache_opts.size ||
+	    opts->entries != cache_opts.entries)
+	{
+	    log_message(LOG_LEVEL_WARNING, "proxy cache: path and size "
+		"changes take a restart");
+	}
+
+	cache_opts.max_object = opts->max_object;
+	cache_opts.stale = opts->stale;
+
+	return 0;
+    }
+
+    if (!path)
+	return 0;
+
+    /* The slab has no name, it goes away with the last process using it */
+    if ((slab_fd = open(path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy cache: slab file in %s", path);
+	return -1;
+    }
+
+    if (ftruncate(slab_fd, opts->size))
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy cache: sizing slab file");
+	goto Error;
+    }
+
+    if ((cache = mmap(NULL, sizeof(cache_header_t) + opts->entries *
+	(sizeof(cache_entry_t) + sizeof(int)), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	cache = NULL;
+	log_message(LOG_LEVEL_ERROR, "proxy cache index mmap");
+	goto Error;
+    }
+
+    cache_opts = *opts;
+    strncpy(cache_path, path, PATH_MAX - 1);
+    entries = (cache_entry_t *)(cache + 1);
+    buckets = (int *)(entries + opts->entries);
+    cache->free = -1;
+
+    for (int i = opts->entries - 1; i >= 0; --i)
+    {
+	buckets[i] = -1;
+	entry_free(i);
+    }
+
+    return 0;
+
+Error:
+    close(slab_fd);
+    slab_fd = -1;
+
+    return -1;
+}
+
+int cache_enabled()
+{
+    return cache && slab_fd != -1;
+}
+
+long cache_max_object()
+{
+    return cache_opts.max_object;
+}
+
+/*
+ * Misses for a key are coalesced: the first one gets CACHE_MISS and an
+ * entry to fill, later ones wait for it up to wait seconds and go to the
+ * backend on their own after that. can_fill is off for requests whose
+ * answer can't be stored, they only take what is there.
+ */
+cache_status_t cache_lookup(char *key, int key_len, int can_fill, int wait,
+    cache_object_t *object)
+{
+    struct timespec pause = { 0, CACHE_WAIT_NS };
+    cache_status_t status = CACHE_BYPASS;
+    cache_entry_t *entry;
+    unsigned int hash;
+    time_t now, deadline = time(NULL) + wait;
+    int i;
+
+    object->entry = object->fill = -1;
+
+    if (!cache_enabled() || key_len >= CACHE_KEY_MAX)
+	return CACHE_BYPASS;
+
+    hash = key_hash(key, key_len);
+
+    while (1)
+    {
+	cache_lock();
+	now = time(NULL);
+
+	if ((i = entry_find(key, key_len, hash)) != -1)
+	{
+	    entry = &entries[i];
+
+	    if (entry->state == ENTRY_FILLING && filler_alive(entry))
+	    {
+		cache_unlock();
+
+		if (now >= deadline)
+		    return CACHE_BYPASS;
+
+		nanosleep(&pause, NULL);
+		continue;
+	    }
+
+	    if (entry->state == ENTRY_VALID && now < entry->stale_until)
+	    {
+		object_set(object, i, now);
+		status = now < entry->expires ? CACHE_HIT : CACHE_STALE;
+
+		/* One worker refreshes it, the others keep serving it */
+		if (status == CACHE_STALE && can_fill && !entry->updating &&
+		    (object->fill = entry_alloc(key, key_len, hash)) != -1)
+		{
+		    entries[i].updating = 1;
+		}
+
+		goto Exit;
+	    }
+
+	    if (entry->state == ENTRY_PASS && now < entry->expires)
+		goto Exit;
+
+	    /* Expired, or its filler died halfway through writing it */
+	    if (entry->state == ENTRY_FILLING)
+		entry->readers = 0;
+
+	    entry_retire(i);
+	}
+
+	if (can_fill && (object->fill = entry_alloc(key, key_len, hash)) != -1)
+	{
+	    entry_link(object->fill);
+	    status = CACHE_MISS;
+	}
+
+	goto Exit;
+    }
+
+Exit:
+    cache_unlock();
+
+    return status;
+}
+
+/*
+ * Writes the response to the slab and publishes it, replacing the entry
+ * it refreshes. On success the object is left pinned for sending, so
+ * cache_release() has to follow.
+ */
+int cache_store(cache_object_t *object, char *head, int head_len, char *body,
+    int body_len, time_t age, int max_age, int stale)
+{
+    cache_entry_t *entry = &entries[object->fill];
+    time_t now;
+    int old, rv;
+
+    cache_lock();
+
+    if ((rv = region_alloc(object->fill, head_len + body_len)) == 0)
+	entry->readers = 1;
+
+    cache_unlock();
+
+    if (rv)
+    {
+	LOG_DEBUG("proxy cache: no room for %d bytes", head_len + body_len);
+	goto Error;
+    }
+
+    if (write_all(slab_fd, head, head_len, entry->offset) ||
+	write_all(slab_fd, body, body_len, entry->offset + head_len))
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy cache: slab write");
+
+	cache_lock();
+	entry->readers = 0;
+	entry->size = 0;
+	cache_unlock();
+
+	goto Error;
+    }
+
+    cache_lock();
+
+    now = time(NULL);
+    entry->head_len = head_len;
+    entry->body_len = body_len;
+    entry->stored = now - age;
+    entry->expires = now + max_age - age;
+    entry->stale_until = entry->expires + (stale < 0 ? cache_opts.stale :
+	stale);
+    entry->state = ENTRY_VALID;
+
+    /* Pinned by the write, now by the caller */
+    entry->readers = 0;
+    object_set(object, object->fill, now);
+
+    if (!entry->linked)
+    {
+	old = entry_find(entry->key, entry->key_len, entry->hash);
+
+	/* The stale copy was evicted and someone else is filling the key */
+	if (old != -1 && entries[old].state != ENTRY_VALID)
+	    entry->state = ENTRY_RETIRED;
+	else
+	{
+	    if (old != -1)
+		entry_retire(old);
+
+	    entry_link(object->fill);
+	}
+    }
+
+    object->fill = -1;
+
+    cache_unlock();
+
+    return 0;
+
+Error:
+    cache_abandon(object, 0);
+
+    return -1;
+}
+
+/*
+ * Gives up an entry being filled. With pass set the key is left to the
+ * backend for a while, otherwise the next lookup tries to fill it again.
+ */
+void cache_abandon(cache_object_t *object, int pass)
+{
+    cache_entry_t *entry;
+    int old;
+
+    if (object->fill == -1)
+	return;
+
+    entry = &entries[object->fill];
+
+    cache_lock();
+
+    /* A refresh: the stale copy goes too if its successor can't be kept */
+    if (!entry->linked)
+    {
+	old = entry_find(entry->key, entry->key_len, entry->hash);
+
+	if (old != -1 && entries[old].state != ENTRY_VALID)
+	    pass = 0;
+	else if (old != -1 && pass)
+	    entry_retire(old);
+	else if (old != -1)
+	    entries[old].updating = 0;
+    }
+
+    if (pass)
+    {
+	if (!entry->linked)
+	    entry_link(object->fill);
+
+	entry->state = ENTRY_PASS;
+	entry->expires = time(NULL) + CACHE_PASS_TTL;
+    }
+    else
+	entry_retire(object->fill);
+
+    cache_unlock();
+
+    object->fill = -1;
+}
+
+void cache_release(cache_object_t *object)
+{
+    cache_entry_t *entry;
+
+    if (object->entry == -1)
+	return;
+
+    entry = &entries[object->entry];
+
+    cache_lock();
+
+    if (!--entry->readers && entry->state == ENTRY_RETIRED)
+	entry_free(object->entry);
+
+    cache_unlock();
+
+    object->entry = -1;
+}
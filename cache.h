@@ -0,0 +1,53 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <time.h>
+#include <sys/types.h>
+
+#define CACHE_KEY_MAX 256
+#define CACHE_SIZE (64 * 1024 * 1024)
+#define CACHE_ENTRIES 4096
+#define CACHE_MAX_OBJECT (1024 * 1024)
+#define CACHE_PASS_TTL 10
+
+typedef struct {
+    char *path;
+    long size;
+    int entries;
+    long max_object;
+    int stale;
+} cache_opts_t;
+
+typedef enum {
+    /* Not cached or not cacheable, go to the backend */
+    CACHE_BYPASS = 0,
+    /* The caller fills the entry, everyone else asking waits for it */
+    CACHE_MISS,
+    CACHE_HIT,
+    /* Past its freshness, served while one worker fetches a new copy */
+    CACHE_STALE
+} cache_status_t;
+
+/* A stored response: head then body, both in the slab file */
+typedef struct {
+    int entry;
+    int fill;
+    int fd;
+    off_t offset;
+    int head_len;
+    int body_len;
+    time_t age;
+} cache_object_t;
+
+int cache_init(cache_opts_t *opts);
+int cache_enabled();
+long cache_max_object();
+int cache_stale();
+cache_status_t cache_lookup(char *key, int key_len, int can_fill, int wait,
+    cache_object_t *object);
+int cache_store(cache_object_t *object, char *head, int head_len, char *body,
+    int body_len, time_t age, int max_age, int stale);
+void cache_abandon(cache_object_t *object, int pass);
+void cache_release(cache_object_t *object);
+
+#endif
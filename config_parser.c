@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
 #include <ctype.h>
 #include "config_parser.h"
 #include "logger.h"
 
+#define MAX_ERROR_LEN 256
+#define KEYWORDS_GROW 64
+
 config_parser_t* config_parser_init(char *path)
 {
     config_parser_t *config_parser;
@@ -14,10 +21,10 @@ config_parser_t* config_parser_init(char *path)
 	log_message(LOG_LEVEL_ERROR, "config_parser allocation");
 	goto Error;
     }
-    
+
     if (!(config_parser->fp = fopen(path, "r")))
     {
-	log_message(LOG_LEVEL_ERROR, "config_parser: fopen\n");
+	log_message(LOG_LEVEL_ERROR, "config_parser: fopen %s", path);
 	goto Error;
     }
 
@@ -33,35 +40,155 @@ void config_parser_deinit(config_parser_t *config_parser)
 {
     if (config_parser->fp)
 	fclose(config_parser->fp);
+    free(config_parser->key_values);
     free(config_parser);
 }
 
+/* Keywords added from now on live in "[<section> <arg>]", NULL is top level */
+void config_set_section(config_parser_t *parser, char *section)
+{
+    parser->section = section;
+}
+
+/* Registration mistakes are reported by config_parser_start() */
+static key_value_t* add_keyword(config_parser_t *parser, char *keyword,
+    config_type_t type, void *value)
+{
+    key_value_t *key_value, *grown;
+
+    /* Grows with the schema, no keyword count to keep in sync */
+    if (parser->keywords_counter == parser->keywords_size)
+    {
+	if (!(grown = realloc(parser->key_values, (parser->keywords_size * 2 +
+	    KEYWORDS_GROW) * sizeof(*grown))))
+	{
+	    log_message(LOG_LEVEL_ERROR, "config: keyword allocation, %s "
+		"dropped", keyword);
+	    parser->errors++;
+	    return NULL;
+	}
+
+	parser->key_values = grown;
+	parser->keywords_size = parser->keywords_size * 2 + KEYWORDS_GROW;
+    }
+
+    key_value = &parser->key_values[parser->keywords_counter++];
+    memset(key_value, 0, sizeof(*key_value));
+    key_value->keyword = keyword;
+    key_value->section = parser->section;
+    key_value->type = type;
+    key_value->value = value;
+
+    return key_value;
+}
+
+static int add_string(config_parser_t *parser, char *keyword, char *value,
+    int value_maxlen, int required)
+{
+    key_value_t *key_value;
+
+    if (!(key_value = add_keyword(parser, keyword, CONFIG_TYPE_STRING, value)))
+	return -1;
+
+    key_value->value_maxlen = value_maxlen;
+    key_value->required = required;
+
+    return 0;
+}
+
 int config_add_keyword(config_parser_t *parser, char *keyword, char *value,
     int value_maxlen)
 {
-    int n = parser->keywords_counter;
+    return add_string(parser, keyword, value, value_maxlen, 1);
+}
 
-    if (parser->keywords_counter >= MAX_KEYWORDS)
-    {
-	log_message(LOG_LEVEL_ERROR,
-	    "[ERROR] parser->keywords_counter overflow");
+/* Value is left untouched when keyword is absent, so preset the default */
+int config_add_optional_keyword(config_parser_t *parser, char *keyword,
+    char *value, int value_maxlen)
+{
+    return add_string(parser, keyword, value, value_maxlen, 0);
+}
+
+int config_add_int(config_parser_t *parser, char *keyword, int *value,
+    int min, int max)
+{
+    key_value_t *key_value;
+
+    if (!(key_value = add_keyword(parser, keyword, CONFIG_TYPE_INT, value)))
 	return -1;
-    }
 
-    if (!(parser->key_values[n] = malloc(sizeof(key_value_t))))
-    {
-	log_message(LOG_LEVEL_ERROR, "[ERROR] parser->key_values allocation");
+    key_value->min = min;
+    key_value->max = max;
+
+    return 0;
+}
+
+/* Bytes, with an optional k/m/g (1024 based) suffix */
+int config_add_size(config_parser_t *parser, char *keyword, long *value,
+    long min, long max)
+{
+    key_value_t *key_value;
+
+    if (!(key_value = add_keyword(parser, keyword, CONFIG_TYPE_SIZE, value)))
 	return -1;
-    }
 
-    parser->key_values[n]->keyword = keyword;
-    parser->key_values[n]->value = value;
-    parser->key_values[n]->value_maxlen = value_maxlen;
-    parser->keywords_counter++;
+    key_value->min = min;
+    key_value->max = max;
+
+    return 0;
+}
+
+int config_add_bool(config_parser_t *parser, char *keyword, int *value)
+{
+    return add_keyword(parser, keyword, CONFIG_TYPE_BOOL, value) ? 0 : -1;
+}
+
+/* Keyword may repeat, every value is passed to handler */
+int config_add_list_keyword(config_parser_t *parser, char *keyword,
+    config_handler_t handler, void *handler_ctx)
+{
+    key_value_t *key_value;
+
+    if (!(key_value = add_keyword(parser, keyword, CONFIG_TYPE_LIST, NULL)))
+	return -1;
+
+    key_value->handler = handler;
+    key_value->handler_ctx = handler_ctx;
 
     return 0;
 }
 
+int config_set_required(config_parser_t *parser, char *keyword)
+{
+    for (int i = 0; i < parser->keywords_counter; ++i)
+    {
+	if (!strcmp(parser->key_values[i].keyword, keyword))
+	{
+	    parser->key_values[i].required = 1;
+	    return 0;
+	}
+    }
+
+    log_message(LOG_LEVEL_ERROR, "config: %s isn't a keyword", keyword);
+    parser->errors++;
+
+    return -1;
+}
+
+static void config_error(config_parser_t *parser, int line_num, char *format,
+    ...)
+{
+    char message[MAX_ERROR_LEN];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    log_message(LOG_LEVEL_ERROR, "config:%d: %s", line_num, message);
+    parser->errors++;
+}
+
 static int is_keyword_valid(char *str, int len)
 {
     for (int i = 0; i < len; ++i)
@@ -70,76 +197,318 @@ static int is_keyword_valid(char *str, int len)
 	    return 0;
     }
 
-    return 1;
+    return len > 0;
 }
 
-int config_parser_start(config_parser_t *parser)
+static char* skip_spaces(char *str)
 {
-    char *delim_ptr, *buffer = NULL;
-    size_t buflen = 0;
-    int read;
+    while (isspace(*str))
+	str++;
 
-    /* Format: "<Keyword>":"<Value>", no whitespaces allowed */
-    while((read = getline(&buffer, &buflen, parser->fp)) != -1)
+    return str;
+}
+
+static int section_equal(char *section, char *name, int len)
+{
+    if (!section || !name)
+	return !section && !name;
+
+    return strlen(section) == len && !strncmp(section, name, len);
+}
+
+static key_value_t* find_keyword(config_parser_t *parser, char *section,
+    char *keyword, int len)
+{
+    key_value_t *key_value;
+
+    for (int i = 0; i < parser->keywords_counter; ++i)
     {
-	/* Find keyword */
-	delim_ptr = strchr(buffer, '"');
-	buffer = delim_ptr + 1;
-	delim_ptr = strchr(buffer, '"');
+	key_value = &parser->key_values[i];
 
-	if (!is_keyword_valid(buffer, delim_ptr - buffer))
+	if (strlen(key_value->keyword) == len &&
+	    !strncmp(key_value->keyword, keyword, len) &&
+	    section_equal(key_value->section, section,
+	    section ? strlen(section) : 0))
 	{
-	    log_message(LOG_LEVEL_ERROR, "config: invalid key");
-	    goto Error;
+	    return key_value;
 	}
+    }
+
+    return NULL;
+}
+
+/* The registered name, so it outlives the line it was read from */
+static char* find_section(config_parser_t *parser, char *name, int len)
+{
+    for (int i = 0; i < parser->keywords_counter; ++i)
+    {
+	if (section_equal(parser->key_values[i].section, name, len))
+	    return parser->key_values[i].section;
+    }
+
+    return NULL;
+}
+
+static int parse_number(char *str, long *value, int with_units)
+{
+    char *str_end;
+    long long n;
+    long unit = 1;
+
+    errno = 0;
+    n = strtoll(str, &str_end, 10);
 
-	if (!((*(delim_ptr + 1) == ':') && (*(delim_ptr + 2) == '"')))
+    if (str_end == str || errno)
+	return -1;
+
+    if (with_units && *str_end)
+    {
+	switch (tolower(*str_end++))
 	{
-	    log_message(LOG_LEVEL_ERROR, "config: invalid format");
-	    goto Error;
+	    case 'k':
+		unit = 1L << 10;
+		break;
+	    case 'm':
+		unit = 1L << 20;
+		break;
+	    case 'g':
+		unit = 1L << 30;
+		break;
+	    default:
+		return -1;
 	}
+    }
+
+    if (*str_end || n > LONG_MAX / unit || n < LONG_MIN / unit)
+	return -1;
+
+    *value = n * unit;
+
+    return 0;
+}
+
+static int parse_bool(char *str, int *value)
+{
+    char *on[] = { "on", "yes", "true", "1" };
+    char *off[] = { "off", "no", "false", "0" };
 
-	for (int i = 0; i < parser->keywords_counter; ++i)
+    for (int i = 0; i < sizeof(on) / sizeof(on[0]); ++i)
+    {
+	if (!strcasecmp(str, on[i]) || !strcasecmp(str, off[i]))
 	{
-	    if (strncmp(buffer, parser->key_values[i]->keyword,
-		delim_ptr - buffer))
-	    {
-		continue;
-	    }
+	    *value = !strcasecmp(str, on[i]);
+	    return 0;
+	}
+    }
 
-	    parser->key_values[i]->found = 1;
+    return -1;
+}
 
-	    buffer = delim_ptr + 3;
-	    delim_ptr = strchr(buffer, '"');
+static void parse_value(config_parser_t *parser, int line_num,
+    key_value_t *key_value, char *section_arg, char *value, int len)
+{
+    long n;
 
-	    if (!delim_ptr || !(delim_ptr - buffer))
+    switch (key_value->type)
+    {
+	case CONFIG_TYPE_STRING:
+	    if (len >= key_value->value_maxlen)
 	    {
-		log_message(LOG_LEVEL_ERROR, "config: invalid format");
-		goto Error;
+		config_error(parser, line_num, "%s: value longer than %d",
+		    key_value->keyword, key_value->value_maxlen - 1);
+		break;
 	    }
 
-	    if ((delim_ptr - buffer) > parser->key_values[i]->value_maxlen)
+	    memcpy(key_value->value, value, len + 1);
+	    break;
+	case CONFIG_TYPE_INT:
+	case CONFIG_TYPE_SIZE:
+	    if (parse_number(value, &n, key_value->type == CONFIG_TYPE_SIZE) ||
+		n < key_value->min || n > key_value->max)
 	    {
-		log_message(LOG_LEVEL_ERROR, "config: value overflow");
-		goto Error;
+		config_error(parser, line_num, "%s: \"%s\" isn't %s in "
+		    "[%ld, %ld]", key_value->keyword, value,
+		    key_value->type == CONFIG_TYPE_SIZE ? "a size" :
+		    "an integer", key_value->min, key_value->max);
+		break;
 	    }
 
-	    strncpy(parser->key_values[i]->value, buffer, delim_ptr - buffer);
+	    if (key_value->type == CONFIG_TYPE_SIZE)
+		*(long *)key_value->value = n;
+	    else
+		*(int *)key_value->value = n;
 	    break;
-	}
+	case CONFIG_TYPE_BOOL:
+	    if (parse_bool(value, key_value->value))
+	    {
+		config_error(parser, line_num, "%s: \"%s\" isn't on or off",
+		    key_value->keyword, value);
+	    }
+	    break;
+	case CONFIG_TYPE_LIST:
+	    if (key_value->handler(key_value->handler_ctx, section_arg, value,
+		len))
+	    {
+		config_error(parser, line_num, "invalid %s", key_value->keyword);
+	    }
+	    break;
+    }
+}
+
+/* Format: [<section> <arg>], [global] goes back to the top level */
+static void parse_section(config_parser_t *parser, int line_num, char *line,
+    char **section, char *section_arg, int *section_valid)
+{
+    char *name = line + 1, *arg, *end;
+    int name_len;
+
+    *section = NULL;
+    *section_valid = 0;
 
+    if (!(end = strchr(name, ']')) || *skip_spaces(end + 1))
+    {
+	config_error(parser, line_num, "expected [<section> <arg>]");
+	return;
     }
 
-    return 0;
+    *end = '\0';
+    name = skip_spaces(name);
+    for (name_len = 0; name[name_len] && !isspace(name[name_len]); name_len++);
+    arg = skip_spaces(name + name_len);
 
-Error:
-    return -1;
+    /* Trailing spaces inside the brackets */
+    while (end > arg && isspace(end[-1]))
+	*--end = '\0';
+
+    if (name_len == strlen("global") && !strncmp(name, "global", name_len) &&
+	!*arg)
+    {
+	*section_valid = 1;
+	return;
+    }
+
+    if (!(*section = find_section(parser, name, name_len)))
+    {
+	config_error(parser, line_num, "unknown section %.*s", name_len, name);
+	return;
+    }
+
+    if (!*arg || end - arg >= MAX_SECTION_ARG_LEN)
+    {
+	config_error(parser, line_num, "section %s needs an argument "
+	    "shorter than %d", *section, MAX_SECTION_ARG_LEN);
+	return;
+    }
+
+    strcpy(section_arg, arg);
+    *section_valid = 1;
 }
 
-int check_all_found(config_parser_t *parser)
+/*
+ * Format: "<Keyword>":"<Value>", spaces around tokens, blank lines and
+ * # comments allowed. Every error is reported before giving up.
+ */
+int config_parser_start(config_parser_t *parser)
 {
+    char *line = NULL, *p, *key, *key_end, *value, *end, *section = NULL,
+	section_arg[MAX_SECTION_ARG_LEN];
+    size_t buflen = 0;
+    int line_num = 0, key_len, section_valid = 1;
+    key_value_t *key_value;
+
+    while (getline(&line, &buflen, parser->fp) != -1)
+    {
+	line_num++;
+	p = skip_spaces(line);
+
+	if (!*p || *p == '#')
+	    continue;
+
+	if (*p == '[')
+	{
+	    parse_section(parser, line_num, p, &section, section_arg,
+		&section_valid);
+	    continue;
+	}
+
+	/* Already reported, don't flood with unknown keys */
+	if (!section_valid)
+	    continue;
+
+	if (*p != '"' || !(key_end = strchr(key = p + 1, '"')) ||
+	    *(p = skip_spaces(key_end + 1)) != ':' ||
+	    *(p = skip_spaces(p + 1)) != '"' ||
+	    !(end = strchr(value = p + 1, '"')))
+	{
+	    config_error(parser, line_num, "expected \"<key>\":\"<value>\"");
+	    continue;
+	}
+
+	key_len = key_end - key;
+	p = skip_spaces(end + 1);
+	*end = '\0';
+
+	if (*p && *p != '#')
+	{
+	    config_error(parser, line_num, "unexpected \"%s\" after value", p);
+	    continue;
+	}
+
+	if (!is_keyword_valid(key, key_len))
+	{
+	    config_error(parser, line_num, "invalid key");
+	    continue;
+	}
+
+	if (!(key_value = find_keyword(parser, section, key, key_len)))
+	{
+	    config_error(parser, line_num, "unknown key %.*s%s%s", key_len, key,
+		section ? " in section " : "", section ?: "");
+	    continue;
+	}
+
+	if (key_value->found && key_value->type != CONFIG_TYPE_LIST)
+	{
+	    config_error(parser, line_num, "duplicate %s", key_value->keyword);
+	    continue;
+	}
+
+	key_value->found = 1;
+
+	if (end == value)
+	{
+	    config_error(parser, line_num, "%s: empty value",
+		key_value->keyword);
+	    continue;
+	}
+
+	parse_value(parser, line_num, key_value, section ? section_arg : NULL,
+	    value, end - value);
+    }
+
+    if (ferror(parser->fp))
+    {
+	log_message(LOG_LEVEL_ERROR, "config: read failed");
+	parser->errors++;
+    }
+
+    free(line);
+
     for (int i = 0; i < parser->keywords_counter; ++i)
-	if (!parser->key_values[i]->found)
-	    return -1;
+    {
+	if (parser->key_values[i].required && !parser->key_values[i].found)
+	{
+	    log_message(LOG_LEVEL_ERROR, "config: missing %s",
+		parser->key_values[i].keyword);
+	    parser->errors++;
+	}
+    }
+
+    if (parser->errors)
+    {
+	log_message(LOG_LEVEL_ERROR, "config: %d error(s)", parser->errors);
+	return -1;
+    }
+
     return 0;
 }
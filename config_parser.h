@@ -3,26 +3,58 @@
 
 #include <stdio.h>
 
-#define MAX_KEYWORDS 8
+#define MAX_SECTION_ARG_LEN 256
+
+typedef enum {
+    CONFIG_TYPE_STRING = 0,
+    CONFIG_TYPE_INT = 1,
+    CONFIG_TYPE_SIZE = 2,
+    CONFIG_TYPE_BOOL = 3,
+    CONFIG_TYPE_LIST = 4
+} config_type_t;
+
+/* section_arg is the "<arg>" of "[<section> <arg>]", NULL at top level */
+typedef int (*config_handler_t)(void *ctx, char *section_arg, char *value,
+    int len);
 
 typedef struct {
     char *keyword;
-    char *value;
+    char *section;
+    config_type_t type;
+    void *value;
     int value_maxlen;
+    long min;
+    long max;
+    int required;
     int found;
+    config_handler_t handler;
+    void *handler_ctx;
 } key_value_t;
 
 typedef struct {
     FILE *fp;
-    key_value_t *key_values[MAX_KEYWORDS];
+    key_value_t *key_values;
     int keywords_counter;
+    int keywords_size;
+    char *section;
+    int errors;
 } config_parser_t;
 
 config_parser_t* config_parser_init(char *path);
 void config_parser_deinit(config_parser_t *config_parser);
+void config_set_section(config_parser_t *parser, char *section);
 int config_add_keyword(config_parser_t *parser, char *keyword, char *value,
     int value_maxlen);
+int config_add_optional_keyword(config_parser_t *parser, char *keyword,
+    char *value, int value_maxlen);
+int config_add_int(config_parser_t *parser, char *keyword, int *value,
+    int min, int max);
+int config_add_size(config_parser_t *parser, char *keyword, long *value,
+    long min, long max);
+int config_add_bool(config_parser_t *parser, char *keyword, int *value);
+int config_add_list_keyword(config_parser_t *parser, char *keyword,
+    config_handler_t handler, void *handler_ctx);
+int config_set_required(config_parser_t *parser, char *keyword);
 int config_parser_start(config_parser_t *config_parser);
-int check_all_found(config_parser_t *parser);
 
 #endif
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "file_cache.h"
+#include "logger.h"
+
+#define CLASS_MIN_SHIFT 10
+#define CLASSES_MAX 32
+#define PROBE_MAX 8
+#define READERS_MAX 1024
+#define LIMBO_MAX 1024
+#define NO_BLOCK ((off_t)-1)
+
+/* Keyed by inode, the rest tells whether the contents are still current */
+typedef struct {
+    /* Odd while being rewritten, readers copy it out and check again */
+    unsigned int seq;
+    /* Size class of the block, -1 for an empty slot */
+    int cls;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    off_t offset;
+    /* MIME type, resolved once when the file is read */
+    int type;
+    time_t used;
+} slot_t;
+
+/* Nonzero epoch while the worker may still send from the arena */
+typedef struct {
+    pid_t pid;
+    unsigned long epoch;
+} reader_t;
+
+/* Unlinked blocks wait here until every reader moved past their epoch */
+typedef struct {
+    off_t offset;
+    int cls;
+    unsigned long epoch;
+} retired_t;
+
+/*
+ * Mapped before the first fork, so every worker hits on what any of them
+ * read. Lookups never lock: slots are versioned and read optimistically.
+ * Filling, eviction and reclamation take the lock, never across I/O.
+ * Bodies sit in a memfd cut into pages, each page split into blocks of
+ * one power of two size class when first needed.
+ */
+typedef struct {
+    unsigned char lock;
+    unsigned long epoch;
+    long pages_used;
+    unsigned int hand;
+    off_t free[CLASSES_MAX];
+    int limbo_num;
+    retired_t limbo[LIMBO_MAX];
+    reader_t readers[READERS_MAX];
+} file_cache_header_t;
+
+static file_cache_header_t *header;
+static slot_t *slots;
+static char *arena;
+static unsigned int slots_mask;
+static int page_shift, classes;
+static long pages;
+static file_cache_opts_t file_cache_opts;
+/* Claimed by each worker on first use, the parent never reads */
+static reader_t *me;
+
+static void file_cache_lock()
+{
+    while (__atomic_test_and_set(&header->lock, __ATOMIC_ACQUIRE))
+	sched_yield();
+}
+
+static void file_cache_unlock()
+{
+    __atomic_clear(&header->lock, __ATOMIC_RELEASE);
+}
+
+static unsigned int file_hash(struct stat *statbuf)
+{
+    unsigned long hash = statbuf->st_ino * 0x9e3779b97f4a7c15ul;
+
+    return (unsigned int)((hash ^ statbuf->st_dev) >> 32);
+}
+
+static void slot_set(slot_t *slot, struct stat *statbuf)
+{
+    slot->dev = statbuf->st_dev;
+    slot->ino = statbuf->st_ino;
+    slot->size = statbuf->st_size;
+    slot->mtime = statbuf->st_mtim;
+    slot->ctime = statbuf->st_ctim;
+}
+
+static int slot_current(slot_t *slot, struct stat *statbuf)
+{
+    return slot->size == statbuf->st_size &&
+	slot->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+	slot->mtime.tv_nsec == statbuf->st_mtim.tv_nsec &&
+	slot->ctime.tv_sec == statbuf->st_ctim.tv_sec &&
+	slot->ctime.tv_nsec == statbuf->st_ctim.tv_nsec;
+}
+
+static void slot_begin(slot_t *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_SEQ_CST);
+}
+
+static void slot_end(slot_t *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int cacheable(struct stat *statbuf)
+{
+    return header && S_ISREG(statbuf->st_mode) && statbuf->st_size > 0 &&
+	statbuf->st_size <= file_cache_opts.max_object;
+}
+
+static int class_of(off_t size)
+{
+    int cls = 0;
+
+    while (((off_t)1 << (CLASS_MIN_SHIFT + cls)) < size)
+	++cls;
+
+    return cls;
+}
+
+static void block_free(off_t offset, int cls)
+{
+    *(off_t *)(arena + offset) = header->free[cls];
+    header->free[cls] = offset;
+}
+
+/* Takes the smallest free block that fits, from a larger class if need be */
+static off_t block_pop(int cls, int *block_cls)
+{
+    off_t offset;
+
+    for (int c = cls; c < classes; ++c)
+    {
+	if ((offset = header->free[c]) == NO_BLOCK)
+	    continue;
+
+	header->free[c] = *(off_t *)(arena + offset);
+	*block_cls = c;
+
+	return offset;
+    }
+
+    return NO_BLOCK;
+}
+
+/* A page belongs to the class it was first cut for */
+static int page_carve(int cls)
+{
+    off_t page, block = (off_t)1 << (CLASS_MIN_SHIFT + cls);
+
+    if (header->pages_used == pages)
+	return -1;
+
+    page = (off_t)header->pages_used++ << page_shift;
+
+    for (off_t o = ((off_t)1 << page_shift) - block; o >= 0; o -= block)
+	block_free(page + o, cls);
+
+    return 0;
+}
+
+static int reader_alive(reader_t *reader)
+{
+    return reader->pid && (!kill(reader->pid, 0) || errno != ESRCH);
+}
+
+/* Frees the retired blocks no active reader can have seen */
+static void reclaim()
+{
+    unsigned long oldest = ULONG_MAX, epoch;
+    reader_t *reader;
+    int kept = 0;
+
+    for (int i = 0; i < READERS_MAX; ++i)
+    {
+	reader = &header->readers[i];
+
+	if (!(epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST)))
+	    continue;
+
+	/* Died halfway through a response */
+	if (!reader_alive(reader))
+	{
+	    reader->epoch = 0;
+	    __atomic_store_n(&reader->pid, 0, __ATOMIC_RELEASE);
+	    continue;
+	}
+
+	if (epoch < oldest)
+	    oldest = epoch;
+    }
+
+    for (int i = 0; i < header->limbo_num; ++i)
+    {
+	if (header->limbo[i].epoch <= oldest)
+	    block_free(header->limbo[i].offset, header->limbo[i].cls);
+	else
+	    header->limbo[kept++] = header->limbo[i];
+    }
+
+    header->limbo_num = kept;
+}
+
+/* The slot is being rewritten, readers already can't pick the block up */
+static void retire(slot_t *slot)
+{
+    retired_t *retired = &header->limbo[header->limbo_num++];
+
+    retired->offset = slot->offset;
+    retired->cls = slot->cls;
+    retired->epoch = __atomic_add_fetch(&header->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static int limbo_room()
+{
+    if (header->limbo_num == LIMBO_MAX)
+	reclaim();
+
+    return header->limbo_num < LIMBO_MAX;
+}
+
+/* Clock over the index for a block that fits, hit this second is spared once */
+static int evict(int cls)
+{
+    time_t now = time(NULL);
+    slot_t *slot;
+
+    if (!limbo_room())
+	return -1;
+
+    for (unsigned int i = 0; i <= 2 * slots_mask + 1; ++i)
+    {
+	slot = &slots[header->hand++ & slots_mask];
+
+	if (slot->cls < cls || (i <= slots_mask && slot->used >= now))
+	    continue;
+
+	slot_begin(slot);
+	retire(slot);
+	slot->cls = -1;
+	slot_end(slot);
+
+	return 0;
+    }
+
+    return -1;
+}
+
+static off_t block_alloc(int cls, int *block_cls)
+{
+    off_t offset;
+
+    if ((offset = block_pop(cls, block_cls)) != NO_BLOCK)
+	return offset;
+
+    if (!page_carve(cls))
+	return block_pop(cls, block_cls);
+
+    /* Full: take back what readers let go of, else make room for later */
+    reclaim();
+
+    if ((offset = block_pop(cls, block_cls)) != NO_BLOCK)
+	return offset;
+
+    if (!evict(cls))
+	reclaim();
+
+    return block_pop(cls, block_cls);
+}
+
+/* The same inode if it's in the window, else an empty or the coldest slot */
+static slot_t *slot_pick(struct stat *statbuf)
+{
+    unsigned int hash = file_hash(statbuf);
+    slot_t *slot, *victim = NULL;
+
+    for (int i = 0; i < PROBE_MAX; ++i)
+    {
+	slot = &slots[(hash + i) & slots_mask];
+
+	if (slot->cls != -1 && slot->dev == statbuf->st_dev &&
+	    slot->ino == statbuf->st_ino)
+	{
+	    return slot;
+	}
+
+	if (!victim || (victim->cls != -1 &&
+	    (slot->cls == -1 || slot->used < victim->used)))
+	{
+	    victim = slot;
+	}
+    }
+
+    return victim;
+}
+
+static reader_t *reader_claim()
+{
+    reader_t *reader;
+    pid_t pid = getpid();
+
+    for (int i = 0; i < READERS_MAX; ++i)
+    {
+	reader = &header->readers[i];
+
+	if (__atomic_compare_exchange_n(&reader->pid, &(pid_t){0}, pid, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+	    return reader;
+	}
+    }
+
+    /* Workers that died without detaching */
+    file_cache_lock();
+
+    for (int i = 0; i < READERS_MAX; ++i)
+    {
+	reader = &header->readers[i];
+
+	if (!reader_alive(reader))
+	{
+	    reader->epoch = 0;
+	    reader->pid = pid;
+	    file_cache_unlock();
+
+	    return reader;
+	}
+    }
+
+    file_cache_unlock();
+    LOG_DEBUG("file cache: no reader slot left");
+
+    return NULL;
+}
+
+static int reader_enter()
+{
+    if (!me && !(me = reader_claim()))
+	return -1;
+
+    /* Already in, the older epoch still covers what was handed out */
+    if (me->epoch)
+	return 0;
+
+    __atomic_store_n(&me->epoch, __atomic_load_n(&header->epoch,
+	__ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+int file_cache_init(file_cache_opts_t *opts)
+{
+    int fd = -1;
+    unsigned int slots_num = 1;
+
+    if (header)
+    {
+	if (opts->size != file_cache_opts.size ||
+	    opts->entries != file_cache_opts.entries ||
+	    opts->max_object != file_cache_opts.max_object)
+	{
+	    log_message(LOG_LEVEL_WARNING, "file cache: changes take a "
+		"restart");
+	}
+
+	return 0;
+    }
+
+    if (!opts->size)
+	return 0;
+
+    for (page_shift = CLASS_MIN_SHIFT; ((long)1 << page_shift) <
+	opts->max_object; ++page_shift);
+
+    classes = page_shift - CLASS_MIN_SHIFT + 1;
+
+    if ((pages = opts->size >> page_shift) < 1)
+    {
+	log_message(LOG_LEVEL_ERROR, "file cache: size below max object");
+	return -1;
+    }
+
+    while (slots_num < opts->entries)
+	slots_num <<= 1;
+
+    /* Anonymous, it goes away with the last process mapping it */
+    if ((fd = memfd_create("file_cache", MFD_CLOEXEC)) == -1 ||
+	ftruncate(fd, pages << page_shift))
+    {
+	log_message(LOG_LEVEL_ERROR, "file cache: memfd");
+	goto Error;
+    }
+
+    if ((arena = mmap(NULL, pages << page_shift, PROT_READ | PROT_WRITE,
+	MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+	arena = NULL;
+	log_message(LOG_LEVEL_ERROR, "file cache: arena mmap");
+	goto Error;
+    }
+
+    if ((header = mmap(NULL, sizeof(file_cache_header_t) + slots_num *
+	sizeof(slot_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	-1, 0)) == MAP_FAILED)
+    {
+	header = NULL;
+	log_message(LOG_LEVEL_ERROR, "file cache: index mmap");
+	goto Error;
+    }
+
+    close(fd);
+
+    file_cache_opts = *opts;
+    slots = (slot_t *)(header + 1);
+    slots_mask = slots_num - 1;
+    header->epoch = 1;
+
+    for (int i = 0; i < CLASSES_MAX; ++i)
+	header->free[i] = NO_BLOCK;
+
+    for (unsigned int i = 0; i < slots_num; ++i)
+	slots[i].cls = -1;
+
+    return 0;
+
+Error:
+    if (arena)
+	munmap(arena, pages << page_shift);
+
+    arena = NULL;
+
+    if (fd != -1)
+	close(fd);
+
+    return -1;
+}
+
+/* Hands out body and type if the cached copy matches the file's stat */
+int file_cache_get(struct stat *statbuf, char **body, int *type)
+{
+    unsigned int hash, seq;
+    slot_t *slot, copy;
+    time_t now;
+
+    if (!cacheable(statbuf) || reader_enter())
+	return -1;
+
+    hash = file_hash(statbuf);
+
+    for (int i = 0; i < PROBE_MAX; ++i)
+    {
+	slot = &slots[(hash + i) & slots_mask];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST);
+	memcpy(&copy, slot, sizeof(copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if ((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+	    continue;
+
+	if (copy.cls == -1 || copy.dev != statbuf->st_dev ||
+	    copy.ino != statbuf->st_ino)
+	{
+	    continue;
+	}
+
+	/* Changed since, the caller reads it again */
+	if (!slot_current(&copy, statbuf))
+	    return -1;
+
+	if (copy.used != (now = time(NULL)))
+	    __atomic_store_n(&slot->used, now, __ATOMIC_RELAXED);
+
+	*body = arena + copy.offset;
+	*type = copy.type;
+
+	return 0;
+    }
+
+    return -1;
+}
+
+/* Reads fd into a fresh block and publishes it, body stays valid as above */
+int file_cache_put(struct stat *statbuf, int fd, int type, char **body)
+{
+    off_t offset;
+    long done = 0, len;
+    int cls = 0;
+    struct stat after;
+    slot_t *slot, read_as;
+
+    if (!cacheable(statbuf))
+	return -1;
+
+    file_cache_lock();
+    offset = block_alloc(class_of(statbuf->st_size), &cls);
+    file_cache_unlock();
+
+    if (offset == NO_BLOCK)
+    {
+	LOG_DEBUG("file cache: no room");
+	return -1;
+    }
+
+    /* Nobody else knows the block yet, no lock needed to fill it */
+    while (done < statbuf->st_size && (len = pread(fd, arena + offset + done,
+	statbuf->st_size - done, done)) > 0)
+    {
+	done += len;
+    }
+
+    /* Written to while we read, the next request tries again */
+    slot_set(&read_as, statbuf);
+
+    if (done != statbuf->st_size || fstat(fd, &after) ||
+	!slot_current(&read_as, &after) || reader_enter())
+    {
+	goto Error;
+    }
+
+    file_cache_lock();
+
+    if ((slot = slot_pick(statbuf))->cls != -1 && !limbo_room())
+    {
+	file_cache_unlock();
+	goto Error;
+    }
+
+    slot_begin(slot);
+
+    if (slot->cls != -1)
+	retire(slot);
+
+    slot_set(slot, statbuf);
+    slot->offset = offset;
+    slot->cls = cls;
+    slot->type = type;
+    slot->used = time(NULL);
+    slot_end(slot);
+
+    file_cache_unlock();
+
+    *body = arena + offset;
+
+    return 0;
+
+Error:
+    file_cache_lock();
+    block_free(offset, cls);
+    file_cache_unlock();
+
+    return -1;
+}
+
+/* Everything handed out has been sent */
+void file_cache_leave()
+{
+    if (me)
+	__atomic_store_n(&me->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* The worker is done, its reader slot goes back */
+void file_cache_detach()
+{
+    if (!me)
+	return;
+
+    file_cache_leave();
+    __atomic_store_n(&me->pid, 0, __ATOMIC_RELEASE);
+    me = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <sys/stat.h>
+
+#define FILE_CACHE_ENTRIES 4096
+#define FILE_CACHE_MAX_OBJECT (256 * 1024)
+
+typedef struct {
+    /* 0 turns the cache off */
+    long size;
+    int entries;
+    long max_object;
+} file_cache_opts_t;
+
+int file_cache_init(file_cache_opts_t *opts);
+int file_cache_get(struct stat *statbuf, char **body, int *type);
+int file_cache_put(struct stat *statbuf, int fd, int type, char **body);
+void file_cache_leave();
+void file_cache_detach();
+
+#endif
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+#include "hpack_tables.h"
+#include "logger.h"
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_INT (1 << 28)
+
+/* Internal nodes are positive, leaves are -(symbol + 1), 0 is unset */
+static short huffman_tree[HPACK_HUFFMAN_EOS + 1][2];
+static int huffman_tree_nodes;
+
+static void huffman_build()
+{
+    unsigned int code;
+    int node, bit;
+
+    huffman_tree_nodes = 1;
+
+    for (int sym = 0; sym <= HPACK_HUFFMAN_EOS; ++sym)
+    {
+	code = hpack_huffman_table[sym].code;
+	node = 0;
+
+	for (int i = hpack_huffman_table[sym].len - 1; i > 0; --i)
+	{
+	    bit = (code >> i) & 1;
+
+	    if (!huffman_tree[node][bit])
+		huffman_tree[node][bit] = huffman_tree_nodes++;
+
+	    node = huffman_tree[node][bit];
+	}
+
+	huffman_tree[node][code & 1] = -(sym + 1);
+    }
+}
+
+/* Padding must be a prefix of EOS shorter than 8 bits, EOS itself is bad */
+static int huffman_decode(unsigned char *src, int len, char *dst)
+{
+    int node = 0, out = 0, bits = 0, all_ones = 1, next, bit;
+
+    for (int i = 0; i < len; ++i)
+    {
+	for (int shift = 7; shift >= 0; --shift)
+	{
+	    bit = (src[i] >> shift) & 1;
+	    next = huffman_tree[node][bit];
+	    bits++;
+	    all_ones &= bit;
+
+	    if (next > 0)
+	    {
+		node = next;
+		continue;
+	    }
+
+	    if (!next || next == -(HPACK_HUFFMAN_EOS + 1))
+		return -1;
+
+	    dst[out++] = -next - 1;
+	    node = 0;
+	    bits = 0;
+	    all_ones = 1;
+	}
+    }
+
+    if (bits > 7 || !all_ones)
+	return -1;
+
+    return out;
+}
+
+static int decode_int(unsigned char **pos, unsigned char *end, int prefix_bits,
+    unsigned int *value)
+{
+    unsigned int mask = (1 << prefix_bits) - 1, byte;
+    int shift = 0;
+
+    if (*pos >= end)
+	return -1;
+
+    *value = *(*pos)++ & mask;
+
+    if (*value < mask)
+	return 0;
+
+    do {
+	if (*pos >= end || shift > 21)
+	    return -1;
+
+	byte = *(*pos)++;
+	*value += (byte & 0x7f) << shift;
+	shift += 7;
+    } while (byte & 0x80);
+
+    return *value < HPACK_MAX_INT ? 0 : -1;
+}
+
+/* Raw strings point into the block, Huffman ones are decoded to scratch */
+static int decode_string(unsigned char **pos, unsigned char *end,
+    char **scratch, char **str, int *len)
+{
+    unsigned int str_len;
+    int huffman = **pos & 0x80;
+
+    if (decode_int(pos, end, 7, &str_len) || str_len > end - *pos)
+	return -1;
+
+    if (!huffman)
+    {
+	*str = (char *)*pos;
+	*len = str_len;
+    }
+    else
+    {
+	if ((*len = huffman_decode(*pos, str_len, *scratch)) == -1)
+	    return -1;
+
+	*str = *scratch;
+	*scratch += *len;
+    }
+
+    *pos += str_len;
+
+    return 0;
+}
+
+static hpack_entry_t* table_get(hpack_table_t *table, unsigned int index)
+{
+    static hpack_entry_t static_entry;
+
+    if (!index)
+	return NULL;
+
+    if (index <= HPACK_STATIC_TABLE_LEN)
+    {
+	static_entry.name = hpack_static_table[index - 1].name;
+	static_entry.name_len = strlen(static_entry.name);
+	static_entry.value = hpack_static_table[index - 1].value;
+	static_entry.value_len = strlen(static_entry.value);
+	return &static_entry;
+    }
+
+    index -= HPACK_STATIC_TABLE_LEN + 1;
+
+    if (index >= table->count)
+	return NULL;
+
+    return &table->entries[(table->head - index + table->capacity) %
+	table->capacity];
+}
+
+static void table_evict(hpack_table_t *table, int max_size)
+{
+    hpack_entry_t *entry;
+
+    while (table->count && table->size > max_size)
+    {
+	entry = &table->entries[(table->head - table->count + 1 +
+	    table->capacity) % table->capacity];
+
+	table->size -= entry->name_len + entry->value_len +
+	    HPACK_ENTRY_OVERHEAD;
+	free(entry->name);
+	entry->name = NULL;
+	table->count--;
+    }
+}
+
+/* Name and value may live in the table itself, copy before evicting */
+static int table_insert(hpack_table_t *table, char *name, int name_len,
+    char *value, int value_len)
+{
+    int entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    hpack_entry_t *entry;
+    char *buf;
+
+    if (entry_size > table->max_size)
+    {
+	table_evict(table, 0);
+	return 0;
+    }
+
+    if (!(buf = malloc(name_len + value_len)))
+	return -1;
+
+    memcpy(buf, name, name_len);
+    memcpy(buf + name_len, value, value_len);
+
+    table_evict(table, table->max_size - entry_size);
+
+    table->head = (table->head + 1) % table->capacity;
+    entry = &table->entries[table->head];
+    entry->name = buf;
+    entry->name_len = name_len;
+    entry->value = buf + name_len;
+    entry->value_len = value_len;
+
+    table->count++;
+    table->size += entry_size;
+
+    return 0;
+}
+
+int hpack_table_init(hpack_table_t *table, int settings_size)
+{
+    if (!huffman_tree_nodes)
+	huffman_build();
+
+    memset(table, 0, sizeof(*table));
+
+    /* Every entry costs at least the overhead, this bounds the ring */
+    table->capacity = settings_size / HPACK_ENTRY_OVERHEAD + 1;
+    table->max_size = settings_size;
+    table->settings_size = settings_size;
+
+    if (!(table->entries = calloc(table->capacity, sizeof(hpack_entry_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "hpack table allocation");
+	return -1;
+    }
+
+    return 0;
+}
+
+void hpack_table_deinit(hpack_table_t *table)
+{
+    table_evict(table, 0);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+int hpack_decode(hpack_table_t *table, unsigned char *block, int len,
+    hpack_header_cb_t cb, void *ctx)
+{
+    unsigned char *pos = block, *end = block + len;
+    unsigned int index;
+    char *scratch, *scratch_pos, *name, *value;
+    int name_len, value_len, indexing, headers = 0, rv = -1;
+    hpack_entry_t *entry;
+
+    /* Huffman decoding grows a string 8/5 times at most */
+    if (!(scratch = malloc(len * 2 + 1)))
+	return -1;
+
+    while (pos < end)
+    {
+	scratch_pos = scratch;
+
+	if (*pos & 0x80)
+	{
+	    if (decode_int(&pos, end, 7, &index) ||
+		!(entry = table_get(table, index)))
+	    {
+		goto Exit;
+	    }
+
+	    if (cb(ctx, entry->name, entry->name_len, entry->value,
+		entry->value_len))
+	    {
+		goto Exit;
+	    }
+
+	    headers++;
+	    continue;
+	}
+
+	if ((*pos & 0xe0) == 0x20)
+	{
+	    /* Size update is only allowed ahead of the first header */
+	    if (headers || decode_int(&pos, end, 5, &index) ||
+		index > table->settings_size)
+	    {
+		goto Exit;
+	    }
+
+	    table->max_size = index;
+	    table_evict(table, table->max_size);
+	    continue;
+	}
+
+	indexing = *pos & 0x40;
+
+	if (decode_int(&pos, end, indexing ? 6 : 4, &index))
+	    goto Exit;
+
+	if (index)
+	{
+	    if (!(entry = table_get(table, index)))
+		goto Exit;
+
+	    name = entry->name;
+	    name_len = entry->name_len;
+	}
+	else if (decode_string(&pos, end, &scratch_pos, &name, &name_len))
+	{
+	    goto Exit;
+	}
+
+	if (decode_string(&pos, end, &scratch_pos, &value, &value_len))
+	    goto Exit;
+
+	if (cb(ctx, name, name_len, value, value_len))
+	    goto Exit;
+
+	if (indexing && table_insert(table, name, name_len, value, value_len))
+	    goto Exit;
+
+	headers++;
+    }
+
+    rv = 0;
+
+Exit:
+    free(scratch);
+    return rv;
+}
+
+static int encode_int(unsigned char *out, int out_len, int prefix_bits,
+    unsigned char first, unsigned int value)
+{
+    unsigned int mask = (1 << prefix_bits) - 1;
+    int n = 0;
+
+    if (out_len < 1)
+	return -1;
+
+    if (value < mask)
+    {
+	out[n++] = first | value;
+	return n;
+    }
+
+    out[n++] = first | mask;
+    value -= mask;
+
+    while (value >= 0x80)
+    {
+	if (n >= out_len)
+	    return -1;
+
+	out[n++] = (value & 0x7f) | 0x80;
+	value >>= 7;
+    }
+
+    if (n >= out_len)
+	return -1;
+
+    out[n++] = value;
+
+    return n;
+}
+
+/* Literals are never indexed nor Huffman coded, the table stays empty */
+static int encode_literal(unsigned char *out, int out_len, int name_index,
+    char *name, char *value, int value_len)
+{
+    int n, len;
+
+    if ((n = encode_int(out, out_len, 4, 0x00, name_index)) == -1)
+	return -1;
+
+    if (!name_index)
+    {
+	if ((len = encode_int(out + n, out_len - n, 7, 0x00,
+	    strlen(name))) == -1 || n + len + strlen(name) > out_len)
+	{
+	    return -1;
+	}
+
+	n += len;
+	memcpy(out + n, name, strlen(name));
+	n += strlen(name);
+    }
+
+    if ((len = encode_int(out + n, out_len - n, 7, 0x00, value_len)) == -1 ||
+	n + len + value_len > out_len)
+    {
+	return -1;
+    }
+
+    n += len;
+    memcpy(out + n, value, value_len);
+
+    return n + value_len;
+}
+
+int hpack_encode_status(unsigned char *out, int out_len, int status)
+{
+    char status_str[4];
+
+    snprintf(status_str, sizeof(status_str), "%03d", status);
+
+    /* Static entries 8-14 are ":status" with common codes */
+    for (int i = 8; i <= 14; ++i)
+    {
+	if (!strcmp(hpack_static_table[i - 1].value, status_str))
+	    return encode_int(out, out_len, 7, 0x80, i);
+    }
+
+    return encode_literal(out, out_len, 8, NULL, status_str, 3);
+}
+
+int hpack_encode_header(unsigned char *out, int out_len, char *name,
+    char *value, int value_len)
+{
+    int name_index = 0;
+
+    for (int i = 0; i < HPACK_STATIC_TABLE_LEN; ++i)
+    {
+	if (!strcmp(hpack_static_table[i].name, name))
+	{
+	    name_index = i + 1;
+	    break;
+	}
+    }
+
+    return encode_literal(out, out_len, name_index, name, value, value_len);
+}
@@ -0,0 +1,35 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    char *name;
+    int name_len;
+    char *value;
+    int value_len;
+} hpack_entry_t;
+
+/* Dynamic table is a ring, newest entry at head */
+typedef struct {
+    hpack_entry_t *entries;
+    int capacity;
+    int head;
+    int count;
+    int size;
+    int max_size;
+    int settings_size;
+} hpack_table_t;
+
+typedef int (*hpack_header_cb_t)(void *ctx, char *name, int name_len,
+    char *value, int value_len);
+
+int hpack_table_init(hpack_table_t *table, int settings_size);
+void hpack_table_deinit(hpack_table_t *table);
+int hpack_decode(hpack_table_t *table, unsigned char *block, int len,
+    hpack_header_cb_t cb, void *ctx);
+int hpack_encode_status(unsigned char *out, int out_len, int status);
+int hpack_encode_header(unsigned char *out, int out_len, char *name,
+    char *value, int value_len);
+
+#endif
@@ -1,20 +1,29 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include "utils.h"
 #include "http.h"
 #include "logger.h"
 #include "w3c_log.h"
+#include "autoindex.h"
+#include "http2.h"
+#include "limit.h"
+#include "timing.h"
+#include "proxy.h"
+#include "file_cache.h"
+#include "mime.h"
 
-#define CHUNK_SIZE 1024
-#define BUFSIZE 2048
-#define MAX_MESSAGE_SIZE 1024
+#define DEFAULT_INDEX_FILE "index.html"
 
 #define HTTP_VER "HTTP/1.1"
 #define HTTP_LINE_END "\r\n"
@@ -22,12 +31,8 @@
 #define HTTP_HDR_TRANSFER_ENCODING "Transfer-Encoding"
 #define HTTP_HDR_CONNECTION "Connection"
 #define HTTP_HDR_KEEPALIVE "Keep-Alive"
-
-typedef struct {
-    char *path;
-    http_code_t http_code;
-    int file_size;
-} http_response_t;
+#define HTTP_HDR_ALLOW "Allow"
+#define HTTP_HDR_CONTENT_TYPE "Content-Type"
 
 static char *methods[HTTP_METHOD_UNKNOWN] = {
 	[HTTP_METHOD_GET] = "GET",
@@ -41,35 +46,62 @@ static char *methods[HTTP_METHOD_UNKNOWN] = {
 	[HTTP_METHOD_PATCH] = "PATCH"
 };
 
-static char* http_code2str(http_code_t http_code)
+char* http_code2str(http_code_t http_code)
 {
     switch (http_code)
     {
+	case HTTP_CODE_CONTINUE:
+	    return "Continue";
+	case HTTP_CODE_SWITCHING_PROTOCOLS:
+	    return "Switching Protocols";
 	case HTTP_CODE_OK:
 	    return "OK";
+	case HTTP_CODE_CREATED:
+	    return "Created";
+	case HTTP_CODE_NO_CONTENT:
+	    return "No Content";
+	case HTTP_CODE_NOT_MODIFIED:
+	    return "Not Modified";
 	case HTTP_CODE_BAD_REQUEST:
 	    return "Bad Request";
+	case HTTP_CODE_FORBIDDEN:
+	    return "Forbidden";
 	case HTTP_CODE_NOT_FOUND:
 	    return "Not Found";
+	case HTTP_CODE_CONFLICT:
+	    return "Conflict";
+	case HTTP_CODE_LENGTH_REQUIRED:
+	    return "Length Required";
+	case HTTP_CODE_CONTENT_TOO_LARGE:
+	    return "Content Too Large";
+	case HTTP_CODE_TOO_MANY_REQUESTS:
+	    return "Too Many Requests";
 	case HTTP_CODE_NOT_IMPLEMENTED:
 	    return "Not Implemented";
+	case HTTP_CODE_BAD_GATEWAY:
+	    return "Bad Gateway";
+	case HTTP_CODE_SERVICE_UNAVAILABLE:
+	    return "Service Unavailable";
+	case HTTP_CODE_GATEWAY_TIMEOUT:
+	    return "Gateway Timeout";
     }
 
     return "";
 }
 
-static http_method_t http_method_str2code(char *buffer, int method_len)
+http_method_t http_method_str2code(char *buffer, int method_len)
 {
     for (int i = 0; i < HTTP_METHOD_UNKNOWN; i++)
     {
-	if (!strncmp(buffer, methods[i], method_len))
+	if (strlen(methods[i]) == method_len &&
+	    !strncmp(buffer, methods[i], method_len))
 	    return i;
     }
 
     return HTTP_METHOD_UNKNOWN;
 }
 
-static char* http_method_code2str(http_method_t method)
+char* http_method_code2str(http_method_t method)
 {
     if (method >= HTTP_METHOD_GET && method <= HTTP_METHOD_PATCH)
 	return methods[method];
@@ -77,55 +109,120 @@ static char* http_method_code2str(http_method_t method)
     return "";
 }
 
-static int set_error_page(http_ctx_t *http_ctx, http_response_t *response)
+#define AUTOINDEX_TYPE_NAME ".html"
+
+/* Replaces the directory in fd/statbuf with its index or listing */
+static int resolve_directory(http_ctx_t *http_ctx, http_request_t *request,
+    route_t *route, int *fd, int flags, struct stat *statbuf,
+    http_response_t *response)
 {
-    if (snprintf_with_alloc(&response->path, "%s/%d.html",
-	http_ctx->root_folder, response->http_code) == -1)
+    int index_fd, dir_fd;
+    struct stat index_stat;
+
+    if ((index_fd = open_beneath(*fd, http_ctx->index_file, flags)) != -1)
+    {
+	if (!fstat(index_fd, &index_stat) && S_ISREG(index_stat.st_mode))
+	{
+	    close(*fd);
+	    *fd = index_fd;
+	    *statbuf = index_stat;
+	    response->type_name = http_ctx->index_file;
+	    return 0;
+	}
+
+	close(index_fd);
+    }
+
+    if (!http_ctx->autoindex_dir)
+	return -1;
+
+    /* A listing has to read the directory, even for HEAD */
+    if (flags & O_PATH)
+    {
+	if ((dir_fd = open_beneath(*fd, ".", O_RDONLY | O_DIRECTORY)) == -1)
+	    return -1;
+
+	close(*fd);
+	*fd = dir_fd;
+    }
+
+    if (autoindex_get(http_ctx->autoindex_dir,
+	*fd, route->root, statbuf, request->path, &response->path, statbuf))
     {
 	return -1;
     }
 
+    /* Listing is served by path */
+    close(*fd);
+    *fd = -1;
+    response->type_name = AUTOINDEX_TYPE_NAME;
+
     return 0;
 }
 
-static int file_exists(http_ctx_t *http_ctx, char *requested_file,
+static int file_exists(http_ctx_t *http_ctx, http_request_t *request,
     http_response_t *response)
 {
-    int rv = 0;
-    char *filepath = NULL;
+    int fd = -1, flags;
     struct stat statbuf;
+    route_t *route;
+
+    /* HEAD only needs metadata, the file is never opened for reading */
+    flags = request->method == HTTP_METHOD_HEAD ? O_PATH : O_RDONLY;
 
-    if (snprintf_with_alloc(&filepath, "%s%s", http_ctx->root_folder,
-	requested_file) == -1)
+    if (!(route = route_lookup(http_ctx->routes, request->host,
+	request->host_len, request->path, request->path_len)))
     {
-	log_message(LOG_LEVEL_ERROR, "snprintf_with_alloc failed");
-	goto Exit;
+	LOG_DEBUG("no route for requested file");
+	goto NotFound;
     }
 
-    if (access(filepath, F_OK) == -1)
+    /* Only HTTP/1.1 requests are proxied, HTTP/2 ones end up here */
+    if (route->type == ROUTE_TYPE_PROXY)
     {
-	log_message(LOG_LEVEL_DEBUG, "file doesn't exist");
-	goto Exit;
+	LOG_DEBUG("proxy routes are HTTP/1.1 only");
+	goto NotFound;
     }
 
-    if (stat(filepath, &statbuf) != 0)
+    /* One walk from the root fd, nothing outside of it can be reached */
+    if ((fd = open_beneath(route->root_fd, request->path, flags)) == -1)
     {
-	log_message(LOG_LEVEL_WARNING, "stat() returned error");
-	goto Exit;
+	LOG_DEBUG("file doesn't exist");
+	goto NotFound;
     }
 
-    if (S_ISDIR(statbuf.st_mode))
+    if (fstat(fd, &statbuf) != 0)
     {
-	log_message(LOG_LEVEL_DEBUG, "requested file is directory");
-	goto Exit;
+	log_message(LOG_LEVEL_WARNING, "fstat() returned error");
+	goto NotFound;
+    }
+
+    response->type_name = request->path;
+
+    if (S_ISDIR(statbuf.st_mode) && resolve_directory(http_ctx, request,
+	route, &fd, flags, &statbuf, response))
+    {
+	LOG_DEBUG("requested directory has no index");
+	goto NotFound;
+    }
+
+    if (fd != -1 && !S_ISREG(statbuf.st_mode))
+    {
+	LOG_DEBUG("requested file is not regular");
+	goto NotFound;
     }
 
-    response->path = filepath;
+    response->fd = fd;
     response->file_size = statbuf.st_size;
+    response->file_stat = statbuf;
 
-    rv = 1;
-Exit:
-    return rv;
+    return 1;
+
+NotFound:
+    if (fd != -1)
+	close(fd);
+
+    return 0;
 }
 
 #define HTTP_STS_LINE_FMT "%s %d %s" HTTP_LINE_END
@@ -173,111 +270,233 @@ static int http_add_header_end(char **response_header)
     return len;
 }
 
+/*
+ * buffer holds the header lines, each ending in CRLF, NUL terminated after
+ * the last one. Lines are cut in place, handlers get the value without
+ * surrounding OWS.
+ */
 static int parse_request_headers(char *buffer, http_request_t *request,
     http_ctx_t *http_ctx)
 {
-    char *line, *delim;
+    char *line, *line_end, *delim, *value, *value_end;
 
-    line = strtok(buffer, HTTP_LINE_END);
-
-    while (line)
+    for (line = buffer; *line; line = line_end + strlen(HTTP_LINE_END))
     {
-	delim = strstr(line, ":");
+	if (!(line_end = strstr(line, HTTP_LINE_END)))
+	    goto BadRequest;
+
+	*line_end = '\0';
+
+	/* A bare CR or LF is a line break to somebody down the line */
+	if (strpbrk(line, "\r\n"))
+	    goto BadRequest;
 
-	if (!delim)
+	/* No obsolete folding, no whitespace between name and colon */
+	if (*line == ' ' || *line == '\t' || !(delim = strchr(line, ':')) ||
+	    delim == line || delim[-1] == ' ' || delim[-1] == '\t')
+	{
 	    goto BadRequest;
+	}
+
+	value = delim + 1;
+	while (*value == ' ' || *value == '\t')
+	    value++;
+
+	for (value_end = line_end; value_end > value &&
+	    (value_end[-1] == ' ' || value_end[-1] == '\t'); value_end--);
+
+	*value_end = '\0';
 
 	for (int i = 0; i < http_ctx->hdr_counter; ++i)
 	{
-	    if (!strncmp(http_ctx->hdr_handlers[i]->header, line, delim - line))
+	    if (strlen(http_ctx->hdr_handlers[i]->header) == delim - line &&
+		!strncasecmp(http_ctx->hdr_handlers[i]->header, line,
+		delim - line))
 	    {
-		for (int j = 0; delim; ++j)
+		if ((http_ctx->hdr_handlers[i]->handler(request, value,
+		    value_end - value)) == -1)
 		{
-		    if (isalpha(*(delim + j)))
-		    {
-			if ((http_ctx->hdr_handlers[i]->handler(request,
-			    delim + j, strlen(delim) - j)) == -1)
-			{
-			    goto BadRequest;
-			}
-
-			break;
-		    }
+		    goto BadRequest;
 		}
+
+		break;
 	    }
 	}
-
-	line = strtok(NULL, HTTP_LINE_END);
     }
 
     return 0;
 
 BadRequest:
-    log_message(LOG_LEVEL_DEBUG, "parsing header: bad request");
+    LOG_DEBUG("parsing header: bad request");
     return -1;
 }
 
-static int parse_request(char *buffer, int buffer_len, http_request_t *request,
-    http_ctx_t *http_ctx)
+static int hex2int(char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+
+    return -1;
+}
+
+/*
+ * Single pass over the origin-form target: drops query and fragment,
+ * percent-decodes, merges slashes and resolves "." and "..". Climbing
+ * above the root is refused. path must hold url_len + 1 bytes.
+ */
+int http_normalize_url(char *url, int url_len, char *path)
+{
+    char *out = path, c;
+    int i = 0, hi, lo;
+
+    if (!url_len || url[0] != '/')
+	return -1;
+
+    while (1)
+    {
+	if (i == url_len || url[i] == '?' || url[i] == '#')
+	    c = '\0';
+	else if (url[i] != '%')
+	    c = url[i++];
+	else if (i + 2 < url_len && (hi = hex2int(url[i + 1])) != -1 &&
+	    (lo = hex2int(url[i + 2])) != -1 && (hi || lo))
+	{
+	    c = hi << 4 | lo;
+	    i += 3;
+	}
+	else
+	    return -1;
+
+	if (c && c != '/')
+	{
+	    *out++ = c;
+	    continue;
+	}
+
+	/* Segment ended, out[-1] is its last byte */
+	if (out - path >= 2 && out[-1] == '.' && out[-2] == '/')
+	{
+	    out--;
+	}
+	else if (out - path >= 3 && out[-1] == '.' && out[-2] == '.' &&
+	    out[-3] == '/')
+	{
+	    out -= 3;
+
+	    if (out == path)
+		return -1;
+
+	    while (out[-1] != '/')
+		out--;
+	}
+
+	if (!c)
+	    break;
+
+	if (out == path || out[-1] != '/')
+	    *out++ = '/';
+    }
+
+    *out = '\0';
+
+    return out - path;
+}
+
+/* head_len covers the blank line, a body starts right after it */
+static int parse_request(char *buffer, int buffer_len, int *head_len,
+    http_request_t *request, http_ctx_t *http_ctx)
 {
-    char *delimiter_ptr;
+    char *line_end, *head_end, *target, *target_end, *version;
     int url_len;
 
-    delimiter_ptr = strchr(buffer, ' ');
+    /* The request line alone, nothing below looks past it */
+    if (!(line_end = strstr(buffer, HTTP_LINE_END)) ||
+	!(head_end = strstr(line_end, HTTP_LINE_END HTTP_LINE_END)))
+    {
+	LOG_DEBUG("Parsing http request: invalid end");
+	goto BadRequest;
+    }
 
-    if (delimiter_ptr)
-	request->method = http_method_str2code(buffer, delimiter_ptr - buffer);
-    else
+    if (!(target_end = memchr(buffer, ' ', line_end - buffer)))
 	goto BadRequest;
 
+    request->method = http_method_str2code(buffer, target_end - buffer);
+
     if (request->method == HTTP_METHOD_UNKNOWN)
     {
-	log_message(LOG_LEVEL_DEBUG, "invalid http method");
+	LOG_DEBUG("invalid http method");
 	goto BadRequest;
     }
 
-    buffer = delimiter_ptr + 1;
-    delimiter_ptr = strchr(buffer, ' ');
+    target = target_end + 1;
+
+    if (!(target_end = memchr(target, ' ', line_end - target)))
+	goto BadRequest;
 
-    url_len = delimiter_ptr - buffer;
+    url_len = target_end - target;
     if (url_len < 1)
 	goto BadRequest;
 
-    request->file = malloc(url_len + 1);
+    version = target_end + 1;
 
-    /* TODO Send Internal Error in such case */
-    if (!request->file)
+    if (line_end - version != strlen(HTTP_VER) ||
+	strncmp(version, HTTP_VER, strlen(HTTP_VER)))
+    {
+	LOG_DEBUG("invalid http version");
 	goto BadRequest;
+    }
 
-    if (delimiter_ptr)
-	strncpy(request->file, buffer, url_len);
-    else
+    request->file = malloc(url_len + 1);
+    request->path = malloc(url_len + 1);
+
+    /* TODO Send Internal Error in such case */
+    if (!request->file || !request->path)
 	goto BadRequest;
 
+    strncpy(request->file, target, url_len);
     request->file[url_len] = '\0';
 
-    buffer = delimiter_ptr + 1;
-    delimiter_ptr = strstr(buffer, HTTP_LINE_END);
-
-    if (strncmp(buffer, "HTTP/1.1", delimiter_ptr - buffer))
+    /* "OPTIONS *" asks about the server, not about a resource */
+    if (request->method == HTTP_METHOD_OPTIONS && url_len == 1 &&
+	*target == '*')
+    {
+	strcpy(request->path, "*");
+	request->path_len = 1;
+    }
+    else if ((request->path_len = http_normalize_url(target, url_len,
+	request->path)) == -1)
     {
-	log_message(LOG_LEVEL_DEBUG, "invalid http version");
+	LOG_DEBUG("invalid request target");
 	goto BadRequest;
     }
-    /* TODO validate headers format */
-    delimiter_ptr = strstr(buffer, HTTP_LINE_END HTTP_LINE_END);
 
-    if (!delimiter_ptr)
+    /* Header parsing must not run into the body */
+    *head_len = head_end + 2 * strlen(HTTP_LINE_END) - buffer;
+    head_end[strlen(HTTP_LINE_END)] = '\0';
+
+    if (parse_request_headers(line_end + strlen(HTTP_LINE_END), request,
+	http_ctx))
     {
-	log_message(LOG_LEVEL_DEBUG, "Parsing http request: invalid end");
 	goto BadRequest;
     }
 
-    delimiter_ptr = strstr(buffer, HTTP_LINE_END);
-    buffer = delimiter_ptr + 1;
+    /* A client may shorten our Keep-Alive timeout, never stretch it */
+    if (http_ctx->keepalive_timeout &&
+	request->timeout > http_ctx->keepalive_timeout)
+    {
+	request->timeout = http_ctx->keepalive_timeout;
+    }
 
-    if (parse_request_headers(buffer, request, http_ctx))
+    /* Both framings at once is how requests get smuggled */
+    if (request->chunked && request->content_length != -1)
+    {
+	LOG_DEBUG("both Content-Length and chunked");
 	goto BadRequest;
+    }
 
     return 0;
 
@@ -286,40 +505,25 @@ BadRequest:
 }
 
 /* Format: <chunk_len><CRLF><chunk><CRLF>...<0><CRLF><CRLF> */
-#define CHUNK_FMT "%x" HTTP_LINE_END "%s" HTTP_LINE_END
-static int send_chunk(http_ctx_t *http_ctx, void *net_ctx, char *chunk,
-    int chunk_len)
-{
-    char *chunk_with_len = NULL;
-    int len;
+#define CHUNK_LEN_MAX 16
+#define LAST_CHUNK "0" HTTP_LINE_END HTTP_LINE_END
 
-    if ((len = snprintf_with_alloc(&chunk_with_len, CHUNK_FMT, chunk_len,
-	chunk)) == -1)
-    {
-	log_message(LOG_LEVEL_ERROR, "snprintf_with_alloc failed");
-	goto Error;
-    }
+/* Chunks are read behind room for their length, framing copies nothing */
+static int send_chunked(http_ctx_t *http_ctx, void *net_ctx, int fd)
+{
+    char chunk_len[CHUNK_LEN_MAX], *chunk;
+    int buflen, len, sent = 0;
 
-    if ((http_ctx->send(net_ctx, chunk_with_len, len)) == -1)
+    if (!http_ctx->chunk_buffer && !(http_ctx->chunk_buffer =
+	malloc(CHUNK_LEN_MAX + http_ctx->chunk_size + strlen(HTTP_LINE_END))))
     {
-	log_message(LOG_LEVEL_ERROR, "sending chunk: message");
-	free(chunk_with_len);
-	goto Error;
+	log_message(LOG_LEVEL_ERROR, "chunk buffer allocation");
+	goto Exit;
     }
 
-    free(chunk_with_len);
-    return 0;
-
-Error:
-    return -1;
-}
-
-static int send_chunked(http_ctx_t *http_ctx, void *net_ctx, int fd)
-{
-    char chunk[CHUNK_SIZE] = {};
-    int buflen;
+    chunk = http_ctx->chunk_buffer + CHUNK_LEN_MAX;
 
-    while((buflen = read(fd, chunk, CHUNK_SIZE - 1)))
+    while((buflen = read(fd, chunk, http_ctx->chunk_size)))
     {
 	if (buflen < 0)
 	{
@@ -327,83 +531,269 @@ static int send_chunked(http_ctx_t *http_ctx, void *net_ctx, int fd)
 	    goto Exit;
 	}
 
-	chunk[buflen] = '\0';
+	len = snprintf(chunk_len, CHUNK_LEN_MAX, "%x" HTTP_LINE_END, buflen);
+	memcpy(chunk - len, chunk_len, len);
+	memcpy(chunk + buflen, HTTP_LINE_END, strlen(HTTP_LINE_END));
 
-	if (send_chunk(http_ctx, net_ctx, chunk, buflen))
+	if (http_ctx->transport->send(net_ctx, chunk - len, len + buflen +
+	    strlen(HTTP_LINE_END)) == -1)
 	{
-	    log_message(LOG_LEVEL_ERROR, "sending message");
+	    log_message(LOG_LEVEL_ERROR, "sending chunk: message");
 	    goto Exit;
 	}
+
+	sent += buflen;
     }
 
-    if (send_chunk(http_ctx, net_ctx, "", 0))
+    if (http_ctx->transport->send(net_ctx, LAST_CHUNK,
+	strlen(LAST_CHUNK)) == -1)
     {
 	log_message(LOG_LEVEL_ERROR, "sending message last chunk");
 	goto Exit;
     }
 
-    return 0;
+    return sent;
 
 Exit:
     return -1;
 }
 
-static int send_not_chunked(http_ctx_t *http_ctx, void *net_ctx, int fd)
+void http_log_request(char *client_address, http_request_t *request,
+    http_response_t *response, char *version)
+{
+    struct timespec now;
+    w3c_log_entry_t entry = {
+	.client_ip = client_address,
+	.method = http_method_code2str(request->method),
+	.uri = request->file,
+	/* A target that failed normalization left path half written */
+	.uri_stem = response->http_code != HTTP_CODE_BAD_REQUEST ?
+	    request->path : NULL,
+	.version = version,
+	.host = request->host,
+	.host_len = request->host_len,
+	.user_agent = request->user_agent,
+	.user_agent_len = request->user_agent_len,
+	.referer = request->referer,
+	.referer_len = request->referer_len,
+	.status = response->http_code,
+	.bytes_sent = response->bytes_sent
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    entry.time_taken_us = (now.tv_sec - request->received.tv_sec) * 1000000LL +
+	(now.tv_nsec - request->received.tv_nsec) / 1000;
+
+    if (w3c_log_write(&entry))
+	log_message(LOG_LEVEL_WARNING, "w3c_logging");
+}
+
+static http_code_t error_codes[] = {
+    HTTP_CODE_BAD_REQUEST,
+    HTTP_CODE_FORBIDDEN,
+    HTTP_CODE_NOT_FOUND,
+    HTTP_CODE_CONFLICT,
+    HTTP_CODE_LENGTH_REQUIRED,
+    HTTP_CODE_CONTENT_TOO_LARGE,
+    HTTP_CODE_TOO_MANY_REQUESTS,
+    HTTP_CODE_NOT_IMPLEMENTED,
+    HTTP_CODE_BAD_GATEWAY,
+    HTTP_CODE_SERVICE_UNAVAILABLE,
+    HTTP_CODE_GATEWAY_TIMEOUT
+};
+
+static void free_pages(http_page_t *pages, int pages_num)
+{
+    for (int i = 0; i < pages_num; ++i)
+    {
+	free(pages[i].head);
+	free(pages[i].body);
+    }
+}
+
+#define PAGE_TYPE_NAME ".txt"
+
+/* A missing <code>.html is replaced by a one line text body */
+static int load_page(char *root, http_page_t *page)
 {
-    char buf[MAX_MESSAGE_SIZE] = {};
-    int buflen;
+    char *path = NULL;
+    struct stat statbuf;
+    int fd = -1, rv = -1, len;
+
+    if (snprintf_with_alloc(&path, "%s/%d.html", root, page->http_code) == -1)
+	goto Exit;
 
-    while((buflen = read(fd, buf, MAX_MESSAGE_SIZE)))
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 &&
+	!fstat(fd, &statbuf) && S_ISREG(statbuf.st_mode))
     {
-	if (buflen < 0)
-	{
-	    log_message(LOG_LEVEL_ERROR, "Read failed");
+	if (!(page->body = malloc(statbuf.st_size + 1)))
 	    goto Exit;
+
+	while (page->body_len < statbuf.st_size && (len = read(fd,
+	    page->body + page->body_len, statbuf.st_size - page->body_len)))
+	{
+	    if (len == -1)
+	    {
+		log_message(LOG_LEVEL_ERROR, "error page %s: read", path);
+		goto Exit;
+	    }
+
+	    page->body_len += len;
 	}
 
-	if (http_ctx->send(net_ctx, buf, buflen) == -1)
+	page->content_type = mime_content_type(mime_lookup(path));
+    }
+    else
+    {
+	log_message(LOG_LEVEL_WARNING, "error page %s missing", path);
+
+	if ((page->body_len = snprintf_with_alloc(&page->body, "%d %s\n",
+	    page->http_code, http_code2str(page->http_code))) == -1)
 	{
-	    log_message(LOG_LEVEL_ERROR, "http_ctx->send(html)");
 	    goto Exit;
 	}
+
+	page->content_type = mime_content_type(mime_lookup(PAGE_TYPE_NAME));
     }
 
-    return 0;
+    if (snprintf_with_alloc(&page->head, HTTP_STS_LINE_FMT
+	HTTP_HDR_CONTENT_TYPE ": %s" HTTP_LINE_END
+	HTTP_HDR_CONTENT_LENGTH ": %d" HTTP_LINE_END, HTTP_VER,
+	page->http_code, http_code2str(page->http_code), page->content_type,
+	page->body_len) == -1)
+    {
+	goto Exit;
+    }
+
+    rv = 0;
 
 Exit:
-    return -1;
+    free(path);
+    if (fd != -1)
+	close(fd);
+    return rv;
+}
+
+static http_page_t* find_page(http_ctx_t *http_ctx, http_code_t http_code)
+{
+    for (int i = 0; i < http_ctx->error_pages_num; ++i)
+    {
+	if (http_ctx->error_pages[i].http_code == http_code)
+	    return &http_ctx->error_pages[i];
+    }
+
+    return NULL;
 }
 
-static int create_response(http_ctx_t *http_ctx, http_request_t *request,
+int http_create_response(http_ctx_t *http_ctx, http_request_t *request,
     http_response_t *response)
 {
+    free(response->path);
     response->path = NULL;
-
-    if (response->http_code != HTTP_CODE_BAD_REQUEST)
+    response->fd = -1;
+    response->file_size = 0;
+    response->type_name = NULL;
+    response->page = NULL;
+    response->allow = NULL;
+
+    /* Codes decided before routing (bad request, limits) stand */
+    if (!response->http_code)
     {
 	switch (request->method)
 	{
 	    case HTTP_METHOD_GET:
-		if (!file_exists(http_ctx, request->file, response))
+	    case HTTP_METHOD_HEAD:
+		if (!file_exists(http_ctx, request, response))
 		    response->http_code = HTTP_CODE_NOT_FOUND;
 		else
 		    response->http_code = HTTP_CODE_OK;
 		break;
+	    case HTTP_METHOD_OPTIONS:
+		response->http_code = HTTP_CODE_NO_CONTENT;
+		response->allow = http_ctx->upload_dir_fd != -1 ?
+		    HTTP_ALLOW_UPLOAD : HTTP_ALLOW;
+		break;
 	    default:
 		response->http_code = HTTP_CODE_NOT_IMPLEMENTED;
 		break;
 	}
     }
 
-    if (response->http_code != HTTP_CODE_OK)
+    /* Uploads answer without a body, errors with a preloaded page */
+    if (response->http_code >= HTTP_CODE_BAD_REQUEST &&
+	!(response->page = find_page(http_ctx, response->http_code)))
     {
-	if (set_error_page(http_ctx, response))
-	{
-	    log_message(LOG_LEVEL_ERROR, "set_error_page failed");
-	    return -1;
-	}
+	log_message(LOG_LEVEL_ERROR, "no error page for %d",
+	    response->http_code);
+	return -1;
+    }
+
+    return 0;
+}
+
+#define BATCH_IOV_MAX 64
+#define BATCH_BYTES_MAX (64 * 1024)
+
+/*
+ * Responses to pipelined requests wait here, unless they stream a body,
+ * and leave in one write once no complete request is left to answer.
+ */
+typedef struct {
+    struct iovec iov[BATCH_IOV_MAX];
+    char *owned[BATCH_IOV_MAX];
+    int iov_num;
+    int bytes;
+    /* A cached body is handed out, its response isn't queued yet */
+    int cached_pending;
+} batch_t;
+
+static batch_t batch;
+
+static int batch_flush(http_ctx_t *http_ctx, void *net_ctx)
+{
+    int rv = 0;
+
+    if (batch.iov_num && http_ctx->transport->writev(net_ctx, batch.iov,
+	batch.iov_num) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "http_ctx->writev(batch)");
+	rv = -1;
     }
 
+    for (int i = 0; i < batch.iov_num; ++i)
+	free(batch.owned[i]);
+
+    batch.iov_num = batch.bytes = 0;
+
+    /*
+     * Cached bodies in the batch are out, their blocks may be reused. One
+     * still to be queued keeps the epoch until a later flush sends it.
+     */
+    if (!batch.cached_pending)
+	file_cache_leave();
+
+    return rv;
+}
+
+/* An owned buffer is freed once sent, others must outlive the batch */
+static int batch_add(http_ctx_t *http_ctx, void *net_ctx, char *buffer,
+    int len, int owned)
+{
+    if (batch.iov_num == BATCH_IOV_MAX && batch_flush(http_ctx, net_ctx))
+    {
+	if (owned)
+	    free(buffer);
+
+	return -1;
+    }
+
+    batch.iov[batch.iov_num].iov_base = buffer;
+    batch.iov[batch.iov_num].iov_len = len;
+    batch.owned[batch.iov_num++] = owned ? buffer : NULL;
+
+    if ((batch.bytes += len) >= BATCH_BYTES_MAX)
+	return batch_flush(http_ctx, net_ctx);
+
     return 0;
 }
 
@@ -411,21 +801,70 @@ static int create_response(http_ctx_t *http_ctx, http_request_t *request,
 #define HTTP_INTERNAL_ERROR_MSG "HTTP/1.1 500 Internal Error" HTTP_LINE_END \
     HTTP_LINE_END
 #define MAX_BUFSIZE_STR 16
+#define HTTP_SWITCHING_PROTOCOLS_MSG "HTTP/1.1 101 Switching Protocols" \
+    HTTP_LINE_END "Connection: Upgrade" HTTP_LINE_END "Upgrade: h2c" \
+    HTTP_LINE_END HTTP_LINE_END
 static int respond(http_ctx_t *http_ctx, void *net_ctx,
     http_response_t *response, http_request_t *request)
 {
-    int rv = -1, response_header_len, fd;
+    int rv = -1, response_header_len, fd, body_len, queued, type = -1,
+	is_head = request->method == HTTP_METHOD_HEAD;
     char *response_header = NULL, *keep_alive_header = NULL,
-	buflen_str[MAX_BUFSIZE_STR];
+	buflen_str[MAX_BUFSIZE_STR], *cached = NULL;
+    http_page_t *page = response->page;
 
-    if ((fd = open(response->path, O_RDONLY)) == -1)
+    /* Found files are already open, listings aren't and HEAD skips them */
+    fd = response->fd;
+    response->fd = -1;
+
+    if (fd == -1 && response->path && !is_head &&
+	(fd = open(response->path, O_RDONLY | O_CLOEXEC)) == -1)
     {
 	log_message(LOG_LEVEL_ERROR, "respond, open");
 	goto Exit;
     }
 
-    CHECK(response_header_len = http_add_status_line(&response_header,
-	response));
+    /* A listing may have been rerendered since it was stat'ed */
+    if (response->path && fd != -1)
+    {
+	if (fstat(fd, &response->file_stat))
+	{
+	    log_message(LOG_LEVEL_ERROR, "respond, fstat");
+	    goto Exit;
+	}
+
+	response->file_size = response->file_stat.st_size;
+    }
+
+    /* Small files are read once into memory all workers share, along
+       with their type */
+    if (fd != -1 && !is_head && file_cache_get(&response->file_stat,
+	&cached, &type))
+    {
+	type = mime_lookup(response->type_name);
+	file_cache_put(&response->file_stat, fd, type, &cached);
+    }
+
+    if (cached)
+    {
+	batch.cached_pending = 1;
+	close(fd);
+	fd = -1;
+    }
+    else if (type == -1 && response->type_name && !page)
+	type = mime_lookup(response->type_name);
+
+    /* Error pages come with their status line and length */
+    if (page)
+    {
+	CHECK(response_header_len = snprintf_with_alloc(&response_header,
+	    "%s", page->head));
+    }
+    else
+    {
+	CHECK(response_header_len = http_add_status_line(&response_header,
+	    response));
+    }
 
     if (request->is_keep_alive)
     {
@@ -444,45 +883,98 @@ static int respond(http_ctx_t *http_ctx, void *net_ctx,
 	}
     }
 
-    if (!http_ctx->chunked)
+    if (response->allow)
     {
-	itoa(response->file_size, buflen_str);
 	CHECK(response_header_len = http_add_header(&response_header,
-	    HTTP_HDR_CONTENT_LENGTH, buflen_str));
+	    HTTP_HDR_ALLOW, response->allow));
     }
 
-    if (http_ctx->chunked)
+    if (type != -1)
     {
 	CHECK(response_header_len = http_add_header(&response_header,
-	    HTTP_HDR_TRANSFER_ENCODING, "chunked"));
+	    HTTP_HDR_CONTENT_TYPE, mime_content_type(type)));
     }
 
-    CHECK(response_header_len = http_add_header_end(&response_header));
-
-    if (http_ctx->send(net_ctx, response_header, response_header_len) == -1)
+    /* Pages carry their length, 204 must not even say it */
+    if (is_head && !page)
     {
-	log_message(LOG_LEVEL_ERROR, "http_ctx->send(header)");
-	goto Exit;
+	itoa(response->file_size, buflen_str);
+	CHECK(response_header_len = http_add_header(&response_header,
+	    HTTP_HDR_CONTENT_LENGTH, buflen_str));
     }
-
-    if (http_ctx->chunked)
+    else if (cached)
     {
-	if (send_chunked(http_ctx, net_ctx, fd))
-	    goto Exit;
+	itoa(response->file_size, buflen_str);
+	CHECK(response_header_len = http_add_header(&response_header,
+	    HTTP_HDR_CONTENT_LENGTH, buflen_str));
+    }
+    else if (fd == -1)
+    {
+	if (!page && response->http_code != HTTP_CODE_NO_CONTENT)
+	{
+	    CHECK(response_header_len = http_add_header(&response_header,
+		HTTP_HDR_CONTENT_LENGTH, "0"));
+	}
+    }
+    else if (!http_ctx->chunked)
+    {
+	itoa(response->file_size, buflen_str);
+	CHECK(response_header_len = http_add_header(&response_header,
+	    HTTP_HDR_CONTENT_LENGTH, buflen_str));
     }
     else
     {
-	if (send_not_chunked(http_ctx, net_ctx, fd))
-	    goto Exit;
+	CHECK(response_header_len = http_add_header(&response_header,
+	    HTTP_HDR_TRANSFER_ENCODING, "chunked"));
     }
 
-    rv = 0;
+    CHECK(response_header_len = http_add_header_end(&response_header));
 
-Exit:
+    /* The batch owns the head now, a page body is shared by all */
+    queued = batch_add(http_ctx, net_ctx, response_header,
+	response_header_len, 1);
+    response_header = NULL;
+    CHECK(queued);
+    response->bytes_sent = response_header_len;
+
+    if (page && !is_head)
+    {
+	CHECK(batch_add(http_ctx, net_ctx, page->body, page->body_len, 0));
+	response->bytes_sent += page->body_len;
+    }
+
+    /* Stays put until the batch is flushed, a flush on the way can't leave */
+    if (cached)
+    {
+	CHECK(batch_add(http_ctx, net_ctx, cached, response->file_size, 0));
+	batch.cached_pending = 0;
+	response->bytes_sent += response->file_size;
+    }
+
+    /* Whatever is batched goes first, with this head */
+    if (fd != -1 && !is_head)
+    {
+	if (batch_flush(http_ctx, net_ctx) ||
+	    (body_len = http_ctx->chunked ? send_chunked(http_ctx, net_ctx,
+	    fd) : http_ctx->transport->sendfile(net_ctx, NULL, 0, fd, 0,
+	    response->file_size)) == -1)
+	{
+	    goto Exit;
+	}
+
+	response->bytes_sent += body_len;
+    }
+
+    rv = 0;
+
+Exit:
+    batch.cached_pending = 0;
 
     if (rv)
-	http_ctx->send(net_ctx, HTTP_INTERNAL_ERROR_MSG,
-	    strlen(HTTP_INTERNAL_ERROR_MSG));
+    {
+	batch_add(http_ctx, net_ctx, HTTP_INTERNAL_ERROR_MSG,
+	    strlen(HTTP_INTERNAL_ERROR_MSG), 0);
+    }
 
     free(response_header);
     if (fd != -1)
@@ -490,99 +982,650 @@ Exit:
     return rv;
 }
 
-/* Format timeout=%d, max=%d */
-typedef struct
-{
-    char *keyword;
-    int *value;
-} key_value_t;
+#define BODY_STAGE_SIZE 1024
+#define CHUNK_SIZE_DIGITS_MAX 15
+#define TRAILERS_MAX 32
+#define UPLOAD_MODE 0644
+#define UPLOAD_TMP_NAME_FMT ".%s.%d.upload"
+#define HTTP_CONTINUE_MSG "HTTP/1.1 100 Continue" HTTP_LINE_END HTTP_LINE_END
 
-static int handle_keep_alive_header(http_request_t *req, char *value, int len)
+/* Body bytes that came with the head are used up before reading more */
+typedef struct {
+    http_ctx_t *http_ctx;
+    void *net_ctx;
+    char *data;
+    int len;
+    char stage[BODY_STAGE_SIZE];
+} body_reader_t;
+
+/* Keeps the unread bytes contiguous in stage, so a line never splits */
+static int body_fill(body_reader_t *reader)
 {
-    int i = 0;
-    char *delim, *delim2, *value_end = NULL;
-    key_value_t key_values[2] = {
-	{ .keyword = "timeout", .value = &req->timeout },
-	{ .keyword = "max", .value = &req->max }
-    };
+    int len;
 
-    if (!req->is_keep_alive)
-	goto BadRequest;
+    if (reader->len >= BODY_STAGE_SIZE)
+	return HTTP_CODE_BAD_REQUEST;
 
-    delim = strtok(value, ",");
+    memmove(reader->stage, reader->data, reader->len);
+    reader->data = reader->stage;
 
-    if (!delim)
-	goto BadRequest;
+    if ((len = reader->http_ctx->transport->recv(reader->net_ctx,
+	reader->stage + reader->len, BODY_STAGE_SIZE - reader->len)) <= 0)
+    {
+	return -1;
+    }
+
+    reader->len += len;
+
+    return 0;
+}
+
+static int body_line(body_reader_t *reader, char **line, int *line_len)
+{
+    char *end;
+    int rv;
 
-    while(delim)
+    while (!(end = memmem(reader->data, reader->len, HTTP_LINE_END,
+	strlen(HTTP_LINE_END))))
     {
-	if (i > 1)
-	    goto BadRequest;
+	if ((rv = body_fill(reader)))
+	    return rv;
+    }
 
-	/* Skip OWS */
-	for (int j = 0; delim + 1; ++j)
+    *line = reader->data;
+    *line_len = end - reader->data;
+    reader->len -= *line_len + strlen(HTTP_LINE_END);
+    reader->data = end + strlen(HTTP_LINE_END);
+
+    return 0;
+}
+
+static int write_all(int fd, char *buffer, int len)
+{
+    int written = 0, rv;
+
+    while (written < len)
+    {
+	if ((rv = write(fd, buffer + written, len - written)) == -1)
 	{
-	    if (isalpha(*(delim + j)))
-		break;
-	    else
-		delim++;
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "upload write");
+	    return -1;
 	}
 
-	delim2 = strchr(delim, '=');
-	if (!delim2)
-	    goto BadRequest;
+	written += rv;
+    }
 
-	if (!strncmp(delim, key_values[i].keyword, delim2 - delim))
+    return 0;
+}
+
+/* The rest moves socket to file in the kernel, fd -1 throws it away */
+static int body_copy(body_reader_t *reader, int fd, long long count)
+{
+    int len;
+
+    while (count)
+    {
+	if (reader->len)
 	{
-	    delim2++;
-	    *(key_values[i].value) = (int)strtol(delim2, &value_end, 10);
+	    len = reader->len < count ? reader->len : count;
 
-	    if (value_end == delim2)
-		goto BadRequest;
+	    if (fd != -1 && write_all(fd, reader->data, len))
+		return -1;
+
+	    reader->data += len;
+	    reader->len -= len;
 	}
-	else
+	else if ((len = fd == -1 ? reader->http_ctx->transport->recv(
+	    reader->net_ctx, reader->stage, count < BODY_STAGE_SIZE ? count :
+	    BODY_STAGE_SIZE) : reader->http_ctx->transport->recvfile(
+	    reader->net_ctx, fd, count < INT_MAX ? count : INT_MAX)) <= 0)
 	{
-	    goto BadRequest;
+	    return -1;
 	}
 
-	delim = strtok(NULL, ",");
-	++i;
+	count -= len;
     }
 
     return 0;
+}
 
-BadRequest:
-    log_message(LOG_LEVEL_DEBUG, "parsing Keep-Alive header: invalid value");
-    return -1;
+/* Format: <hex size>[;extensions], extensions are ignored */
+long long http_parse_chunk_size(char *line, int len)
+{
+    long long size = 0;
+    int i, digit;
+
+    for (i = 0; i < len && (digit = hex2int(line[i])) != -1; ++i)
+    {
+	if (i == CHUNK_SIZE_DIGITS_MAX)
+	    return -1;
+
+	size = size << 4 | digit;
+    }
+
+    while (i < len && (line[i] == ' ' || line[i] == '\t'))
+	i++;
+
+    return i && (i == len || line[i] == ';') ? size : -1;
 }
 
-static int handle_connection_header(http_request_t *req, char *value, int len)
+/* 0 when the body was consumed, -1 on I/O errors, else the status to send */
+static int read_body(body_reader_t *reader, http_request_t *request, int fd,
+    long long max)
 {
-    for (int i = 0; i < len; ++i)
+    long long size, total = 0;
+    char *line;
+    int line_len, trailers = 0, rv;
+
+    if (!request->chunked)
+	return body_copy(reader, fd, request->content_length);
+
+    while (1)
     {
-	value[i] = tolower(value[i]);
+	if ((rv = body_line(reader, &line, &line_len)))
+	    return rv;
 
-	if (!isalpha(value[i]) && value[i] != '-')
-	{
-	    len = i;
+	if ((size = http_parse_chunk_size(line, line_len)) == -1)
+	    return HTTP_CODE_BAD_REQUEST;
+
+	if (!size)
 	    break;
+
+	if ((total += size) > max)
+	    return HTTP_CODE_CONTENT_TOO_LARGE;
+
+	if ((rv = body_copy(reader, fd, size)) ||
+	    (rv = body_line(reader, &line, &line_len)))
+	{
+	    return rv;
+	}
+
+	if (line_len)
+	    return HTTP_CODE_BAD_REQUEST;
+    }
+
+    /* Trailer fields aren't used, the blank line ends the body */
+    do
+    {
+	if (++trailers > TRAILERS_MAX)
+	    return HTTP_CODE_BAD_REQUEST;
+
+	if ((rv = body_line(reader, &line, &line_len)))
+	    return rv;
+    } while (line_len);
+
+    return 0;
+}
+
+/*
+ * The body goes to a hidden file next to the target, which only takes its
+ * place once complete: PUT replaces, POST never overwrites.
+ */
+static int store_upload(http_ctx_t *http_ctx, body_reader_t *reader,
+    http_request_t *request, http_response_t *response)
+{
+    char *name, *dir = NULL, tmp_name[NAME_MAX + 1];
+    int dir_fd = -1, fd = -1, exists, rv = 0, code;
+    struct stat statbuf;
+
+    /* Normalized, so it starts with '/' and has no "." or ".." */
+    name = strrchr(request->path, '/') + 1;
+
+    if (!*name || snprintf(tmp_name, sizeof(tmp_name), UPLOAD_TMP_NAME_FMT,
+	name, getpid()) >= sizeof(tmp_name))
+    {
+	response->http_code = HTTP_CODE_FORBIDDEN;
+	goto Exit;
+    }
+
+    if (!(dir = strndup(request->path, name - request->path)))
+    {
+	log_message(LOG_LEVEL_ERROR, "upload directory allocation");
+	rv = -1;
+	goto Exit;
+    }
+
+    if ((dir_fd = open_beneath(http_ctx->upload_dir_fd, dir,
+	O_PATH | O_DIRECTORY)) == -1)
+    {
+	response->http_code = errno == ENOENT || errno == ENOTDIR ?
+	    HTTP_CODE_NOT_FOUND : HTTP_CODE_FORBIDDEN;
+	goto Exit;
+    }
+
+    exists = !fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW);
+
+    if (exists && (request->method == HTTP_METHOD_POST ||
+	!S_ISREG(statbuf.st_mode)))
+    {
+	response->http_code = request->method == HTTP_METHOD_POST ?
+	    HTTP_CODE_CONFLICT : HTTP_CODE_FORBIDDEN;
+	goto Exit;
+    }
+
+    if ((fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+	UPLOAD_MODE)) == -1)
+    {
+	log_message(LOG_LEVEL_WARNING, "upload %s: creating file", tmp_name);
+	response->http_code = HTTP_CODE_FORBIDDEN;
+	goto Exit;
+    }
+
+    /* Only now is the client told to go ahead */
+    if (request->expect_continue && http_ctx->transport->send(reader->net_ctx,
+	HTTP_CONTINUE_MSG, strlen(HTTP_CONTINUE_MSG)) == -1)
+    {
+	rv = -1;
+	goto Unlink;
+    }
+
+    if ((code = read_body(reader, request, fd, http_ctx->max_body_size)))
+    {
+	if (code == -1)
+	    rv = -1;
+	else
+	    response->http_code = code;
+
+	goto Unlink;
+    }
+
+    if (request->method == HTTP_METHOD_PUT ?
+	renameat(dir_fd, tmp_name, dir_fd, name) :
+	linkat(dir_fd, tmp_name, dir_fd, name, 0))
+    {
+	response->http_code = errno == EEXIST ? HTTP_CODE_CONFLICT :
+	    HTTP_CODE_FORBIDDEN;
+	goto Unlink;
+    }
+
+    response->http_code = exists ? HTTP_CODE_NO_CONTENT : HTTP_CODE_CREATED;
+
+    /* Renamed away already, POST only linked the name */
+    if (request->method == HTTP_METHOD_PUT)
+	goto Exit;
+
+Unlink:
+    unlinkat(dir_fd, tmp_name, 0);
+
+Exit:
+    /* Whatever wasn't read would be taken for the next request */
+    if (response->http_code >= HTTP_CODE_BAD_REQUEST)
+	request->is_keep_alive = 0;
+
+    if (fd != -1)
+	close(fd);
+    if (dir_fd != -1)
+	close(dir_fd);
+    free(dir);
+
+    return rv;
+}
+
+/*
+ * Runs before routing so the connection stays in sync whatever the answer:
+ * uploads are stored, other bodies are drained, and a body that is left
+ * unread closes the connection after the response. What the reader holds
+ * afterwards is the start of the next request.
+ */
+static int receive_body(body_reader_t *reader, http_request_t *request,
+    http_response_t *response)
+{
+    http_ctx_t *http_ctx = reader->http_ctx;
+    int has_body = request->chunked || request->content_length > 0, rv;
+
+    if (http_ctx->upload_dir_fd == -1 || (request->method !=
+	HTTP_METHOD_PUT && request->method != HTTP_METHOD_POST))
+    {
+	if (!has_body)
+	    return 0;
+
+	/* Nobody waits on a 100 for a body we'd throw away */
+	if (response->http_code || request->expect_continue ||
+	    request->content_length > http_ctx->max_body_size)
+	{
+	    request->is_keep_alive = 0;
+	    return 0;
 	}
+
+	if ((rv = read_body(reader, request, -1, http_ctx->max_body_size)))
+	    request->is_keep_alive = 0;
+
+	return rv == -1 ? -1 : 0;
     }
 
-    if (!strncmp(value, "keep-alive", len))
+    if (response->http_code)
+    {
+	if (has_body)
+	    request->is_keep_alive = 0;
+
+	return 0;
+    }
+
+    if (!request->chunked && request->content_length == -1)
+    {
+	response->http_code = HTTP_CODE_LENGTH_REQUIRED;
+	return 0;
+    }
+
+    if (request->content_length > http_ctx->max_body_size)
+    {
+	response->http_code = HTTP_CODE_CONTENT_TOO_LARGE;
+	request->is_keep_alive = 0;
+	return 0;
+    }
+
+    return store_upload(http_ctx, reader, request, response);
+}
+
+/*
+ * The body is read whole into memory first, so the backend gets a length
+ * whatever the client's framing was and a retry can send it again.
+ */
+static int proxy_pass(body_reader_t *reader, char *client_address,
+    upstream_t *upstream, http_request_t *request, http_response_t *response,
+    timing_t *timing, char *head, int head_len)
+{
+    http_ctx_t *http_ctx = reader->http_ctx;
+    void *net_ctx = reader->net_ctx;
+    int body_fd = -1, rv = -1, code;
+    struct stat statbuf = { .st_size = 0 };
+
+    if (request->chunked || request->content_length > 0)
+    {
+	if (request->content_length > http_ctx->max_body_size)
+	{
+	    response->http_code = HTTP_CODE_CONTENT_TOO_LARGE;
+	    request->is_keep_alive = 0;
+	    return 0;
+	}
+
+	if ((body_fd = memfd_create("proxy body", MFD_CLOEXEC)) == -1)
+	{
+	    log_message(LOG_LEVEL_ERROR, "proxy body memfd");
+	    return -1;
+	}
+
+	if (request->expect_continue && http_ctx->transport->send(net_ctx,
+	    HTTP_CONTINUE_MSG, strlen(HTTP_CONTINUE_MSG)) == -1)
+	{
+	    goto Exit;
+	}
+
+	if ((code = read_body(reader, request, body_fd,
+	    http_ctx->max_body_size)))
+	{
+	    if (code != -1)
+	    {
+		response->http_code = code;
+		request->is_keep_alive = 0;
+		rv = 0;
+	    }
+
+	    goto Exit;
+	}
+
+	if (fstat(body_fd, &statbuf))
+	{
+	    log_message(LOG_LEVEL_ERROR, "proxy body fstat");
+	    goto Exit;
+	}
+    }
+
+    /* Waiting on and relaying the backend counts as sending */
+    timing_mark(timing, TIMING_BODY);
+    rv = proxy_request(http_ctx, net_ctx, client_address, upstream, request,
+	response, head, head_len, body_fd, statbuf.st_size);
+    timing_mark(timing, TIMING_SEND);
+
+Exit:
+    if (body_fd != -1)
+	close(body_fd);
+
+    return rv;
+}
+
+/* Calls cb for every token of a comma separated list */
+static void for_each_token(char *value, int len,
+    void (*cb)(http_request_t *req, char *token, int token_len),
+    http_request_t *req)
+{
+    char *end = value + len;
+    int token_len;
+
+    while (value < end)
+    {
+	while (value < end && (*value == ',' || *value == ' ' ||
+	    *value == '\t'))
+	{
+	    value++;
+	}
+
+	for (token_len = 0; value + token_len < end && value[token_len] != ','
+	    && value[token_len] != ' ' && value[token_len] != '\t';
+	    ++token_len);
+
+	if (token_len)
+	    cb(req, value, token_len);
+
+	value += token_len;
+    }
+}
+
+#define TOKEN_IS(token, len, str) \
+    ((len) == strlen(str) && !strncasecmp((token), (str), (len)))
+
+/* Only digits, values past INT_MAX are capped rather than wrapped */
+static int token_int(char *value, int len)
+{
+    long long n = 0;
+
+    if (!len)
+	return -1;
+
+    for (int i = 0; i < len; ++i)
+    {
+	if (!isdigit(value[i]))
+	    return -1;
+
+	if ((n = n * 10 + value[i] - '0') > INT_MAX)
+	    n = INT_MAX;
+    }
+
+    return n;
+}
+
+/* timeout=<s> and max=<n> in any order, anything else is ignored */
+static void keep_alive_token(http_request_t *req, char *token, int len)
+{
+    char *eq;
+    int n;
+
+    if (!(eq = memchr(token, '=', len)) ||
+	(n = token_int(eq + 1, token + len - eq - 1)) == -1)
+    {
+	return;
+    }
+
+    if (TOKEN_IS(token, eq - token, "timeout"))
+	req->timeout = n;
+    else if (TOKEN_IS(token, eq - token, "max"))
+	req->max = n;
+}
+
+/* Advisory only, a malformed value isn't worth refusing the request */
+static int handle_keep_alive_header(http_request_t *req, char *value, int len)
+{
+    for_each_token(value, len, keep_alive_token, req);
+
+    return 0;
+}
+
+static void connection_token(http_request_t *req, char *token, int len)
+{
+    if (TOKEN_IS(token, len, "keep-alive"))
 	req->is_keep_alive = 1;
-    else if (!strncmp(value, "close", len))
+    else if (TOKEN_IS(token, len, "close"))
 	req->is_keep_alive = 0;
+    else if (TOKEN_IS(token, len, "upgrade"))
+	req->connection_upgrade = 1;
+}
+
+/* Unknown tokens name hop-by-hop headers, nothing to do with them */
+static int handle_connection_header(http_request_t *req, char *value, int len)
+{
+    for_each_token(value, len, connection_token, req);
+
+    return 0;
+}
+
+static void upgrade_token(http_request_t *req, char *token, int len)
+{
+    if (TOKEN_IS(token, len, "h2c"))
+	req->upgrade_h2c = 1;
+}
+
+static int handle_upgrade_header(http_request_t *req, char *value, int len)
+{
+    for_each_token(value, len, upgrade_token, req);
+
+    return 0;
+}
+
+static int handle_http2_settings_header(http_request_t *req, char *value,
+    int len)
+{
+    while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+	len--;
+
+    req->http2_settings = value;
+    req->http2_settings_len = len;
+
+    return 0;
+}
+
+/* Points into the request buffer, port and trailing OWS cut off */
+int http_parse_host(http_request_t *req, char *value, int len)
+{
+    char *end;
+
+    while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+	len--;
+
+    if (!len)
+	goto BadRequest;
+
+    /* Bracketed IPv6 literal keeps its colons */
+    if (value[0] == '[')
+    {
+	if (!(end = memchr(value, ']', len)))
+	    goto BadRequest;
+
+	end++;
+    }
     else
+    {
+	end = memchr(value, ':', len) ?: value + len;
+    }
+
+    req->host = value;
+    req->host_len = end - value;
+
+    return 0;
+
+BadRequest:
+    LOG_DEBUG("parsing Host header: invalid value");
+    return -1;
+}
+
+/* Kept only for the access log, values point into the request buffer */
+static int handle_user_agent_header(http_request_t *req, char *value, int len)
+{
+    req->user_agent = value;
+    req->user_agent_len = len;
+
+    return 0;
+}
+
+static int handle_referer_header(http_request_t *req, char *value, int len)
+{
+    req->referer = value;
+    req->referer_len = len;
+
+    return 0;
+}
+
+/* Repeats are fine as long as they agree */
+static int handle_content_length_header(http_request_t *req, char *value,
+    int len)
+{
+    long long content_length = 0;
+    int i;
+
+    for (i = 0; i < len && isdigit(value[i]); ++i)
+    {
+	if (content_length > (LLONG_MAX - 9) / 10)
+	    goto BadRequest;
+
+	content_length = content_length * 10 + value[i] - '0';
+    }
+
+    while (i < len && (value[i] == ' ' || value[i] == '\t'))
+	i++;
+
+    if (!len || !isdigit(value[0]) || i != len ||
+	(req->content_length != -1 && req->content_length != content_length))
+    {
 	goto BadRequest;
+    }
+
+    req->content_length = content_length;
 
     return 0;
 
 BadRequest:
-    log_message(LOG_LEVEL_DEBUG, "parsing Connection header: invalid value");
+    LOG_DEBUG("parsing Content-Length header: invalid value");
     return -1;
 }
 
+static void transfer_coding_token(http_request_t *req, char *token, int len)
+{
+    /* Anything but a lone "chunked" can't be framed, so it's refused */
+    if (TOKEN_IS(token, len, "chunked") && !req->chunked)
+	req->chunked = 1;
+    else
+	req->chunked = -1;
+}
+
+static int handle_transfer_encoding_header(http_request_t *req, char *value,
+    int len)
+{
+    for_each_token(value, len, transfer_coding_token, req);
+
+    if (req->chunked != 1)
+    {
+	LOG_DEBUG("parsing Transfer-Encoding header: unsupported coding");
+	return -1;
+    }
+
+    return 0;
+}
+
+static void expect_token(http_request_t *req, char *token, int len)
+{
+    if (TOKEN_IS(token, len, "100-continue"))
+	req->expect_continue = 1;
+}
+
+static int handle_expect_header(http_request_t *req, char *value, int len)
+{
+    for_each_token(value, len, expect_token, req);
+
+    return 0;
+}
+
 static int register_header_handler(char *header, hdr_handler_t handler,
     http_ctx_t *http_ctx)
 {
@@ -602,10 +1645,20 @@ static int register_header_handler(char *header, hdr_handler_t handler,
 
 http_ctx_t* http_init()
 {
-    http_ctx_t *http_ctx = malloc(sizeof(*http_ctx));
+    http_ctx_t *http_ctx = calloc(1, sizeof(*http_ctx));
 
     if (!http_ctx)
+    {
 	log_message(LOG_LEVEL_ERROR, "http_ctx memory allocation");
+	return NULL;
+    }
+
+    http_ctx->index_file = DEFAULT_INDEX_FILE;
+    http_ctx->keepalive_timeout = HTTP_KEEPALIVE_TIMEOUT;
+    http_ctx->request_buffer_size = HTTP_REQUEST_BUFFER_SIZE;
+    http_ctx->chunk_size = HTTP_CHUNK_SIZE;
+    http_ctx->upload_dir_fd = -1;
+    http_ctx->max_body_size = HTTP_MAX_BODY_SIZE;
 
     if (register_header_handler("Connection", handle_connection_header,
 	http_ctx))
@@ -619,6 +1672,43 @@ http_ctx_t* http_init()
 	log_message(LOG_LEVEL_ERROR, "register Keep-Alive header failed");
     }
 
+    if (register_header_handler("Host", http_parse_host, http_ctx))
+	log_message(LOG_LEVEL_ERROR, "register Host header failed");
+
+    if (register_header_handler("Upgrade", handle_upgrade_header, http_ctx))
+	log_message(LOG_LEVEL_ERROR, "register Upgrade header failed");
+
+    if (register_header_handler("HTTP2-Settings",
+	handle_http2_settings_header, http_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR, "register HTTP2-Settings header failed");
+    }
+
+    if (register_header_handler("User-Agent", handle_user_agent_header,
+	http_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR, "register User-Agent header failed");
+    }
+
+    if (register_header_handler("Referer", handle_referer_header, http_ctx))
+	log_message(LOG_LEVEL_ERROR, "register Referer header failed");
+
+    if (register_header_handler("Content-Length",
+	handle_content_length_header, http_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR, "register Content-Length header failed");
+    }
+
+    if (register_header_handler("Transfer-Encoding",
+	handle_transfer_encoding_header, http_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR,
+	    "register Transfer-Encoding header failed");
+    }
+
+    if (register_header_handler("Expect", handle_expect_header, http_ctx))
+	log_message(LOG_LEVEL_ERROR, "register Expect header failed");
+
     return http_ctx;
 }
 
@@ -627,12 +1717,53 @@ void http_deinit(http_ctx_t *http_ctx)
     for (int i = 0; i < http_ctx->hdr_counter; ++i)
 	free(http_ctx->hdr_handlers[i]);
 
+    free(http_ctx->chunk_buffer);
+    free_pages(http_ctx->error_pages, http_ctx->error_pages_num);
+    if (http_ctx->upload_dir_fd != -1)
+	close(http_ctx->upload_dir_fd);
     free(http_ctx);
 }
 
-void http_set_root_folder(http_ctx_t *http_ctx, char *path)
+/* Error pages are read here, not per request, a failed reload keeps them */
+int http_set_root_folder(http_ctx_t *http_ctx, char *path)
 {
+    http_page_t pages[HTTP_ERROR_PAGES_MAX] = { 0 };
+    int pages_num = sizeof(error_codes) / sizeof(error_codes[0]);
+
+    for (int i = 0; i < pages_num; ++i)
+    {
+	pages[i].http_code = error_codes[i];
+
+	if (load_page(path, &pages[i]))
+	{
+	    free_pages(pages, i + 1);
+	    return -1;
+	}
+    }
+
+    free_pages(http_ctx->error_pages, http_ctx->error_pages_num);
+    memcpy(http_ctx->error_pages, pages, sizeof(pages));
+    http_ctx->error_pages_num = pages_num;
     http_ctx->root_folder = path;
+
+    return 0;
+}
+
+void http_set_routes(http_ctx_t *http_ctx, route_table_t *routes)
+{
+    http_ctx->routes = routes;
+}
+
+void http_set_index_file(http_ctx_t *http_ctx, char *index_file)
+{
+    http_ctx->index_file = index_file;
+}
+
+/* NULL cache_dir turns autoindex off */
+/* The directory is made by autoindex_init() */
+void http_set_autoindex(http_ctx_t *http_ctx, char *cache_dir)
+{
+    http_ctx->autoindex_dir = cache_dir;
 }
 
 void http_set_chunked(http_ctx_t *http_ctx, int is_chunked)
@@ -640,101 +1771,327 @@ void http_set_chunked(http_ctx_t *http_ctx, int is_chunked)
     http_ctx->chunked = is_chunked;
 }
 
-void http_set_callback(http_ctx_t *http_ctx, http_cb_t http_cb, void *cb)
+void http_set_http2(http_ctx_t *http_ctx, int is_enabled)
 {
-    switch(http_cb)
+    http_ctx->http2 = is_enabled;
+}
+
+/* 0 waits for idle clients forever */
+void http_set_keepalive_timeout(http_ctx_t *http_ctx, int timeout)
+{
+    http_ctx->keepalive_timeout = timeout;
+}
+
+/* Requests with a longer head than this are cut off */
+void http_set_request_buffer_size(http_ctx_t *http_ctx, int size)
+{
+    http_ctx->request_buffer_size = size;
+}
+
+void http_set_chunk_size(http_ctx_t *http_ctx, int size)
+{
+    free(http_ctx->chunk_buffer);
+    http_ctx->chunk_buffer = NULL;
+    http_ctx->chunk_size = size;
+}
+
+/* NULL turns PUT/POST uploads off */
+int http_set_upload_dir(http_ctx_t *http_ctx, char *path)
+{
+    int fd = -1;
+
+    if (path && (fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
     {
-	case HTTP_CB_RECV:
-	    http_ctx->recv = cb;
-	    break;
-	case HTTP_CB_SET_RECV_TIMEOUT:
-	    http_ctx->set_recv_timeout = cb;
-	    break;
-	case HTTP_CB_SEND:
-	    http_ctx->send = cb;
-	    break;
-	default:
-	    break;
+	log_message(LOG_LEVEL_ERROR, "upload dir %s: not a directory", path);
+	return -1;
     }
+
+    if (http_ctx->upload_dir_fd != -1)
+	close(http_ctx->upload_dir_fd);
+
+    http_ctx->upload_dir_fd = fd;
+
+    return 0;
+}
+
+void http_set_max_body_size(http_ctx_t *http_ctx, long size)
+{
+    http_ctx->max_body_size = size;
+}
+
+void http_set_stop_flag(http_ctx_t *http_ctx, int *stop)
+{
+    http_ctx->stop = stop;
+}
+
+int http_stopping(http_ctx_t *http_ctx)
+{
+    return http_ctx->stop && *http_ctx->stop;
+}
+
+/* Keep-alive seconds for poll(), 0 is no timeout as for SO_RCVTIMEO */
+int http_timeout_ms(int timeout)
+{
+    return timeout && timeout <= INT_MAX / 1000 ? timeout * 1000 : -1;
+}
+
+/* Kept by reference, so it must outlive the context */
+void http_set_transport(http_ctx_t *http_ctx,
+    const http_transport_t *transport)
+{
+    http_ctx->transport = transport;
 }
 
 int http_handle_peer(http_ctx_t *http_ctx, char client_address[],void *net_ctx)
 {
-    char buffer[BUFSIZE] = {};
+    char *buffer, *head = NULL;
     http_request_t request = {};
-    http_response_t response = {};
+    http_response_t response = { .fd = -1 };
+    body_reader_t reader = { .http_ctx = http_ctx, .net_ctx = net_ctx };
+    timing_t timing;
+    route_t *route;
     request.is_keep_alive = 1;
-    int buffer_len = 0, request_counter = 0, rv = -1;
+    int buffer_len = 0, head_len, len, request_counter = 0, timeout = 0,
+	rv = -1;
+
+    /* Parsing cuts the head up, proxied requests need it whole */
+    if (!(buffer = malloc(http_ctx->request_buffer_size)) ||
+	(http_ctx->routes->proxies &&
+	!(head = malloc(http_ctx->request_buffer_size))))
+    {
+	log_message(LOG_LEVEL_ERROR, "request buffer allocation");
+	goto Exit;
+    }
 
     while(request.is_keep_alive)
     {
 	request_counter++;
 
-	if (request.timeout)
+	/* Client's Keep-Alive timeout, no longer than ours */
+	if ((request.timeout ?: http_ctx->keepalive_timeout) != timeout)
 	{
-	    if ((http_ctx->set_recv_timeout(net_ctx, request.timeout) == -1))
+	    timeout = request.timeout ?: http_ctx->keepalive_timeout;
+
+	    if ((http_ctx->transport->set_recv_timeout(net_ctx, timeout) == -1))
 	    {
 		log_message(LOG_LEVEL_ERROR, "Failed to set recv timeout");
 		goto Exit;
 	    }
 	}
 
-	/* TODO Handle case when request larger than BUFSIZE */
-	if ((buffer_len = http_ctx->recv(net_ctx, buffer, BUFSIZE)) == -1)
+	timing_start(&timing);
+
+	/* A pipelined head may be buffered already, a full buffer is a 400 */
+	while (!memmem(buffer, buffer_len, HTTP_LINE_END HTTP_LINE_END,
+	    2 * strlen(HTTP_LINE_END)) &&
+	    buffer_len < http_ctx->request_buffer_size - 1)
 	{
-	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    /* Nothing left to answer, the batch goes before we block */
+	    if (batch_flush(http_ctx, net_ctx))
+		goto Exit;
+
+	    /*
+	     * Between requests is the only place a drain closes us: a signal
+	     * ends the wait, reads inside a request just go on.
+	     */
+	    if (!buffer_len)
 	    {
-		log_message(LOG_LEVEL_DEBUG, "Timeout on recv");
-		return 0;
+		if (!http_stopping(http_ctx) &&
+		    (len = http_ctx->transport->poll(net_ctx,
+		    http_timeout_ms(timeout))) == -1)
+		{
+		    log_message(LOG_LEVEL_ERROR, "http_ctx->poll");
+		    goto Exit;
+		}
+
+		if (http_stopping(http_ctx) || !len)
+		{
+		    LOG_DEBUG(http_stopping(http_ctx) ? "stopping, closing "
+			"idle connection" : "Timeout on poll");
+		    rv = 0;
+		    goto Exit;
+		}
 	    }
 
-	    log_message(LOG_LEVEL_ERROR, "http_ctx->recv");
-	    goto Exit;
+	    if ((len = http_ctx->transport->recv(net_ctx, buffer + buffer_len,
+		http_ctx->request_buffer_size - 1 - buffer_len)) == -1)
+	    {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+		    LOG_DEBUG("Timeout on recv");
+		    rv = 0;
+		    goto Exit;
+		}
+
+		log_message(LOG_LEVEL_ERROR, "http_ctx->recv");
+		goto Exit;
+	    }
+
+	    if (!len)
+	    {
+		LOG_DEBUG("client closed connection");
+		rv = 0;
+		goto Exit;
+	    }
+
+	    buffer_len += len;
 	}
 
-	if (!buffer_len)
+	LOG_DEBUG("received request");
+	clock_gettime(CLOCK_MONOTONIC, &request.received);
+	timing_mark(&timing, TIMING_RECV);
+
+	/* Leftovers of a longer previous request must not be parsed */
+	buffer[buffer_len] = '\0';
+
+	/* Prior knowledge, the connection preface replaces the first request */
+	if (http_ctx->http2 && request_counter == 1 &&
+	    !strncmp(buffer, HTTP2_PREFACE_START, strlen(HTTP2_PREFACE_START)))
 	{
-	    log_message(LOG_LEVEL_DEBUG, "client closed connection");
-	    return 0;
+	    rv = http2_handle_peer(http_ctx, client_address, net_ctx, buffer,
+		buffer_len);
+	    goto Exit;
 	}
 
-	log_message(LOG_LEVEL_DEBUG, "received request");
-
-	if (parse_request(buffer, buffer_len, &request, http_ctx))
+	free(request.file);
+	free(request.path);
+	request.file = NULL;
+	request.path = NULL;
+	request.host = NULL;
+	request.host_len = 0;
+	request.connection_upgrade = 0;
+	request.upgrade_h2c = 0;
+	request.http2_settings = NULL;
+	request.http2_settings_len = 0;
+	request.user_agent = NULL;
+	request.user_agent_len = 0;
+	request.referer = NULL;
+	request.referer_len = 0;
+	request.content_length = -1;
+	request.chunked = 0;
+	request.expect_continue = 0;
+	response.http_code = 0;
+	response.bytes_sent = 0;
+	route = NULL;
+	head_len = buffer_len;
+
+	if (head)
+	    memcpy(head, buffer, buffer_len + 1);
+
+	if (parse_request(buffer, buffer_len, &head_len, &request, http_ctx))
 	{
 	    response.http_code = HTTP_CODE_BAD_REQUEST;
 	    request.is_keep_alive = 0;
 	}
-
-	if (create_response(http_ctx, &request, &response))
+	else if (limit_request(client_address))
+	{
+	    response.http_code = HTTP_CODE_TOO_MANY_REQUESTS;
+	}
+	else if (http_ctx->http2 && request.connection_upgrade &&
+	    request.upgrade_h2c && request.http2_settings)
 	{
-	    log_message(LOG_LEVEL_ERROR, "create_response");
+	    if (batch_flush(http_ctx, net_ctx) ||
+		http_ctx->transport->send(net_ctx, HTTP_SWITCHING_PROTOCOLS_MSG,
+		strlen(HTTP_SWITCHING_PROTOCOLS_MSG)) == -1)
+	    {
+		log_message(LOG_LEVEL_ERROR, "http_ctx->send(upgrade)");
+		goto Exit;
+	    }
+
+	    /* Stream 1 takes over the request, its strings included */
+	    rv = http2_handle_upgrade(http_ctx, client_address, net_ctx,
+		&request);
 	    goto Exit;
 	}
 
-	if (respond(http_ctx, net_ctx, &response, &request))
+	timing_mark(&timing, TIMING_PARSE);
+
+	if (head && !response.http_code)
 	{
-	    log_message(LOG_LEVEL_ERROR, "respond");
+	    route = route_lookup(http_ctx->routes, request.host,
+		request.host_len, request.path, request.path_len);
+	}
+
+	reader.data = buffer + head_len;
+	reader.len = buffer_len - head_len;
+
+	/* Those may write to the client themselves, earlier answers go first */
+	if ((route && route->type == ROUTE_TYPE_PROXY) || request.chunked ||
+	    request.content_length > 0)
+	{
+	    if (batch_flush(http_ctx, net_ctx))
+		goto Exit;
+	}
+
+	/* Relayed responses count as sent, a 502/504 is answered below */
+	if (route && route->type == ROUTE_TYPE_PROXY)
+	{
+	    if (proxy_pass(&reader, client_address, route->upstream, &request,
+		&response, &timing, head, head_len))
+	    {
+		log_message(LOG_LEVEL_ERROR, "proxying request");
+		goto Exit;
+	    }
+	}
+	else if (response.http_code != HTTP_CODE_BAD_REQUEST &&
+	    receive_body(&reader, &request, &response))
+	{
+	    log_message(LOG_LEVEL_ERROR, "receiving request body");
 	    goto Exit;
 	}
 
-	if (w3c_log_message(4, client_address,
-	    http_method_code2str(request.method), request.file ?: "",
-	    http_code2str(response.http_code)))
+	timing_mark(&timing, TIMING_BODY);
+
+	if (!response.bytes_sent)
 	{
-	    log_message(LOG_LEVEL_WARNING, "w3c_logging");
+	    if (http_create_response(http_ctx, &request, &response))
+	    {
+		log_message(LOG_LEVEL_ERROR, "http_create_response");
+		goto Exit;
+	    }
+
+	    timing_mark(&timing, TIMING_RESPONSE);
+
+	    if (respond(http_ctx, net_ctx, &response, &request))
+	    {
+		log_message(LOG_LEVEL_ERROR, "respond");
+		goto Exit;
+	    }
 	}
 
-	log_message(LOG_LEVEL_DEBUG, "responded");
+	timing_mark(&timing, TIMING_SEND);
+	http_log_request(client_address, &request, &response, HTTP_VER);
+	timing_mark(&timing, TIMING_LOG);
+	timing_end(&timing, client_address, http_method_code2str(request.method),
+	    request.file);
+
+	LOG_DEBUG("responded");
 
 	if (request.max && request_counter >= request.max)
 	    request.is_keep_alive = 0;
 
+	/* What followed this request starts the next one */
+	if (reader.len >= http_ctx->request_buffer_size)
+	    request.is_keep_alive = 0;
+	else
+	{
+	    memmove(buffer, reader.data, reader.len);
+	    buffer_len = reader.len;
+	}
+
 	rv = 0;
     }
 
 Exit:
+    batch_flush(http_ctx, net_ctx);
+
+    if (http_ctx->transport->shutdown)
+	http_ctx->transport->shutdown(net_ctx);
+
     free(request.file);
+    free(request.path);
     free(response.path);
+    free(buffer);
+    free(head);
     return rv;
 }
@@ -1,21 +1,45 @@
 #ifndef _HTTP_H_
 #define _HTTP_H_
 
-#define HANDLERS_MAX 10
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "route.h"
+
+#define HANDLERS_MAX 16
+#define HTTP_KEEPALIVE_TIMEOUT 60
+#define HTTP_REQUEST_BUFFER_SIZE 2048
+#define HTTP_CHUNK_SIZE 1024
+#define HTTP_MAX_BODY_SIZE (1024 * 1024)
+#define HTTP_ERROR_PAGES_MAX 16
+#define HTTP_ALLOW "GET, HEAD, OPTIONS"
+#define HTTP_ALLOW_UPLOAD HTTP_ALLOW ", PUT, POST"
+
+/* For refusals made before a worker exists to render the error page */
+#define HTTP_SERVICE_UNAVAILABLE_MSG "HTTP/1.1 503 Service Unavailable\r\n" \
+    "Content-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n"
 
 typedef enum {
+    HTTP_CODE_CONTINUE = 100,
+    HTTP_CODE_SWITCHING_PROTOCOLS = 101,
     HTTP_CODE_OK = 200,
+    HTTP_CODE_CREATED = 201,
+    HTTP_CODE_NO_CONTENT = 204,
+    HTTP_CODE_NOT_MODIFIED = 304,
     HTTP_CODE_BAD_REQUEST = 400,
+    HTTP_CODE_FORBIDDEN = 403,
     HTTP_CODE_NOT_FOUND = 404,
-    HTTP_CODE_NOT_IMPLEMENTED = 501
+    HTTP_CODE_CONFLICT = 409,
+    HTTP_CODE_LENGTH_REQUIRED = 411,
+    HTTP_CODE_CONTENT_TOO_LARGE = 413,
+    HTTP_CODE_TOO_MANY_REQUESTS = 429,
+    HTTP_CODE_NOT_IMPLEMENTED = 501,
+    HTTP_CODE_BAD_GATEWAY = 502,
+    HTTP_CODE_SERVICE_UNAVAILABLE = 503,
+    HTTP_CODE_GATEWAY_TIMEOUT = 504
 } http_code_t;
 
-typedef enum {
-    HTTP_CB_RECV = 0,
-    HTTP_CB_SET_RECV_TIMEOUT = 1,
-    HTTP_CB_SEND = 2
-} http_cb_t;
-
 typedef enum {
     HTTP_METHOD_GET = 0,
     HTTP_METHOD_HEAD = 1,
@@ -32,15 +56,78 @@ typedef enum {
 typedef int (*http_recv_t)(void* net_ctx, char *buffer, int buffer_len);
 typedef int (*http_set_recv_timeout_t)(void* net_ctx, int timeout);
 typedef int (*http_send_t)(void* net_ctx, char *buffer, int buffer_len);
+typedef int (*http_poll_t)(void* net_ctx, int timeout_ms);
+typedef int (*http_sendfile_t)(void* net_ctx, char *prefix, int prefix_len,
+    int fd, off_t offset, int count);
+/* Moves up to count bytes from the peer into fd, 0 once the peer is gone */
+typedef int (*http_recvfile_t)(void* net_ctx, int fd, int count);
+/* Moves up to count bytes from socket fd to the peer, 0 once fd is drained */
+typedef int (*http_splice_t)(void* net_ctx, int fd, int count);
+/* Sends all of iov, which may be modified on the way */
+typedef int (*http_writev_t)(void* net_ctx, struct iovec *iov, int iovcnt);
+/* Last call on a connection, its owner closes it afterwards. Optional */
+typedef int (*http_shutdown_t)(void* net_ctx);
+
+/* Everything a connection needs, one table per kind of net_ctx */
+typedef struct {
+    http_recv_t recv;
+    http_set_recv_timeout_t set_recv_timeout;
+    http_send_t send;
+    http_poll_t poll;
+    http_sendfile_t sendfile;
+    http_recvfile_t recvfile;
+    http_splice_t splice;
+    http_writev_t writev;
+    http_shutdown_t shutdown;
+} http_transport_t;
 
 typedef struct {
     char *file;
+    char *path;
+    int path_len;
+    char *host;
+    int host_len;
     http_method_t method;
     int is_keep_alive;
     int timeout;
     int max;
+    int connection_upgrade;
+    int upgrade_h2c;
+    char *http2_settings;
+    int http2_settings_len;
+    char *user_agent;
+    int user_agent_len;
+    char *referer;
+    int referer_len;
+    long long content_length;
+    int chunked;
+    int expect_continue;
+    struct timespec received;
 } http_request_t;
 
+/* Error page read once, head holds the status line and Content-Length */
+typedef struct {
+    http_code_t http_code;
+    char *head;
+    char *body;
+    int body_len;
+    char *content_type;
+} http_page_t;
+
+typedef struct {
+    char *path;
+    int fd;
+    http_code_t http_code;
+    int file_size;
+    /* As found by routing, tells the file cache which version it is */
+    struct stat file_stat;
+    /* The name the MIME type goes by, a directory's index or listing */
+    char *type_name;
+    http_page_t *page;
+    char *allow;
+    long long bytes_sent;
+} http_response_t;
+
 typedef int (*hdr_handler_t)(http_request_t *req, char *val, int len);
 
 typedef struct {
@@ -49,20 +136,57 @@ typedef struct {
 } hdr_handler_ctx_t;
 
 typedef struct {
-    http_recv_t recv;
-    http_set_recv_timeout_t set_recv_timeout;
-    http_send_t send;
+    const http_transport_t *transport;
     char *root_folder;
+    http_page_t error_pages[HTTP_ERROR_PAGES_MAX];
+    int error_pages_num;
+    route_table_t *routes;
+    char *index_file;
+    char *autoindex_dir;
     int chunked;
+    int http2;
+    int keepalive_timeout;
+    int request_buffer_size;
+    int chunk_size;
+    char *chunk_buffer;
+    int upload_dir_fd;
+    long max_body_size;
     hdr_handler_ctx_t *hdr_handlers[HANDLERS_MAX];
     int hdr_counter;
+    /* Set once the server drains, idle connections close right away */
+    int *stop;
 } http_ctx_t;
 
 http_ctx_t* http_init();
 void http_deinit(http_ctx_t *http_ctx);
-void http_set_root_folder(http_ctx_t *http_ctx, char *path);
+int http_set_root_folder(http_ctx_t *http_ctx, char *path);
+void http_set_routes(http_ctx_t *http_ctx, route_table_t *routes);
+void http_set_index_file(http_ctx_t *http_ctx, char *index_file);
+void http_set_autoindex(http_ctx_t *http_ctx, char *cache_dir);
 void http_set_chunked(http_ctx_t *http_ctx, int is_chunked);
-void http_set_callback(http_ctx_t *http_ctx, http_cb_t http_cb, void *cb);
+void http_set_http2(http_ctx_t *http_ctx, int is_enabled);
+void http_set_keepalive_timeout(http_ctx_t *http_ctx, int timeout);
+void http_set_request_buffer_size(http_ctx_t *http_ctx, int size);
+void http_set_chunk_size(http_ctx_t *http_ctx, int size);
+int http_set_upload_dir(http_ctx_t *http_ctx, char *path);
+void http_set_max_body_size(http_ctx_t *http_ctx, long size);
+void http_set_stop_flag(http_ctx_t *http_ctx, int *stop);
+int http_stopping(http_ctx_t *http_ctx);
+int http_timeout_ms(int timeout);
+void http_set_transport(http_ctx_t *http_ctx,
+    const http_transport_t *transport);
 int http_handle_peer(http_ctx_t *http_ctx, char client_address[],void *net_ctx);
 
+/* Shared with the HTTP/2 framing layer */
+char* http_code2str(http_code_t http_code);
+http_method_t http_method_str2code(char *buffer, int method_len);
+char* http_method_code2str(http_method_t method);
+int http_normalize_url(char *url, int url_len, char *path);
+int http_parse_host(http_request_t *req, char *value, int len);
+long long http_parse_chunk_size(char *line, int len);
+int http_create_response(http_ctx_t *http_ctx, http_request_t *request,
+    http_response_t *response);
+void http_log_request(char *client_address, http_request_t *request,
+    http_response_t *response, char *version);
+
 #endif
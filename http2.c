@@ -0,0 +1,1277 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "http.h"
+#include "http2.h"
+#include "hpack.h"
+#include "logger.h"
+#include "limit.h"
+#include "timing.h"
+#include "mime.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN 24
+#define FRAME_HEADER_LEN 9
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE 16777215
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define MAX_STREAMS 100
+#define MAX_HEADER_BLOCK 65536
+#define MAX_HOST_LEN 256
+#define RBUF_SIZE (2 * (FRAME_HEADER_LEN + DEFAULT_FRAME_SIZE))
+#define WBUF_SIZE 16384
+#define HEADERS_BUF_SIZE 256
+#define DEFAULT_WEIGHT 16
+#define DEFAULT_URGENCY 3
+#define VTIME_SCALE 256
+#define HTTP2_VER "HTTP/2"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define NAME_IS(name, len, str) \
+    ((len) == strlen(str) && !memcmp((name), (str), (len)))
+
+typedef enum {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+} frame_type_t;
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+typedef enum {
+    ERR_NO_ERROR = 0x0,
+    ERR_PROTOCOL = 0x1,
+    ERR_INTERNAL = 0x2,
+    ERR_FLOW_CONTROL = 0x3,
+    ERR_STREAM_CLOSED = 0x5,
+    ERR_FRAME_SIZE = 0x6,
+    ERR_REFUSED_STREAM = 0x7,
+    ERR_COMPRESSION = 0x9,
+    ERR_ENHANCE_YOUR_CALM = 0xb
+} h2_error_t;
+
+typedef enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5
+} settings_id_t;
+
+typedef enum {
+    STREAM_FREE = 0,
+    STREAM_OPEN,
+    STREAM_SENDING
+} stream_state_t;
+
+/* OPEN receives headers and body, SENDING is half closed (remote) */
+typedef struct {
+    unsigned int id;
+    stream_state_t state;
+    http_request_t request;
+    http_response_t response;
+    char host[MAX_HOST_LEN];
+    int malformed;
+    int fd;
+    char *body;
+    off_t offset;
+    int remaining;
+    int window;
+    int recv_consumed;
+    unsigned int dependency;
+    int weight;
+    int urgency;
+    unsigned long long vtime;
+    timing_t timing;
+} stream_t;
+
+typedef struct {
+    http_ctx_t *http_ctx;
+    char *client_address;
+    void *net_ctx;
+    unsigned char rbuf[RBUF_SIZE];
+    int rbuf_len;
+    int preface_done;
+    int settings_seen;
+    unsigned char wbuf[WBUF_SIZE];
+    int wbuf_len;
+    hpack_table_t decoder;
+    unsigned char *header_block;
+    int header_block_len;
+    unsigned int header_stream_id;
+    stream_t *header_stream;
+    int header_end_stream;
+    int header_trailers;
+    stream_t streams[MAX_STREAMS];
+    int active_streams;
+    unsigned int last_stream_id;
+    int send_window;
+    int recv_consumed;
+    int peer_initial_window;
+    int peer_max_frame_size;
+    unsigned long long vclock;
+    h2_error_t error;
+    int goaway;
+    int goaway_sent;
+    int closed;
+} conn_t;
+
+static unsigned int get_u32(unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_u32(unsigned char *p, unsigned int value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put_frame_header(unsigned char *p, int len, frame_type_t type,
+    int flags, unsigned int stream_id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_u32(p + 5, stream_id);
+}
+
+static int conn_error(conn_t *conn, h2_error_t error)
+{
+    LOG_DEBUG("http2 connection error %d", error);
+    conn->error = error;
+    return -1;
+}
+
+static int flush(conn_t *conn)
+{
+    if (conn->wbuf_len && conn->http_ctx->transport->send(conn->net_ctx,
+	(char *)conn->wbuf, conn->wbuf_len) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "http2 flush");
+	conn->closed = 1;
+	return -1;
+    }
+
+    conn->wbuf_len = 0;
+
+    return 0;
+}
+
+/* Frames are batched and go out with the next flush or DATA frame */
+static int queue_frame(conn_t *conn, frame_type_t type, int flags,
+    unsigned int stream_id, unsigned char *payload, int len)
+{
+    if (conn->wbuf_len + FRAME_HEADER_LEN + len > WBUF_SIZE && flush(conn))
+	return -1;
+
+    put_frame_header(conn->wbuf + conn->wbuf_len, len, type, flags,
+	stream_id);
+    conn->wbuf_len += FRAME_HEADER_LEN;
+
+    if (len)
+    {
+	memcpy(conn->wbuf + conn->wbuf_len, payload, len);
+	conn->wbuf_len += len;
+    }
+
+    return 0;
+}
+
+static int queue_u32(conn_t *conn, frame_type_t type, unsigned int stream_id,
+    unsigned int value)
+{
+    unsigned char payload[4];
+
+    put_u32(payload, value);
+
+    return queue_frame(conn, type, 0, stream_id, payload, sizeof(payload));
+}
+
+static stream_t* stream_find(conn_t *conn, unsigned int id)
+{
+    for (int i = 0; i < MAX_STREAMS; ++i)
+    {
+	if (conn->streams[i].state != STREAM_FREE && conn->streams[i].id == id)
+	    return &conn->streams[i];
+    }
+
+    return NULL;
+}
+
+static stream_t* stream_open(conn_t *conn, unsigned int id)
+{
+    stream_t *stream;
+
+    for (int i = 0; i < MAX_STREAMS; ++i)
+    {
+	stream = &conn->streams[i];
+
+	if (stream->state != STREAM_FREE)
+	    continue;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->id = id;
+	stream->state = STREAM_OPEN;
+	stream->fd = -1;
+	stream->response.fd = -1;
+	stream->request.method = HTTP_METHOD_UNKNOWN;
+	stream->window = conn->peer_initial_window;
+	stream->weight = DEFAULT_WEIGHT;
+	stream->urgency = DEFAULT_URGENCY;
+	/* Newcomers start at the current virtual time, nobody starves */
+	stream->vtime = conn->vclock;
+	clock_gettime(CLOCK_MONOTONIC, &stream->request.received);
+	timing_start(&stream->timing);
+
+	conn->active_streams++;
+
+	return stream;
+    }
+
+    return NULL;
+}
+
+static void stream_close(conn_t *conn, stream_t *stream)
+{
+    free(stream->request.file);
+    free(stream->request.path);
+    free(stream->request.user_agent);
+    free(stream->request.referer);
+    free(stream->response.path);
+
+    if (stream->fd != -1)
+	close(stream->fd);
+
+    if (stream->response.fd != -1)
+	close(stream->response.fd);
+
+    stream->state = STREAM_FREE;
+    conn->active_streams--;
+}
+
+static void stream_finish(conn_t *conn, stream_t *stream)
+{
+    timing_mark(&stream->timing, TIMING_SEND);
+    http_log_request(conn->client_address, &stream->request,
+	&stream->response, HTTP2_VER);
+    timing_mark(&stream->timing, TIMING_LOG);
+    timing_end(&stream->timing, conn->client_address,
+	http_method_code2str(stream->request.method), stream->request.file);
+
+    stream_close(conn, stream);
+}
+
+static int reset(conn_t *conn, unsigned int id, stream_t *stream,
+    h2_error_t error)
+{
+    if (queue_u32(conn, FRAME_RST_STREAM, id, error))
+	return -1;
+
+    if (stream)
+	stream_close(conn, stream);
+
+    return 0;
+}
+
+/* RFC 9218 "u=N", the incremental flag makes no difference here */
+static void parse_priority(stream_t *stream, char *value, int len)
+{
+    char *u = memmem(value, len, "u=", 2);
+
+    if (u && u + 2 < value + len && u[2] >= '0' && u[2] <= '7')
+	stream->urgency = u[2] - '0';
+}
+
+static int on_header(void *ctx, char *name, int name_len, char *value,
+    int value_len)
+{
+    stream_t *stream = ctx;
+    http_request_t *request;
+
+    /* Refused streams and trailers still go through HPACK */
+    if (!stream)
+	return 0;
+
+    request = &stream->request;
+
+    if (NAME_IS(name, name_len, ":method"))
+    {
+	request->method = http_method_str2code(value, value_len);
+    }
+    else if (NAME_IS(name, name_len, ":path"))
+    {
+	if (request->file || !(request->file = strndup(value, value_len)) ||
+	    !(request->path = malloc(value_len + 1)) ||
+	    (request->path_len = http_normalize_url(value, value_len,
+	    request->path)) == -1)
+	{
+	    stream->malformed = 1;
+	}
+    }
+    else if (NAME_IS(name, name_len, ":authority") ||
+	(NAME_IS(name, name_len, "host") && !request->host))
+    {
+	if (value_len >= sizeof(stream->host))
+	{
+	    stream->malformed = 1;
+	    return 0;
+	}
+
+	memcpy(stream->host, value, value_len);
+	stream->host[value_len] = '\0';
+
+	if (http_parse_host(request, stream->host, value_len))
+	    stream->malformed = 1;
+    }
+    else if (NAME_IS(name, name_len, "priority"))
+    {
+	parse_priority(stream, value, value_len);
+    }
+    else if (NAME_IS(name, name_len, "user-agent") && !request->user_agent)
+    {
+	if ((request->user_agent = strndup(value, value_len)))
+	    request->user_agent_len = value_len;
+    }
+    else if (NAME_IS(name, name_len, "referer") && !request->referer)
+    {
+	if ((request->referer = strndup(value, value_len)))
+	    request->referer_len = value_len;
+    }
+
+    return 0;
+}
+
+static int stream_respond(conn_t *conn, stream_t *stream)
+{
+    unsigned char headers[HEADERS_BUF_SIZE];
+    char length_str[24], *content_type;
+    http_response_t *response = &stream->response;
+    int len, n;
+
+    stream->state = STREAM_SENDING;
+    timing_mark(&stream->timing, TIMING_PARSE);
+
+    if (stream->malformed || !stream->request.path ||
+	stream->request.method == HTTP_METHOD_UNKNOWN)
+    {
+	stream->response.http_code = HTTP_CODE_BAD_REQUEST;
+    }
+    else if (limit_request(conn->client_address))
+    {
+	stream->response.http_code = HTTP_CODE_TOO_MANY_REQUESTS;
+    }
+
+    if (http_create_response(conn->http_ctx, &stream->request,
+	&stream->response))
+    {
+	log_message(LOG_LEVEL_ERROR, "http_create_response");
+	return reset(conn, stream->id, stream, ERR_INTERNAL);
+    }
+
+    timing_mark(&stream->timing, TIMING_RESPONSE);
+
+    /* Found files are already open, listings aren't, pages are in memory */
+    stream->fd = response->fd;
+    response->fd = -1;
+
+    if (response->page)
+    {
+	stream->body = response->page->body;
+	stream->remaining = response->page->body_len;
+    }
+    else if (stream->fd == -1 && response->path &&
+	stream->request.method != HTTP_METHOD_HEAD &&
+	(stream->fd = open(response->path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "http2 respond, open");
+	return reset(conn, stream->id, stream, ERR_INTERNAL);
+    }
+    else
+	stream->remaining = response->file_size;
+
+    snprintf(length_str, sizeof(length_str), "%d", stream->remaining);
+
+    if (stream->request.method == HTTP_METHOD_HEAD)
+	stream->remaining = 0;
+
+    if ((len = hpack_encode_status(headers, sizeof(headers),
+	response->http_code)) == -1)
+    {
+	return reset(conn, stream->id, stream, ERR_INTERNAL);
+    }
+
+    /* 204 has no length, h2 takes no uploads so they aren't allowed */
+    if (response->http_code != HTTP_CODE_NO_CONTENT)
+    {
+	if ((n = hpack_encode_header(headers + len, sizeof(headers) - len,
+	    "content-length", length_str, strlen(length_str))) == -1)
+	{
+	    return reset(conn, stream->id, stream, ERR_INTERNAL);
+	}
+
+	len += n;
+    }
+
+    content_type = response->page ? response->page->content_type :
+	response->type_name ? mime_content_type(mime_lookup(
+	response->type_name)) : NULL;
+
+    if (content_type)
+    {
+	if ((n = hpack_encode_header(headers + len, sizeof(headers) - len,
+	    "content-type", content_type, strlen(content_type))) == -1)
+	{
+	    return reset(conn, stream->id, stream, ERR_INTERNAL);
+	}
+
+	len += n;
+    }
+
+    if (response->allow)
+    {
+	if ((n = hpack_encode_header(headers + len, sizeof(headers) - len,
+	    "allow", HTTP_ALLOW, strlen(HTTP_ALLOW))) == -1)
+	{
+	    return reset(conn, stream->id, stream, ERR_INTERNAL);
+	}
+
+	len += n;
+    }
+
+    if (queue_frame(conn, FRAME_HEADERS, FLAG_END_HEADERS |
+	(stream->remaining ? 0 : FLAG_END_STREAM), stream->id, headers, len))
+    {
+	return -1;
+    }
+
+    stream->response.bytes_sent = len;
+
+    if (!stream->remaining)
+	stream_finish(conn, stream);
+
+    return 0;
+}
+
+static int header_block_done(conn_t *conn)
+{
+    stream_t *stream = conn->header_stream;
+
+    if (hpack_decode(&conn->decoder, conn->header_block,
+	conn->header_block_len, on_header,
+	conn->header_trailers ? NULL : stream))
+    {
+	return conn_error(conn, ERR_COMPRESSION);
+    }
+
+    conn->header_block_len = 0;
+    conn->header_stream_id = 0;
+    conn->header_stream = NULL;
+
+    if (stream && conn->header_end_stream)
+	return stream_respond(conn, stream);
+
+    return 0;
+}
+
+static int header_block_append(conn_t *conn, unsigned char *fragment,
+    int len, int flags)
+{
+    if (conn->header_block_len + len > MAX_HEADER_BLOCK)
+	return conn_error(conn, ERR_ENHANCE_YOUR_CALM);
+
+    memcpy(conn->header_block + conn->header_block_len, fragment, len);
+    conn->header_block_len += len;
+
+    if (flags & FLAG_END_HEADERS)
+	return header_block_done(conn);
+
+    return 0;
+}
+
+/* Strips padding, fails on frames too short to carry it */
+static int unpad(unsigned char **payload, int *len, int flags)
+{
+    int pad_len;
+
+    if (!(flags & FLAG_PADDED))
+	return 0;
+
+    if (*len < 1 || (pad_len = **payload) >= *len)
+	return -1;
+
+    (*payload)++;
+    *len -= pad_len + 1;
+
+    return 0;
+}
+
+static void set_priority(stream_t *stream, unsigned char *payload)
+{
+    stream->dependency = get_u32(payload) & 0x7fffffff;
+    stream->weight = payload[4] + 1;
+}
+
+static int on_headers(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    stream_t *stream;
+    unsigned char *priority = NULL;
+
+    if (!id || !(id & 1) || unpad(&payload, &len, flags))
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (flags & FLAG_PRIORITY)
+    {
+	if (len < 5)
+	    return conn_error(conn, ERR_FRAME_SIZE);
+
+	priority = payload;
+	payload += 5;
+	len -= 5;
+    }
+
+    conn->header_trailers = 0;
+
+    if ((stream = stream_find(conn, id)))
+    {
+	/* Trailers, they have to end the stream */
+	if (stream->state != STREAM_OPEN)
+	    return conn_error(conn, ERR_STREAM_CLOSED);
+
+	if (!(flags & FLAG_END_STREAM))
+	    return conn_error(conn, ERR_PROTOCOL);
+
+	conn->header_trailers = 1;
+    }
+    else if (id <= conn->last_stream_id)
+    {
+	return conn_error(conn, ERR_STREAM_CLOSED);
+    }
+    else
+    {
+	conn->last_stream_id = id;
+
+	/* The block is decoded anyway to keep HPACK state in sync */
+	if (conn->goaway || !(stream = stream_open(conn, id)))
+	{
+	    if (queue_u32(conn, FRAME_RST_STREAM, id, ERR_REFUSED_STREAM))
+		return -1;
+	}
+    }
+
+    if (stream && priority)
+    {
+	set_priority(stream, priority);
+
+	if (stream->dependency == id)
+	    stream->dependency = 0;
+    }
+
+    conn->header_stream_id = id;
+    conn->header_stream = stream;
+    conn->header_end_stream = flags & FLAG_END_STREAM;
+
+    return header_block_append(conn, payload, len, flags);
+}
+
+static int on_continuation(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    if (id != conn->header_stream_id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    return header_block_append(conn, payload, len, flags);
+}
+
+static int on_data(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    stream_t *stream;
+    int frame_len = len;
+
+    if (!id || unpad(&payload, &len, flags))
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (id > conn->last_stream_id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    /* Padding counts against flow control, give it all back in batches */
+    conn->recv_consumed += frame_len;
+
+    if (conn->recv_consumed >= DEFAULT_WINDOW / 2)
+    {
+	if (queue_u32(conn, FRAME_WINDOW_UPDATE, 0, conn->recv_consumed))
+	    return -1;
+
+	conn->recv_consumed = 0;
+    }
+
+    if (!(stream = stream_find(conn, id)) || stream->state != STREAM_OPEN)
+	return reset(conn, id, stream, ERR_STREAM_CLOSED);
+
+    /* Request bodies aren't served yet, they are dropped */
+    if (flags & FLAG_END_STREAM)
+	return stream_respond(conn, stream);
+
+    stream->recv_consumed += frame_len;
+
+    if (stream->recv_consumed >= DEFAULT_WINDOW / 2)
+    {
+	if (queue_u32(conn, FRAME_WINDOW_UPDATE, id, stream->recv_consumed))
+	    return -1;
+
+	stream->recv_consumed = 0;
+    }
+
+    return 0;
+}
+
+static int on_priority(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    stream_t *stream;
+
+    if (!id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (len != 5)
+	return reset(conn, id, stream_find(conn, id), ERR_FRAME_SIZE);
+
+    if ((stream = stream_find(conn, id)))
+    {
+	set_priority(stream, payload);
+
+	if (stream->dependency == id)
+	    return reset(conn, id, stream, ERR_PROTOCOL);
+    }
+
+    return 0;
+}
+
+static int on_rst_stream(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    stream_t *stream;
+
+    if (!id || id > conn->last_stream_id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (len != 4)
+	return conn_error(conn, ERR_FRAME_SIZE);
+
+    if ((stream = stream_find(conn, id)))
+	stream_close(conn, stream);
+
+    return 0;
+}
+
+static int apply_settings(conn_t *conn, unsigned char *payload, int len)
+{
+    unsigned int value;
+    int delta;
+
+    for (int i = 0; i + 6 <= len; i += 6)
+    {
+	value = get_u32(payload + i + 2);
+
+	switch (payload[i] << 8 | payload[i + 1])
+	{
+	    case SETTINGS_ENABLE_PUSH:
+		if (value > 1)
+		    return conn_error(conn, ERR_PROTOCOL);
+		break;
+	    case SETTINGS_INITIAL_WINDOW_SIZE:
+		if (value > MAX_WINDOW)
+		    return conn_error(conn, ERR_FLOW_CONTROL);
+
+		/* Applies retroactively to every open stream */
+		delta = value - conn->peer_initial_window;
+
+		for (int j = 0; j < MAX_STREAMS; ++j)
+		{
+		    if (conn->streams[j].state == STREAM_FREE)
+			continue;
+
+		    if (delta > 0 && conn->streams[j].window > MAX_WINDOW -
+			delta)
+		    {
+			return conn_error(conn, ERR_FLOW_CONTROL);
+		    }
+
+		    conn->streams[j].window += delta;
+		}
+
+		conn->peer_initial_window = value;
+		break;
+	    case SETTINGS_MAX_FRAME_SIZE:
+		if (value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE)
+		    return conn_error(conn, ERR_PROTOCOL);
+
+		conn->peer_max_frame_size = value;
+		break;
+	    default:
+		/* Our encoder never indexes, table size is of no concern */
+		break;
+	}
+    }
+
+    return 0;
+}
+
+static int on_settings(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    if (id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (flags & FLAG_ACK)
+	return len ? conn_error(conn, ERR_FRAME_SIZE) : 0;
+
+    if (len % 6)
+	return conn_error(conn, ERR_FRAME_SIZE);
+
+    if (apply_settings(conn, payload, len))
+	return -1;
+
+    return queue_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_ping(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    if (id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (len != 8)
+	return conn_error(conn, ERR_FRAME_SIZE);
+
+    if (flags & FLAG_ACK)
+	return 0;
+
+    return queue_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, len);
+}
+
+static int on_goaway(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    if (id)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    if (len < 8)
+	return conn_error(conn, ERR_FRAME_SIZE);
+
+    /* Streams in flight are finished, new ones refused */
+    conn->goaway = 1;
+
+    return 0;
+}
+
+static int on_window_update(conn_t *conn, int flags, unsigned int id,
+    unsigned char *payload, int len)
+{
+    stream_t *stream;
+    int increment;
+
+    if (len != 4)
+	return conn_error(conn, ERR_FRAME_SIZE);
+
+    increment = get_u32(payload) & 0x7fffffff;
+
+    if (!id)
+    {
+	if (!increment || conn->send_window > MAX_WINDOW - increment)
+	    return conn_error(conn, increment ? ERR_FLOW_CONTROL :
+		ERR_PROTOCOL);
+
+	conn->send_window += increment;
+	return 0;
+    }
+
+    if (!(stream = stream_find(conn, id)))
+	return 0;
+
+    if (!increment)
+	return reset(conn, id, stream, ERR_PROTOCOL);
+
+    if (stream->window > MAX_WINDOW - increment)
+	return reset(conn, id, stream, ERR_FLOW_CONTROL);
+
+    stream->window += increment;
+
+    return 0;
+}
+
+static int dispatch(conn_t *conn, frame_type_t type, int flags,
+    unsigned int id, unsigned char *payload, int len)
+{
+    if (!conn->settings_seen && type != FRAME_SETTINGS)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    conn->settings_seen = 1;
+
+    /* A header block can't be interleaved with anything */
+    if (conn->header_stream_id && type != FRAME_CONTINUATION)
+	return conn_error(conn, ERR_PROTOCOL);
+
+    switch (type)
+    {
+	case FRAME_DATA:
+	    return on_data(conn, flags, id, payload, len);
+	case FRAME_HEADERS:
+	    return on_headers(conn, flags, id, payload, len);
+	case FRAME_PRIORITY:
+	    return on_priority(conn, flags, id, payload, len);
+	case FRAME_RST_STREAM:
+	    return on_rst_stream(conn, flags, id, payload, len);
+	case FRAME_SETTINGS:
+	    return on_settings(conn, flags, id, payload, len);
+	case FRAME_PUSH_PROMISE:
+	    return conn_error(conn, ERR_PROTOCOL);
+	case FRAME_PING:
+	    return on_ping(conn, flags, id, payload, len);
+	case FRAME_GOAWAY:
+	    return on_goaway(conn, flags, id, payload, len);
+	case FRAME_WINDOW_UPDATE:
+	    return on_window_update(conn, flags, id, payload, len);
+	case FRAME_CONTINUATION:
+	    return on_continuation(conn, flags, id, payload, len);
+    }
+
+    /* Unknown frame types are ignored */
+    return 0;
+}
+
+static int process_input(conn_t *conn)
+{
+    unsigned char *pos = conn->rbuf, *end = conn->rbuf + conn->rbuf_len;
+    int len, rv = 0;
+
+    if (!conn->preface_done)
+    {
+	if (memcmp(conn->rbuf, PREFACE, MIN(conn->rbuf_len, PREFACE_LEN)))
+	    return conn_error(conn, ERR_PROTOCOL);
+
+	if (conn->rbuf_len < PREFACE_LEN)
+	    return 0;
+
+	pos += PREFACE_LEN;
+	conn->preface_done = 1;
+    }
+
+    while (end - pos >= FRAME_HEADER_LEN)
+    {
+	len = pos[0] << 16 | pos[1] << 8 | pos[2];
+
+	/* Larger frames were never allowed by our SETTINGS */
+	if (len > DEFAULT_FRAME_SIZE)
+	{
+	    rv = conn_error(conn, ERR_FRAME_SIZE);
+	    break;
+	}
+
+	if (end - pos < FRAME_HEADER_LEN + len)
+	    break;
+
+	if ((rv = dispatch(conn, pos[3], pos[4], get_u32(pos + 5) & 0x7fffffff,
+	    pos + FRAME_HEADER_LEN, len)))
+	{
+	    break;
+	}
+
+	pos += FRAME_HEADER_LEN + len;
+    }
+
+    memmove(conn->rbuf, pos, end - pos);
+    conn->rbuf_len = end - pos;
+
+    return rv;
+}
+
+/*
+ * Returns bytes read, 0 if nothing is pending and -1 once the peer is gone.
+ * A drain ends a blocking wait once, so GOAWAY goes out right away.
+ */
+static int conn_read(conn_t *conn, int block)
+{
+    int len;
+
+    if ((len = conn->http_ctx->transport->poll(conn->net_ctx, block ?
+	http_timeout_ms(conn->http_ctx->keepalive_timeout) : 0)) <= 0)
+    {
+	if (!block || (!len && http_stopping(conn->http_ctx) &&
+	    !conn->goaway_sent))
+	{
+	    return len;
+	}
+
+	if (!len)
+	    LOG_DEBUG("http2 idle timeout");
+
+	return -1;
+    }
+
+    if ((len = conn->http_ctx->transport->recv(conn->net_ctx,
+	(char *)conn->rbuf + conn->rbuf_len, RBUF_SIZE - conn->rbuf_len)) > 0)
+    {
+	conn->rbuf_len += len;
+	return len;
+    }
+
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+	LOG_DEBUG("http2 idle timeout");
+	return -1;
+    }
+
+    LOG_DEBUG("client closed connection");
+    conn->closed = 1;
+
+    return -1;
+}
+
+static int blocked_by_parent(conn_t *conn, stream_t *stream)
+{
+    stream_t *parent;
+
+    return stream->dependency && (parent = stream_find(conn,
+	stream->dependency)) && parent->state == STREAM_SENDING &&
+	parent->remaining;
+}
+
+/*
+ * Lowest urgency wins, ties go to the stream with the smallest virtual
+ * time. Sending advances it inversely to the weight, so siblings share
+ * bandwidth in proportion. Dependents wait for their parent.
+ */
+static stream_t* schedule(conn_t *conn)
+{
+    stream_t *stream, *best = NULL;
+
+    /* Upgraded clients may not read until their preface is out */
+    if (conn->send_window <= 0 || !conn->preface_done)
+	return NULL;
+
+    for (int i = 0; i < MAX_STREAMS; ++i)
+    {
+	stream = &conn->streams[i];
+
+	if (stream->state != STREAM_SENDING || !stream->remaining ||
+	    stream->window <= 0 || blocked_by_parent(conn, stream))
+	{
+	    continue;
+	}
+
+	if (!best || stream->urgency < best->urgency ||
+	    (stream->urgency == best->urgency && stream->vtime < best->vtime))
+	{
+	    best = stream;
+	}
+    }
+
+    return best;
+}
+
+static int send_data(conn_t *conn, stream_t *stream)
+{
+    int len;
+
+    len = MIN(stream->remaining, stream->window);
+    len = MIN(len, conn->send_window);
+    len = MIN(len, conn->peer_max_frame_size);
+
+    /* Bodies from memory are copied, a frame has to fit the buffer */
+    if (stream->body)
+    {
+	len = MIN(len, WBUF_SIZE - FRAME_HEADER_LEN);
+
+	if (queue_frame(conn, FRAME_DATA, len == stream->remaining ?
+	    FLAG_END_STREAM : 0, stream->id,
+	    (unsigned char *)stream->body + stream->offset, len))
+	{
+	    return -1;
+	}
+    }
+    else
+    {
+	if (conn->wbuf_len + FRAME_HEADER_LEN > WBUF_SIZE && flush(conn))
+	    return -1;
+
+	put_frame_header(conn->wbuf + conn->wbuf_len, len, FRAME_DATA,
+	    len == stream->remaining ? FLAG_END_STREAM : 0, stream->id);
+	conn->wbuf_len += FRAME_HEADER_LEN;
+
+	/* Pending control frames and the frame header lead the file data */
+	if (conn->http_ctx->transport->sendfile(conn->net_ctx,
+	    (char *)conn->wbuf, conn->wbuf_len, stream->fd, stream->offset,
+	    len) == -1)
+	{
+	    log_message(LOG_LEVEL_ERROR, "http2 sendfile");
+	    conn->closed = 1;
+	    return -1;
+	}
+
+	conn->wbuf_len = 0;
+    }
+    conn->send_window -= len;
+    conn->vclock = stream->vtime;
+
+    stream->offset += len;
+    stream->remaining -= len;
+    stream->response.bytes_sent += len;
+    stream->window -= len;
+    stream->vtime += (unsigned long long)len * VTIME_SCALE / stream->weight;
+
+    if (!stream->remaining)
+	stream_finish(conn, stream);
+
+    return 0;
+}
+
+static conn_t* conn_new(http_ctx_t *http_ctx, char *client_address,
+    void *net_ctx)
+{
+    unsigned char settings[6];
+    conn_t *conn;
+
+    if (!(conn = calloc(1, sizeof(conn_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "http2 connection allocation");
+	return NULL;
+    }
+
+    conn->http_ctx = http_ctx;
+    conn->client_address = client_address;
+    conn->net_ctx = net_ctx;
+    conn->send_window = DEFAULT_WINDOW;
+    conn->peer_initial_window = DEFAULT_WINDOW;
+    conn->peer_max_frame_size = DEFAULT_FRAME_SIZE;
+
+    if (!(conn->header_block = malloc(MAX_HEADER_BLOCK)))
+    {
+	log_message(LOG_LEVEL_ERROR, "http2 header block allocation");
+	free(conn);
+	return NULL;
+    }
+
+    if (hpack_table_init(&conn->decoder, HPACK_DEFAULT_TABLE_SIZE))
+    {
+	free(conn->header_block);
+	free(conn);
+	return NULL;
+    }
+
+    if (http_ctx->transport->set_recv_timeout(net_ctx,
+	http_ctx->keepalive_timeout) == -1)
+	log_message(LOG_LEVEL_WARNING, "http2 idle timeout not set");
+
+    /* Server connection preface, must be the first frame we send */
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32(settings + 2, MAX_STREAMS);
+    queue_frame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    return conn;
+}
+
+static void conn_free(conn_t *conn)
+{
+    for (int i = 0; i < MAX_STREAMS; ++i)
+    {
+	if (conn->streams[i].state != STREAM_FREE)
+	    stream_close(conn, &conn->streams[i]);
+    }
+
+    hpack_table_deinit(&conn->decoder);
+    free(conn->header_block);
+    free(conn);
+}
+
+static int queue_goaway(conn_t *conn)
+{
+    unsigned char goaway[8];
+
+    put_u32(goaway, conn->last_stream_id);
+    put_u32(goaway + 4, conn->error);
+    conn->goaway_sent = 1;
+
+    return queue_frame(conn, FRAME_GOAWAY, 0, 0, goaway, sizeof(goaway));
+}
+
+static int serve(conn_t *conn)
+{
+    stream_t *stream;
+
+    while (!conn->closed && !conn->error && !process_input(conn))
+    {
+	/* Draining: streams already opened are served to the end */
+	if (!conn->goaway_sent && http_stopping(conn->http_ctx))
+	{
+	    LOG_DEBUG("http2 stopping, GOAWAY after stream %u",
+		conn->last_stream_id);
+	    conn->goaway = 1;
+
+	    if (queue_goaway(conn) || flush(conn))
+		break;
+	}
+
+	if (conn->goaway && !conn->active_streams)
+	    break;
+
+	if ((stream = schedule(conn)))
+	{
+	    if (send_data(conn, stream) || conn_read(conn, 0) == -1)
+		break;
+
+	    continue;
+	}
+
+	if (flush(conn) || conn_read(conn, 1) == -1)
+	    break;
+    }
+
+    /* A drain's GOAWAY went out already, unless an error followed */
+    if (!conn->closed && (!conn->goaway_sent || conn->error) &&
+	!queue_goaway(conn))
+    {
+	flush(conn);
+    }
+
+    conn_free(conn);
+
+    return 0;
+}
+
+int http2_handle_peer(http_ctx_t *http_ctx, char client_address[],
+    void *net_ctx, char *data, int data_len)
+{
+    conn_t *conn;
+
+    if (!(conn = conn_new(http_ctx, client_address, net_ctx)))
+	return -1;
+
+    memcpy(conn->rbuf, data, MIN(data_len, RBUF_SIZE));
+    conn->rbuf_len = MIN(data_len, RBUF_SIZE);
+
+    return serve(conn);
+}
+
+static int base64url_decode(char *src, int len, unsigned char *dst)
+{
+    unsigned int acc = 0;
+    int bits = 0, out = 0, value;
+    char c;
+
+    for (int i = 0; i < len && src[i] != '='; ++i)
+    {
+	c = src[i];
+
+	if (c >= 'A' && c <= 'Z')
+	    value = c - 'A';
+	else if (c >= 'a' && c <= 'z')
+	    value = c - 'a' + 26;
+	else if (c >= '0' && c <= '9')
+	    value = c - '0' + 52;
+	else if (c == '-' || c == '+')
+	    value = 62;
+	else if (c == '_' || c == '/')
+	    value = 63;
+	else
+	    return -1;
+
+	acc = (acc << 6 | value) & 0xffff;
+	bits += 6;
+
+	if (bits >= 8)
+	{
+	    bits -= 8;
+	    dst[out++] = acc >> bits;
+	}
+    }
+
+    return out;
+}
+
+/* The 101 is already out, request becomes half closed stream 1 */
+int http2_handle_upgrade(http_ctx_t *http_ctx, char client_address[],
+    void *net_ctx, http_request_t *request)
+{
+    unsigned char *settings;
+    stream_t *stream;
+    conn_t *conn;
+    int len;
+
+    if (!(conn = conn_new(http_ctx, client_address, net_ctx)))
+	return -1;
+
+    /* Acknowledged implicitly by the 101 */
+    if (!(settings = malloc(request->http2_settings_len + 1)) ||
+	(len = base64url_decode(request->http2_settings,
+	request->http2_settings_len, settings)) == -1 || len % 6 ||
+	apply_settings(conn, settings, len))
+    {
+	LOG_DEBUG("invalid HTTP2-Settings");
+	conn->error = ERR_PROTOCOL;
+	free(settings);
+	return serve(conn);
+    }
+
+    free(settings);
+
+    stream = stream_open(conn, 1);
+    conn->last_stream_id = 1;
+
+    stream->request.method = request->method;
+    stream->request.file = request->file;
+    stream->request.path = request->path;
+    stream->request.path_len = request->path_len;
+    request->file = NULL;
+    request->path = NULL;
+    stream->request.received = request->received;
+
+    /* Stream strings are owned, these point into the HTTP/1 buffer */
+    if (request->user_agent && (stream->request.user_agent =
+	strndup(request->user_agent, request->user_agent_len)))
+    {
+	stream->request.user_agent_len = request->user_agent_len;
+    }
+
+    if (request->referer && (stream->request.referer =
+	strndup(request->referer, request->referer_len)))
+    {
+	stream->request.referer_len = request->referer_len;
+    }
+
+    if (request->host && request->host_len < sizeof(stream->host))
+    {
+	memcpy(stream->host, request->host, request->host_len);
+	stream->request.host = stream->host;
+	stream->request.host_len = request->host_len;
+    }
+
+    if (stream_respond(conn, stream))
+	conn->closed = 1;
+
+    return serve(conn);
+}
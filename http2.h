@@ -0,0 +1,13 @@
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include "http.h"
+
+#define HTTP2_PREFACE_START "PRI * HTTP/2.0"
+
+int http2_handle_peer(http_ctx_t *http_ctx, char client_address[],
+    void *net_ctx, char *data, int data_len);
+int http2_handle_upgrade(http_ctx_t *http_ctx, char client_address[],
+    void *net_ctx, http_request_t *request);
+
+#endif
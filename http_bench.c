@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+#include "mempipe.h"
+#include "route.h"
+#include "mime.h"
+#include "logger.h"
+
+#define BENCH_REQUESTS 100000
+/* The first round warms the page cache and the file cache */
+#define BENCH_ROUNDS 2
+#define BENCH_OUT_SIZE 256
+#define BENCH_REQUEST "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n"
+
+/*
+ * Serves requests for one path, pipelined on one in-memory connection, so
+ * what gets measured is the HTTP layer and the file system only.
+ */
+int main(int argc, char *argv[])
+{
+    http_ctx_t *http = NULL;
+    route_table_t *routes = NULL;
+    mempipe_t *pipe = NULL;
+    struct timespec start, end;
+    char *in = NULL, *status_end;
+    long requests = BENCH_REQUESTS, request_len;
+    double seconds;
+    int rv = 1;
+
+    log_init(stderr, LOG_LEVEL_ERROR);
+
+    if (argc < 3 || argc > 4 || *argv[2] != '/' ||
+	(argc == 4 && (requests = atol(argv[3])) <= 0))
+    {
+	fprintf(stderr, "usage: %s <root> </path> [requests]\n", argv[0]);
+	goto Exit;
+    }
+
+    request_len = snprintf(NULL, 0, BENCH_REQUEST, argv[2]);
+
+    if (!(in = malloc(request_len * requests + 1)))
+    {
+	log_message(LOG_LEVEL_ERROR, "request buffer allocation");
+	goto Exit;
+    }
+
+    for (long i = 0; i < requests; ++i)
+	sprintf(in + i * request_len, BENCH_REQUEST, argv[2]);
+
+    if (!(http = http_init()) || mime_init(NULL, MIME_CHARSET) ||
+	http_set_root_folder(http, argv[1]) ||
+	!(routes = route_table_init(NULL)) || route_add(routes,
+	ROUTE_HOST_ANY, strlen(ROUTE_HOST_ANY), "/", 1, ROUTE_TYPE_ROOT,
+	argv[1], strlen(argv[1])) ||
+	!(pipe = mempipe_new(in, request_len * requests, BENCH_OUT_SIZE)))
+    {
+	log_message(LOG_LEVEL_ERROR, "initialization");
+	goto Exit;
+    }
+
+    http_set_routes(http, routes);
+    http_set_transport(http, &mempipe_transport);
+
+    /* The last round is the one reported */
+    for (int round = 0; round < BENCH_ROUNDS; ++round)
+    {
+	mempipe_rewind(pipe);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (http_handle_peer(http, "127.0.0.1", pipe))
+	{
+	    log_message(LOG_LEVEL_ERROR, "handling requests");
+	    goto Exit;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+
+    seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    status_end = memchr(pipe->out, '\r', pipe->out_len);
+    printf("%.*s\n", status_end ? (int)(status_end - pipe->out) : 0,
+	pipe->out);
+    printf("%ld requests, %ld bytes in %.3f s, %.0f req/s\n", requests,
+	pipe->sent, seconds, requests / seconds);
+
+    rv = 0;
+
+Exit:
+    mempipe_free(pipe);
+    route_table_deinit(routes);
+    if (http)
+	http_deinit(http);
+    free(in);
+    log_deinit();
+
+    return rv;
+}
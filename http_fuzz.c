@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "http.h"
+#include "mempipe.h"
+#include "route.h"
+#include "mime.h"
+#include "logger.h"
+
+#define FUZZ_ROOT_ENV "HTTP_FUZZ_ROOT"
+#define FUZZ_ROOT "pages"
+#define FUZZ_OUT_SIZE 4096
+
+static http_ctx_t *http;
+
+/* Set up once, every input is a fresh connection to the same server */
+static int fuzz_init()
+{
+    route_table_t *routes;
+    char *root;
+
+    if (!(root = getenv(FUZZ_ROOT_ENV)))
+	root = FUZZ_ROOT;
+
+    /* Clients hanging up mid-request are errors to the server, not here */
+    log_init(fopen("/dev/null", "we") ?: stderr, LOG_LEVEL_ERROR);
+
+    if (!(http = http_init()) || mime_init(NULL, MIME_CHARSET) ||
+	http_set_root_folder(http, root) ||
+	!(routes = route_table_init(NULL)) || route_add(routes,
+	ROUTE_HOST_ANY, strlen(ROUTE_HOST_ANY), "/", 1, ROUTE_TYPE_ROOT,
+	root, strlen(root)))
+    {
+	log_message(LOG_LEVEL_ERROR, "fuzz: initialization, root %s", root);
+	log_flush();
+	return -1;
+    }
+
+    http_set_routes(http, routes);
+    http_set_chunked(http, 1);
+    http_set_http2(http, 1);
+    http_set_transport(http, &mempipe_transport);
+
+    return 0;
+}
+
+/* Whatever the bytes, the connection is answered and closed cleanly */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    mempipe_t *pipe;
+    char *in;
+
+    if (!http && fuzz_init())
+	abort();
+
+    /* A copy, so reads past the input are caught rather than tolerated */
+    if (!(in = malloc(size ? size : 1)))
+	return 0;
+
+    memcpy(in, data, size);
+
+    if ((pipe = mempipe_new(in, size, FUZZ_OUT_SIZE)))
+    {
+	http_handle_peer(http, "127.0.0.1", pipe);
+	mempipe_free(pipe);
+    }
+
+    free(in);
+    log_flush();
+
+    return 0;
+}
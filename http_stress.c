@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include "logger.h"
+
+#define STRESS_ROUNDS 20000
+#define STRESS_SEED 1
+#define STRESS_INPUT_MAX (64 * 1024)
+#define STRESS_EDITS_MAX 8
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+typedef struct {
+    char *data;
+    size_t len;
+} input_t;
+
+static input_t *inputs;
+static int inputs_num;
+
+/* The bytes parsers trip over, biased towards framing */
+static char specials[] = " \t\r\n:;,=%/.?*#\"\\\x00\x7f" "\xff" "09aZ";
+
+static int input_add(char *path)
+{
+    FILE *fp;
+    input_t *grown;
+    char *data;
+    size_t len;
+
+    if (!(fp = fopen(path, "re")))
+    {
+	log_message(LOG_LEVEL_ERROR, "stress: opening %s", path);
+	return -1;
+    }
+
+    data = malloc(STRESS_INPUT_MAX);
+    len = data ? fread(data, 1, STRESS_INPUT_MAX, fp) : 0;
+    fclose(fp);
+
+    if (!data || !(grown = realloc(inputs, (inputs_num + 1) *
+	sizeof(*inputs))))
+    {
+	free(data);
+	return -1;
+    }
+
+    inputs = grown;
+    inputs[inputs_num].data = data;
+    inputs[inputs_num++].len = len;
+
+    return 0;
+}
+
+static int corpus_read(char *dir_path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char path[4096];
+    int rv = 0;
+
+    if (!(dir = opendir(dir_path)))
+	return input_add(dir_path);
+
+    while (!rv && (entry = readdir(dir)))
+    {
+	if (*entry->d_name == '.')
+	    continue;
+
+	snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+	rv = input_add(path);
+    }
+
+    closedir(dir);
+
+    return rv;
+}
+
+/* A few byte edits, splices from another input or cuts */
+static size_t mutate(char *buffer, size_t len)
+{
+    input_t *other;
+    size_t at, n;
+
+    for (int edits = 1 + rand() % STRESS_EDITS_MAX; edits; --edits)
+    {
+	at = len ? rand() % (len + 1) : 0;
+
+	switch (rand() % 5)
+	{
+	    case 0:
+		if (at < len)
+		    buffer[at] = specials[rand() % (sizeof(specials) - 1)];
+		break;
+	    case 1:
+		if (len < STRESS_INPUT_MAX)
+		{
+		    memmove(buffer + at + 1, buffer + at, len - at);
+		    buffer[at] = specials[rand() % (sizeof(specials) - 1)];
+		    len++;
+		}
+		break;
+	    case 2:
+		n = len - at ? 1 + rand() % (len - at) : 0;
+		memmove(buffer + at, buffer + at + n, len - at - n);
+		len -= n;
+		break;
+	    case 3:
+		other = &inputs[rand() % inputs_num];
+		n = other->len ? rand() % other->len : 0;
+		n = n > STRESS_INPUT_MAX - len ? STRESS_INPUT_MAX - len : n;
+		memmove(buffer + at + n, buffer + at, len - at);
+		memcpy(buffer + at, other->data, n);
+		len += n;
+		break;
+	    default:
+		len = at;
+		break;
+	}
+    }
+
+    return len;
+}
+
+/*
+ * Replays every corpus input as is, then mutated ones. Built with the
+ * sanitizers, a crash or a report stops the run with a non-zero status.
+ */
+int main(int argc, char *argv[])
+{
+    char *buffer;
+    long rounds = STRESS_ROUNDS;
+    size_t len;
+    int i, rv = 1;
+
+    log_init(stderr, LOG_LEVEL_ERROR);
+
+    if (argc < 2 || (argc > 2 && (rounds = atol(argv[2])) < 0) || argc > 3)
+    {
+	fprintf(stderr, "usage: %s <corpus dir> [rounds]\n", argv[0]);
+	goto Exit;
+    }
+
+    if (corpus_read(argv[1]) || !inputs_num ||
+	!(buffer = malloc(STRESS_INPUT_MAX)))
+    {
+	log_message(LOG_LEVEL_ERROR, "stress: reading corpus %s", argv[1]);
+	goto Exit;
+    }
+
+    for (i = 0; i < inputs_num; ++i)
+	LLVMFuzzerTestOneInput((uint8_t *)inputs[i].data, inputs[i].len);
+
+    srand(STRESS_SEED);
+
+    for (long round = 0; round < rounds; ++round)
+    {
+	i = rand() % inputs_num;
+	memcpy(buffer, inputs[i].data, inputs[i].len);
+	len = mutate(buffer, inputs[i].len);
+	LLVMFuzzerTestOneInput((uint8_t *)buffer, len);
+    }
+
+    printf("%d corpus inputs, %ld mutated rounds\n", inputs_num, rounds);
+
+    free(buffer);
+    rv = 0;
+
+Exit:
+    for (i = 0; i < inputs_num; ++i)
+	free(inputs[i].data);
+
+    free(inputs);
+    log_deinit();
+
+    return rv;
+}
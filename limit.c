@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "limit.h"
+#include "network.h"
+#include "logger.h"
+
+#define LIMIT_SLOTS 65536
+#define LIMIT_PROBES 16
+#define LIMIT_IDLE_SECONDS 60
+#define TOKEN_UNIT 1000
+/* Workers' clock readings are never further apart than this */
+#define CLOCK_SKEW_MS 1000
+
+typedef enum {
+    SLOT_EMPTY = 0,
+    SLOT_BUSY,
+    SLOT_READY
+} slot_state_t;
+
+/*
+ * One cache line per client address. bucket packs milli-tokens in the
+ * high half and the millisecond stamp of the last refill in the low
+ * half, so a single CAS moves both.
+ */
+typedef struct {
+    unsigned int state;
+    int connections;
+    unsigned int last_seen;
+    unsigned long long key[2];
+    unsigned long long bucket;
+} __attribute__((aligned(64))) limit_entry_t;
+
+/*
+ * Open addressed with linear probing and shared by every worker. Slots
+ * are claimed with a CAS and never freed, only recycled once their
+ * client has had no connection for a while.
+ */
+typedef struct {
+    limit_stats_t stats __attribute__((aligned(64)));
+    limit_entry_t entries[LIMIT_SLOTS];
+} limit_table_t;
+
+static limit_table_t *table;
+static limit_opts_t limits;
+
+/* Set by the parent right before fork, so each worker knows its own */
+static char cached_address[INET6_ADDRSTRLEN];
+static limit_entry_t *cached_entry;
+static limit_entry_t *acquired_entry;
+
+static void now(unsigned int *ms, unsigned int *s)
+{
+    struct timespec ts;
+
+    /* vDSO, no syscall */
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    *ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    *s = ts.tv_sec;
+}
+
+/* IPv4 is stored mapped, ::ffff:a.b.c.d */
+static int address_key(char *address, unsigned long long key[2])
+{
+    unsigned char addr[16] = {};
+    unsigned int uid;
+    int pid;
+
+    /* Local clients share limits per user, whatever process connects */
+    if (sscanf(address, UNIX_PEER_FORMAT, &uid, &pid) == 2)
+    {
+	key[0] = ~0ull;
+	key[1] = uid;
+	return 0;
+    }
+
+    if (inet_pton(AF_INET6, address, addr) != 1)
+    {
+	addr[10] = addr[11] = 0xff;
+
+	if (inet_pton(AF_INET, address, addr + 12) != 1)
+	    return -1;
+    }
+
+    memcpy(key, addr, sizeof(addr));
+
+    return 0;
+}
+
+static unsigned int key_hash(unsigned long long key[2])
+{
+    unsigned long long hash = key[0] ^ key[1] * 0x9e3779b97f4a7c15ull;
+
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/* Caller owns the slot in SLOT_BUSY, publishing it releases the fields */
+static limit_entry_t* entry_fill(limit_entry_t *entry,
+    unsigned long long key[2])
+{
+    unsigned int ms, s;
+
+    now(&ms, &s);
+
+    entry->key[0] = key[0];
+    entry->key[1] = key[1];
+    entry->connections = 0;
+    entry->last_seen = s;
+    entry->bucket = (unsigned long long)limits.burst * TOKEN_UNIT << 32 | ms;
+
+    __atomic_store_n(&entry->state, SLOT_READY, __ATOMIC_RELEASE);
+
+    return entry;
+}
+
+static limit_entry_t* entry_cache(limit_entry_t *entry, char *client_address)
+{
+    strncpy(cached_address, client_address, INET6_ADDRSTRLEN - 1);
+    cached_entry = entry;
+
+    return entry;
+}
+
+static limit_entry_t* entry_get(char *client_address)
+{
+    unsigned long long key[2];
+    unsigned int hash, state, ms, s;
+    limit_entry_t *entry;
+
+    if (cached_entry && !strcmp(cached_address, client_address))
+	return cached_entry;
+
+    if (!table || address_key(client_address, key))
+	return NULL;
+
+    hash = key_hash(key);
+
+    for (int i = 0; i < LIMIT_PROBES; ++i)
+    {
+	entry = &table->entries[(hash + i) & (LIMIT_SLOTS - 1)];
+	state = SLOT_EMPTY;
+
+	if (__atomic_compare_exchange_n(&entry->state, &state, SLOT_BUSY, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+	    return entry_cache(entry_fill(entry, key),
+		client_address);
+	}
+
+	/* Being filled by another worker, may well be our own address */
+	while (state == SLOT_BUSY)
+	    state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+	if (entry->key[0] == key[0] && entry->key[1] == key[1])
+	    return entry_cache(entry, client_address);
+    }
+
+    /* Probe window is full, take over a client that went quiet */
+    now(&ms, &s);
+
+    for (int i = 0; i < LIMIT_PROBES; ++i)
+    {
+	entry = &table->entries[(hash + i) & (LIMIT_SLOTS - 1)];
+	state = SLOT_READY;
+
+	if (__atomic_load_n(&entry->connections, __ATOMIC_RELAXED) ||
+	    s - __atomic_load_n(&entry->last_seen, __ATOMIC_RELAXED) <
+	    LIMIT_IDLE_SECONDS)
+	{
+	    continue;
+	}
+
+	if (__atomic_compare_exchange_n(&entry->state, &state, SLOT_BUSY, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+	    return entry_cache(entry_fill(entry, key),
+		client_address);
+	}
+    }
+
+    __atomic_fetch_add(&table->stats.table_full, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static void entry_touch(limit_entry_t *entry)
+{
+    unsigned int ms, s;
+
+    now(&ms, &s);
+    __atomic_store_n(&entry->last_seen, s, __ATOMIC_RELAXED);
+}
+
+/* Table is mapped once, before the first fork, later calls only retune */
+int limit_init(limit_opts_t *opts)
+{
+    limits = *opts;
+
+    if (!limits.burst)
+	limits.burst = limits.rate;
+
+    if (table || (!limits.max_conn && !limits.rate))
+	return 0;
+
+    if ((table = mmap(NULL, sizeof(limit_table_t), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	table = NULL;
+	log_message(LOG_LEVEL_ERROR, "limit table mmap");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Connections are counted whenever limiting is on, idle slots rely on it */
+int limit_conn_acquire(char *client_address)
+{
+    limit_entry_t *entry;
+
+    acquired_entry = NULL;
+
+    /* A full table lets the client through rather than lock it out */
+    if ((!limits.max_conn && !limits.rate) ||
+	!(entry = entry_get(client_address)))
+    {
+	return 0;
+    }
+
+    entry_touch(entry);
+
+    if (__atomic_add_fetch(&entry->connections, 1, __ATOMIC_RELAXED) >
+	limits.max_conn && limits.max_conn)
+    {
+	__atomic_sub_fetch(&entry->connections, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&table->stats.conn_rejected, 1, __ATOMIC_RELAXED);
+	return -1;
+    }
+
+    acquired_entry = entry;
+
+    return 0;
+}
+
+void limit_conn_release(char *client_address)
+{
+    if (!acquired_entry)
+	return;
+
+    entry_touch(acquired_entry);
+    __atomic_sub_fetch(&acquired_entry->connections, 1, __ATOMIC_RELAXED);
+    acquired_entry = NULL;
+}
+
+int limit_request(char *client_address)
+{
+    unsigned long long old, new, tokens, cap;
+    unsigned int ms, s, stamp;
+    limit_entry_t *entry;
+    int elapsed, allowed;
+
+    if (!limits.rate || !(entry = entry_get(client_address)))
+	return 0;
+
+    now(&ms, &s);
+    cap = (unsigned long long)limits.burst * TOKEN_UNIT;
+    old = __atomic_load_n(&entry->bucket, __ATOMIC_ACQUIRE);
+
+    do {
+	tokens = old >> 32;
+	stamp = old;
+
+	elapsed = ms - stamp;
+
+	/* Another worker may have refilled with a later clock reading */
+	if (elapsed < 0 && elapsed > -CLOCK_SKEW_MS)
+	{
+	    elapsed = 0;
+	    ms = stamp;
+	}
+
+	/*
+	 * Further ahead, the 32 bit stamp wrapped: idle for more than 24
+	 * days, way past a full refill. rate tokens per second is rate
+	 * milli-tokens per millisecond.
+	 */
+	if (elapsed < 0)
+	    tokens = cap;
+	else
+	    tokens += (unsigned long long)elapsed * limits.rate;
+
+	if (tokens > cap)
+	    tokens = cap;
+
+	if ((allowed = tokens >= TOKEN_UNIT))
+	    tokens -= TOKEN_UNIT;
+
+	new = tokens << 32 | ms;
+    } while (!__atomic_compare_exchange_n(&entry->bucket, &old, new, 1,
+	__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (!allowed)
+    {
+	__atomic_fetch_add(&table->stats.rate_limited, 1, __ATOMIC_RELAXED);
+	return -1;
+    }
+
+    return 0;
+}
+
+void limit_get_stats(limit_stats_t *stats)
+{
+    if (!table)
+    {
+	memset(stats, 0, sizeof(*stats));
+	return;
+    }
+
+    stats->conn_rejected = __atomic_load_n(&table->stats.conn_rejected,
+	__ATOMIC_RELAXED);
+    stats->rate_limited = __atomic_load_n(&table->stats.rate_limited,
+	__ATOMIC_RELAXED);
+    stats->table_full = __atomic_load_n(&table->stats.table_full,
+	__ATOMIC_RELAXED);
+}
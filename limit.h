@@ -0,0 +1,24 @@
+#ifndef _LIMIT_H_
+#define _LIMIT_H_
+
+#define LIMIT_RATE_MAX 1000000
+
+typedef struct {
+    int max_conn;
+    int rate;
+    int burst;
+} limit_opts_t;
+
+typedef struct {
+    unsigned long conn_rejected;
+    unsigned long rate_limited;
+    unsigned long table_full;
+} limit_stats_t;
+
+int limit_init(limit_opts_t *opts);
+int limit_conn_acquire(char *client_address);
+void limit_conn_release(char *client_address);
+int limit_request(char *client_address);
+void limit_get_stats(limit_stats_t *stats);
+
+#endif
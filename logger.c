@@ -1,15 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
 #include "logger.h"
 
+#define LOG_BUFFER_SIZE 8192
+#define LOG_LINE_MAX 1024
+#define LOG_FLUSH_INTERVAL 1
+#define LOG_STAMP_LEN 16
+
+/* Every process has its own buffer, lines leave it with a single write() */
 typedef struct {
     FILE *fp;
-    log_level_t log_level;
+    int fd;
+    char buffer[LOG_BUFFER_SIZE];
+    int len;
+    time_t flushed_at;
+    time_t stamp_time;
+    char stamp[LOG_STAMP_LEN];
 } logger_t;
 
-static logger_t logger;
+log_level_t log_min_level;
+static logger_t logger = { .fd = -1 };
 
 static char* log_level2str(log_level_t log_level)
 {
@@ -28,36 +44,115 @@ static char* log_level2str(log_level_t log_level)
     return NULL;
 }
 
+/* Stdio may already hold output, it must not land after ours */
 void log_init(FILE *stream, log_level_t log_level)
 {
+    fflush(stream);
     logger.fp = stream;
-    logger.log_level = log_level;
+    logger.fd = fileno(stream);
+    log_min_level = log_level;
 }
 
 void log_deinit()
 {
+    log_flush();
     fclose(logger.fp);
+    logger.fp = NULL;
+    logger.fd = -1;
+}
+
+int log_level_parse(char *str, log_level_t *log_level)
+{
+    for (log_level_t level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR;
+	++level)
+    {
+	if (!strcasecmp(str, log_level2str(level)))
+	{
+	    *log_level = level;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+void log_set_level(log_level_t log_level)
+{
+    log_min_level = log_level;
+}
+
+/* The clock is only turned into text once a second */
+static void update_stamp(time_t now)
+{
+    struct tm tm;
+
+    if (now == logger.stamp_time)
+	return;
+
+    localtime_r(&now, &tm);
+    strftime(logger.stamp, LOG_STAMP_LEN, "%H:%M:%S", &tm);
+    logger.stamp_time = now;
 }
 
+/* Warnings and errors go out at once, debug lines at most a second late */
 void log_message(log_level_t log_level, char *format, ...)
 {
     va_list args;
-    struct tm *current_time;
-    time_t timer;
+    struct timespec now;
+    char *line;
+    int len;
 
-    if (logger.log_level > log_level)
+    if (log_min_level > log_level || logger.fd == -1)
 	return;
 
-    time(&timer);
-    current_time = localtime(&timer);
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    update_stamp(now.tv_sec);
+
+    if (LOG_BUFFER_SIZE - logger.len < LOG_LINE_MAX)
+	log_flush();
 
-    fprintf(logger.fp, "[%s][%02i:%02i:%02i] ", log_level2str(log_level),
-	current_time->tm_hour, current_time->tm_min, current_time->tm_sec);
+    line = logger.buffer + logger.len;
+    len = snprintf(line, LOG_LINE_MAX, "[%s][%s] ", log_level2str(log_level),
+	logger.stamp);
 
     va_start(args, format);
-    vfprintf(logger.fp, format, args);
+    len += vsnprintf(line + len, LOG_LINE_MAX - len, format, args);
     va_end(args);
 
-    fprintf(logger.fp, "\n");
+    /* Truncated, the newline takes the place of the NUL */
+    if (len > LOG_LINE_MAX - 1)
+	len = LOG_LINE_MAX - 1;
+
+    line[len++] = '\n';
+    logger.len += len;
+
+    if (log_level > LOG_LEVEL_DEBUG ||
+	now.tv_sec - logger.flushed_at >= LOG_FLUSH_INTERVAL)
+    {
+	log_flush();
+    }
 }
 
+/* Call before fork(), or the child writes the parent's lines again */
+void log_flush()
+{
+    int written = 0, len;
+
+    while (written < logger.len)
+    {
+	if ((len = write(logger.fd, logger.buffer + written,
+	    logger.len - written)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    /* Nowhere to report it, drop the lines */
+	    break;
+	}
+
+	written += len;
+    }
+
+    logger.len = 0;
+    logger.flushed_at = logger.stamp_time;
+}
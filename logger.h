@@ -9,8 +9,28 @@ typedef enum {
     LOG_LEVEL_ERROR = 2
 } log_level_t;
 
+/* Calls below this level aren't compiled in, "make RELEASE=1" drops debug */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
+extern log_level_t log_min_level;
+
+/* Arguments are only evaluated when the message is going to be written */
+#if LOG_COMPILE_LEVEL > 0
+#define LOG_DEBUG(...) do { } while (0)
+#else
+#define LOG_DEBUG(...) do { \
+    if (log_min_level <= LOG_LEVEL_DEBUG) \
+	log_message(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+} while (0)
+#endif
+
 void log_init(FILE *stream, log_level_t log_level);
 void log_deinit();
+int log_level_parse(char *str, log_level_t *log_level);
+void log_set_level(log_level_t log_level);
 void log_message(log_level_t log_level, char *message, ...);
+void log_flush();
 
 #endif
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include "network.h"
@@ -12,58 +13,384 @@
 #include "logger.h"
 #include "config_parser.h"
 #include "w3c_log.h"
+#include "route.h"
+#include "upstream.h"
+#include "tls.h"
+#include "limit.h"
+#include "timing.h"
+#include "cache.h"
+#include "file_cache.h"
+#include "preload.h"
+#include "mime.h"
+#include "autoindex.h"
+#include "utils.h"
 
 #define CONFIG_FILENAME "config"
-#define MAX_PORT_LEN 5
+#define MAX_FORMAT_LEN 8
+#define MAX_BALANCE_LEN 16
+#define MAX_FIELDS_LEN 512
+#define MAX_CHARSET_LEN 32
+#define MAX_MODE_LEN 8
+#define W3C_LOG_FIELDS_DEFAULT "time c-ip cs-method cs-uri sc-status"
+#define LISTEN_STATS_INTERVAL 1000
+#define TLS_SESSION_TIMEOUT 300
+#define TIMING_REPORT_INTERVAL 60
+#define REQUEST_BUFFER_MIN 256
+#define REQUEST_BUFFER_MAX (32 * 1024)
+#define CHUNK_SIZE_MIN 64
+#define CHUNK_SIZE_MAX (16 * 1024 * 1024)
+#define CACHE_ENTRIES_MIN 16
+#define CACHE_MAX_OBJECT_MIN 1024
+/* The kernel's own bounds for the keepalive probes */
+#define TCP_KEEPIDLE_MAX 32767
+#define TCP_KEEPINTVL_MAX 32767
+#define TCP_KEEPCNT_MAX 127
+#define LISTEN_FD_ENV "HTTP_SERVER_LISTEN_FD"
+#define PARENT_PID_ENV "HTTP_SERVER_PARENT_PID"
+/* Seconds the new binary has to start serving and tell us so */
+#define UPGRADE_TIMEOUT 10
+#define ACCEPT_BACKOFF_MS 100
 
 typedef struct {
     int port;
-    char address[INET6_ADDRSTRLEN];
+    char address[LISTEN_ADDRESS_LEN];
     char root[PATH_MAX];
     char w3c_log_path[PATH_MAX];
+    w3c_log_opts_t w3c_log_opts;
+    listen_opts_t listen_opts;
+    route_table_t *routes;
+    upstream_table_t *upstreams;
+    char proxy_cache[PATH_MAX];
+    cache_opts_t cache_opts;
+    file_cache_opts_t file_cache_opts;
+    char preload_manifest[PATH_MAX];
+    preload_opts_t preload_opts;
+    char index_file[NAME_MAX + 1];
+    char mime_types[PATH_MAX];
+    char charset[MAX_CHARSET_LEN];
+    int autoindex;
+    char autoindex_cache[PATH_MAX];
+    int http2;
+    char tls_cert[PATH_MAX];
+    char tls_key[PATH_MAX];
+    tls_opts_t tls_opts;
+    tls_ctx_t *tls;
+    limit_opts_t limit_opts;
+    timing_opts_t timing_opts;
+    int keepalive_timeout;
+    int cpu_affinity;
+    long request_buffer_size;
+    int chunked;
+    long chunk_size;
+    char upload_dir[PATH_MAX];
+    long max_body_size;
+    log_level_t log_level;
 } config_ctx_t;
 
-static config_ctx_t* read_config()
+sig_atomic_t stop_server;
+sig_atomic_t reload_server;
+sig_atomic_t upgrade_server;
+sig_atomic_t quit_server;
+
+static void free_config(config_ctx_t *config_ctx)
 {
-    config_parser_t *config_parser;
-    char port[MAX_PORT_LEN];
+    if (!config_ctx)
+	return;
 
-    config_ctx_t *config_ctx = malloc(sizeof(config_ctx_t));
+    tls_deinit(config_ctx->tls);
+    route_table_deinit(config_ctx->routes);
+    upstream_table_deinit(config_ctx->upstreams);
+    free(config_ctx);
+}
+
+static config_ctx_t* read_config()
+{
+    config_parser_t *config_parser = NULL;
+    char w3c_log_fields[MAX_FIELDS_LEN] = W3C_LOG_FIELDS_DEFAULT,
+	w3c_log_format[MAX_FORMAT_LEN] = "text",
+	log_level[MAX_FORMAT_LEN] = "debug",
+	upstream_balance[MAX_BALANCE_LEN] = "round_robin",
+	unix_mode[MAX_MODE_LEN] = "", *mode_end;
+    int errors = 0;
+
+    config_ctx_t *config_ctx = calloc(1, sizeof(config_ctx_t));
     if (!config_ctx)
     {
 	log_message(LOG_LEVEL_ERROR, "config_ctx memory allocation");
 	return NULL;
     }
 
+    if (!(config_ctx->upstreams = upstream_table_init()) ||
+	!(config_ctx->routes = route_table_init(config_ctx->upstreams)))
+    {
+	log_message(LOG_LEVEL_ERROR, "route table initialization");
+	goto Error;
+    }
+
     if (!(config_parser = config_parser_init(CONFIG_FILENAME)))
     {
 	log_message(LOG_LEVEL_ERROR, "config parser initialization");
 	goto Error;
-    } 
+    }
 
-    config_add_keyword(config_parser, "port", port, MAX_PORT_LEN);
+    config_add_int(config_parser, "port", &config_ctx->port, 0, 65535);
+    config_set_required(config_parser, "port");
     config_add_keyword(config_parser, "address", config_ctx->address,
-	INET6_ADDRSTRLEN);
+	LISTEN_ADDRESS_LEN);
     config_add_keyword(config_parser, "root", config_ctx->root, PATH_MAX);
     config_add_keyword(config_parser, "w3c_log_path", config_ctx->w3c_log_path,
 	PATH_MAX);
 
+    config_add_optional_keyword(config_parser, "log_level", log_level,
+	MAX_FORMAT_LEN);
+
+    config_add_optional_keyword(config_parser, "w3c_log_fields",
+	w3c_log_fields, MAX_FIELDS_LEN);
+    config_add_optional_keyword(config_parser, "w3c_log_format",
+	w3c_log_format, MAX_FORMAT_LEN);
+    config_add_size(config_parser, "w3c_log_rotate_size",
+	&config_ctx->w3c_log_opts.rotate_size, 0, LONG_MAX);
+    config_add_int(config_parser, "w3c_log_rotate_interval",
+	&config_ctx->w3c_log_opts.rotate_interval, 0, INT_MAX);
+
+    config_ctx->listen_opts.backlog = SOMAXCONN;
+    config_add_int(config_parser, "backlog", &config_ctx->listen_opts.backlog,
+	1, INT_MAX);
+    config_add_int(config_parser, "defer_accept",
+	&config_ctx->listen_opts.defer_accept, 0, INT_MAX);
+    config_add_int(config_parser, "fastopen",
+	&config_ctx->listen_opts.fastopen_qlen, 0, INT_MAX);
+
+    /* Socket options, accepted connections inherit them from the listener */
+    config_ctx->listen_opts.nodelay = 1;
+    config_add_bool(config_parser, "tcp_nodelay",
+	&config_ctx->listen_opts.nodelay);
+    config_add_size(config_parser, "sndbuf", &config_ctx->listen_opts.sndbuf,
+	0, INT_MAX);
+    config_add_size(config_parser, "rcvbuf", &config_ctx->listen_opts.rcvbuf,
+	0, INT_MAX);
+    config_add_size(config_parser, "notsent_lowat",
+	&config_ctx->listen_opts.notsent_lowat, 0, INT_MAX);
+    config_add_int(config_parser, "busy_poll",
+	&config_ctx->listen_opts.busy_poll, 0, INT_MAX);
+    config_add_int(config_parser, "tcp_keepidle",
+	&config_ctx->listen_opts.keepidle, 0, TCP_KEEPIDLE_MAX);
+    config_add_int(config_parser, "tcp_keepintvl",
+	&config_ctx->listen_opts.keepintvl, 0, TCP_KEEPINTVL_MAX);
+    config_add_int(config_parser, "tcp_keepcnt",
+	&config_ctx->listen_opts.keepcnt, 0, TCP_KEEPCNT_MAX);
+    config_add_int(config_parser, "ip_tos", &config_ctx->listen_opts.tos, 0,
+	255);
+    config_add_bool(config_parser, "cpu_affinity", &config_ctx->cpu_affinity);
+    config_add_optional_keyword(config_parser, "unix_socket_mode", unix_mode,
+	MAX_MODE_LEN);
+    config_add_list_keyword(config_parser, "route", route_add_str,
+	config_ctx->routes);
+
+    config_ctx->keepalive_timeout = HTTP_KEEPALIVE_TIMEOUT;
+    config_ctx->request_buffer_size = HTTP_REQUEST_BUFFER_SIZE;
+    config_ctx->chunk_size = HTTP_CHUNK_SIZE;
+    config_add_int(config_parser, "keepalive_timeout",
+	&config_ctx->keepalive_timeout, 0, INT_MAX);
+    config_add_size(config_parser, "request_buffer_size",
+	&config_ctx->request_buffer_size, REQUEST_BUFFER_MIN,
+	REQUEST_BUFFER_MAX);
+    config_add_bool(config_parser, "chunked", &config_ctx->chunked);
+    config_add_size(config_parser, "chunk_size", &config_ctx->chunk_size,
+	CHUNK_SIZE_MIN, CHUNK_SIZE_MAX);
+
+    /* Backends, "proxy" routes refer to them by name */
+    config_add_list_keyword(config_parser, "upstream", upstream_add_str,
+	config_ctx->upstreams);
+    config_add_list_keyword(config_parser, "proxy", route_add_proxy_str,
+	config_ctx->routes);
+    config_add_optional_keyword(config_parser, "upstream_balance",
+	upstream_balance, MAX_BALANCE_LEN);
+    config_add_int(config_parser, "upstream_max_fails",
+	&config_ctx->upstreams->opts.max_fails, 0, INT_MAX);
+    config_add_int(config_parser, "upstream_fail_timeout",
+	&config_ctx->upstreams->opts.fail_timeout, 1, INT_MAX);
+    config_add_int(config_parser, "upstream_timeout",
+	&config_ctx->upstreams->opts.timeout, 1, INT_MAX);
+    config_add_int(config_parser, "upstream_keepalive",
+	&config_ctx->upstreams->opts.keepalive, 0, UPSTREAM_KEEPALIVE_MAX);
+
+    /* Proxied responses are cached once proxy_cache names a directory */
+    config_ctx->cache_opts.size = CACHE_SIZE;
+    config_ctx->cache_opts.entries = CACHE_ENTRIES;
+    config_ctx->cache_opts.max_object = CACHE_MAX_OBJECT;
+    config_add_optional_keyword(config_parser, "proxy_cache",
+	config_ctx->proxy_cache, PATH_MAX);
+    config_add_size(config_parser, "proxy_cache_size",
+	&config_ctx->cache_opts.size, CACHE_MAX_OBJECT_MIN, LONG_MAX);
+    config_add_int(config_parser, "proxy_cache_entries",
+	&config_ctx->cache_opts.entries, CACHE_ENTRIES_MIN, INT_MAX / 1024);
+    config_add_size(config_parser, "proxy_cache_max_object",
+	&config_ctx->cache_opts.max_object, CACHE_MAX_OBJECT_MIN, INT_MAX);
+    config_add_int(config_parser, "proxy_cache_stale",
+	&config_ctx->cache_opts.stale, 0, INT_MAX);
+
+    /* Static files up to the max object size, shared by all workers */
+    config_ctx->file_cache_opts.entries = FILE_CACHE_ENTRIES;
+    config_ctx->file_cache_opts.max_object = FILE_CACHE_MAX_OBJECT;
+    config_add_size(config_parser, "file_cache_size",
+	&config_ctx->file_cache_opts.size, 0, LONG_MAX);
+    config_add_int(config_parser, "file_cache_entries",
+	&config_ctx->file_cache_opts.entries, CACHE_ENTRIES_MIN, INT_MAX / 1024);
+    config_add_size(config_parser, "file_cache_max_object",
+	&config_ctx->file_cache_opts.max_object, CACHE_MAX_OBJECT_MIN,
+	INT_MAX);
+
+    /* Files read before the listener opens, see preload.h */
+    config_ctx->preload_opts.workers = PRELOAD_WORKERS;
+    config_ctx->preload_opts.threshold = 100;
+    config_add_bool(config_parser, "preload",
+	&config_ctx->preload_opts.walk_root);
+    config_add_optional_keyword(config_parser, "preload_manifest",
+	config_ctx->preload_manifest, PATH_MAX);
+    config_add_int(config_parser, "preload_workers",
+	&config_ctx->preload_opts.workers, 1, PRELOAD_WORKERS_MAX);
+    config_add_int(config_parser, "preload_threshold",
+	&config_ctx->preload_opts.threshold, 0, 100);
+
+    /* PUT/POST bodies land beneath upload_dir, unset turns them off */
+    config_ctx->max_body_size = HTTP_MAX_BODY_SIZE;
+    config_add_optional_keyword(config_parser, "upload_dir",
+	config_ctx->upload_dir, PATH_MAX);
+    config_add_size(config_parser, "max_body_size",
+	&config_ctx->max_body_size, 0, LONG_MAX);
+
+    strcpy(config_ctx->index_file, "index.html");
+    strcpy(config_ctx->autoindex_cache, "./cache");
+    config_add_optional_keyword(config_parser, "index", config_ctx->index_file,
+	NAME_MAX + 1);
+    config_add_optional_keyword(config_parser, "mime_types",
+	config_ctx->mime_types, PATH_MAX);
+    strcpy(config_ctx->charset, MIME_CHARSET);
+    config_add_optional_keyword(config_parser, "charset", config_ctx->charset,
+	MAX_CHARSET_LEN);
+    config_add_bool(config_parser, "autoindex", &config_ctx->autoindex);
+    config_add_optional_keyword(config_parser, "autoindex_cache",
+	config_ctx->autoindex_cache, PATH_MAX);
+    config_ctx->http2 = 1;
+    config_add_bool(config_parser, "http2", &config_ctx->http2);
+
+    /* TLS is on once a certificate is configured */
+    config_ctx->tls_opts.tickets = 1;
+    config_ctx->tls_opts.ktls = 1;
+    config_ctx->tls_opts.session_timeout = TLS_SESSION_TIMEOUT;
+    config_add_optional_keyword(config_parser, "tls_cert",
+	config_ctx->tls_cert, PATH_MAX);
+    config_add_optional_keyword(config_parser, "tls_key",
+	config_ctx->tls_key, PATH_MAX);
+    config_add_bool(config_parser, "tls_tickets",
+	&config_ctx->tls_opts.tickets);
+    config_add_int(config_parser, "tls_session_timeout",
+	&config_ctx->tls_opts.session_timeout, 1, INT_MAX);
+    config_add_bool(config_parser, "ktls", &config_ctx->tls_opts.ktls);
+
+    config_ctx->timing_opts.report_interval = TIMING_REPORT_INTERVAL;
+    config_add_int(config_parser, "slow_request_ms",
+	&config_ctx->timing_opts.slow_ms, 0, INT_MAX);
+    config_add_int(config_parser, "timing_report_interval",
+	&config_ctx->timing_opts.report_interval, 0, INT_MAX);
+
+    /* Per client address, 0 is unlimited */
+    config_add_int(config_parser, "limit_conn",
+	&config_ctx->limit_opts.max_conn, 0, INT_MAX);
+    config_add_int(config_parser, "limit_rate", &config_ctx->limit_opts.rate,
+	0, LIMIT_RATE_MAX);
+    config_add_int(config_parser, "limit_burst",
+	&config_ctx->limit_opts.burst, 0, LIMIT_RATE_MAX);
+
+    /* [vhost <host>] gets its own root and routes */
+    config_set_section(config_parser, "vhost");
+    config_add_list_keyword(config_parser, "root", route_add_root_str,
+	config_ctx->routes);
+    config_add_list_keyword(config_parser, "route", route_add_str,
+	config_ctx->routes);
+    config_add_list_keyword(config_parser, "proxy", route_add_proxy_str,
+	config_ctx->routes);
+    config_set_section(config_parser, NULL);
+
+    /* Keep going, whatever is wrong below is reported along with it */
     if (config_parser_start(config_parser))
+	errors++;
+
+    if (log_level_parse(log_level, &config_ctx->log_level))
     {
-	log_message(LOG_LEVEL_ERROR, "config: parsing");
-	goto Error;
+	log_message(LOG_LEVEL_ERROR, "config: log_level must be debug, "
+	    "warning or error");
+	errors++;
+    }
+
+    if (w3c_log_parse_fields(w3c_log_fields, &config_ctx->w3c_log_opts))
+    {
+	log_message(LOG_LEVEL_ERROR, "config: invalid w3c_log_fields");
+	errors++;
+    }
+
+    /* Octal, as chmod takes it */
+    config_ctx->listen_opts.unix_mode = *unix_mode ? strtol(unix_mode,
+	&mode_end, 8) : UNIX_SOCKET_MODE;
+
+    if (*unix_mode && (*mode_end || config_ctx->listen_opts.unix_mode < 0 ||
+	config_ctx->listen_opts.unix_mode > 0777))
+    {
+	log_message(LOG_LEVEL_ERROR, "config: unix_socket_mode must be octal "
+	    "permissions, e.g. 660");
+	errors++;
+    }
+
+    if (strcmp(w3c_log_format, "text") && strcmp(w3c_log_format, "binary"))
+    {
+	log_message(LOG_LEVEL_ERROR, "config: w3c_log_format must be text or "
+	    "binary");
+	errors++;
+    }
+
+    config_ctx->w3c_log_opts.binary = !strcmp(w3c_log_format, "binary");
+
+    if (upstream_balance_parse(upstream_balance,
+	&config_ctx->upstreams->opts.balance))
+    {
+	log_message(LOG_LEVEL_ERROR, "config: upstream_balance must be "
+	    "round_robin or least_conn");
+	errors++;
     }
 
-    if (check_all_found(config_parser))
+    if (upstream_table_start(config_ctx->upstreams))
+	errors++;
+
+    if (!*config_ctx->tls_cert != !*config_ctx->tls_key)
     {
-	log_message(LOG_LEVEL_ERROR, "config: not all keywords found");
+	log_message(LOG_LEVEL_ERROR, "config: tls_cert and tls_key go together");
+	errors++;
+    }
+
+    if (errors)
 	goto Error;
+
+    /* Loaded here so a broken certificate fails reload, not the server */
+    if (*config_ctx->tls_cert)
+    {
+	config_ctx->tls_opts.cert = config_ctx->tls_cert;
+	config_ctx->tls_opts.key = config_ctx->tls_key;
+	config_ctx->tls_opts.http2 = config_ctx->http2;
+
+	if (!(config_ctx->tls = tls_init(&config_ctx->tls_opts)))
+	{
+	    log_message(LOG_LEVEL_ERROR, "config: tls initialization");
+	    goto Error;
+	}
     }
 
-    config_ctx->port = atoi(port);
-    if (config_ctx->port < 0 || config_ctx->port > 65536)
+    /* "root" serves whatever the explicit routes don't cover */
+    if (!route_lookup(config_ctx->routes, NULL, 0, "/", 1) &&
+	route_add(config_ctx->routes, ROUTE_HOST_ANY, strlen(ROUTE_HOST_ANY),
+	"/", 1, ROUTE_TYPE_ROOT, config_ctx->root, strlen(config_ctx->root)))
     {
-	log_message(LOG_LEVEL_ERROR, "config: invalid port");
+	log_message(LOG_LEVEL_ERROR, "config: default route");
 	goto Error;
     }
 
@@ -72,47 +399,397 @@ static config_ctx_t* read_config()
     return config_ctx;
 
 Error:
-    free(config_ctx);
+    free_config(config_ctx);
     if (config_parser)
 	config_parser_deinit(config_parser);
 
     return NULL;
 }
 
-sig_atomic_t stop_server;
+/* What can fail goes first, http points into config_ctx only after it */
+static int apply_config(http_ctx_t *http, config_ctx_t *config_ctx)
+{
+    /* Error pages are typed when loaded below */
+    if (mime_init(config_ctx->mime_types, config_ctx->charset))
+	return -1;
+
+    config_ctx->cache_opts.path = config_ctx->proxy_cache;
+
+    if (cache_init(&config_ctx->cache_opts))
+	return -1;
+
+    if (file_cache_init(&config_ctx->file_cache_opts))
+	return -1;
+
+    if (config_ctx->autoindex && autoindex_init(config_ctx->autoindex_cache))
+	return -1;
+
+    if (http_set_upload_dir(http, *config_ctx->upload_dir ?
+	config_ctx->upload_dir : NULL))
+    {
+	return -1;
+    }
+
+    /* Keeps the previous root and pages when it fails */
+    if (http_set_root_folder(http, config_ctx->root))
+	return -1;
+
+    http_set_autoindex(http, config_ctx->autoindex ?
+	config_ctx->autoindex_cache : NULL);
+    http_set_routes(http, config_ctx->routes);
+    http_set_index_file(http, config_ctx->index_file);
+    http_set_http2(http, config_ctx->http2);
+    log_set_level(config_ctx->log_level);
+    http_set_keepalive_timeout(http, config_ctx->keepalive_timeout);
+    http_set_request_buffer_size(http, config_ctx->request_buffer_size);
+    http_set_chunked(http, config_ctx->chunked);
+    http_set_chunk_size(http, config_ctx->chunk_size);
+    http_set_max_body_size(http, config_ctx->max_body_size);
+
+    /* These copy their options and only fail on first use, at startup */
+    if (timing_init(&config_ctx->timing_opts))
+	return -1;
+
+    return limit_init(&config_ctx->limit_opts);
+}
+
+/* Errors that say the listener itself is broken */
+static int accept_fatal(int err)
+{
+    return err == EBADF || err == EFAULT || err == EINVAL ||
+	err == ENOTSOCK || err == EOPNOTSUPP;
+}
+
+/* Signals cut it short, so the loop still sees them promptly */
+static void accept_backoff(void)
+{
+    struct timespec pause = { 0, ACCEPT_BACKOFF_MS * 1000000L };
+
+    nanosleep(&pause, NULL);
+}
 
 static void handle_interrupt_sig(int sig)
 {
     stop_server = 1;
-    log_message(LOG_LEVEL_DEBUG, "interrupted signal received");
 }
 
-int main(void)
+/* Also how a new binary says it took over the listener */
+static void handle_quit_sig(int sig)
+{
+    quit_server = 1;
+    stop_server = 1;
+}
+
+static void handle_reload_sig(int sig)
+{
+    reload_server = 1;
+}
+
+static void handle_upgrade_sig(int sig)
+{
+    upgrade_server = 1;
+}
+
+static int set_signal_handlers()
 {
-    int server_sock_fd = -1, client_sock_fd = -1, pid, status = 0, rv = 1;
     struct sigaction sa;
-    http_ctx_t *http;
-    config_ctx_t *config_ctx;
-    w3c_log_field_t w3c_log_fields[] = {
-	W3C_LOG_FIELD_C_IP,
-	W3C_LOG_FIELD_CS_METHOD,
-	W3C_LOG_FIELD_CS_URI,
-	W3C_LOG_FIELD_SC_STATUS
+    struct {
+	int sig;
+	void (*handler)(int);
+    } handlers[] = {
+	{ SIGINT, handle_interrupt_sig },
+	{ SIGTERM, handle_interrupt_sig },
+	{ SIGQUIT, handle_quit_sig },
+	{ SIGHUP, handle_reload_sig },
+	{ SIGUSR2, handle_upgrade_sig }
     };
+
+    /* No SA_RESTART: blocking accept/recv must notice the flags */
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+
+    for (int i = 0; i < sizeof(handlers) / sizeof(handlers[0]); ++i)
+    {
+	sa.sa_handler = handlers[i].handler;
+
+	if (sigaction(handlers[i].sig, &sa, NULL) == -1)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* New listener only if the address changed, workers keep the old root */
+static int reload_config(http_ctx_t *http, config_ctx_t **config_ctx,
+    int *server_sock_fd)
+{
+    int sock_fd = -1;
+    config_ctx_t *new_config_ctx;
+
+    if (!(new_config_ctx = read_config()))
+    {
+	log_message(LOG_LEVEL_ERROR, "reload: reading config");
+	return -1;
+    }
+
+    /* The old listener stays until the new config is in place */
+    if ((new_config_ctx->port != (*config_ctx)->port &&
+	strncmp(new_config_ctx->address, UNIX_ADDRESS_PREFIX,
+	strlen(UNIX_ADDRESS_PREFIX))) ||
+	strcmp(new_config_ctx->address, (*config_ctx)->address))
+    {
+	if ((sock_fd = create_listener(new_config_ctx->port,
+	    new_config_ctx->address, &new_config_ctx->listen_opts)) == -1)
+	{
+	    log_message(LOG_LEVEL_ERROR, "reload: listener creation");
+	    free_config(new_config_ctx);
+	    return -1;
+	}
+    }
+
+    if (apply_config(http, new_config_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR, "reload: applying config");
+
+	/* Only the upload dir can be swapped ahead of the failing step */
+	if (http_set_upload_dir(http, *(*config_ctx)->upload_dir ?
+	    (*config_ctx)->upload_dir : NULL))
+	{
+	    log_message(LOG_LEVEL_WARNING, "reload: restoring upload dir");
+	}
+
+	if (sock_fd != -1)
+	{
+	    unlink_listener(sock_fd);
+	    close_socket(sock_fd);
+	}
+
+	free_config(new_config_ctx);
+	return -1;
+    }
+
+    if (sock_fd != -1)
+    {
+	unlink_listener(*server_sock_fd);
+	close_socket(*server_sock_fd);
+	*server_sock_fd = sock_fd;
+    }
+    else if (set_listen_opts(*server_sock_fd, &new_config_ctx->listen_opts))
+    {
+	log_message(LOG_LEVEL_WARNING, "reload: updating listen options");
+    }
+
+    if (w3c_log_reopen(new_config_ctx->w3c_log_path,
+	&new_config_ctx->w3c_log_opts))
+	log_message(LOG_LEVEL_WARNING, "reload: keeping previous w3c log");
+
+    free_config(*config_ctx);
+    *config_ctx = new_config_ctx;
+
+    log_message(LOG_LEVEL_DEBUG, "config reloaded");
+
+    return 0;
+}
+
+/*
+ * Exec a new binary which inherits the listener. It's double forked, so it
+ * isn't our child, and tells us to drain once it's serving.
+ */
+static int upgrade_binary(char *argv[], int server_sock_fd)
+{
+    int pid;
+    char parent_pid[16];
+
+    snprintf(parent_pid, sizeof(parent_pid), "%d", getpid());
+    log_flush();
+
+    if ((pid = fork()))
+    {
+	if (pid == -1)
+	{
+	    log_message(LOG_LEVEL_ERROR, "upgrade: fork failed");
+	    return -1;
+	}
+
+	waitpid(pid, NULL, 0);
+
+	return 0;
+    }
+
+    if ((pid = fork()))
+	_exit(pid == -1);
+
+    if (listener_to_env(server_sock_fd, LISTEN_FD_ENV) ||
+	setenv(PARENT_PID_ENV, parent_pid, 1))
+    {
+	log_message(LOG_LEVEL_ERROR, "upgrade: passing listener");
+	_exit(1);
+    }
+
+    execvp(argv[0], argv);
+
+    log_message(LOG_LEVEL_ERROR, "upgrade: exec %s failed", argv[0]);
+    _exit(1);
+}
+
+static void check_limit_stats(limit_stats_t *last)
+{
+    limit_stats_t stats;
+
+    limit_get_stats(&stats);
+
+    if (stats.conn_rejected > last->conn_rejected ||
+	stats.rate_limited > last->rate_limited ||
+	stats.table_full > last->table_full)
+    {
+	log_message(LOG_LEVEL_WARNING, "limits conn_rejected:%lu "
+	    "rate_limited:%lu table_full:%lu",
+	    stats.conn_rejected - last->conn_rejected,
+	    stats.rate_limited - last->rate_limited,
+	    stats.table_full - last->table_full);
+    }
+
+    *last = stats;
+}
+
+/* Kernel drops SYNs silently once the accept queue is full, report it */
+static void check_listen_stats(listen_stats_t *last, time_t *last_check,
+    limit_stats_t *last_limit)
+{
+    listen_stats_t stats = {};
+    time_t now = time(NULL);
+
+    if (now - *last_check < LISTEN_STATS_INTERVAL / 1000)
+	return;
+
+    *last_check = now;
+
+    check_limit_stats(last_limit);
+
+    if (get_listen_stats(&stats))
+	return;
+
+    if (stats.listen_overflows > last->listen_overflows ||
+	stats.listen_drops > last->listen_drops)
+    {
+	log_message(LOG_LEVEL_WARNING, "accept queue overflows:%lu drops:%lu",
+	    stats.listen_overflows - last->listen_overflows,
+	    stats.listen_drops - last->listen_drops);
+    }
+
+    *last = stats;
+}
+
+/* Stream sockets of any family, TCP and Unix alike */
+static const http_transport_t socket_transport = {
+    .recv = recv_request,
+    .set_recv_timeout = set_recv_timeout,
+    .send = send_response,
+    .poll = poll_request,
+    .sendfile = send_file,
+    .recvfile = recv_file,
+    .splice = splice_socket,
+    .writev = send_iov,
+    .shutdown = shutdown_socket
+};
+
+/* tls_close() sends close_notify, nothing to do before it */
+static const http_transport_t tls_transport = {
+    .recv = tls_recv,
+    .set_recv_timeout = tls_set_recv_timeout,
+    .send = tls_send,
+    .poll = tls_poll,
+    .sendfile = tls_sendfile,
+    .recvfile = tls_recvfile,
+    .splice = tls_splice,
+    .writev = tls_writev
+};
+
+/* Worker side, TLS callbacks take over the plain ones after handshake */
+static int handle_peer(http_ctx_t *http, tls_ctx_t *tls, int *client_sock_fd,
+    char *client_address)
+{
+    tls_conn_t *tls_conn;
+    int rv = 0;
+
+    if (!tls)
+    {
+	rv = http_handle_peer(http, client_address, client_sock_fd);
+	goto Exit;
+    }
+
+    /* A failed handshake is the client's problem, not ours */
+    if (!(tls_conn = tls_accept(tls, *client_sock_fd)))
+	goto Exit;
+
+    http_set_transport(http, &tls_transport);
+
+    rv = http_handle_peer(http, client_address, tls_conn);
+
+    tls_close(tls_conn);
+
+Exit:
+    limit_conn_release(client_address);
+
+    return rv;
+}
+
+static void notify_parent()
+{
+    char *value;
+    int pid;
+
+    if (!(value = getenv(PARENT_PID_ENV)))
+	return;
+
+    if ((pid = atoi(value)) > 1 && kill(pid, SIGQUIT) == -1)
+	log_message(LOG_LEVEL_WARNING, "upgrade: notifying old server");
+
+    unsetenv(PARENT_PID_ENV);
+}
+
+int main(int argc, char *argv[])
+{
+    int server_sock_fd = -1, client_sock_fd = -1, pid, status = 0, rv = 1;
+    http_ctx_t *http = NULL;
+    config_ctx_t *config_ctx = NULL;
     char client_address[INET6_ADDRSTRLEN] = {};
+    listen_stats_t listen_stats = {};
+    time_t listen_stats_time = 0, upgrade_time = 0;
+    limit_stats_t limit_stats = {};
 
     log_init(stdout, LOG_LEVEL_DEBUG);
 
-    sa.sa_handler = handle_interrupt_sig;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
+    /* -t only validates the config, certificates and roots included */
+    if (argc > 1)
+    {
+	if (argc > 2 || strcmp(argv[1], "-t"))
+	{
+	    log_message(LOG_LEVEL_ERROR, "usage: %s [-t]", argv[0]);
+	    goto Exit;
+	}
+
+	if ((config_ctx = read_config()))
+	{
+	    log_message(LOG_LEVEL_DEBUG, "config is valid");
+	    rv = 0;
+	}
+
+	goto Exit;
+    }
+
+    /* Own process group, so draining signals reach our workers only */
+    setpgid(0, 0);
 
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
+    if (set_signal_handlers())
+    {
         log_message(LOG_LEVEL_ERROR, "sigaction failed");
         goto Exit;
     }
 
-    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+    /* OpenSSL and sendfile() write to sockets without MSG_NOSIGNAL */
+    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR ||
+	signal(SIGPIPE, SIG_IGN) == SIG_ERR)
     {
 	log_message(LOG_LEVEL_ERROR, "signal function failed");
 	goto Exit;
@@ -130,76 +807,197 @@ int main(void)
 	goto Exit;
     }
 
-    http_set_root_folder(http, config_ctx->root);
-    http_set_chunked(http, 1);
+    if (apply_config(http, config_ctx))
+    {
+	log_message(LOG_LEVEL_ERROR, "applying config");
+	goto Exit;
+    }
+
+    http_set_stop_flag(http, &stop_server);
+
+    http_set_transport(http, &socket_transport);
 
-    http_set_callback(http, HTTP_CB_RECV, recv_request);
-    http_set_callback(http, HTTP_CB_SET_RECV_TIMEOUT, set_recv_timeout);
-    http_set_callback(http, HTTP_CB_SEND, send_response);
+    /* Probed once here, workers inherit the answer */
+    open_beneath_init();
 
-    if ((server_sock_fd = create_listener(config_ctx->port,
-	config_ctx->address, &stop_server)) == -1)
+    /* Connections wait in the backlog of the old server, if any */
+    config_ctx->preload_opts.manifest = config_ctx->preload_manifest;
+
+    if (preload(config_ctx->root, &config_ctx->preload_opts, &stop_server))
+    {
+	log_message(LOG_LEVEL_ERROR, "preloading");
+	goto Exit;
+    }
+
+    if ((server_sock_fd = listener_from_env(LISTEN_FD_ENV,
+	&config_ctx->listen_opts)) != -1)
+    {
+	log_message(LOG_LEVEL_DEBUG, "using inherited listener");
+    }
+    else if ((server_sock_fd = create_listener(config_ctx->port,
+	config_ctx->address, &config_ctx->listen_opts)) == -1)
     {
 	log_message(LOG_LEVEL_ERROR, "listener creation");
 	goto Exit;
     }
 
-    if (w3c_log_init(config_ctx->w3c_log_path, w3c_log_fields,
-	(sizeof(w3c_log_fields) / sizeof(w3c_log_fields[0]))))
+    if (w3c_log_init(config_ctx->w3c_log_path, &config_ctx->w3c_log_opts))
     {
 	log_message(LOG_LEVEL_ERROR, "server_log initialization");
 	goto Exit;
     }
 
+    notify_parent();
+    check_listen_stats(&listen_stats, &listen_stats_time, &limit_stats);
+
     while(!stop_server)
     {
-	if ((client_sock_fd = accept_connection(server_sock_fd, client_address,
-	    INET6_ADDRSTRLEN)) < 1)
+	if (reload_server)
 	{
-	    if (!client_sock_fd)
-		break;
+	    reload_server = 0;
+	    reload_config(http, &config_ctx, &server_sock_fd);
+	}
 
-	    log_message(LOG_LEVEL_ERROR, "connection acceptance");
-	    goto Exit;
+	/* One at a time, it's done only once the new binary calls back */
+	if (upgrade_server)
+	{
+	    upgrade_server = 0;
+
+	    if (!upgrade_time && !upgrade_binary(argv, server_sock_fd))
+		upgrade_time = time(NULL);
 	}
 
-	if ((pid = fork()))
+	if (upgrade_time && time(NULL) - upgrade_time > UPGRADE_TIMEOUT)
 	{
-	    if (pid == -1)
+	    log_message(LOG_LEVEL_ERROR, "upgrade: new binary didn't take "
+		"over in %d s, still serving", UPGRADE_TIMEOUT);
+	    upgrade_time = 0;
+	}
+
+	if (wait_connection(server_sock_fd, LISTEN_STATS_INTERVAL) == -1)
+	    goto Exit;
+
+	check_listen_stats(&listen_stats, &listen_stats_time, &limit_stats);
+	w3c_log_check_rotate();
+	timing_report();
+	log_flush();
+
+	/* Drain the whole accept queue per wakeup */
+	while (!stop_server)
+	{
+	    if ((client_sock_fd = accept_connection(server_sock_fd,
+		client_address, INET6_ADDRSTRLEN)) < 1)
+	    {
+		if (!client_sock_fd)
+		{
+		    client_sock_fd = -1;
+		    break;
+		}
+
+		if (accept_fatal(errno))
+		{
+		    log_message(LOG_LEVEL_ERROR, "connection acceptance");
+		    goto Exit;
+		}
+
+		/* Out of fds or memory, workers exiting free some up */
+		client_sock_fd = -1;
+		accept_backoff();
+		break;
+	    }
+
+	    /* Refused before fork, a flood must not cost us processes */
+	    if (limit_conn_acquire(client_address))
+	    {
+		if (!config_ctx->tls)
+		    send_nowait(client_sock_fd, HTTP_SERVICE_UNAVAILABLE_MSG,
+			sizeof(HTTP_SERVICE_UNAVAILABLE_MSG) - 1);
+
+		close_socket(client_sock_fd);
+		client_sock_fd = -1;
+
+		continue;
+	    }
+
+	    log_flush();
+
+	    /* The client is turned away, the listener keeps serving */
+	    if ((pid = fork()) == -1)
 	    {
 		log_message(LOG_LEVEL_ERROR, "fork failed");
+		limit_conn_release(client_address);
+
+		if (!config_ctx->tls)
+		    send_nowait(client_sock_fd, HTTP_SERVICE_UNAVAILABLE_MSG,
+			sizeof(HTTP_SERVICE_UNAVAILABLE_MSG) - 1);
+
+		close_socket(client_sock_fd);
+		client_sock_fd = -1;
+		accept_backoff();
+
+		break;
+	    }
+
+	    if (pid)
+	    {
+		close_socket(client_sock_fd);
+		client_sock_fd = -1;
+
+		continue;
+	    }
+
+	    close_socket(server_sock_fd);
+	    server_sock_fd = -1;
+
+	    /* Before the worker allocates, so its buffers are node local */
+	    if (config_ctx->cpu_affinity)
+		pin_to_incoming_cpu(client_sock_fd);
+
+	    if (handle_peer(http, config_ctx->tls, &client_sock_fd,
+		client_address) == -1)
+	    {
+		log_message(LOG_LEVEL_ERROR, "http_handle_peer");
 		goto Exit;
 	    }
 
 	    close_socket(client_sock_fd);
+	    file_cache_detach();
+	    w3c_log_flush();
+	    timing_flush();
 
-	    continue;
+	    LOG_DEBUG("Child closed");
+	    log_flush();
+	    return 0;
 	}
+    }
 
-	if ((http_handle_peer(http, client_address, &client_sock_fd) == -1))
-	{
-	    log_message(LOG_LEVEL_ERROR, "http_handle_peer");
-	    goto Exit;
-	}
+    /* Stop accepting and let workers finish their in-flight requests */
+    log_message(LOG_LEVEL_DEBUG, "stopping, draining workers");
 
-	close_socket(client_sock_fd);
+    /* The new binary serves on the same socket file */
+    if (!upgrade_time || !quit_server)
+	unlink_listener(server_sock_fd);
 
-	log_message(LOG_LEVEL_DEBUG, "Child closed");
-	return 0;
-    }
+    close_socket(server_sock_fd);
+    server_sock_fd = -1;
+    kill(0, SIGTERM);
 
-    while ((pid = waitpid(-1, &status, 0)) > 0)
-	log_message(LOG_LEVEL_DEBUG, "child terminated, pid:%d", pid);
+    while ((pid = waitpid(-1, &status, 0)) > 0 || errno == EINTR)
+    {
+	if (pid > 0)
+	    LOG_DEBUG("child terminated, pid:%d", pid);
+    }
 
     rv = 0;
 
 Exit:
-    free(config_ctx);
+    free_config(config_ctx);
 
     close_socket(client_sock_fd);
     close_socket(server_sock_fd);
 
-    http_deinit(http);
+    if (http)
+	http_deinit(http);
 
     w3c_log_deinit();
     log_deinit();
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "mempipe.h"
+#include "logger.h"
+
+#define MEMPIPE_SPLICE_SIZE (16 * 1024)
+
+/* The copy is capped, the count is not */
+static void out_put(mempipe_t *pipe, char *data, long len)
+{
+    long room = pipe->out_size - pipe->out_len;
+
+    if (room > len)
+	room = len;
+
+    if (room)
+    {
+	memcpy(pipe->out + pipe->out_len, data, room);
+	pipe->out_len += room;
+    }
+
+    pipe->sent += len;
+}
+
+static int mempipe_recv(void *net_ctx, char *buffer, int buffer_len)
+{
+    mempipe_t *pipe = net_ctx;
+    long len = pipe->in_len - pipe->in_off;
+
+    if (len > buffer_len)
+	len = buffer_len;
+
+    memcpy(buffer, pipe->in + pipe->in_off, len);
+    pipe->in_off += len;
+
+    return len;
+}
+
+static int mempipe_set_recv_timeout(void *net_ctx, int timeout)
+{
+    return 0;
+}
+
+static int mempipe_send(void *net_ctx, char *buffer, int buffer_len)
+{
+    out_put(net_ctx, buffer, buffer_len);
+
+    return buffer_len;
+}
+
+/* Whatever is left of in is already there */
+static int mempipe_poll(void *net_ctx, int timeout_ms)
+{
+    mempipe_t *pipe = net_ctx;
+
+    return pipe->in_off < pipe->in_len;
+}
+
+/* The file is only read while out has room for it */
+static int mempipe_sendfile(void *net_ctx, char *prefix, int prefix_len,
+    int fd, off_t offset, int count)
+{
+    mempipe_t *pipe = net_ctx;
+    long room;
+    ssize_t len;
+
+    out_put(pipe, prefix, prefix_len);
+
+    room = pipe->out_size - pipe->out_len;
+
+    if (room > count)
+	room = count;
+
+    while (room)
+    {
+	if ((len = pread(fd, pipe->out + pipe->out_len, room, offset)) <= 0)
+	{
+	    if (len == -1 && errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "mempipe: pread");
+	    return -1;
+	}
+
+	pipe->out_len += len;
+	offset += len;
+	room -= len;
+    }
+
+    pipe->sent += count;
+
+    return count;
+}
+
+static int mempipe_recvfile(void *net_ctx, int fd, int count)
+{
+    mempipe_t *pipe = net_ctx;
+    long len = pipe->in_len - pipe->in_off, written = 0;
+    ssize_t n;
+
+    if (len > count)
+	len = count;
+
+    while (written < len)
+    {
+	if ((n = write(fd, pipe->in + pipe->in_off + written,
+	    len - written)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "mempipe: write");
+	    return -1;
+	}
+
+	written += n;
+    }
+
+    pipe->in_off += len;
+
+    return len;
+}
+
+static int mempipe_splice(void *net_ctx, int fd, int count)
+{
+    char buffer[MEMPIPE_SPLICE_SIZE];
+    ssize_t len;
+
+    while ((len = read(fd, buffer, count < sizeof(buffer) ? count :
+	sizeof(buffer))) == -1)
+    {
+	if (errno == EINTR)
+	    continue;
+
+	log_message(LOG_LEVEL_ERROR, "mempipe: read");
+	return -1;
+    }
+
+    out_put(net_ctx, buffer, len);
+
+    return len;
+}
+
+static int mempipe_writev(void *net_ctx, struct iovec *iov, int iovcnt)
+{
+    int sent = 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+	out_put(net_ctx, iov[i].iov_base, iov[i].iov_len);
+	sent += iov[i].iov_len;
+    }
+
+    return sent;
+}
+
+const http_transport_t mempipe_transport = {
+    .recv = mempipe_recv,
+    .set_recv_timeout = mempipe_set_recv_timeout,
+    .send = mempipe_send,
+    .poll = mempipe_poll,
+    .sendfile = mempipe_sendfile,
+    .recvfile = mempipe_recvfile,
+    .splice = mempipe_splice,
+    .writev = mempipe_writev
+};
+
+/* in is borrowed and must outlive the pipe */
+mempipe_t* mempipe_new(char *in, long in_len, long out_size)
+{
+    mempipe_t *pipe;
+
+    if (!(pipe = calloc(1, sizeof(*pipe))))
+	return NULL;
+
+    if (out_size && !(pipe->out = malloc(out_size)))
+    {
+	free(pipe);
+	return NULL;
+    }
+
+    pipe->in = in;
+    pipe->in_len = in_len;
+    pipe->out_size = out_size;
+
+    return pipe;
+}
+
+void mempipe_rewind(mempipe_t *pipe)
+{
+    pipe->in_off = 0;
+    pipe->out_len = 0;
+    pipe->sent = 0;
+}
+
+void mempipe_free(mempipe_t *pipe)
+{
+    if (!pipe)
+	return;
+
+    free(pipe->out);
+    free(pipe);
+}
@@ -0,0 +1,26 @@
+#ifndef _MEMPIPE_H_
+#define _MEMPIPE_H_
+
+#include "http.h"
+
+/*
+ * A connection without a kernel under it: requests are read from memory,
+ * responses are copied out while out has room and counted either way.
+ */
+typedef struct {
+    char *in;
+    long in_len;
+    long in_off;
+    char *out;
+    long out_size;
+    long out_len;
+    long sent;
+} mempipe_t;
+
+extern const http_transport_t mempipe_transport;
+
+mempipe_t* mempipe_new(char *in, long in_len, long out_size);
+void mempipe_rewind(mempipe_t *pipe);
+void mempipe_free(mempipe_t *pipe);
+
+#endif
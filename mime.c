@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "mime.h"
+#include "logger.h"
+#include "utils.h"
+
+#define MIME_EXT_MAX 32
+#define MIME_BUCKET_EXTS 4
+#define MIME_SEEDS_MAX 65536
+#define MIME_LINE_MAX 256
+
+/* Used without a "mime_types" file, same format as one */
+static char *builtin_types[] = {
+    "text/html html htm shtml",
+    "text/css css",
+    "text/plain txt",
+    "text/xml xml",
+    "text/csv csv",
+    "text/markdown md",
+    "text/javascript js mjs",
+    "application/json json map",
+    "application/manifest+json webmanifest",
+    "application/wasm wasm",
+    "application/pdf pdf",
+    "application/zip zip",
+    "application/gzip gz",
+    "application/x-tar tar",
+    "application/rss+xml rss",
+    "application/atom+xml atom",
+    "image/png png",
+    "image/jpeg jpeg jpg",
+    "image/gif gif",
+    "image/webp webp",
+    "image/avif avif",
+    "image/svg+xml svg svgz",
+    "image/x-icon ico",
+    "font/woff woff",
+    "font/woff2 woff2",
+    "font/ttf ttf",
+    "font/otf otf",
+    "audio/mpeg mp3",
+    "audio/ogg ogg",
+    "video/mp4 mp4",
+    "video/webm webm",
+};
+
+typedef struct {
+    char ext[MIME_EXT_MAX];
+    int type;
+} mime_ext_t;
+
+/*
+ * Extensions are compiled once into a perfect hash: a first hash picks a
+ * bucket, the bucket's seed a slot no other extension has, so a lookup is
+ * two hashes and one compare. Type strings already carry the charset.
+ */
+static char **types;
+static int types_num;
+static mime_ext_t *exts;
+static int exts_num, exts_size;
+static mime_ext_t *table;
+static unsigned int table_mask, buckets_mask, *seeds;
+static int *bucket_start;
+static char *mime_path, *mime_charset;
+
+static unsigned int ext_hash(char *ext, unsigned int seed)
+{
+    unsigned int hash = 2166136261u ^ seed;
+
+    while (*ext)
+    {
+	hash ^= (unsigned char)*ext++;
+	hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+/* Text types and the few others browsers decode as text */
+static int takes_charset(char *type)
+{
+    return !strncmp(type, "text/", 5) || !strcmp(type,
+	"application/json") || !strcmp(type, "application/javascript") ||
+	!strcmp(type, "application/xml");
+}
+
+static int type_add(char *type, int len)
+{
+    char **grown, *content_type = NULL;
+    int rv;
+
+    if (mime_charset && takes_charset(type))
+    {
+	rv = snprintf_with_alloc(&content_type, "%.*s; charset=%s", len, type,
+	    mime_charset);
+    }
+    else
+	rv = snprintf_with_alloc(&content_type, "%.*s", len, type);
+
+    if (rv == -1)
+	return -1;
+
+    if (!(grown = realloc(types, (types_num + 1) * sizeof(*types))))
+    {
+	free(content_type);
+	return -1;
+    }
+
+    types = grown;
+    types[types_num] = content_type;
+
+    return types_num++;
+}
+
+/* The first type listed for an extension keeps it */
+static int ext_add(char *ext, int len, int type)
+{
+    mime_ext_t *grown;
+
+    if (len >= MIME_EXT_MAX)
+    {
+	log_message(LOG_LEVEL_WARNING, "mime: .%.*s too long", len, ext);
+	return 0;
+    }
+
+    for (int i = 0; i < exts_num; ++i)
+    {
+	if (!strncasecmp(exts[i].ext, ext, len) && !exts[i].ext[len])
+	    return 0;
+    }
+
+    if (exts_num == exts_size)
+    {
+	if (!(grown = realloc(exts, (exts_size * 2 + 64) * sizeof(*exts))))
+	    return -1;
+
+	exts = grown;
+	exts_size = exts_size * 2 + 64;
+    }
+
+    for (int i = 0; i < len; ++i)
+	exts[exts_num].ext[i] = tolower((unsigned char)ext[i]);
+
+    exts[exts_num].ext[len] = '\0';
+    exts[exts_num++].type = type;
+
+    return 0;
+}
+
+/* "type ext ext ...;" as in mime.types, nginx's trailing ; included */
+static int parse_line(char *line)
+{
+    char *token, *save;
+    int type = -1;
+
+    if (*line == '#')
+	return 0;
+
+    for (token = strtok_r(line, " \t\r\n;", &save); token;
+	token = strtok_r(NULL, " \t\r\n;", &save))
+    {
+	if (type == -1)
+	{
+	    if ((type = type_add(token, strlen(token))) == -1)
+		return -1;
+
+	    continue;
+	}
+
+	if (ext_add(token, strlen(token), type))
+	    return -1;
+    }
+
+    return 0;
+}
+
+static int load(char *path)
+{
+    FILE *fp;
+    char *line = NULL, builtin[MIME_LINE_MAX];
+    size_t line_size = 0;
+    int rv = -1;
+
+    if (!path)
+    {
+	for (int i = 0; i < sizeof(builtin_types) / sizeof(*builtin_types);
+	    ++i)
+	{
+	    strncpy(builtin, builtin_types[i], MIME_LINE_MAX - 1);
+	    builtin[MIME_LINE_MAX - 1] = '\0';
+
+	    if (parse_line(builtin))
+		return -1;
+	}
+
+	return 0;
+    }
+
+    if (!(fp = fopen(path, "re")))
+    {
+	log_message(LOG_LEVEL_ERROR, "mime: can't open %s", path);
+	return -1;
+    }
+
+    while (getline(&line, &line_size, fp) != -1)
+    {
+	if (parse_line(line))
+	    goto Exit;
+    }
+
+    rv = 0;
+
+Exit:
+    free(line);
+    fclose(fp);
+
+    return rv;
+}
+
+static int by_size(const void *a, const void *b)
+{
+    int i = *(int *)a, j = *(int *)b;
+
+    return (bucket_start[j + 1] - bucket_start[j]) -
+	(bucket_start[i + 1] - bucket_start[i]);
+}
+
+/* Fits every extension of bucket b with one seed, or places none */
+static int bucket_place(int b, int *members, unsigned int seed)
+{
+    int i;
+    mime_ext_t *slot;
+
+    for (i = bucket_start[b]; i < bucket_start[b + 1]; ++i)
+    {
+	slot = &table[ext_hash(exts[members[i]].ext, seed) & table_mask];
+
+	if (slot->ext[0])
+	    break;
+
+	*slot = exts[members[i]];
+    }
+
+    if (i == bucket_start[b + 1])
+	return 0;
+
+    while (i-- > bucket_start[b])
+	table[ext_hash(exts[members[i]].ext, seed) & table_mask].ext[0] = '\0';
+
+    return -1;
+}
+
+static int compile()
+{
+    unsigned int size = 1, buckets = 1, seed;
+    int *members = NULL, *order = NULL, *fill = NULL, b, k, rv = -1;
+
+    while (size < 2 * exts_num)
+	size <<= 1;
+
+    while (buckets * MIME_BUCKET_EXTS < exts_num)
+	buckets <<= 1;
+
+    if (!(bucket_start = calloc(buckets + 1, sizeof(int))) ||
+	!(fill = calloc(buckets, sizeof(int))) ||
+	!(members = calloc(exts_num + 1, sizeof(int))) ||
+	!(order = calloc(buckets, sizeof(int))) ||
+	!(seeds = calloc(buckets, sizeof(*seeds))))
+    {
+	goto Exit;
+    }
+
+    buckets_mask = buckets - 1;
+
+    for (int i = 0; i < exts_num; ++i)
+	bucket_start[(ext_hash(exts[i].ext, 0) & buckets_mask) + 1]++;
+
+    for (b = 0; b < buckets; ++b)
+    {
+	bucket_start[b + 1] += bucket_start[b];
+	fill[b] = bucket_start[b];
+	order[b] = b;
+    }
+
+    for (int i = 0; i < exts_num; ++i)
+	members[fill[ext_hash(exts[i].ext, 0) & buckets_mask]++] = i;
+
+    qsort(order, buckets, sizeof(int), by_size);
+
+    /* Crowded buckets pick their seeds first, while slots are plenty */
+    for (;;)
+    {
+	free(table);
+
+	if (!(table = calloc(size, sizeof(*table))))
+	    goto Exit;
+
+	table_mask = size - 1;
+
+	for (k = 0; k < buckets; ++k)
+	{
+	    for (seed = 1; seed < MIME_SEEDS_MAX &&
+		bucket_place(order[k], members, seed); ++seed);
+
+	    if (seed == MIME_SEEDS_MAX)
+		break;
+
+	    seeds[order[k]] = seed;
+	}
+
+	if (k == buckets)
+	    break;
+
+	size <<= 1;
+    }
+
+    rv = 0;
+
+Exit:
+    free(bucket_start);
+    bucket_start = NULL;
+    free(fill);
+    free(members);
+    free(order);
+
+    return rv;
+}
+
+int mime_init(char *path, char *charset)
+{
+    path = path && *path ? path : NULL;
+    charset = charset && *charset && strcmp(charset, "off") ? charset : NULL;
+
+    if (types)
+    {
+	if ((path ? !mime_path || strcmp(path, mime_path) : !!mime_path) ||
+	    (charset ? !mime_charset || strcmp(charset, mime_charset) :
+	    !!mime_charset))
+	{
+	    log_message(LOG_LEVEL_WARNING, "mime: changes take a restart");
+	}
+
+	return 0;
+    }
+
+    if ((path && !(mime_path = strdup(path))) ||
+	(charset && !(mime_charset = strdup(charset))))
+    {
+	goto Error;
+    }
+
+    if (type_add(MIME_DEFAULT, strlen(MIME_DEFAULT)) == -1 || load(path) ||
+	compile())
+    {
+	goto Error;
+    }
+
+    LOG_DEBUG("mime: %d types, %d extensions in %u slots", types_num,
+	exts_num, table_mask + 1);
+
+    free(exts);
+    exts = NULL;
+    exts_num = exts_size = 0;
+
+    return 0;
+
+Error:
+    for (int i = 0; i < types_num; ++i)
+	free(types[i]);
+
+    free(types);
+    free(exts);
+    free(table);
+    free(seeds);
+    free(mime_path);
+    free(mime_charset);
+    types = NULL;
+    exts = NULL;
+    table = NULL;
+    seeds = NULL;
+    mime_path = mime_charset = NULL;
+    types_num = exts_num = exts_size = 0;
+
+    return -1;
+}
+
+static int ext_lookup(char *dot)
+{
+    char ext[MIME_EXT_MAX];
+    mime_ext_t *slot;
+    int len;
+
+    for (len = 0; dot[len + 1]; ++len)
+    {
+	if (len == MIME_EXT_MAX - 1)
+	    return 0;
+
+	ext[len] = tolower((unsigned char)dot[len + 1]);
+    }
+
+    ext[len] = '\0';
+    slot = &table[ext_hash(ext, seeds[ext_hash(ext, 0) & buckets_mask]) &
+	table_mask];
+
+    return slot->ext[0] && !strcmp(slot->ext, ext) ? slot->type : 0;
+}
+
+/* Longest known extension of the last path component, 0 if none */
+int mime_lookup(char *name)
+{
+    char *base, *dot;
+    int type;
+
+    if (!table || !name)
+	return 0;
+
+    base = (base = strrchr(name, '/')) ? base + 1 : name;
+
+    for (dot = strchr(base, '.'); dot; dot = strchr(dot + 1, '.'))
+    {
+	if ((type = ext_lookup(dot)))
+	    return type;
+    }
+
+    return 0;
+}
+
+char *mime_content_type(int type)
+{
+    return type > 0 && type < types_num ? types[type] : MIME_DEFAULT;
+}
@@ -0,0 +1,12 @@
+#ifndef _MIME_H_
+#define _MIME_H_
+
+#define MIME_CHARSET "utf-8"
+/* Unknown extensions, always type 0 */
+#define MIME_DEFAULT "application/octet-stream"
+
+int mime_init(char *path, char *charset);
+int mime_lookup(char *name);
+char *mime_content_type(int type);
+
+#endif
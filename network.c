@@ -1,27 +1,63 @@
+#define _GNU_SOURCE
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include "network.h"
 #include "logger.h"
 
-#define BACKLOG 10
+#define NETSTAT_PATH "/proc/net/netstat"
+#define NETSTAT_TCPEXT "TcpExt:"
+#define LINGER_TIME_MS 500
+#define LINGER_BUFFER_SIZE 4096
 
-static int *stop_network;
 
-static int addr_str2bin(char address[], int port, struct sockaddr_storage *sa)
+static int addr_str2bin(char address[], int port, struct sockaddr_storage *sa,
+    socklen_t *sa_len)
 {
     int res;
     struct sockaddr_in *addr_v4;
     struct sockaddr_in6 *addr_v6;
+    struct sockaddr_un *addr_un;
+
+    memset(sa, 0, sizeof(*sa));
+
+    if (!strncmp(address, UNIX_ADDRESS_PREFIX, strlen(UNIX_ADDRESS_PREFIX)))
+    {
+	address += strlen(UNIX_ADDRESS_PREFIX);
+	addr_un = (struct sockaddr_un *)sa;
+
+	if (!*address || strlen(address) >= sizeof(addr_un->sun_path))
+	{
+	    log_message(LOG_LEVEL_ERROR, "unix socket path: %s", address);
+	    return -1;
+	}
+
+	addr_un->sun_family = AF_UNIX;
+	strcpy(addr_un->sun_path, address);
+	*sa_len = sizeof(*addr_un);
+
+	return 0;
+    }
 
     addr_v4 = (struct sockaddr_in *)sa;
     addr_v4->sin_family = AF_INET;
     addr_v4->sin_port = htons(port);
+    *sa_len = sizeof(*addr_v4);
 
     res = inet_pton(addr_v4->sin_family, address, &addr_v4->sin_addr);
 
@@ -31,6 +67,7 @@ static int addr_str2bin(char address[], int port, struct sockaddr_storage *sa)
     addr_v6 = (struct sockaddr_in6 *)sa;
     addr_v6->sin6_family = AF_INET6;
     addr_v6->sin6_port = htons(port);
+    *sa_len = sizeof(*addr_v6);
 
     res = inet_pton(addr_v6->sin6_family, address, &addr_v6->sin6_addr);
 
@@ -42,101 +79,484 @@ static int addr_str2bin(char address[], int port, struct sockaddr_storage *sa)
     return -1;
 }
 
-static int addr_bin2str(struct sockaddr_storage *sa, char address[], int len)
+/* A Unix peer has no address worth logging, who it runs as is */
+static int addr_bin2str(int sock_fd, struct sockaddr_storage *sa,
+    char address[], int len)
 {
-    struct in_addr ipv4_addr;
-    struct in6_addr ipv6_addr;
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (sa->ss_family == AF_UNIX)
+    {
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &cred,
+	    &cred_len) == -1)
+	{
+	    log_message(LOG_LEVEL_ERROR, "SO_PEERCRED");
+	    return -1;
+	}
 
-    ipv4_addr = ((struct sockaddr_in *)sa)->sin_addr;
+	snprintf(address, len, UNIX_PEER_FORMAT, cred.uid, cred.pid);
 
-    if (inet_ntop(AF_INET, &ipv4_addr, address, len))
 	return 0;
+    }
 
-    ipv6_addr = ((struct sockaddr_in6 *)sa)->sin6_addr;
+    if (sa->ss_family == AF_INET && inet_ntop(AF_INET,
+	&((struct sockaddr_in *)sa)->sin_addr, address, len))
+    {
+	return 0;
+    }
 
-    if (inet_ntop(AF_INET6, &ipv6_addr, address, len))
+    if (sa->ss_family == AF_INET6 && inet_ntop(AF_INET6,
+	&((struct sockaddr_in6 *)sa)->sin6_addr, address, len))
+    {
 	return 0;
+    }
 
     log_message(LOG_LEVEL_ERROR, "addr_bin2str");
     return -1;
 }
 
-int create_listener(int port, char *address, int *stop_network_flag)
+/*
+ * A socket file nobody accepts on is left over from a server that didn't
+ * exit cleanly. One somebody still accepts on is theirs.
+ */
+static int unlink_stale(struct sockaddr_un *sa)
+{
+    struct stat statbuf;
+    int sock_fd, rv = -1;
+
+    if (lstat(sa->sun_path, &statbuf) == -1)
+	return errno == ENOENT ? 0 : -1;
+
+    if (!S_ISSOCK(statbuf.st_mode))
+    {
+	log_message(LOG_LEVEL_ERROR, "%s exists and isn't a socket",
+	    sa->sun_path);
+	return -1;
+    }
+
+    if ((sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+
+    if (!connect(sock_fd, (struct sockaddr *)sa, sizeof(*sa)))
+	log_message(LOG_LEVEL_ERROR, "%s is in use", sa->sun_path);
+    else if (errno != ECONNREFUSED)
+	log_message(LOG_LEVEL_ERROR, "probing %s", sa->sun_path);
+    else if (unlink(sa->sun_path) == -1)
+	log_message(LOG_LEVEL_ERROR, "removing stale %s", sa->sun_path);
+    else
+    {
+	log_message(LOG_LEVEL_WARNING, "removed stale %s", sa->sun_path);
+	rv = 0;
+    }
+
+    close(sock_fd);
+
+    return rv;
+}
+
+static void set_int_opt(int sock_fd, int level, int name, int value,
+    char *what)
+{
+    if (setsockopt(sock_fd, level, name, &value, sizeof(value)) == -1)
+	log_message(LOG_LEVEL_WARNING, "setting %s", what);
+}
+
+/*
+ * Accepted sockets are cloned from the listener, so everything below is
+ * set once here rather than after every accept. Options left at 0 are not
+ * touched, a reload that drops one keeps the previous value.
+ */
+static void set_sock_opts(int server_sock_fd, int family, listen_opts_t *opts)
+{
+    int inet = family == AF_INET || family == AF_INET6;
+
+    if (opts->sndbuf)
+	set_int_opt(server_sock_fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf,
+	    "SO_SNDBUF");
+
+    /* Has to precede listen() for the window scale to account for it */
+    if (opts->rcvbuf)
+	set_int_opt(server_sock_fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf,
+	    "SO_RCVBUF");
+
+    /* Raising it past net.core.busy_read needs CAP_NET_ADMIN */
+    if (opts->busy_poll)
+	set_int_opt(server_sock_fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll,
+	    "SO_BUSY_POLL");
+
+    if (!inet)
+	return;
+
+    /* HTTP/2 writes frame by frame, Nagle would hold them for an ACK */
+    set_int_opt(server_sock_fd, IPPROTO_TCP, TCP_NODELAY, opts->nodelay,
+	"TCP_NODELAY");
+
+    if (opts->notsent_lowat)
+	set_int_opt(server_sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	    opts->notsent_lowat, "TCP_NOTSENT_LOWAT");
+
+    /* Probing starts once an idle time is given */
+    if (opts->keepidle)
+    {
+	set_int_opt(server_sock_fd, SOL_SOCKET, SO_KEEPALIVE, 1,
+	    "SO_KEEPALIVE");
+	set_int_opt(server_sock_fd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepidle,
+	    "TCP_KEEPIDLE");
+    }
+
+    if (opts->keepintvl)
+	set_int_opt(server_sock_fd, IPPROTO_TCP, TCP_KEEPINTVL,
+	    opts->keepintvl, "TCP_KEEPINTVL");
+
+    if (opts->keepcnt)
+	set_int_opt(server_sock_fd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepcnt,
+	    "TCP_KEEPCNT");
+
+    if (opts->tos && family == AF_INET)
+	set_int_opt(server_sock_fd, IPPROTO_IP, IP_TOS, opts->tos, "IP_TOS");
+    else if (opts->tos)
+	set_int_opt(server_sock_fd, IPPROTO_IPV6, IPV6_TCLASS, opts->tos,
+	    "IPV6_TCLASS");
+}
+
+int set_listen_opts(int server_sock_fd, listen_opts_t *opts)
 {
-    int server_sock_fd = -1;
     struct sockaddr_storage sa;
+    socklen_t sa_len = sizeof(sa);
 
-    if (addr_str2bin(address, port, &sa))
+    if (getsockname(server_sock_fd, (struct sockaddr *)&sa, &sa_len) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "listener getsockname");
 	return -1;
+    }
+
+    set_sock_opts(server_sock_fd, sa.ss_family, opts);
+
+    /* Before listen(), nobody can connect while it's still wider */
+    if (sa.ss_family == AF_UNIX && chmod(((struct sockaddr_un *)&sa)->sun_path,
+	opts->unix_mode) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "setting mode of %s",
+	    ((struct sockaddr_un *)&sa)->sun_path);
+	return -1;
+    }
+
+    /* Don't wake us up until the client actually sent something */
+    if ((sa.ss_family == AF_INET || sa.ss_family == AF_INET6) &&
+	setsockopt(server_sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+	&opts->defer_accept, sizeof(opts->defer_accept)) == -1)
+    {
+	log_message(LOG_LEVEL_WARNING, "setting TCP_DEFER_ACCEPT");
+    }
+
+    if ((sa.ss_family == AF_INET || sa.ss_family == AF_INET6) &&
+	opts->fastopen_qlen && setsockopt(server_sock_fd, IPPROTO_TCP,
+	TCP_FASTOPEN, &opts->fastopen_qlen, sizeof(opts->fastopen_qlen)) == -1)
+    {
+	log_message(LOG_LEVEL_WARNING, "setting TCP_FASTOPEN");
+    }
+
+    /* Accepts are drained until EAGAIN */
+    if (fcntl(server_sock_fd, F_SETFL,
+	fcntl(server_sock_fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "listener fcntl");
+	return -1;
+    }
 
-    if ((server_sock_fd = socket(sa.ss_family, SOCK_STREAM, 0)) == -1)
+    /* Calling listen() again just updates the backlog of a listener */
+    if (listen(server_sock_fd, opts->backlog) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "listening");
+	return -1;
+    }
+
+    return 0;
+}
+
+int create_listener(int port, char *address, listen_opts_t *opts)
+{
+    int server_sock_fd = -1, bound = 0;
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    mode_t mask;
+
+    if (addr_str2bin(address, port, &sa, &sa_len))
+	return -1;
+
+    if (sa.ss_family == AF_UNIX && unlink_stale((struct sockaddr_un *)&sa))
+	return -1;
+
+    if ((server_sock_fd = socket(sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC,
+	0)) == -1)
     {
 	log_message(LOG_LEVEL_ERROR, "socket creation");
 	goto Error;
     }
 
-    if (bind(server_sock_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+    /* Restarts must not wait for the old connections' TIME_WAIT */
+    if (setsockopt(server_sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+	sizeof(int)) == -1)
     {
-	log_message(LOG_LEVEL_ERROR, "binding");
-	goto Error;
+	log_message(LOG_LEVEL_WARNING, "setting SO_REUSEADDR");
     }
 
-    if (listen(server_sock_fd, BACKLOG) == -1)
+    /* The socket file is created no wider than it ends up */
+    mask = umask(~opts->unix_mode & 0777);
+    bound = bind(server_sock_fd, (struct sockaddr *)&sa, sa_len) != -1;
+    umask(mask);
+
+    if (!bound)
     {
-	log_message(LOG_LEVEL_ERROR, "listening");
+	log_message(LOG_LEVEL_ERROR, "binding");
 	goto Error;
     }
 
-    stop_network = stop_network_flag;
+    if (set_listen_opts(server_sock_fd, opts))
+	goto Error;
 
     return server_sock_fd;
 
 Error:
+    if (bound && sa.ss_family == AF_UNIX)
+	unlink(((struct sockaddr_un *)&sa)->sun_path);
+
     if (server_sock_fd != -1)
 	close(server_sock_fd);
 
     return -1;
 }
 
+int listener_from_env(char *env_name, listen_opts_t *opts)
+{
+    int server_sock_fd, accepting = 0;
+    socklen_t len = sizeof(accepting);
+    char *value, *value_end = NULL;
+
+    if (!(value = getenv(env_name)))
+	return -1;
+
+    server_sock_fd = (int)strtol(value, &value_end, 10);
+    unsetenv(env_name);
+
+    if (value_end == value || server_sock_fd < 0)
+    {
+	log_message(LOG_LEVEL_WARNING, "inherited listener: invalid fd");
+	return -1;
+    }
+
+    if (getsockopt(server_sock_fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting,
+	&len) == -1 || !accepting)
+    {
+	log_message(LOG_LEVEL_WARNING, "inherited fd is not a listener");
+	return -1;
+    }
+
+    if (fcntl(server_sock_fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "inherited listener: fcntl");
+	return -1;
+    }
+
+    if (set_listen_opts(server_sock_fd, opts))
+	return -1;
+
+    return server_sock_fd;
+}
+
+int listener_to_env(int server_sock_fd, char *env_name)
+{
+    char value[16];
+
+    if (fcntl(server_sock_fd, F_SETFD, 0) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "passing listener: fcntl");
+	return -1;
+    }
+
+    snprintf(value, sizeof(value), "%d", server_sock_fd);
+
+    return setenv(env_name, value, 1);
+}
+
+/* Unix listeners leave their file behind, unless it's handed on */
+int unlink_listener(int server_sock_fd)
+{
+    struct sockaddr_un sa;
+    socklen_t sa_len = sizeof(sa);
+
+    if (server_sock_fd == -1 || getsockname(server_sock_fd,
+	(struct sockaddr *)&sa, &sa_len) == -1 || sa.sun_family != AF_UNIX ||
+	sa_len <= offsetof(struct sockaddr_un, sun_path) || !*sa.sun_path)
+    {
+	return 0;
+    }
+
+    if (unlink(sa.sun_path) == -1)
+    {
+	log_message(LOG_LEVEL_WARNING, "removing %s", sa.sun_path);
+	return -1;
+    }
+
+    return 0;
+}
+
+int wait_connection(int server_sock_fd, int timeout)
+{
+    struct pollfd pfd = { .fd = server_sock_fd, .events = POLLIN };
+    int rv;
+
+    if ((rv = poll(&pfd, 1, timeout)) == -1)
+    {
+	if (errno == EINTR)
+	    return 0;
+
+	log_message(LOG_LEVEL_ERROR, "poll");
+    }
+
+    return rv;
+}
+
+/*
+ * Returns 0 once the accept queue is drained or a signal arrived. Client
+ * sockets stay blocking, workers rely on SO_RCVTIMEO for keep-alive. On
+ * -1 errno tells what went wrong.
+ */
 int accept_connection(int server_sock_fd, char client_address[], int addr_len)
 {
-    int client_sock_fd;
+    int client_sock_fd, err;
     struct sockaddr_storage peer_addr;
-    socklen_t peer_addr_size = sizeof(struct sockaddr_storage);
+    socklen_t peer_addr_size;
 
-    while ((client_sock_fd = accept(server_sock_fd,
-	(struct sockaddr *)&peer_addr, &peer_addr_size)) == -1)
+    for (;;)
     {
-	if (errno == EINTR)
+	peer_addr_size = sizeof(struct sockaddr_storage);
+
+	if ((client_sock_fd = accept4(server_sock_fd,
+	    (struct sockaddr *)&peer_addr, &peer_addr_size,
+	    SOCK_CLOEXEC)) == -1)
 	{
-	    if (*stop_network)
+	    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 		return 0;
-	    continue;
+
+	    /* The peer went away in the queue, or Linux passed on its
+	       network error */
+	    if (errno == ECONNABORTED || errno == EPROTO ||
+		errno == ENETDOWN || errno == ENOPROTOOPT ||
+		errno == EHOSTDOWN || errno == ENONET ||
+		errno == EHOSTUNREACH || errno == ENETUNREACH)
+	    {
+		continue;
+	    }
+
+	    err = errno;
+	    log_message(LOG_LEVEL_ERROR, "accepting");
+	    errno = err;
+
+	    return -1;
 	}
 
-	log_message(LOG_LEVEL_ERROR, "accepting");
+	/* Only this peer is dropped, the next one may do */
+	if (!addr_bin2str(client_sock_fd, &peer_addr, client_address,
+	    addr_len))
+	{
+	    return client_sock_fd;
+	}
 
+	close(client_sock_fd);
+    }
+}
+
+/*
+ * Moves the calling worker onto the CPU whose softirq received the
+ * connection's packets, so the socket and the worker share its caches.
+ * Memory the worker touches afterwards is allocated on that CPU's node.
+ */
+int pin_to_incoming_cpu(int sock_fd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    cpu_set_t set;
+
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 ||
+	cpu < 0)
+    {
 	return -1;
     }
 
-    if (addr_bin2str(&peer_addr, client_address, addr_len))
+    /* Stay inside whatever cpuset we were started in */
+    if (sched_getaffinity(0, sizeof(set), &set) == -1 ||
+	cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set))
+    {
 	return -1;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+	log_message(LOG_LEVEL_WARNING, "pinning worker to cpu %d", cpu);
+	return -1;
+    }
+
+    LOG_DEBUG("worker pinned to cpu %d", cpu);
+
+    return 0;
+}
+
+/* System wide TcpExt counters, there is no per-socket equivalent */
+int get_listen_stats(listen_stats_t *stats)
+{
+    FILE *fp;
+    char *header = NULL, *values = NULL, *name, *value, *name_save, *value_save;
+    size_t header_len = 0, values_len = 0;
+    int rv = -1;
+
+    if (!(fp = fopen(NETSTAT_PATH, "re")))
+	return -1;
+
+    while (getline(&header, &header_len, fp) != -1 &&
+	getline(&values, &values_len, fp) != -1)
+    {
+	if (strncmp(header, NETSTAT_TCPEXT, strlen(NETSTAT_TCPEXT)))
+	    continue;
+
+	name = strtok_r(header, " \n", &name_save);
+	value = strtok_r(values, " \n", &value_save);
+
+	while (name && value)
+	{
+	    if (!strcmp(name, "ListenOverflows"))
+		stats->listen_overflows = strtoul(value, NULL, 10);
+	    else if (!strcmp(name, "ListenDrops"))
+		stats->listen_drops = strtoul(value, NULL, 10);
+
+	    name = strtok_r(NULL, " \n", &name_save);
+	    value = strtok_r(NULL, " \n", &value_save);
+	}
+
+	rv = 0;
+	break;
+    }
+
+    free(header);
+    free(values);
+    fclose(fp);
 
-    return client_sock_fd;
+    return rv;
 }
 
 int recv_request(void *client_sock_fd, char *buffer, int buffer_len)
 {
     int buflen;
 
+    /* A drain lets requests finish, it's noticed between them */
     while ((buflen = recv(*(int*)client_sock_fd, buffer, buffer_len, 0)) == -1)
     {	
 	if (errno == EINTR)
-	{
-	    if (*stop_network)
-		return 0;
 	    continue;
-	}
 
 	log_message(LOG_LEVEL_ERROR, "recv");
 
@@ -156,9 +576,203 @@ int set_recv_timeout(void *client_sock_fd, int timeout)
 	(const char*)&tv, sizeof tv);
 }
 
+static int send_all(int sock_fd, char *buffer, int buffer_len, int flags)
+{
+    int sent = 0, len;
+
+    /* A draining worker may be signalled mid-response, finish it anyway */
+    while (sent < buffer_len)
+    {
+	if ((len = send(sock_fd, buffer + sent, buffer_len - sent,
+	    MSG_NOSIGNAL | flags)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "send");
+
+	    return -1;
+	}
+
+	sent += len;
+    }
+
+    return sent;
+}
+
 int send_response(void *client_sock_fd, char *buffer, int buffer_len)
 {
-    return send(*(int*)client_sock_fd, buffer, buffer_len, 0);
+    return send_all(*(int*)client_sock_fd, buffer, buffer_len, 0);
+}
+
+/* One syscall for the whole batch unless the socket buffer fills up */
+int send_iov(void *client_sock_fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    int sock_fd = *(int*)client_sock_fd, sent = 0;
+    ssize_t len;
+
+    while (msg.msg_iovlen)
+    {
+	if ((len = sendmsg(sock_fd, &msg, MSG_NOSIGNAL)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "sendmsg");
+
+	    return -1;
+	}
+
+	sent += len;
+
+	/* Skip what went out, resume inside a partly sent buffer */
+	while (msg.msg_iovlen && len >= msg.msg_iov->iov_len)
+	{
+	    len -= msg.msg_iov->iov_len;
+	    msg.msg_iov++;
+	    msg.msg_iovlen--;
+	}
+
+	if (msg.msg_iovlen)
+	{
+	    msg.msg_iov->iov_base += len;
+	    msg.msg_iov->iov_len -= len;
+	}
+    }
+
+    return sent;
+}
+
+/* Prefix is corked with MSG_MORE so it shares segments with the file */
+int send_file(void *client_sock_fd, char *prefix, int prefix_len, int fd,
+    off_t offset, int count)
+{
+    int sock_fd = *(int*)client_sock_fd, sent = 0;
+    ssize_t len;
+
+    if (prefix_len && send_all(sock_fd, prefix, prefix_len,
+	count ? MSG_MORE : 0) == -1)
+    {
+	return -1;
+    }
+
+    while (sent < count)
+    {
+	if ((len = sendfile(sock_fd, fd, &offset, count - sent)) <= 0)
+	{
+	    if (len == -1 && errno == EINTR)
+		continue;
+
+	    /* Zero means the file shrank under us */
+	    log_message(LOG_LEVEL_ERROR, "sendfile");
+
+	    return -1;
+	}
+
+	sent += len;
+    }
+
+    return sent;
+}
+
+/* Through a pipe, the body never enters userspace. 0 once the peer is gone */
+/* One pipe per process carries every splice, it's empty between calls */
+static int splice_pipe(int from_fd, int to_fd, int count)
+{
+    static int pipe_fds[2] = { -1, -1 };
+    ssize_t len, moved, written = 0;
+
+    if (pipe_fds[0] == -1 && pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "splice pipe");
+	return -1;
+    }
+
+    while ((len = splice(from_fd, NULL, pipe_fds[1], NULL, count,
+	SPLICE_F_MOVE)) == -1)
+    {
+	if (errno == EINTR)
+	    continue;
+
+	log_message(LOG_LEVEL_ERROR, "splice from socket");
+	return -1;
+    }
+
+    while (written < len)
+    {
+	if ((moved = splice(pipe_fds[0], NULL, to_fd, NULL, len - written,
+	    SPLICE_F_MOVE)) <= 0)
+	{
+	    if (moved == -1 && errno == EINTR)
+		continue;
+
+	    /* What's left in the pipe belongs to nobody now */
+	    log_message(LOG_LEVEL_ERROR, "splice out of pipe");
+	    close(pipe_fds[0]);
+	    close(pipe_fds[1]);
+	    pipe_fds[0] = pipe_fds[1] = -1;
+	    return -1;
+	}
+
+	written += moved;
+    }
+
+    return len;
+}
+
+int recv_file(void *client_sock_fd, int fd, int count)
+{
+    return splice_pipe(*(int*)client_sock_fd, fd, count);
+}
+
+/* Backend socket to client socket, the bytes never enter userspace */
+int splice_socket(void *client_sock_fd, int fd, int count)
+{
+    return splice_pipe(fd, *(int*)client_sock_fd, count);
+}
+
+/* Returns 1 once the peer sent something, 0 on timeout or signal */
+int poll_request(void *client_sock_fd, int timeout)
+{
+    return wait_connection(*(int*)client_sock_fd, timeout);
+}
+
+/*
+ * Half-closes and reads whatever the peer still sends. Closing with unread
+ * data resets the connection, and the reset may overtake the last response.
+ */
+int shutdown_socket(void *client_sock_fd)
+{
+    int sock_fd = *(int*)client_sock_fd, left;
+    char buffer[LINGER_BUFFER_SIZE];
+    struct timespec start, now;
+
+    if (shutdown(sock_fd, SHUT_WR) == -1)
+	return errno == ENOTCONN ? 0 : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = LINGER_TIME_MS - ((now.tv_sec - start.tv_sec) * 1000 +
+	    (now.tv_nsec - start.tv_nsec) / 1000000);
+
+	if (left <= 0 || wait_connection(sock_fd, left) <= 0 ||
+	    recv(sock_fd, buffer, sizeof(buffer), MSG_DONTWAIT) <= 0)
+	{
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+/* Best effort from the accepting process, which must never block */
+int send_nowait(int sock_fd, char *buffer, int buffer_len)
+{
+    return send(sock_fd, buffer, buffer_len, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 int close_socket(int sock_fd)
@@ -1,11 +1,62 @@
 #ifndef _NETWORK_H_
 #define _NETWORK_H_
 
-int create_listener(int port, char *address, int *stop_network);
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/* "unix:<path>" listens on a Unix socket, the port is ignored then */
+#define UNIX_ADDRESS_PREFIX "unix:"
+#define LISTEN_ADDRESS_LEN (sizeof(UNIX_ADDRESS_PREFIX) + \
+    sizeof(((struct sockaddr_un *)0)->sun_path))
+#define UNIX_SOCKET_MODE 0660
+/* Unix peers go by their credentials where others have an address */
+#define UNIX_PEER_FORMAT "uid=%u,pid=%d"
+
+typedef struct {
+    int backlog;
+    int defer_accept;
+    int fastopen_qlen;
+    /* Set on the listener and inherited by accepted sockets, 0 keeps the
+       kernel default */
+    int nodelay;
+    long sndbuf;
+    long rcvbuf;
+    long notsent_lowat;
+    int busy_poll;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int tos;
+    /* Permissions of a Unix socket's file */
+    int unix_mode;
+} listen_opts_t;
+
+typedef struct {
+    unsigned long listen_overflows;
+    unsigned long listen_drops;
+} listen_stats_t;
+
+int create_listener(int port, char *address, listen_opts_t *opts);
+int set_listen_opts(int server_sock_fd, listen_opts_t *opts);
+int listener_from_env(char *env_name, listen_opts_t *opts);
+int listener_to_env(int server_sock_fd, char *env_name);
+int unlink_listener(int server_sock_fd);
+int wait_connection(int server_sock_fd, int timeout);
 int accept_connection(int server_sock_fd, char address[], int addr_len);
+int get_listen_stats(listen_stats_t *stats);
+int pin_to_incoming_cpu(int sock_fd);
 int recv_request(void *client_sock_fd, char *buffer, int buffer_len);
 int set_recv_timeout(void *client_sock_fd, int timeout);
 int send_response(void *client_sock_fd, char *buffer, int buffer_len);
+int send_file(void *client_sock_fd, char *prefix, int prefix_len, int fd,
+    off_t offset, int count);
+int recv_file(void *client_sock_fd, int fd, int count);
+int splice_socket(void *client_sock_fd, int fd, int count);
+int send_iov(void *client_sock_fd, struct iovec *iov, int iovcnt);
+int poll_request(void *client_sock_fd, int timeout);
+int shutdown_socket(void *client_sock_fd);
+int send_nowait(int sock_fd, char *buffer, int buffer_len);
 int close_socket(int sock_fd);
 
 #endif
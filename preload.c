@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "preload.h"
+#include "file_cache.h"
+#include "mime.h"
+#include "logger.h"
+#include "utils.h"
+#include "http.h"
+
+#define PRELOAD_NFTW_FDS 16
+#define PRELOAD_WAIT_US 10000
+
+typedef struct {
+    char *path;
+    int hits;
+} preload_path_t;
+
+/* Shared with the readers, which go on after the listener opens */
+typedef struct {
+    long warmed;
+    int finished;
+} preload_progress_t;
+
+static preload_path_t *paths;
+static int paths_num, paths_size;
+static size_t walk_root_len;
+
+static int path_add(const char *path, int len)
+{
+    preload_path_t *grown;
+
+    if (paths_num == paths_size)
+    {
+	if (!(grown = realloc(paths, (paths_size * 2 + 64) * sizeof(*paths))))
+	    return -1;
+
+	paths = grown;
+	paths_size = paths_size * 2 + 64;
+    }
+
+    if (!(paths[paths_num].path = strndup(path, len)))
+	return -1;
+
+    paths[paths_num++].hits = 1;
+
+    return 0;
+}
+
+static void paths_free()
+{
+    for (int i = 0; i < paths_num; ++i)
+	free(paths[i].path);
+
+    free(paths);
+    paths = NULL;
+    paths_num = paths_size = 0;
+}
+
+static int by_path(const void *a, const void *b)
+{
+    return strcmp(((preload_path_t *)a)->path, ((preload_path_t *)b)->path);
+}
+
+static int by_hits(const void *a, const void *b)
+{
+    return ((preload_path_t *)b)->hits - ((preload_path_t *)a)->hits;
+}
+
+/* Repeated paths fold into one, the most requested are read first */
+static void paths_rank()
+{
+    int kept = 0;
+
+    qsort(paths, paths_num, sizeof(*paths), by_path);
+
+    for (int i = 0; i < paths_num; ++i)
+    {
+	if (kept && !strcmp(paths[kept - 1].path, paths[i].path))
+	{
+	    paths[kept - 1].hits++;
+	    free(paths[i].path);
+	    continue;
+	}
+
+	paths[kept++] = paths[i];
+    }
+
+    paths_num = kept;
+    qsort(paths, paths_num, sizeof(*paths), by_hits);
+}
+
+static int walk_entry(const char *path, const struct stat *statbuf, int type,
+    struct FTW *ftw)
+{
+    if (type != FTW_F || !S_ISREG(statbuf->st_mode))
+	return 0;
+
+    return path_add(path + walk_root_len, strlen(path + walk_root_len));
+}
+
+/*
+ * First token of each line, so a W3C log led by cs-uri-stem works as is.
+ * Tokens are normalized like request targets, those that aren't one are
+ * skipped.
+ */
+static int read_manifest(char *manifest)
+{
+    FILE *fp;
+    char *line = NULL, path[PATH_MAX];
+    size_t line_size = 0;
+    int len, skipped = 0, rv = -1;
+
+    if (!(fp = fopen(manifest, "re")))
+    {
+	log_message(LOG_LEVEL_ERROR, "preload: can't open %s", manifest);
+	return -1;
+    }
+
+    while (getline(&line, &line_size, fp) != -1)
+    {
+	if (*line == '#')
+	    continue;
+
+	if (!(len = strcspn(line, " \t\r\n?")))
+	    continue;
+
+	if (len >= sizeof(path) || (len = http_normalize_url(line, len,
+	    path)) == -1)
+	{
+	    skipped++;
+	    continue;
+	}
+
+	if (path_add(path, len))
+	    goto Exit;
+    }
+
+    if (skipped)
+	log_message(LOG_LEVEL_WARNING, "preload: %d invalid paths in %s",
+	    skipped, manifest);
+
+    rv = 0;
+
+Exit:
+    free(line);
+    fclose(fp);
+
+    return rv;
+}
+
+/* The page cache gets every file, the file cache those small enough */
+static void warm(int root_fd, int first, int step, preload_progress_t *progress,
+    int *stop)
+{
+    struct stat statbuf;
+    char *body;
+    int fd, type;
+
+    for (int i = first; i < paths_num && !*stop; i += step)
+    {
+	if ((fd = open_beneath(root_fd, paths[i].path, O_RDONLY)) != -1)
+	{
+	    if (!fstat(fd, &statbuf) && S_ISREG(statbuf.st_mode))
+	    {
+		readahead(fd, 0, statbuf.st_size);
+
+		if (!file_cache_get(&statbuf, &body, &type) ||
+		    !file_cache_put(&statbuf, fd, mime_lookup(paths[i].path),
+		    &body))
+		{
+		    file_cache_leave();
+		}
+	    }
+
+	    close(fd);
+	}
+
+	__atomic_add_fetch(&progress->warmed, 1, __ATOMIC_RELEASE);
+    }
+
+    file_cache_detach();
+    __atomic_add_fetch(&progress->finished, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns once threshold percent of the files are read. The reader
+ * processes finish the rest while the server is already answering.
+ */
+int preload(char *root, preload_opts_t *opts, int *stop)
+{
+    preload_progress_t *progress = MAP_FAILED;
+    int root_fd = -1, started = 0, rv = -1;
+    long target;
+    pid_t pid;
+
+    if (!opts->walk_root && !(opts->manifest && *opts->manifest))
+	return 0;
+
+    walk_root_len = strlen(root);
+
+    if (opts->walk_root && nftw(root, walk_entry, PRELOAD_NFTW_FDS,
+	FTW_PHYS) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "preload: walking %s", root);
+	goto Exit;
+    }
+
+    if (opts->manifest && *opts->manifest && read_manifest(opts->manifest))
+	goto Exit;
+
+    paths_rank();
+
+    if ((root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "preload: opening %s", root);
+	goto Exit;
+    }
+
+    if ((progress = mmap(NULL, sizeof(*progress), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	log_message(LOG_LEVEL_ERROR, "preload: mmap");
+	goto Exit;
+    }
+
+    log_flush();
+
+    for (int i = 0; i < opts->workers; ++i)
+    {
+	if ((pid = fork()) == -1)
+	{
+	    log_message(LOG_LEVEL_WARNING, "preload: fork failed");
+	    warm(root_fd, i, opts->workers, progress, stop);
+	    continue;
+	}
+
+	if (!pid)
+	{
+	    warm(root_fd, i, opts->workers, progress, stop);
+	    log_flush();
+	    _exit(0);
+	}
+
+	started++;
+    }
+
+    target = (long)paths_num * opts->threshold / 100;
+
+    while (!*stop && __atomic_load_n(&progress->warmed, __ATOMIC_ACQUIRE) <
+	target && __atomic_load_n(&progress->finished, __ATOMIC_ACQUIRE) <
+	opts->workers)
+    {
+	usleep(PRELOAD_WAIT_US);
+    }
+
+    LOG_DEBUG("preload: %ld of %d files warm, %d readers", progress->warmed,
+	paths_num, started);
+
+    rv = 0;
+
+Exit:
+    if (progress != MAP_FAILED)
+	munmap(progress, sizeof(*progress));
+
+    if (root_fd != -1)
+	close(root_fd);
+
+    paths_free();
+
+    return rv;
+}
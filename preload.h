@@ -0,0 +1,19 @@
+#ifndef _PRELOAD_H_
+#define _PRELOAD_H_
+
+#define PRELOAD_WORKERS 4
+#define PRELOAD_WORKERS_MAX 64
+
+typedef struct {
+    /* Every regular file under root */
+    int walk_root;
+    /* Paths, hottest first once counted, lines starting with # skipped */
+    char *manifest;
+    int workers;
+    /* Percent of the files warmed before the listener opens */
+    int threshold;
+} preload_opts_t;
+
+int preload(char *root, preload_opts_t *opts, int *stop);
+
+#endif
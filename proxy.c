@@ -0,0 +1,1051 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "proxy.h"
+#include "cache.h"
+#include "network.h"
+#include "logger.h"
+
+#define PROXY_BUFFER_SIZE 8192
+#define PROXY_HEADERS_EXTRA 256
+#define PROXY_TRAILERS_MAX 32
+#define LINE_END "\r\n"
+#define HEAD_END LINE_END LINE_END
+#define STATUS_LINE_MIN 12
+#define HDR_X_FORWARDED_FOR "X-Forwarded-For"
+#define DATE_MAX 64
+
+typedef enum {
+    RELAY_DONE = 0,
+    /* A pooled connection the backend had closed, not the server's fault */
+    RELAY_STALE,
+    /* Nothing reached the client, another server may still answer */
+    RELAY_FAILED,
+    /* The client got part of a response or is gone */
+    RELAY_BROKEN,
+    /* Not for the cache, relayed as usual */
+    RELAY_PASS
+} relay_t;
+
+/* What the backend's head says about its body and its connection */
+typedef struct {
+    int code;
+    long long content_length;
+    int chunked;
+    int keep_alive;
+} upstream_head_t;
+
+typedef struct {
+    http_ctx_t *http_ctx;
+    void *net_ctx;
+    http_request_t *request;
+    http_response_t *response;
+    int fd;
+    int sent;
+    int received;
+    int timed_out;
+    int keep;
+    char *data;
+    int len;
+    char buffer[PROXY_BUFFER_SIZE];
+    char head[PROXY_BUFFER_SIZE + PROXY_HEADERS_EXTRA];
+    int head_len;
+    /* Set while filling a cache entry, background when nobody waits */
+    cache_object_t *object;
+    int background;
+    int pass;
+    char *body;
+    int body_len;
+} proxy_t;
+
+/* X-Forwarded-For is dropped too, it's sent again with the client added */
+static char *request_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+    "HTTP2-Settings", "Transfer-Encoding", "Content-Length", "Expect",
+    HDR_X_FORWARDED_FOR, NULL
+};
+
+static char *response_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Upgrade", NULL
+};
+
+/* Stored responses get their own framing and age */
+static char *stored_drop_headers[] = {
+    "Content-Length", "Transfer-Encoding", "Age", NULL
+};
+
+/* Cacheable by default once they say for how long, RFC 9110 */
+static int cacheable_codes[] = {
+    200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501, 0
+};
+
+static char *cache_statuses[] = {
+    [CACHE_BYPASS] = "BYPASS",
+    [CACHE_MISS] = "MISS",
+    [CACHE_HIT] = "HIT",
+    [CACHE_STALE] = "STALE"
+};
+
+static int header_is(char *name, int name_len, char *header)
+{
+    return strlen(header) == name_len && !strncasecmp(name, header, name_len);
+}
+
+static int hop_by_hop(char *name, int name_len, char **headers)
+{
+    for (; *headers; ++headers)
+    {
+	if (header_is(name, name_len, *headers))
+	    return 1;
+    }
+
+    return 0;
+}
+
+static int has_token(char *value, int len, char *token)
+{
+    int n;
+
+    while (len > 0)
+    {
+	while (len && (*value == ',' || *value == ' ' || *value == '\t'))
+	{
+	    value++;
+	    len--;
+	}
+
+	for (n = 0; n < len && value[n] != ',' && value[n] != ' ' &&
+	    value[n] != '\t'; ++n);
+
+	if (header_is(value, n, token))
+	    return 1;
+
+	value += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+static long long parse_length(char *value, int len)
+{
+    long long length = 0;
+
+    if (!len)
+	return -1;
+
+    for (int i = 0; i < len; ++i)
+    {
+	if (!isdigit(value[i]) || length > (LLONG_MAX - 9) / 10)
+	    return -1;
+
+	length = length * 10 + value[i] - '0';
+    }
+
+    return length;
+}
+
+/*
+ * Splits the next header line of a head, 0 at the blank line ending it.
+ * Lines without a colon come back with a zero name_len.
+ */
+static int next_header(char **line, char *end, int *name_len, char **value,
+    int *value_len)
+{
+    char *eol, *colon;
+
+    if (!(eol = memmem(*line, end - *line, LINE_END, strlen(LINE_END))) ||
+	eol == *line)
+    {
+	return 0;
+    }
+
+    *name_len = (colon = memchr(*line, ':', eol - *line)) ? colon - *line : 0;
+    *value = colon ? colon + 1 : eol;
+
+    while (*value < eol && (**value == ' ' || **value == '\t'))
+	(*value)++;
+
+    for (*value_len = eol - *value; *value_len && ((*value)[*value_len - 1] ==
+	' ' || (*value)[*value_len - 1] == '\t'); --*value_len);
+
+    return eol + strlen(LINE_END) - *line;
+}
+
+/* The client's head minus hop-by-hop fields, the body framed by length */
+static char* request_head(char *head, int head_len, char *client_address,
+    int body_fd, int body_len, int *len)
+{
+    char *out, *line, *end = head + head_len, *value, *forwarded = "";
+    int line_len, name_len, value_len, forwarded_len = 0;
+
+    if (!(out = malloc(head_len + strlen(client_address) +
+	PROXY_HEADERS_EXTRA)))
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy head allocation");
+	return NULL;
+    }
+
+    /* The request line goes as is, target included */
+    line = memmem(head, head_len, LINE_END, strlen(LINE_END)) +
+	strlen(LINE_END);
+    *len = line - head;
+    memcpy(out, head, *len);
+
+    while ((line_len = next_header(&line, end, &name_len, &value,
+	&value_len)))
+    {
+	if (header_is(line, name_len, HDR_X_FORWARDED_FOR))
+	{
+	    forwarded = value;
+	    forwarded_len = value_len;
+	}
+	else if (!hop_by_hop(line, name_len, request_hop_headers))
+	{
+	    memcpy(out + *len, line, line_len);
+	    *len += line_len;
+	}
+
+	line += line_len;
+    }
+
+    if (body_fd != -1)
+    {
+	*len += sprintf(out + *len, "Content-Length: %d" LINE_END,
+	    body_len);
+    }
+
+    *len += sprintf(out + *len, HDR_X_FORWARDED_FOR ": %.*s%s%s" LINE_END
+	"Connection: keep-alive" HEAD_END, forwarded_len, forwarded,
+	forwarded_len ? ", " : "", client_address);
+
+    return out;
+}
+
+/* Reads the backend's framing and writes the head the client gets */
+static int response_head(proxy_t *proxy, char *head, int head_len,
+    upstream_head_t *uh)
+{
+    char *line, *end = head + head_len, *value;
+    int line_len, name_len, value_len;
+
+    if (head_len < STATUS_LINE_MIN || strncmp(head, "HTTP/1.", 7) ||
+	head[8] != ' ' || !isdigit(head[9]) || !isdigit(head[10]) ||
+	!isdigit(head[11]))
+    {
+	return -1;
+    }
+
+    uh->code = (head[9] - '0') * 100 + (head[10] - '0') * 10 + head[11] - '0';
+    uh->content_length = -1;
+    uh->chunked = 0;
+    uh->keep_alive = head[7] != '0';
+
+    /* Whatever the backend speaks, the client is answered in 1.1 */
+    line = memmem(head, head_len, LINE_END, strlen(LINE_END)) +
+	strlen(LINE_END);
+    proxy->head_len = sprintf(proxy->head, "HTTP/1.1%.*s", (int)(line - head -
+	strlen("HTTP/1.x")), head + strlen("HTTP/1.x"));
+
+    while ((line_len = next_header(&line, end, &name_len, &value,
+	&value_len)))
+    {
+	if (header_is(line, name_len, "Content-Length") &&
+	    (uh->content_length = parse_length(value, value_len)) == -1)
+	{
+	    return -1;
+	}
+	else if (header_is(line, name_len, "Transfer-Encoding"))
+	    uh->chunked = has_token(value, value_len, "chunked");
+	else if (header_is(line, name_len, "Connection"))
+	{
+	    if (has_token(value, value_len, "close"))
+		uh->keep_alive = 0;
+	    else if (has_token(value, value_len, "keep-alive"))
+		uh->keep_alive = 1;
+	}
+
+	if (!hop_by_hop(line, name_len, response_hop_headers))
+	{
+	    memcpy(proxy->head + proxy->head_len, line, line_len);
+	    proxy->head_len += line_len;
+	}
+
+	line += line_len;
+    }
+
+    /* Both framings at once is how responses get smuggled */
+    return uh->chunked && uh->content_length != -1 ? -1 : 0;
+}
+
+/* IMF-fixdate only, anything else counts as already expired */
+static time_t parse_date(char *value, int len)
+{
+    char date[DATE_MAX];
+    struct tm tm = {};
+
+    if (len >= DATE_MAX)
+	return 0;
+
+    memcpy(date, value, len);
+    date[len] = '\0';
+
+    if (!strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+	return 0;
+
+    return timegm(&tm);
+}
+
+/* -1 when the response must not be stored */
+static int cache_control(char *value, int len, int *max_age, int *stale,
+    int *found)
+{
+    char *item, *eq;
+    int item_len, name_len, shared = 0;
+    long long arg;
+
+    for (item = value; item < value + len; item += item_len + 1)
+    {
+	item_len = (eq = memchr(item, ',', value + len - item)) ? eq - item :
+	    value + len - item;
+
+	while (item_len && (*item == ' ' || *item == '\t'))
+	{
+	    item++;
+	    item_len--;
+	}
+
+	while (item_len && (item[item_len - 1] == ' ' ||
+	    item[item_len - 1] == '\t'))
+	{
+	    item_len--;
+	}
+
+	name_len = (eq = memchr(item, '=', item_len)) ? eq - item : item_len;
+	arg = eq ? parse_length(eq + 1, item + item_len - eq - 1) : -1;
+
+	if (header_is(item, name_len, "no-store") ||
+	    header_is(item, name_len, "no-cache") ||
+	    header_is(item, name_len, "private"))
+	{
+	    return -1;
+	}
+
+	if (header_is(item, name_len, "s-maxage") ||
+	    (header_is(item, name_len, "max-age") && !shared))
+	{
+	    if (arg == -1)
+		return -1;
+
+	    *max_age = arg > INT_MAX ? INT_MAX : arg;
+	    *found = 1;
+	    shared = header_is(item, name_len, "s-maxage");
+	}
+	else if (header_is(item, name_len, "stale-while-revalidate") &&
+	    arg != -1)
+	{
+	    *stale = arg > INT_MAX ? INT_MAX : arg;
+	}
+    }
+
+    return 0;
+}
+
+/* Only explicit freshness is trusted, there is no guessing at it */
+static int response_ttl(proxy_t *proxy, int code, int *max_age, int *age,
+    int *stale)
+{
+    char *line, *end = proxy->head + proxy->head_len, *value;
+    int line_len, name_len, value_len, found = 0, i;
+    time_t expires = -1, date = -1;
+    long long arg;
+
+    for (i = 0; cacheable_codes[i] && cacheable_codes[i] != code; ++i);
+
+    if (!cacheable_codes[i])
+	return -1;
+
+    *max_age = *age = 0;
+    *stale = -1;
+    line = memmem(proxy->head, proxy->head_len, LINE_END, strlen(LINE_END)) +
+	strlen(LINE_END);
+
+    while ((line_len = next_header(&line, end, &name_len, &value,
+	&value_len)))
+    {
+	/* One client's cookie, or a variant keyed on what we don't key on */
+	if (header_is(line, name_len, "Set-Cookie") ||
+	    header_is(line, name_len, "Vary"))
+	{
+	    return -1;
+	}
+
+	if (header_is(line, name_len, "Cache-Control") &&
+	    cache_control(value, value_len, max_age, stale, &found))
+	{
+	    return -1;
+	}
+
+	if (header_is(line, name_len, "Expires"))
+	    expires = parse_date(value, value_len);
+	else if (header_is(line, name_len, "Date"))
+	    date = parse_date(value, value_len);
+	else if (header_is(line, name_len, "Age") &&
+	    (arg = parse_length(value, value_len)) != -1)
+	{
+	    *age = arg > INT_MAX ? INT_MAX : arg;
+	}
+
+	line += line_len;
+    }
+
+    if (!found && expires != -1)
+    {
+	*max_age = expires - (date > 0 ? date : time(NULL));
+	found = 1;
+    }
+
+    return found && *max_age > *age ? 0 : -1;
+}
+
+/*
+ * Decides whether the cache is looked at and whether a miss may fill it.
+ * Bodies, credentials, ranges and clients asking for a fresh copy go
+ * straight to the backend.
+ */
+static int cache_request(http_request_t *request, char *head, int head_len,
+    int body_fd, int *can_fill)
+{
+    char *line, *end = head + head_len, *value;
+    int line_len, name_len, value_len;
+
+    if ((request->method != HTTP_METHOD_GET &&
+	request->method != HTTP_METHOD_HEAD) || body_fd != -1)
+    {
+	return 0;
+    }
+
+    *can_fill = request->method == HTTP_METHOD_GET;
+    line = memmem(head, head_len, LINE_END, strlen(LINE_END)) +
+	strlen(LINE_END);
+
+    while ((line_len = next_header(&line, end, &name_len, &value,
+	&value_len)))
+    {
+	if (header_is(line, name_len, "Authorization") ||
+	    header_is(line, name_len, "Range") ||
+	    (header_is(line, name_len, "Cache-Control") &&
+	    (has_token(value, value_len, "no-cache") ||
+	    has_token(value, value_len, "no-store"))))
+	{
+	    return 0;
+	}
+
+	/* A 304 for one client is no answer for the next */
+	if (header_is(line, name_len, "If-None-Match") ||
+	    header_is(line, name_len, "If-Modified-Since"))
+	{
+	    *can_fill = 0;
+	}
+
+	line += line_len;
+    }
+
+    return 1;
+}
+
+/* Host and the target as the client sent it, query included */
+static int cache_key(http_request_t *request, char *head, int head_len,
+    char *key)
+{
+    char *target, *end;
+    int len;
+
+    if (!(target = memchr(head, ' ', head_len)) ||
+	!(end = memchr(target + 1, ' ', head + head_len - target - 1)))
+    {
+	return -1;
+    }
+
+    target++;
+
+    len = snprintf(key, CACHE_KEY_MAX, "%.*s%.*s", request->host_len,
+	request->host ?: "", (int)(end - target), target);
+
+    return len < CACHE_KEY_MAX ? len : -1;
+}
+
+/* The client head as stored, its body read whole and framed by length */
+static void stored_head(proxy_t *proxy)
+{
+    char *line, *end = proxy->head + proxy->head_len, *out, *value;
+    int line_len, name_len, value_len;
+
+    out = line = memmem(proxy->head, proxy->head_len, LINE_END,
+	strlen(LINE_END)) + strlen(LINE_END);
+
+    while ((line_len = next_header(&line, end, &name_len, &value,
+	&value_len)))
+    {
+	if (!hop_by_hop(line, name_len, stored_drop_headers))
+	{
+	    memmove(out, line, line_len);
+	    out += line_len;
+	}
+
+	line += line_len;
+    }
+
+    proxy->head_len = out - proxy->head;
+    proxy->head_len += sprintf(out, "Content-Length: %d" LINE_END,
+	proxy->body_len);
+}
+
+/* Keeps the unread bytes at the start of the buffer and adds to them */
+static int fill(proxy_t *proxy)
+{
+    int len;
+
+    if (proxy->len == sizeof(proxy->buffer))
+    {
+	log_message(LOG_LEVEL_WARNING, "upstream head or chunk line too long");
+	return -1;
+    }
+
+    memmove(proxy->buffer, proxy->data, proxy->len);
+    proxy->data = proxy->buffer;
+
+    while ((len = recv(proxy->fd, proxy->buffer + proxy->len,
+	sizeof(proxy->buffer) - proxy->len, 0)) == -1 && errno == EINTR);
+
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	proxy->timed_out = 1;
+
+    if (len <= 0)
+	return -1;
+
+    proxy->len += len;
+    proxy->received += len;
+
+    return 0;
+}
+
+static void consume(proxy_t *proxy, int len)
+{
+    proxy->data += len;
+    proxy->len -= len;
+}
+
+static int next_line(proxy_t *proxy, char **line, int *line_len)
+{
+    char *end;
+
+    while (!(end = memmem(proxy->data, proxy->len, LINE_END,
+	strlen(LINE_END))))
+    {
+	if (fill(proxy))
+	    return -1;
+    }
+
+    *line = proxy->data;
+    *line_len = end - proxy->data;
+
+    return 0;
+}
+
+/* Into proxy->body, for the cache */
+static int collect_bytes(proxy_t *proxy, long long count)
+{
+    int len;
+
+    while (count)
+    {
+	if (!proxy->len && fill(proxy))
+	    return -1;
+
+	len = count < proxy->len ? count : proxy->len;
+	memcpy(proxy->body + proxy->body_len, proxy->data, len);
+	proxy->body_len += len;
+	consume(proxy, len);
+	count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Dechunks into proxy->body. 1 once the next chunk wouldn't fit, left
+ * unread from its size line on so it can still be relayed.
+ */
+static int collect_chunked(proxy_t *proxy, long max)
+{
+    long long size;
+    char *line;
+    int line_len, trailers = 0;
+
+    while (1)
+    {
+	if (next_line(proxy, &line, &line_len) ||
+	    (size = http_parse_chunk_size(line, line_len)) == -1)
+	{
+	    return -1;
+	}
+
+	if (!size)
+	    break;
+
+	if (proxy->body_len + size > max)
+	    return 1;
+
+	consume(proxy, line_len + strlen(LINE_END));
+
+	if (collect_bytes(proxy, size) || next_line(proxy, &line, &line_len) ||
+	    line_len)
+	{
+	    return -1;
+	}
+
+	consume(proxy, strlen(LINE_END));
+    }
+
+    /* Trailers aren't stored */
+    do
+    {
+	consume(proxy, line_len + strlen(LINE_END));
+
+	if (++trailers > PROXY_TRAILERS_MAX ||
+	    next_line(proxy, &line, &line_len))
+	{
+	    return -1;
+	}
+    } while (line_len);
+
+    consume(proxy, strlen(LINE_END));
+
+    return 0;
+}
+
+/* Buffered bytes go first, the rest is spliced socket to socket */
+static int relay_bytes(proxy_t *proxy, long long count)
+{
+    int len;
+
+    while (count)
+    {
+	if (proxy->len)
+	{
+	    len = count != -1 && count < proxy->len ? count : proxy->len;
+
+	    if (proxy->http_ctx->transport->send(proxy->net_ctx, proxy->data,
+		len) == -1)
+	    {
+		return -1;
+	    }
+
+	    proxy->data += len;
+	    proxy->len -= len;
+	}
+	else if ((len = proxy->http_ctx->transport->splice(proxy->net_ctx,
+	    proxy->fd, count == -1 || count > INT_MAX ? INT_MAX : count)) <= 0)
+	{
+	    /* Without a length the body ends when the backend closes */
+	    return count == -1 && !len ? 0 : -1;
+	}
+
+	proxy->response->bytes_sent += len;
+
+	if (count != -1)
+	    count -= len;
+    }
+
+    return 0;
+}
+
+/* Chunk framing is passed on as is, it's only read to find the end */
+static int relay_line(proxy_t *proxy, char **line, int *line_len)
+{
+    if (next_line(proxy, line, line_len))
+	return -1;
+
+    return relay_bytes(proxy, *line_len + strlen(LINE_END));
+}
+
+static int relay_chunked(proxy_t *proxy)
+{
+    long long size;
+    char *line;
+    int line_len, trailers = 0;
+
+    while (1)
+    {
+	if (relay_line(proxy, &line, &line_len) ||
+	    (size = http_parse_chunk_size(line, line_len)) == -1)
+	{
+	    return -1;
+	}
+
+	if (!size)
+	    break;
+
+	if (relay_bytes(proxy, size) || relay_line(proxy, &line, &line_len) ||
+	    line_len)
+	{
+	    return -1;
+	}
+    }
+
+    do
+    {
+	if (++trailers > PROXY_TRAILERS_MAX ||
+	    relay_line(proxy, &line, &line_len))
+	{
+	    return -1;
+	}
+    } while (line_len);
+
+    return 0;
+}
+
+/*
+ * proxy->head holds a stored head. The body is sent from the cache's slab
+ * with object, else from proxy->body when it couldn't be stored.
+ */
+static int respond_stored(proxy_t *proxy, char *status, time_t age,
+    cache_object_t *object)
+{
+    http_ctx_t *http_ctx = proxy->http_ctx;
+    http_request_t *request = proxy->request;
+    int body_len = object ? object->body_len : proxy->body_len;
+
+    if (object && pread(object->fd, proxy->head, object->head_len,
+	object->offset) != object->head_len)
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy cache: slab read");
+	return -1;
+    }
+
+    if (object)
+	proxy->head_len = object->head_len;
+
+    if (request->method == HTTP_METHOD_HEAD)
+	body_len = 0;
+
+    proxy->response->http_code = atoi(proxy->head + strlen("HTTP/1.1 "));
+    proxy->head_len += sprintf(proxy->head + proxy->head_len, "Age: %ld"
+	LINE_END "X-Cache: %s" LINE_END "Connection: %s" HEAD_END, (long)age,
+	status, request->is_keep_alive ? "keep-alive" : "close");
+
+    if (object ? http_ctx->transport->sendfile(proxy->net_ctx, proxy->head,
+	proxy->head_len, object->fd, object->offset + object->head_len,
+	body_len) == -1 : http_ctx->transport->send(proxy->net_ctx,
+	proxy->head, proxy->head_len) == -1 || (body_len &&
+	http_ctx->transport->send(proxy->net_ctx, proxy->body,
+	body_len) == -1))
+    {
+	return -1;
+    }
+
+    proxy->response->bytes_sent = proxy->head_len + body_len;
+
+    return 0;
+}
+
+/*
+ * A miss being filled. A cacheable answer is read whole, stored and sent
+ * from the cache, anything else comes back as RELAY_PASS. Of a chunked
+ * body too big to keep, the part already read is left in proxy->body.
+ */
+static relay_t cache_response(proxy_t *proxy, upstream_head_t *uh,
+    int no_body)
+{
+    long max_object = cache_max_object();
+    int max_age, age, stale, rv;
+
+    if (proxy->head_len > PROXY_BUFFER_SIZE ||
+	response_ttl(proxy, uh->code, &max_age, &age, &stale) ||
+	(!no_body && !uh->chunked && (uh->content_length == -1 ||
+	uh->content_length > max_object)))
+    {
+	proxy->pass = 1;
+	return RELAY_PASS;
+    }
+
+    if (!proxy->body && !(proxy->body = malloc(max_object)))
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy cache body allocation");
+	return RELAY_PASS;
+    }
+
+    if ((rv = no_body ? 0 : uh->chunked ? collect_chunked(proxy, max_object) :
+	collect_bytes(proxy, uh->content_length)) == -1)
+    {
+	return RELAY_FAILED;
+    }
+
+    if (rv)
+    {
+	proxy->pass = 1;
+	return RELAY_PASS;
+    }
+
+    stored_head(proxy);
+    proxy->keep = uh->keep_alive && !proxy->len;
+
+    if (!cache_store(proxy->object, proxy->head, proxy->head_len, proxy->body,
+	proxy->body_len, age, max_age, stale))
+    {
+	rv = proxy->background ? 0 : respond_stored(proxy,
+	    cache_statuses[CACHE_MISS], proxy->object->age, proxy->object);
+	cache_release(proxy->object);
+    }
+    else if (!proxy->background)
+	rv = respond_stored(proxy, cache_statuses[CACHE_MISS], age, NULL);
+
+    return rv ? RELAY_BROKEN : RELAY_DONE;
+}
+
+static relay_t relay(proxy_t *proxy, char *head, int head_len, int body_fd,
+    int body_len, int reused)
+{
+    http_request_t *request = proxy->request;
+    upstream_head_t uh;
+    relay_t relayed;
+    int no_body, until_close, len;
+    char *end, size_line[32];
+
+    proxy->data = proxy->buffer;
+    proxy->len = 0;
+    proxy->received = 0;
+    proxy->timed_out = 0;
+    proxy->keep = 0;
+    proxy->body_len = 0;
+
+    if (send_file(&proxy->fd, head, head_len, body_fd, 0, body_len) == -1)
+	return reused ? RELAY_STALE : RELAY_FAILED;
+
+    proxy->sent = 1;
+
+    /* Interim 1xx answers aren't passed on, nothing asked for them */
+    do
+    {
+	while (!(end = memmem(proxy->data, proxy->len, HEAD_END,
+	    strlen(HEAD_END))))
+	{
+	    if (fill(proxy))
+	    {
+		return reused && !proxy->received && !proxy->timed_out ?
+		    RELAY_STALE : RELAY_FAILED;
+	    }
+	}
+
+	end += strlen(HEAD_END);
+
+	if (response_head(proxy, proxy->data, end - proxy->data, &uh) ||
+	    uh.code == HTTP_CODE_SWITCHING_PROTOCOLS)
+	{
+	    log_message(LOG_LEVEL_WARNING, "upstream sent a bad head");
+	    return RELAY_FAILED;
+	}
+
+	proxy->len -= end - proxy->data;
+	proxy->data = end;
+    } while (uh.code < HTTP_CODE_OK);
+
+    no_body = request->method == HTTP_METHOD_HEAD ||
+	uh.code == HTTP_CODE_NO_CONTENT || uh.code == HTTP_CODE_NOT_MODIFIED;
+    until_close = !no_body && !uh.chunked && uh.content_length == -1;
+
+    if (proxy->object && proxy->object->fill != -1 &&
+	(relayed = cache_response(proxy, &uh, no_body)) != RELAY_PASS)
+    {
+	return relayed;
+    }
+
+    /* Refreshing for nobody, an answer that can't be kept is dropped */
+    if (proxy->background)
+	return RELAY_DONE;
+
+    /* The client can only tell where such a body ends by the close */
+    if (until_close)
+	request->is_keep_alive = 0;
+
+    proxy->head_len += sprintf(proxy->head + proxy->head_len,
+	"Connection: %s" HEAD_END, request->is_keep_alive ? "keep-alive" :
+	"close");
+    proxy->response->http_code = uh.code;
+
+    if (proxy->http_ctx->transport->send(proxy->net_ctx, proxy->head,
+	proxy->head_len) == -1)
+    {
+	return RELAY_BROKEN;
+    }
+
+    proxy->response->bytes_sent = proxy->head_len;
+
+    /* What the cache had read already goes on as one chunk */
+    if (proxy->body_len)
+    {
+	len = sprintf(size_line, "%x" LINE_END, proxy->body_len);
+
+	if (proxy->http_ctx->transport->send(proxy->net_ctx, size_line,
+	    len) == -1 || proxy->http_ctx->transport->send(proxy->net_ctx,
+	    proxy->body, proxy->body_len) == -1 ||
+	    proxy->http_ctx->transport->send(proxy->net_ctx, LINE_END,
+	    strlen(LINE_END)) == -1)
+	{
+	    return RELAY_BROKEN;
+	}
+
+	proxy->response->bytes_sent += len + proxy->body_len +
+	    strlen(LINE_END);
+    }
+
+    if (!no_body && (uh.chunked ? relay_chunked(proxy) :
+	relay_bytes(proxy, uh.content_length)))
+    {
+	log_message(LOG_LEVEL_WARNING, "relaying upstream body failed");
+	return RELAY_BROKEN;
+    }
+
+    /* Leftovers would be taken for the next response */
+    proxy->keep = uh.keep_alive && !until_close && !proxy->len;
+
+    return RELAY_DONE;
+}
+
+static int idempotent(http_method_t method)
+{
+    return method != HTTP_METHOD_POST && method != HTTP_METHOD_PATCH &&
+	method != HTTP_METHOD_CONNECT;
+}
+
+/*
+ * Servers are tried in balancing order until one answers. A request the
+ * backend may have acted on is only sent once unless it's idempotent.
+ * Returns -1 when the client connection is no use anymore, else 0 with
+ * either the relayed response or a 502/504 left for the caller to send.
+ * A stale cached answer is refreshed after it was sent, on the same path.
+ */
+int proxy_request(http_ctx_t *http_ctx, void *net_ctx, char *client_address,
+    upstream_t *upstream, http_request_t *request, http_response_t *response,
+    char *head, int head_len, int body_fd, int body_len)
+{
+    proxy_t *proxy;
+    upstream_server_t *server;
+    cache_object_t object = { .entry = -1, .fill = -1 };
+    cache_status_t cached = CACHE_BYPASS;
+    unsigned int tried = 0;
+    relay_t relayed = RELAY_FAILED;
+    char *upstream_head = NULL, key[CACHE_KEY_MAX];
+    int upstream_head_len, reused, key_len, can_fill, rv = -1;
+
+    if (!(proxy = calloc(1, sizeof(proxy_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "proxy allocation");
+	return -1;
+    }
+
+    proxy->http_ctx = http_ctx;
+    proxy->net_ctx = net_ctx;
+    proxy->request = request;
+    proxy->response = response;
+
+    if (cache_enabled() && cache_request(request, head, head_len, body_fd,
+	&can_fill) && (key_len = cache_key(request, head, head_len, key)) != -1)
+    {
+	cached = cache_lookup(key, key_len, can_fill, upstream->opts->timeout,
+	    &object);
+	LOG_DEBUG("proxy cache %s: %s", cache_statuses[cached], key);
+    }
+
+    if (cached == CACHE_HIT || cached == CACHE_STALE)
+    {
+	rv = respond_stored(proxy, cache_statuses[cached], object.age, &object);
+	cache_release(&object);
+
+	if (rv || object.fill == -1)
+	    goto Exit;
+
+	proxy->background = 1;
+	rv = -1;
+    }
+
+    if (object.fill != -1)
+	proxy->object = &object;
+
+    if (!(upstream_head = request_head(head, head_len, client_address,
+	body_fd, body_len, &upstream_head_len)))
+    {
+	goto Exit;
+    }
+
+    while ((server = upstream_pick(upstream, tried)))
+    {
+	tried |= 1 << (server - upstream->servers);
+	proxy->sent = 0;
+
+	if ((proxy->fd = upstream_connect(upstream, server, &reused)) == -1)
+	{
+	    upstream_fail(upstream, server);
+	    continue;
+	}
+
+	/* The pool only shrinks, so a fresh connection ends this */
+	while ((relayed = relay(proxy, upstream_head, upstream_head_len,
+	    body_fd, body_len, reused)) == RELAY_STALE)
+	{
+	    LOG_DEBUG("upstream %s: idle connection was closed",
+		server->address);
+	    upstream_release(upstream, server, proxy->fd, 0);
+
+	    if ((proxy->fd = upstream_connect(upstream, server, &reused)) == -1)
+		break;
+	}
+
+	if (proxy->fd != -1)
+	    upstream_release(upstream, server, proxy->fd, proxy->keep);
+
+	if (relayed != RELAY_FAILED && relayed != RELAY_STALE)
+	{
+	    upstream_ok(server);
+	    break;
+	}
+
+	upstream_fail(upstream, server);
+
+	if (proxy->sent && !idempotent(request->method))
+	    break;
+    }
+
+    if (relayed == RELAY_BROKEN)
+	goto Exit;
+
+    if (relayed != RELAY_DONE)
+    {
+	log_message(LOG_LEVEL_WARNING, "upstream %s: no server answered",
+	    upstream->name);
+
+	if (!proxy->background)
+	{
+	    response->http_code = proxy->timed_out ?
+		HTTP_CODE_GATEWAY_TIMEOUT : HTTP_CODE_BAD_GATEWAY;
+	}
+    }
+
+    rv = 0;
+
+Exit:
+    cache_abandon(&object, proxy->pass);
+    free(upstream_head);
+    free(proxy->body);
+    free(proxy);
+    return rv;
+}
@@ -0,0 +1,11 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include "http.h"
+#include "upstream.h"
+
+int proxy_request(http_ctx_t *http_ctx, void *net_ctx, char *client_address,
+    upstream_t *upstream, http_request_t *request, http_response_t *response,
+    char *head, int head_len, int body_fd, int body_len);
+
+#endif
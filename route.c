@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "route.h"
+#include "logger.h"
+
+#define HOSTS_MIN_SIZE 16
+
+/*
+ * Hosts live in an open addressed hash, every host owns a radix tree of
+ * path prefixes. Both are built once while loading config, lookups only
+ * walk them and never allocate.
+ */
+struct route_node {
+    char *label;
+    int label_len;
+    route_t *route;
+    route_node_t *child;
+    route_node_t *sibling;
+};
+
+static unsigned int host_hash(char *host, int len)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < len; ++i)
+    {
+	hash ^= (unsigned char)tolower(host[i]);
+	hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static int host_equal(route_host_t *entry, char *host, int len)
+{
+    if (entry->name_len != len)
+	return 0;
+
+    for (int i = 0; i < len; ++i)
+    {
+	if (entry->name[i] != tolower(host[i]))
+	    return 0;
+    }
+
+    return 1;
+}
+
+static route_node_t* node_new(char *label, int label_len)
+{
+    route_node_t *node;
+
+    if (!(node = calloc(1, sizeof(*node))))
+	return NULL;
+
+    if (label_len && !(node->label = strndup(label, label_len)))
+    {
+	free(node);
+	return NULL;
+    }
+
+    node->label_len = label_len;
+
+    return node;
+}
+
+static void node_free(route_node_t *node)
+{
+    route_node_t *next;
+
+    while (node)
+    {
+	next = node->sibling;
+
+	node_free(node->child);
+
+	if (node->route)
+	{
+	    if (node->route->root_fd != -1)
+		close(node->route->root_fd);
+	    free(node->route->root);
+	    free(node->route);
+	}
+
+	free(node->label);
+	free(node);
+
+	node = next;
+    }
+}
+
+static route_node_t* node_insert(route_node_t *node, char *key, int key_len)
+{
+    route_node_t *child, *tail;
+    int common;
+
+    while (key_len)
+    {
+	for (child = node->child; child; child = child->sibling)
+	{
+	    if (child->label[0] == key[0])
+		break;
+	}
+
+	if (!child)
+	{
+	    if (!(child = node_new(key, key_len)))
+		return NULL;
+
+	    child->sibling = node->child;
+	    node->child = child;
+
+	    return child;
+	}
+
+	for (common = 0; common < child->label_len && common < key_len &&
+	    child->label[common] == key[common]; ++common);
+
+	/* Split the edge in place, the tail takes over route and children */
+	if (common < child->label_len)
+	{
+	    if (!(tail = node_new(child->label + common,
+		child->label_len - common)))
+	    {
+		return NULL;
+	    }
+
+	    tail->route = child->route;
+	    tail->child = child->child;
+
+	    child->route = NULL;
+	    child->child = tail;
+	    child->label_len = common;
+	}
+
+	node = child;
+	key += common;
+	key_len -= common;
+    }
+
+    return node;
+}
+
+static route_t* node_lookup(route_node_t *node, char *path, int path_len)
+{
+    route_t *route = node->route;
+    route_node_t *child;
+
+    while (path_len)
+    {
+	for (child = node->child; child && child->label[0] != *path;
+	    child = child->sibling);
+
+	if (!child || child->label_len > path_len ||
+	    memcmp(child->label, path, child->label_len))
+	{
+	    break;
+	}
+
+	path += child->label_len;
+	path_len -= child->label_len;
+	node = child;
+
+	if (node->route)
+	    route = node->route;
+    }
+
+    return route;
+}
+
+static route_host_t* host_find(route_table_t *table, char *host, int len,
+    unsigned int hash)
+{
+    route_host_t *entry;
+    int mask = table->hosts_size - 1;
+
+    for (int i = hash & mask;; i = (i + 1) & mask)
+    {
+	entry = &table->hosts[i];
+
+	if (!entry->name || (entry->hash == hash && host_equal(entry, host,
+	    len)))
+	{
+	    return entry;
+	}
+    }
+}
+
+static int hosts_grow(route_table_t *table)
+{
+    route_host_t *old_hosts = table->hosts, *entry;
+    int old_size = table->hosts_size;
+
+    table->hosts_size = old_size ? old_size * 2 : HOSTS_MIN_SIZE;
+
+    if (!(table->hosts = calloc(table->hosts_size, sizeof(route_host_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "route hosts allocation");
+	table->hosts = old_hosts;
+	table->hosts_size = old_size;
+	return -1;
+    }
+
+    for (int i = 0; i < old_size; ++i)
+    {
+	if (!old_hosts[i].name)
+	    continue;
+
+	entry = host_find(table, old_hosts[i].name, old_hosts[i].name_len,
+	    old_hosts[i].hash);
+	*entry = old_hosts[i];
+    }
+
+    free(old_hosts);
+
+    return 0;
+}
+
+static route_node_t* host_tree(route_table_t *table, char *host, int len)
+{
+    route_host_t *entry;
+    unsigned int hash;
+
+    if (len == strlen(ROUTE_HOST_ANY) && !strncmp(host, ROUTE_HOST_ANY, len))
+	return table->any_host;
+
+    /* Keep the load factor under 1/2 so probing stays short */
+    if ((table->hosts_num + 1) * 2 > table->hosts_size && hosts_grow(table))
+	return NULL;
+
+    hash = host_hash(host, len);
+    entry = host_find(table, host, len, hash);
+
+    if (entry->name)
+	return entry->tree;
+
+    if (!(entry->tree = node_new(NULL, 0)))
+	return NULL;
+
+    if (!(entry->name = strndup(host, len)))
+    {
+	free(entry->tree);
+	entry->tree = NULL;
+	return NULL;
+    }
+
+    for (int i = 0; i < len; ++i)
+	entry->name[i] = tolower(entry->name[i]);
+
+    entry->name_len = len;
+    entry->hash = hash;
+    table->hosts_num++;
+
+    return entry->tree;
+}
+
+/* Proxy routes look their upstream up in upstreams */
+route_table_t* route_table_init(upstream_table_t *upstreams)
+{
+    route_table_t *table;
+
+    if (!(table = calloc(1, sizeof(route_table_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "route table allocation");
+	return NULL;
+    }
+
+    if (!(table->any_host = node_new(NULL, 0)) || hosts_grow(table))
+    {
+	log_message(LOG_LEVEL_ERROR, "route table initialization");
+	route_table_deinit(table);
+	return NULL;
+    }
+
+    table->upstreams = upstreams;
+
+    return table;
+}
+
+void route_table_deinit(route_table_t *table)
+{
+    if (!table)
+	return;
+
+    for (int i = 0; i < table->hosts_size; ++i)
+    {
+	free(table->hosts[i].name);
+	node_free(table->hosts[i].tree);
+    }
+
+    free(table->hosts);
+    node_free(table->any_host);
+    free(table);
+}
+
+/* Adding the same host and prefix again replaces the route */
+int route_add(route_table_t *table, char *host, int host_len, char *prefix,
+    int prefix_len, route_type_t type, char *root, int root_len)
+{
+    route_node_t *tree, *node;
+    upstream_t *upstream = NULL;
+    char *root_copy;
+    int root_fd = -1;
+
+    if (!prefix_len || prefix[0] != '/')
+    {
+	log_message(LOG_LEVEL_ERROR, "route prefix must start with '/'");
+	return -1;
+    }
+
+    if (!(tree = host_tree(table, host, host_len)) ||
+	!(node = node_insert(tree, prefix, prefix_len)))
+    {
+	log_message(LOG_LEVEL_ERROR, "route insertion");
+	return -1;
+    }
+
+    if (!(root_copy = strndup(root, root_len)))
+    {
+	log_message(LOG_LEVEL_ERROR, "route root allocation");
+	return -1;
+    }
+
+    if (type == ROUTE_TYPE_PROXY)
+    {
+	if (!(upstream = upstream_find(table->upstreams, root, root_len)))
+	{
+	    free(root_copy);
+	    return -1;
+	}
+    }
+    /* Files are looked up beneath this fd, root is never walked again */
+    else if ((root_fd = open(root_copy, O_PATH | O_DIRECTORY |
+	O_CLOEXEC)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "route root %s: not a directory",
+	    root_copy);
+	free(root_copy);
+	return -1;
+    }
+
+    if (!node->route && !(node->route = calloc(1, sizeof(route_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "route allocation");
+	if (root_fd != -1)
+	    close(root_fd);
+	free(root_copy);
+	return -1;
+    }
+
+    if (node->route->root)
+    {
+	if (node->route->root_fd != -1)
+	    close(node->route->root_fd);
+	free(node->route->root);
+    }
+
+    node->route->type = type;
+    node->route->root = root_copy;
+    node->route->root_fd = root_fd;
+    node->route->upstream = upstream;
+
+    if (type == ROUTE_TYPE_PROXY)
+	table->proxies++;
+
+    return 0;
+}
+
+/* "<host|*></prefix>=<target>", "</prefix>=<target>" in a vhost section */
+static int route_add_typed_str(route_table_t *table, char *vhost, char *value,
+    int len, route_type_t type)
+{
+    char *prefix, *root, *name = type == ROUTE_TYPE_PROXY ? "proxy" : "route",
+	*target = type == ROUTE_TYPE_PROXY ? "upstream" : "root";
+
+    if (!(prefix = memchr(value, '/', len)) || (prefix == value) == !vhost ||
+	!(root = memchr(prefix, '=', len - (prefix - value))) ||
+	root == value + len - 1)
+    {
+	log_message(LOG_LEVEL_ERROR, vhost ? "%s format: </prefix>=<%s>" :
+	    "%s format: <host></prefix>=<%s>", name, target);
+	return -1;
+    }
+
+    root++;
+
+    return route_add(table, vhost ?: value, vhost ? strlen(vhost) :
+	prefix - value, prefix, root - prefix - 1, type, root,
+	len - (root - value));
+}
+
+int route_add_str(void *table, char *vhost, char *value, int len)
+{
+    return route_add_typed_str(table, vhost, value, len, ROUTE_TYPE_ROOT);
+}
+
+/* Requests under the prefix go to the named upstream */
+int route_add_proxy_str(void *table, char *vhost, char *value, int len)
+{
+    return route_add_typed_str(table, vhost, value, len, ROUTE_TYPE_PROXY);
+}
+
+/* "root" of a vhost section, what its explicit routes don't cover */
+int route_add_root_str(void *table, char *vhost, char *value, int len)
+{
+    return route_add(table, vhost, strlen(vhost), "/", 1, ROUTE_TYPE_ROOT,
+	value, len);
+}
+
+/* Unknown hosts fall back to "*", known ones only match their own routes */
+route_t* route_lookup(route_table_t *table, char *host, int host_len,
+    char *path, int path_len)
+{
+    route_host_t *entry = NULL;
+
+    if (host && host_len)
+    {
+	entry = host_find(table, host, host_len, host_hash(host, host_len));
+
+	if (entry->name)
+	    return node_lookup(entry->tree, path, path_len);
+    }
+
+    return node_lookup(table->any_host, path, path_len);
+}
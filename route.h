@@ -0,0 +1,49 @@
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+#include "upstream.h"
+
+#define ROUTE_HOST_ANY "*"
+
+typedef enum {
+    ROUTE_TYPE_ROOT = 0,
+    ROUTE_TYPE_PROXY = 1
+} route_type_t;
+
+/* Proxy routes keep the upstream's name in root and have no root_fd */
+typedef struct {
+    route_type_t type;
+    char *root;
+    int root_fd;
+    upstream_t *upstream;
+} route_t;
+
+typedef struct route_node route_node_t;
+
+typedef struct {
+    char *name;
+    int name_len;
+    unsigned int hash;
+    route_node_t *tree;
+} route_host_t;
+
+typedef struct {
+    route_host_t *hosts;
+    int hosts_size;
+    int hosts_num;
+    route_node_t *any_host;
+    upstream_table_t *upstreams;
+    int proxies;
+} route_table_t;
+
+route_table_t* route_table_init(upstream_table_t *upstreams);
+void route_table_deinit(route_table_t *table);
+int route_add(route_table_t *table, char *host, int host_len, char *prefix,
+    int prefix_len, route_type_t type, char *root, int root_len);
+int route_add_str(void *table, char *vhost, char *value, int len);
+int route_add_root_str(void *table, char *vhost, char *value, int len);
+int route_add_proxy_str(void *table, char *vhost, char *value, int len);
+route_t* route_lookup(route_table_t *table, char *host, int host_len,
+    char *path, int path_len);
+
+#endif
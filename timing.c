@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define HAVE_TSC
+#endif
+#include "timing.h"
+#include "logger.h"
+
+#define BUCKETS 32
+#define FLUSH_REQUESTS 256
+#define CALIBRATE_NS 10000000
+
+/* Bucket b counts durations below 2^b microseconds, 0 is under 1us */
+typedef struct {
+    unsigned long counts[TIMING_PHASES][BUCKETS];
+    unsigned long long max_us[TIMING_PHASES];
+} timing_hist_t;
+
+static char *phase_names[] = {
+    [TIMING_RECV] = "recv",
+    [TIMING_BODY] = "body",
+    [TIMING_PARSE] = "parse",
+    [TIMING_RESPONSE] = "response",
+    [TIMING_SEND] = "send",
+    [TIMING_LOG] = "log",
+    [TIMING_TOTAL] = "total"
+};
+
+/* Workers fill local, merge it into shared, the parent reports deltas */
+static timing_hist_t *shared;
+static timing_hist_t local;
+static int local_requests;
+static timing_hist_t reported;
+static time_t reported_at;
+static timing_opts_t timing_opts;
+static double ns_per_tick = 1;
+static int use_tsc;
+
+static unsigned long long clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long ticks()
+{
+#ifdef HAVE_TSC
+    if (use_tsc)
+	return __rdtsc();
+#endif
+
+    return clock_ns();
+}
+
+/* Only an invariant TSC ticks at one rate on every core, in every state */
+static void calibrate()
+{
+#ifdef HAVE_TSC
+    struct timespec pause = { 0, CALIBRATE_NS };
+    unsigned int eax, ebx, ecx, edx;
+    unsigned long long tsc, ns;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+	!(edx & (1 << 8)))
+    {
+	log_message(LOG_LEVEL_DEBUG, "timing: no invariant TSC, using clock");
+	return;
+    }
+
+    tsc = __rdtsc();
+    ns = clock_ns();
+    nanosleep(&pause, NULL);
+    ns_per_tick = (double)(clock_ns() - ns) / (__rdtsc() - tsc);
+    use_tsc = 1;
+#endif
+}
+
+static unsigned long long ticks2us(unsigned long long ticks)
+{
+    return ticks * ns_per_tick / 1000;
+}
+
+static int bucket(unsigned long long us)
+{
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+/* Histograms are mapped before the first fork, reloads only retune */
+int timing_init(timing_opts_t *opts)
+{
+    timing_opts = *opts;
+
+    if (shared)
+	return 0;
+
+    calibrate();
+
+    if ((shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	shared = NULL;
+	log_message(LOG_LEVEL_ERROR, "timing histogram mmap");
+	return -1;
+    }
+
+    reported_at = time(NULL);
+
+    return 0;
+}
+
+void timing_start(timing_t *timing)
+{
+    memset(timing->phases, 0, sizeof(timing->phases));
+    timing->last = ticks();
+}
+
+void timing_mark(timing_t *timing, timing_phase_t phase)
+{
+    unsigned long long now = ticks();
+
+    timing->phases[phase] += now - timing->last;
+    timing->last = now;
+
+    TIMING_PROBE(phase, phase, timing->phases[phase]);
+}
+
+void timing_end(timing_t *timing, char *client_address, char *method,
+    char *uri)
+{
+    unsigned long long us[TIMING_PHASES];
+
+    timing->phases[TIMING_TOTAL] = 0;
+
+    for (int phase = TIMING_PARSE; phase < TIMING_TOTAL; ++phase)
+	timing->phases[TIMING_TOTAL] += timing->phases[phase];
+
+    for (int phase = 0; phase < TIMING_PHASES; ++phase)
+    {
+	us[phase] = ticks2us(timing->phases[phase]);
+
+	/* Not a phase this request went through (HTTP/2 has no recv) */
+	if (!timing->phases[phase])
+	    continue;
+
+	local.counts[phase][bucket(us[phase])]++;
+
+	if (us[phase] > local.max_us[phase])
+	    local.max_us[phase] = us[phase];
+    }
+
+    TIMING_PROBE(request, us[TIMING_TOTAL], us[TIMING_RECV]);
+
+    if (timing_opts.slow_ms && us[TIMING_TOTAL] >=
+	timing_opts.slow_ms * 1000ULL)
+    {
+	log_message(LOG_LEVEL_WARNING, "slow request %s %s %s: recv %lluus "
+	    "body %lluus parse %lluus response %lluus send %lluus log %lluus "
+	    "total %lluus", client_address, method, uri ?: "-",
+	    us[TIMING_RECV], us[TIMING_BODY], us[TIMING_PARSE],
+	    us[TIMING_RESPONSE],
+	    us[TIMING_SEND], us[TIMING_LOG], us[TIMING_TOTAL]);
+    }
+
+    if (++local_requests >= FLUSH_REQUESTS)
+	timing_flush();
+}
+
+void timing_flush()
+{
+    unsigned long long max;
+
+    if (!shared || !local_requests)
+	return;
+
+    for (int phase = 0; phase < TIMING_PHASES; ++phase)
+    {
+	for (int b = 0; b < BUCKETS; ++b)
+	{
+	    if (local.counts[phase][b])
+	    {
+		__atomic_fetch_add(&shared->counts[phase][b],
+		    local.counts[phase][b], __ATOMIC_RELAXED);
+	    }
+	}
+
+	max = __atomic_load_n(&shared->max_us[phase], __ATOMIC_RELAXED);
+
+	while (local.max_us[phase] > max &&
+	    !__atomic_compare_exchange_n(&shared->max_us[phase], &max,
+	    local.max_us[phase], 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    memset(&local, 0, sizeof(local));
+    local_requests = 0;
+}
+
+static unsigned long long percentile(unsigned long counts[], unsigned long n,
+    int percent)
+{
+    unsigned long sum = 0, rank = (n * percent + 99) / 100;
+    int b;
+
+    for (b = 0; b < BUCKETS - 1; ++b)
+    {
+	if ((sum += counts[b]) >= rank)
+	    break;
+    }
+
+    return 1ULL << b;
+}
+
+/* Parent only, one line per phase for the requests since last time */
+void timing_report()
+{
+    unsigned long counts[BUCKETS], total, n;
+    unsigned long long max;
+    time_t now = time(NULL);
+
+    if (!shared || !timing_opts.report_interval ||
+	now - reported_at < timing_opts.report_interval)
+    {
+	return;
+    }
+
+    reported_at = now;
+
+    for (int phase = 0; phase < TIMING_PHASES; ++phase)
+    {
+	n = 0;
+
+	for (int b = 0; b < BUCKETS; ++b)
+	{
+	    total = __atomic_load_n(&shared->counts[phase][b],
+		__ATOMIC_RELAXED);
+	    counts[b] = total - reported.counts[phase][b];
+	    reported.counts[phase][b] = total;
+	    n += counts[b];
+	}
+
+	max = __atomic_exchange_n(&shared->max_us[phase], 0,
+	    __ATOMIC_RELAXED);
+
+	if (!n)
+	    continue;
+
+	log_message(LOG_LEVEL_DEBUG, "timing %s n:%lu p50:<%lluus "
+	    "p99:<%lluus max:%lluus", phase_names[phase], n,
+	    percentile(counts, n, 50), percentile(counts, n, 99), max);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+/* Static tracepoints for bpftrace/perf when systemtap's header is around */
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TIMING_PROBE(name, a, b) DTRACE_PROBE2(http_server, name, a, b)
+#else
+#define TIMING_PROBE(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
+
+/* RECV and BODY include waiting for the client and aren't part of TOTAL */
+typedef enum {
+    TIMING_RECV = 0,
+    TIMING_BODY,
+    TIMING_PARSE,
+    TIMING_RESPONSE,
+    TIMING_SEND,
+    TIMING_LOG,
+    TIMING_TOTAL,
+    TIMING_PHASES
+} timing_phase_t;
+
+typedef struct {
+    int slow_ms;
+    int report_interval;
+} timing_opts_t;
+
+typedef struct {
+    unsigned long long last;
+    unsigned long long phases[TIMING_PHASES];
+} timing_t;
+
+int timing_init(timing_opts_t *opts);
+void timing_start(timing_t *timing);
+void timing_mark(timing_t *timing, timing_phase_t phase);
+void timing_end(timing_t *timing, char *client_address, char *method,
+    char *uri);
+void timing_flush();
+void timing_report();
+
+#endif
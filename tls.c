@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "network.h"
+#include "logger.h"
+
+#define TLS_HANDSHAKE_TIMEOUT 10
+#define TLS_RECORD_SIZE 16384
+#define TLS_SESSION_CONTEXT "http-server"
+#define SESSION_CACHE_SLOTS 4096
+#define SESSION_DER_MAX 1024
+
+/* Wire format, length prefixed */
+#define ALPN_HTTP11 "\x08http/1.1"
+#define ALPN_H2_HTTP11 "\x02h2" ALPN_HTTP11
+
+struct tls_ctx {
+    SSL_CTX *ssl_ctx;
+    int http2;
+};
+
+struct tls_conn {
+    SSL *ssl;
+    int fd;
+    int ktls_send;
+};
+
+/*
+ * Workers are forked per connection, so OpenSSL's internal cache would
+ * die with them. Sessions live in a direct mapped table in shared memory
+ * instead, created once before the first fork. A newer session evicts
+ * whatever hashed to its slot.
+ */
+typedef struct {
+    unsigned char lock;
+    unsigned int id_len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    time_t expires;
+    int der_len;
+    unsigned char der[SESSION_DER_MAX];
+} session_slot_t;
+
+static session_slot_t *session_cache;
+
+static void log_ssl_error(char *what)
+{
+    unsigned long err = ERR_get_error();
+
+    log_message(LOG_LEVEL_ERROR, "%s: %s", what,
+	err ? ERR_error_string(err, NULL) : "unknown error");
+    ERR_clear_error();
+}
+
+static int session_cache_init()
+{
+    if (session_cache)
+	return 0;
+
+    if ((session_cache = mmap(NULL, SESSION_CACHE_SLOTS *
+	sizeof(session_slot_t), PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	session_cache = NULL;
+	log_message(LOG_LEVEL_ERROR, "tls session cache mmap");
+	return -1;
+    }
+
+    return 0;
+}
+
+static session_slot_t* session_slot_lock(const unsigned char *id,
+    unsigned int id_len)
+{
+    unsigned int hash = 2166136261u;
+    session_slot_t *slot;
+
+    for (int i = 0; i < id_len; ++i)
+    {
+	hash ^= id[i];
+	hash *= 16777619u;
+    }
+
+    slot = &session_cache[hash % SESSION_CACHE_SLOTS];
+
+    /* Held for a memcpy at most */
+    while (__atomic_test_and_set(&slot->lock, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    return slot;
+}
+
+static void session_slot_unlock(session_slot_t *slot)
+{
+    __atomic_clear(&slot->lock, __ATOMIC_RELEASE);
+}
+
+static int session_matches(session_slot_t *slot, const unsigned char *id,
+    unsigned int id_len)
+{
+    return slot->id_len == id_len && !memcmp(slot->id, id, id_len);
+}
+
+static int session_new(SSL *ssl, SSL_SESSION *session)
+{
+    const unsigned char *id;
+    unsigned char *der;
+    unsigned int id_len;
+    int der_len;
+    session_slot_t *slot;
+
+    id = SSL_SESSION_get_id(session, &id_len);
+
+    if (!id_len || (der_len = i2d_SSL_SESSION(session, NULL)) <= 0 ||
+	der_len > SESSION_DER_MAX)
+    {
+	return 0;
+    }
+
+    slot = session_slot_lock(id, id_len);
+
+    der = slot->der;
+    slot->der_len = i2d_SSL_SESSION(session, &der);
+    slot->id_len = id_len;
+    memcpy(slot->id, id, id_len);
+    slot->expires = SSL_SESSION_get_time(session) +
+	SSL_SESSION_get_timeout(session);
+
+    session_slot_unlock(slot);
+
+    /* No reference kept, OpenSSL may free it */
+    return 0;
+}
+
+static SSL_SESSION* session_get(SSL *ssl, const unsigned char *id,
+    int id_len, int *copy)
+{
+    SSL_SESSION *session = NULL;
+    const unsigned char *der;
+    session_slot_t *slot;
+
+    *copy = 0;
+
+    slot = session_slot_lock(id, id_len);
+
+    if (session_matches(slot, id, id_len) && slot->expires > time(NULL))
+    {
+	der = slot->der;
+	session = d2i_SSL_SESSION(NULL, &der, slot->der_len);
+    }
+
+    session_slot_unlock(slot);
+
+    return session;
+}
+
+static void session_remove(SSL_CTX *ssl_ctx, SSL_SESSION *session)
+{
+    const unsigned char *id;
+    unsigned int id_len;
+    session_slot_t *slot;
+
+    id = SSL_SESSION_get_id(session, &id_len);
+    slot = session_slot_lock(id, id_len);
+
+    if (session_matches(slot, id, id_len))
+	slot->id_len = 0;
+
+    session_slot_unlock(slot);
+}
+
+static int select_alpn(SSL *ssl, const unsigned char **out,
+    unsigned char *out_len, const unsigned char *in, unsigned int in_len,
+    void *arg)
+{
+    tls_ctx_t *tls_ctx = arg;
+    char *protos = tls_ctx->http2 ? ALPN_H2_HTTP11 : ALPN_HTTP11;
+
+    /* Our preference order wins */
+    if (SSL_select_next_proto((unsigned char **)out, out_len,
+	(unsigned char *)protos, strlen(protos), in, in_len) !=
+	OPENSSL_NPN_NEGOTIATED)
+    {
+	return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+tls_ctx_t* tls_init(tls_opts_t *opts)
+{
+    tls_ctx_t *tls_ctx;
+    uint64_t options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION |
+	SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+    if (!(tls_ctx = calloc(1, sizeof(tls_ctx_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "tls_ctx memory allocation");
+	return NULL;
+    }
+
+    tls_ctx->http2 = opts->http2;
+
+    if (session_cache_init())
+	goto Error;
+
+    if (!(tls_ctx->ssl_ctx = SSL_CTX_new(TLS_server_method())))
+    {
+	log_ssl_error("SSL_CTX_new");
+	goto Error;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx->ssl_ctx, opts->cert) != 1)
+    {
+	log_ssl_error(opts->cert);
+	goto Error;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(tls_ctx->ssl_ctx, opts->key,
+	SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls_ctx->ssl_ctx)
+	!= 1)
+    {
+	log_ssl_error(opts->key);
+	goto Error;
+    }
+
+    /* Without tickets TLS 1.3 resumes by id through the shared cache */
+    if (!opts->tickets)
+	options |= SSL_OP_NO_TICKET;
+
+    /* Effective only if both OpenSSL and the kernel support it */
+    if (opts->ktls)
+	options |= SSL_OP_ENABLE_KTLS;
+
+    SSL_CTX_set_options(tls_ctx->ssl_ctx, options);
+    SSL_CTX_set_min_proto_version(tls_ctx->ssl_ctx, TLS1_2_VERSION);
+
+    SSL_CTX_set_session_id_context(tls_ctx->ssl_ctx,
+	(unsigned char *)TLS_SESSION_CONTEXT, strlen(TLS_SESSION_CONTEXT));
+    SSL_CTX_set_session_cache_mode(tls_ctx->ssl_ctx, SSL_SESS_CACHE_SERVER |
+	SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(tls_ctx->ssl_ctx, opts->session_timeout);
+    SSL_CTX_sess_set_new_cb(tls_ctx->ssl_ctx, session_new);
+    SSL_CTX_sess_set_get_cb(tls_ctx->ssl_ctx, session_get);
+    SSL_CTX_sess_set_remove_cb(tls_ctx->ssl_ctx, session_remove);
+
+    SSL_CTX_set_alpn_select_cb(tls_ctx->ssl_ctx, select_alpn, tls_ctx);
+
+    return tls_ctx;
+
+Error:
+    tls_deinit(tls_ctx);
+    return NULL;
+}
+
+void tls_deinit(tls_ctx_t *tls_ctx)
+{
+    if (!tls_ctx)
+	return;
+
+    SSL_CTX_free(tls_ctx->ssl_ctx);
+    free(tls_ctx);
+}
+
+tls_conn_t* tls_accept(tls_ctx_t *tls_ctx, int sock_fd)
+{
+    tls_conn_t *tls_conn;
+
+    if (!(tls_conn = calloc(1, sizeof(tls_conn_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "tls_conn memory allocation");
+	return NULL;
+    }
+
+    tls_conn->fd = sock_fd;
+
+    if (!(tls_conn->ssl = SSL_new(tls_ctx->ssl_ctx)) ||
+	!SSL_set_fd(tls_conn->ssl, sock_fd))
+    {
+	log_ssl_error("SSL_new");
+	goto Error;
+    }
+
+    if (set_recv_timeout(&tls_conn->fd, TLS_HANDSHAKE_TIMEOUT))
+	log_message(LOG_LEVEL_WARNING, "tls handshake timeout not set");
+
+    if (SSL_accept(tls_conn->ssl) != 1)
+    {
+	LOG_DEBUG("tls handshake failed");
+	ERR_clear_error();
+	goto Error;
+    }
+
+    /* OpenSSL switched to kTLS during the handshake if it could */
+    tls_conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls_conn->ssl));
+
+    LOG_DEBUG("%s session %s%s",
+	SSL_get_version(tls_conn->ssl),
+	SSL_session_reused(tls_conn->ssl) ? "resumed" : "established",
+	tls_conn->ktls_send ? ", kTLS send" : "");
+
+    return tls_conn;
+
+Error:
+    SSL_free(tls_conn->ssl);
+    free(tls_conn);
+    return NULL;
+}
+
+void tls_close(tls_conn_t *tls_conn)
+{
+    if (!tls_conn)
+	return;
+
+    SSL_shutdown(tls_conn->ssl);
+    SSL_free(tls_conn->ssl);
+    free(tls_conn);
+}
+
+int tls_recv(void *tls_conn, char *buffer, int buffer_len)
+{
+    tls_conn_t *conn = tls_conn;
+    int len;
+
+    while ((len = SSL_read(conn->ssl, buffer, buffer_len)) <= 0)
+    {
+	switch (SSL_get_error(conn->ssl, len))
+	{
+	    case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	    case SSL_ERROR_WANT_READ:
+	    case SSL_ERROR_WANT_WRITE:
+		/* errno tells a signal from an expired SO_RCVTIMEO */
+		if (errno == EINTR)
+		    continue;
+
+		return -1;
+	    default:
+		log_ssl_error("SSL_read");
+		return -1;
+	}
+    }
+
+    return len;
+}
+
+int tls_set_recv_timeout(void *tls_conn, int timeout)
+{
+    return set_recv_timeout(&((tls_conn_t *)tls_conn)->fd, timeout);
+}
+
+int tls_send(void *tls_conn, char *buffer, int buffer_len)
+{
+    tls_conn_t *conn = tls_conn;
+    size_t written;
+    int sent = 0;
+
+    while (sent < buffer_len)
+    {
+	if (!SSL_write_ex(conn->ssl, buffer + sent, buffer_len - sent,
+	    &written))
+	{
+	    /* Retried with the same arguments, as OpenSSL requires */
+	    if (SSL_get_error(conn->ssl, 0) == SSL_ERROR_WANT_WRITE &&
+		errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    log_ssl_error("SSL_write");
+	    return -1;
+	}
+
+	sent += written;
+    }
+
+    return sent;
+}
+
+/* Decrypted bytes may already wait inside OpenSSL, poll can't see them */
+int tls_poll(void *tls_conn, int timeout)
+{
+    tls_conn_t *conn = tls_conn;
+
+    if (SSL_has_pending(conn->ssl))
+	return 1;
+
+    return poll_request(&conn->fd, timeout);
+}
+
+/* Without kTLS the file is read into records of its own */
+static int sendfile_copy(tls_conn_t *conn, char *prefix, int prefix_len,
+    int fd, off_t offset, int count)
+{
+    char buffer[TLS_RECORD_SIZE];
+    int used = 0, sent = 0, want, len;
+
+    if (prefix_len > sizeof(buffer))
+    {
+	if (tls_send(conn, prefix, prefix_len) == -1)
+	    return -1;
+
+	prefix_len = 0;
+    }
+
+    memcpy(buffer, prefix, prefix_len);
+    used = prefix_len;
+
+    while (sent < count || used)
+    {
+	want = count - sent < sizeof(buffer) - used ? count - sent :
+	    sizeof(buffer) - used;
+
+	if ((len = pread(fd, buffer + used, want, offset + sent)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "tls pread");
+	    return -1;
+	}
+
+	if (want && !len)
+	{
+	    log_message(LOG_LEVEL_ERROR, "tls sendfile: file shrank");
+	    return -1;
+	}
+
+	sent += len;
+	used += len;
+
+	if (tls_send(conn, buffer, used) == -1)
+	    return -1;
+
+	used = 0;
+    }
+
+    return sent;
+}
+
+/* Records are decrypted here, so bodies can't be spliced */
+int tls_recvfile(void *tls_conn, int fd, int count)
+{
+    char buffer[TLS_RECORD_SIZE];
+    int len, written = 0, rv;
+
+    if ((len = tls_recv(tls_conn, buffer, count < sizeof(buffer) ? count :
+	sizeof(buffer))) <= 0)
+    {
+	return len;
+    }
+
+    while (written < len)
+    {
+	if ((rv = write(fd, buffer + written, len - written)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "tls recvfile write");
+	    return -1;
+	}
+
+	written += rv;
+    }
+
+    return len;
+}
+
+/* Proxied bodies have to be encrypted, so they pass through a buffer */
+int tls_splice(void *tls_conn, int fd, int count)
+{
+    char buffer[TLS_RECORD_SIZE];
+    int len;
+
+    while ((len = recv(fd, buffer, count < sizeof(buffer) ? count :
+	sizeof(buffer), 0)) == -1 && errno == EINTR);
+
+    if (len > 0 && tls_send(tls_conn, buffer, len) == -1)
+	return -1;
+
+    return len;
+}
+
+/* Gathered into full records, not one record per buffer */
+int tls_writev(void *tls_conn, struct iovec *iov, int iovcnt)
+{
+    char record[TLS_RECORD_SIZE];
+    int len = 0, sent = 0, n;
+
+    for (int i = 0; i < iovcnt; ++i)
+    {
+	for (int off = 0; off < iov[i].iov_len; off += n)
+	{
+	    n = iov[i].iov_len - off < sizeof(record) - len ?
+		iov[i].iov_len - off : sizeof(record) - len;
+	    memcpy(record + len, (char *)iov[i].iov_base + off, n);
+
+	    if ((len += n) == sizeof(record))
+	    {
+		if (tls_send(tls_conn, record, len) == -1)
+		    return -1;
+
+		sent += len;
+		len = 0;
+	    }
+	}
+    }
+
+    if (len && tls_send(tls_conn, record, len) == -1)
+	return -1;
+
+    return sent + len;
+}
+
+int tls_sendfile(void *tls_conn, char *prefix, int prefix_len, int fd,
+    off_t offset, int count)
+{
+    tls_conn_t *conn = tls_conn;
+    ossl_ssize_t len;
+    int sent = 0;
+
+    if (!conn->ktls_send)
+	return sendfile_copy(conn, prefix, prefix_len, fd, offset, count);
+
+    if (prefix_len && tls_send(conn, prefix, prefix_len) == -1)
+	return -1;
+
+    /* Kernel encrypts, pages never enter userspace */
+    while (sent < count)
+    {
+	if ((len = SSL_sendfile(conn->ssl, fd, offset + sent, count - sent,
+	    0)) <= 0)
+	{
+	    if (len == -1 && errno == EINTR)
+		continue;
+
+	    log_ssl_error("SSL_sendfile");
+	    return -1;
+	}
+
+	sent += len;
+    }
+
+    return sent;
+}
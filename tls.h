@@ -0,0 +1,35 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct {
+    char *cert;
+    char *key;
+    int tickets;
+    int session_timeout;
+    int ktls;
+    int http2;
+} tls_opts_t;
+
+typedef struct tls_ctx tls_ctx_t;
+typedef struct tls_conn tls_conn_t;
+
+tls_ctx_t* tls_init(tls_opts_t *opts);
+void tls_deinit(tls_ctx_t *tls_ctx);
+tls_conn_t* tls_accept(tls_ctx_t *tls_ctx, int sock_fd);
+void tls_close(tls_conn_t *tls_conn);
+
+/* Same contracts as the plain socket callbacks in network.h */
+int tls_recv(void *tls_conn, char *buffer, int buffer_len);
+int tls_set_recv_timeout(void *tls_conn, int timeout);
+int tls_send(void *tls_conn, char *buffer, int buffer_len);
+int tls_poll(void *tls_conn, int timeout);
+int tls_sendfile(void *tls_conn, char *prefix, int prefix_len, int fd,
+    off_t offset, int count);
+int tls_recvfile(void *tls_conn, int fd, int count);
+int tls_splice(void *tls_conn, int fd, int count);
+int tls_writev(void *tls_conn, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,118 @@
+#!/bin/sh
+# Checks TLS against a throwaway certificate: the handshake, resumption
+# through the cache shared by the workers (tickets and session ids) and
+# files sent over kTLS or the userspace fallback. Run by "make tls-test".
+
+SERVER=$(cd "$(dirname "$0")" && pwd)/server
+PAGES=$(cd "$(dirname "$0")" && pwd)/pages
+PORT=${TLS_TEST_PORT:-8443}
+DIR=$(mktemp -d)
+PID=
+FAILED=0
+
+cleanup()
+{
+    [ -n "$PID" ] && kill -INT "$PID" 2>/dev/null && wait "$PID"
+    rm -rf "$DIR"
+}
+
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+start()
+{
+    cat > "$DIR/config" <<EOF
+"port":"$PORT"
+"address":"127.0.0.1"
+"root":"./pages"
+"w3c_log_path":"./w3c.log"
+"tls_cert":"./cert.pem"
+"tls_key":"./key.pem"
+"log_level":"debug"
+$1
+EOF
+    (cd "$DIR" && exec "$SERVER" > server.log 2>&1) &
+    PID=$!
+
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+	openssl s_client -connect 127.0.0.1:$PORT < /dev/null > /dev/null \
+	    2>&1 && return 0
+	sleep 0.2
+    done
+
+    fail "server didn't start"; cat "$DIR/server.log"
+    return 1
+}
+
+stop()
+{
+    kill -INT "$PID" && wait "$PID"
+    PID=
+}
+
+# A request read to the end, so TLS 1.3 tickets have arrived
+handshake()
+{
+    printf 'GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n' |
+	openssl s_client -connect 127.0.0.1:$PORT -servername localhost \
+	-CAfile "$DIR/cert.pem" -verify_return_error -ign_eof "$@" 2>&1
+}
+
+resumption()
+{
+    handshake -sess_out "$DIR/session" > "$DIR/first" || {
+	fail "$1: handshake"; cat "$DIR/first"; return; }
+
+    grep -q "^New, TLS" "$DIR/first" || fail "$1: first session not new"
+    grep -q "HTTP/1.1 200 OK" "$DIR/first" || fail "$1: no response"
+
+    handshake -sess_in "$DIR/session" > "$DIR/second" || {
+	fail "$1: resumed handshake"; return; }
+
+    grep -q "^Reused, TLS" "$DIR/second" || fail "$1: session not reused"
+}
+
+sendfile_check()
+{
+    curl -s --cacert "$DIR/cert.pem" --resolve localhost:$PORT:127.0.0.1 \
+	-o "$DIR/got" "https://localhost:$PORT/big.bin" ||
+	{ fail "$1: fetching big.bin"; return; }
+
+    cmp -s "$DIR/got" "$DIR/pages/big.bin" || fail "$1: big.bin corrupted"
+}
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -keyout "$DIR/key.pem" -out "$DIR/cert.pem" -days 1 -subj /CN=localhost \
+    -addext subjectAltName=DNS:localhost > /dev/null 2>&1 ||
+    { echo "FAIL: generating a certificate"; exit 1; }
+
+cp -r "$PAGES" "$DIR/pages"
+head -c 3000000 /dev/urandom > "$DIR/pages/big.bin"
+
+start '"tls_tickets":"on"' && {
+    resumption tickets
+    sendfile_check ktls
+    grep -q "kTLS send" "$DIR/server.log" && echo "kTLS send in use" ||
+	echo "kTLS unavailable, the fallback served the file"
+    stop
+}
+
+# Each connection is a new worker, only the shared cache knows the id
+start '"tls_tickets":"off"' && {
+    resumption "session ids"
+    stop
+}
+
+start '"ktls":"off"' && {
+    sendfile_check fallback
+    grep -q "kTLS send" "$DIR/server.log" && fail "kTLS used while off"
+    stop
+}
+
+[ $FAILED = 0 ] && echo "tls tests passed"
+exit $FAILED
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "upstream.h"
+#include "logger.h"
+
+#define UNIX_PREFIX "unix:"
+
+static char *balance_names[] = {
+    [UPSTREAM_BALANCE_ROUND_ROBIN] = "round_robin",
+    [UPSTREAM_BALANCE_LEAST_CONN] = "least_conn"
+};
+
+upstream_table_t* upstream_table_init()
+{
+    upstream_table_t *table;
+
+    if (!(table = calloc(1, sizeof(upstream_table_t))))
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream table allocation");
+	return NULL;
+    }
+
+    table->opts.max_fails = UPSTREAM_MAX_FAILS;
+    table->opts.fail_timeout = UPSTREAM_FAIL_TIMEOUT;
+    table->opts.timeout = UPSTREAM_TIMEOUT;
+    table->opts.keepalive = UPSTREAM_KEEPALIVE;
+
+    return table;
+}
+
+void upstream_table_deinit(upstream_table_t *table)
+{
+    upstream_server_t *server;
+
+    if (!table)
+	return;
+
+    for (int i = 0; i < table->upstreams_num; ++i)
+    {
+	for (int j = 0; j < table->upstreams[i].servers_num; ++j)
+	{
+	    server = &table->upstreams[i].servers[j];
+
+	    while (server->idle_num)
+		close(server->idle_fds[--server->idle_num]);
+
+	    free(server->address);
+	}
+    }
+
+    if (table->shared)
+	munmap(table->shared, table->shared_size);
+
+    free(table);
+}
+
+int upstream_balance_parse(char *str, upstream_balance_t *balance)
+{
+    for (int i = 0; i < sizeof(balance_names) / sizeof(balance_names[0]); ++i)
+    {
+	if (!strcmp(str, balance_names[i]))
+	{
+	    *balance = i;
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+/* Proxy routes may name an upstream before it's defined */
+upstream_t* upstream_find(upstream_table_t *table, char *name, int len)
+{
+    upstream_t *upstream;
+
+    for (int i = 0; i < table->upstreams_num; ++i)
+    {
+	upstream = &table->upstreams[i];
+
+	if (strlen(upstream->name) == len && !strncmp(upstream->name, name, len))
+	    return upstream;
+    }
+
+    if (table->upstreams_num == UPSTREAMS_MAX || len >= UPSTREAM_NAME_MAX)
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream %.*s: over %d upstreams or "
+	    "name too long", len, name, UPSTREAMS_MAX);
+	return NULL;
+    }
+
+    upstream = &table->upstreams[table->upstreams_num++];
+    memcpy(upstream->name, name, len);
+    upstream->opts = &table->opts;
+
+    return upstream;
+}
+
+/* "unix:<path>", "<host>:<port>" or "[<ipv6>]:<port>", resolved once here */
+static int parse_address(char *address, upstream_server_t *server)
+{
+    struct sockaddr_un *sun = (struct sockaddr_un *)&server->sa;
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM,
+	.ai_flags = AI_NUMERICSERV }, *res;
+    char host[NI_MAXHOST], *port, *path;
+    int host_len;
+
+    if (!strncmp(address, UNIX_PREFIX, strlen(UNIX_PREFIX)))
+    {
+	path = address + strlen(UNIX_PREFIX);
+
+	if (!*path || strlen(path) >= sizeof(sun->sun_path))
+	    return -1;
+
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	server->sa_len = sizeof(*sun);
+
+	return 0;
+    }
+
+    if (!(port = strrchr(address, ':')) || !port[1])
+	return -1;
+
+    host_len = port++ - address;
+
+    if (*address == '[' && host_len > 2 && address[host_len - 1] == ']')
+    {
+	address++;
+	host_len -= 2;
+    }
+
+    if (!host_len || host_len >= sizeof(host))
+	return -1;
+
+    memcpy(host, address, host_len);
+    host[host_len] = '\0';
+
+    if (getaddrinfo(host, port, &hints, &res))
+	return -1;
+
+    memcpy(&server->sa, res->ai_addr, res->ai_addrlen);
+    server->sa_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/* Format: <name>=<address>[,<address>...] */
+int upstream_add_str(void *ctx, char *vhost, char *value, int len)
+{
+    upstream_table_t *table = ctx;
+    upstream_t *upstream;
+    upstream_server_t *server;
+    char *copy, *address, *next, *delim;
+    int rv = -1;
+
+    if (!(copy = strndup(value, len)))
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream allocation");
+	return -1;
+    }
+
+    if (!(delim = strchr(copy, '=')) || delim == copy || !delim[1])
+    {
+	log_message(LOG_LEVEL_ERROR,
+	    "upstream format: <name>=<address>[,<address>...]");
+	goto Exit;
+    }
+
+    *delim = '\0';
+
+    if (!(upstream = upstream_find(table, copy, delim - copy)))
+	goto Exit;
+
+    if (upstream->servers_num)
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream %s defined twice", copy);
+	goto Exit;
+    }
+
+    for (address = strtok_r(delim + 1, ",", &next); address;
+	address = strtok_r(NULL, ",", &next))
+    {
+	while (*address == ' ')
+	    address++;
+
+	if (upstream->servers_num == UPSTREAM_SERVERS_MAX)
+	{
+	    log_message(LOG_LEVEL_ERROR, "upstream %s: over %d servers", copy,
+		UPSTREAM_SERVERS_MAX);
+	    goto Exit;
+	}
+
+	server = &upstream->servers[upstream->servers_num];
+
+	if (parse_address(address, server))
+	{
+	    log_message(LOG_LEVEL_ERROR, "upstream %s: bad address %s", copy,
+		address);
+	    goto Exit;
+	}
+
+	if (!(server->address = strdup(address)))
+	{
+	    log_message(LOG_LEVEL_ERROR, "upstream allocation");
+	    goto Exit;
+	}
+
+	upstream->servers_num++;
+    }
+
+    rv = 0;
+
+Exit:
+    free(copy);
+    return rv;
+}
+
+/* Counters go to shared memory once every upstream is known */
+int upstream_table_start(upstream_table_t *table)
+{
+    upstream_state_t *states;
+    unsigned int *next;
+    int servers_num = 0, errors = 0;
+
+    for (int i = 0; i < table->upstreams_num; ++i)
+    {
+	if (!table->upstreams[i].servers_num)
+	{
+	    log_message(LOG_LEVEL_ERROR, "upstream %s has no servers",
+		table->upstreams[i].name);
+	    errors++;
+	}
+
+	servers_num += table->upstreams[i].servers_num;
+    }
+
+    if (errors || !table->upstreams_num)
+	return errors ? -1 : 0;
+
+    table->shared_size = servers_num * sizeof(upstream_state_t) +
+	table->upstreams_num * sizeof(unsigned int);
+
+    if ((table->shared = mmap(NULL, table->shared_size, PROT_READ |
+	PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+	table->shared = NULL;
+	log_message(LOG_LEVEL_ERROR, "upstream state mmap");
+	return -1;
+    }
+
+    states = table->shared;
+    next = (unsigned int *)(states + servers_num);
+
+    for (int i = 0; i < table->upstreams_num; ++i)
+    {
+	table->upstreams[i].next = next++;
+
+	for (int j = 0; j < table->upstreams[i].servers_num; ++j)
+	    table->upstreams[i].servers[j].state = states++;
+    }
+
+    return 0;
+}
+
+/* Servers in tried (bit per index) or marked down are passed over */
+upstream_server_t* upstream_pick(upstream_t *upstream, unsigned int tried)
+{
+    upstream_server_t *server, *best = NULL;
+    time_t now = time(NULL);
+    unsigned int start;
+    int i;
+
+    start = __atomic_fetch_add(upstream->next, 1, __ATOMIC_RELAXED);
+
+    for (int n = 0; n < upstream->servers_num; ++n)
+    {
+	i = (start + n) % upstream->servers_num;
+	server = &upstream->servers[i];
+
+	if (tried & 1 << i || __atomic_load_n(&server->state->down_until,
+	    __ATOMIC_RELAXED) > now)
+	{
+	    continue;
+	}
+
+	if (upstream->opts->balance == UPSTREAM_BALANCE_ROUND_ROBIN)
+	    return server;
+
+	if (!best || __atomic_load_n(&server->state->active,
+	    __ATOMIC_RELAXED) < __atomic_load_n(&best->state->active,
+	    __ATOMIC_RELAXED))
+	{
+	    best = server;
+	}
+    }
+
+    return best;
+}
+
+static int connect_timeout(int fd, struct sockaddr *sa, socklen_t sa_len,
+    int timeout)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    socklen_t len = sizeof(int);
+    int error, rv;
+
+    if (!connect(fd, sa, sa_len))
+	return 0;
+
+    if (errno != EINPROGRESS)
+	return -1;
+
+    while ((rv = poll(&pfd, 1, timeout * 1000)) == -1 && errno == EINTR);
+
+    if (rv <= 0)
+    {
+	errno = rv ? errno : ETIMEDOUT;
+	return -1;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+	return -1;
+
+    errno = error;
+
+    return error ? -1 : 0;
+}
+
+/* Newest idle connection first, reused tells the caller it may be stale */
+int upstream_connect(upstream_t *upstream, upstream_server_t *server,
+    int *reused)
+{
+    struct timeval tv = { .tv_sec = upstream->opts->timeout };
+    int fd, one = 1;
+    char c;
+
+    while (server->idle_num)
+    {
+	fd = server->idle_fds[--server->idle_num];
+
+	/* Anything readable on an idle connection is EOF or garbage */
+	if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+	    *reused = 1;
+	    goto Connected;
+	}
+
+	close(fd);
+    }
+
+    *reused = 0;
+
+    if ((fd = socket(server->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+	SOCK_CLOEXEC, 0)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream socket");
+	return -1;
+    }
+
+    if (connect_timeout(fd, (struct sockaddr *)&server->sa, server->sa_len,
+	upstream->opts->timeout))
+    {
+	log_message(LOG_LEVEL_WARNING, "upstream %s: connecting to %s: %s",
+	    upstream->name, server->address, strerror(errno));
+	close(fd);
+	return -1;
+    }
+
+    if (fcntl(fd, F_SETFL, 0) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	(server->sa.ss_family != AF_UNIX && setsockopt(fd, IPPROTO_TCP,
+	TCP_NODELAY, &one, sizeof(one)) == -1))
+    {
+	log_message(LOG_LEVEL_ERROR, "upstream socket options");
+	close(fd);
+	return -1;
+    }
+
+Connected:
+    __atomic_add_fetch(&server->state->active, 1, __ATOMIC_RELAXED);
+
+    return fd;
+}
+
+void upstream_release(upstream_t *upstream, upstream_server_t *server,
+    int fd, int keep)
+{
+    __atomic_sub_fetch(&server->state->active, 1, __ATOMIC_RELAXED);
+
+    if (keep && server->idle_num < upstream->opts->keepalive)
+	server->idle_fds[server->idle_num++] = fd;
+    else
+	close(fd);
+}
+
+/* Passive health check, max_fails in a row takes a server out for a while */
+void upstream_fail(upstream_t *upstream, upstream_server_t *server)
+{
+    upstream_opts_t *opts = upstream->opts;
+
+    if (!opts->max_fails || __atomic_add_fetch(&server->state->fails, 1,
+	__ATOMIC_RELAXED) < opts->max_fails)
+    {
+	return;
+    }
+
+    __atomic_store_n(&server->state->fails, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&server->state->down_until, time(NULL) +
+	opts->fail_timeout, __ATOMIC_RELAXED);
+
+    log_message(LOG_LEVEL_WARNING, "upstream %s: %s down for %ds",
+	upstream->name, server->address, opts->fail_timeout);
+}
+
+void upstream_ok(upstream_server_t *server)
+{
+    if (__atomic_load_n(&server->state->fails, __ATOMIC_RELAXED))
+	__atomic_store_n(&server->state->fails, 0, __ATOMIC_RELAXED);
+}
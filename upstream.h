@@ -0,0 +1,76 @@
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include <time.h>
+#include <sys/socket.h>
+
+#define UPSTREAMS_MAX 16
+#define UPSTREAM_SERVERS_MAX 16
+#define UPSTREAM_NAME_MAX 64
+#define UPSTREAM_KEEPALIVE_MAX 32
+#define UPSTREAM_KEEPALIVE 8
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_FAIL_TIMEOUT 10
+#define UPSTREAM_TIMEOUT 60
+
+typedef enum {
+    UPSTREAM_BALANCE_ROUND_ROBIN = 0,
+    UPSTREAM_BALANCE_LEAST_CONN = 1
+} upstream_balance_t;
+
+typedef struct {
+    upstream_balance_t balance;
+    int max_fails;
+    int fail_timeout;
+    int timeout;
+    int keepalive;
+} upstream_opts_t;
+
+/* Shared by every worker, mapped before the first fork */
+typedef struct {
+    int active;
+    int fails;
+    time_t down_until;
+} upstream_state_t;
+
+/* Idle connections are the worker's own, they are never shared */
+typedef struct {
+    char *address;
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    upstream_state_t *state;
+    int idle_fds[UPSTREAM_KEEPALIVE_MAX];
+    int idle_num;
+} upstream_server_t;
+
+typedef struct {
+    char name[UPSTREAM_NAME_MAX];
+    upstream_server_t servers[UPSTREAM_SERVERS_MAX];
+    int servers_num;
+    unsigned int *next;
+    upstream_opts_t *opts;
+} upstream_t;
+
+typedef struct {
+    upstream_t upstreams[UPSTREAMS_MAX];
+    int upstreams_num;
+    upstream_opts_t opts;
+    void *shared;
+    size_t shared_size;
+} upstream_table_t;
+
+upstream_table_t* upstream_table_init();
+void upstream_table_deinit(upstream_table_t *table);
+int upstream_balance_parse(char *str, upstream_balance_t *balance);
+upstream_t* upstream_find(upstream_table_t *table, char *name, int len);
+int upstream_add_str(void *table, char *vhost, char *value, int len);
+int upstream_table_start(upstream_table_t *table);
+upstream_server_t* upstream_pick(upstream_t *upstream, unsigned int tried);
+int upstream_connect(upstream_t *upstream, upstream_server_t *server,
+    int *reused);
+void upstream_release(upstream_t *upstream, upstream_server_t *server,
+    int fd, int keep);
+void upstream_fail(upstream_t *upstream, upstream_server_t *server);
+void upstream_ok(upstream_server_t *server);
+
+#endif
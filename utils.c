@@ -1,8 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include "utils.h"
+#include "logger.h"
+
+/* openat2() state: unknown yet, usable, or missing / filtered out */
+#define OPENAT2_UNKNOWN 0
+#define OPENAT2_OK 1
+#define OPENAT2_NONE -1
+
+static int openat2_state;
 
 static void reverse(char s[])
 {
@@ -56,3 +72,112 @@ void itoa(int n, char s[])
 
     reverse(s);
 }
+
+/*
+ * Without openat2() the walk is done here, one component at a time: ".."
+ * is refused and no symlink is followed, even one staying beneath.
+ */
+static int open_components(int dir_fd, char *path, int flags)
+{
+    char buffer[PATH_MAX], *name, *next, *save;
+    int fd = dir_fd, next_fd, error;
+    struct stat statbuf;
+
+    if (snprintf(buffer, sizeof(buffer), "%s", path) >= sizeof(buffer))
+    {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+
+    if (!(name = strtok_r(buffer, "/", &save)))
+	name = ".";
+
+    for (; name; name = next)
+    {
+	next = strtok_r(NULL, "/", &save);
+
+	if (!strcmp(name, ".."))
+	{
+	    next_fd = -1;
+	    error = EXDEV;
+	}
+	else
+	{
+	    next_fd = openat(fd, name, (next ? O_PATH | O_DIRECTORY : flags) |
+		O_NOFOLLOW | O_CLOEXEC);
+	    error = errno;
+	}
+
+	if (fd != dir_fd)
+	    close(fd);
+
+	if ((fd = next_fd) == -1)
+	{
+	    errno = error;
+	    return -1;
+	}
+    }
+
+    /* O_PATH | O_NOFOLLOW opens a last component symlink as itself */
+    if (flags & O_PATH && (fstat(fd, &statbuf) ||
+	S_ISLNK(statbuf.st_mode)))
+    {
+	close(fd);
+	errno = ELOOP;
+	return -1;
+    }
+
+    return fd;
+}
+
+/* ENOSYS from old kernels, EPERM from seccomp filters */
+static int openat2_usable()
+{
+    struct open_how how = { .flags = O_PATH | O_CLOEXEC };
+    int fd;
+
+    if (openat2_state != OPENAT2_UNKNOWN)
+	return openat2_state == OPENAT2_OK;
+
+    if ((fd = syscall(SYS_openat2, AT_FDCWD, "/", &how, sizeof(how))) != -1)
+    {
+	close(fd);
+	openat2_state = OPENAT2_OK;
+	return 1;
+    }
+
+    log_message(LOG_LEVEL_WARNING, "openat2() unavailable (%s), files are "
+	"opened one path component at a time and symlinks aren't followed",
+	strerror(errno));
+    openat2_state = OPENAT2_NONE;
+
+    return 0;
+}
+
+void open_beneath_init()
+{
+    openat2_usable();
+}
+
+/*
+ * Opens path relative to dir_fd, refusing anything that resolves outside of
+ * it ("..", absolute symlinks, magic links).
+ */
+int open_beneath(int dir_fd, char *path, int flags)
+{
+    struct open_how how = {
+	.flags = flags | O_CLOEXEC,
+	.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+    };
+
+    while (*path == '/')
+	path++;
+
+    if (!*path)
+	path = ".";
+
+    if (!openat2_usable())
+	return open_components(dir_fd, path, flags);
+
+    return syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+}
@@ -3,5 +3,7 @@
 
 int snprintf_with_alloc(char **buffer, char *format, ...);
 void itoa(int n, char s[]);
+void open_beneath_init();
+int open_beneath(int dir_fd, char *path, int flags);
 
 #endif
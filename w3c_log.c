@@ -1,127 +1,837 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
-#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "w3c_log.h"
 #include "logger.h"
 
-#define MAX_FIELD_STR 128
-#define MAX_TIME_STR 96
-#define MAX_MESSAGE_STR 1024
-#define MAX_ENTRY_STR 128
+#define BUF_SIZE 16384
+#define LINE_SIZE 65536
+#define FLUSH_INTERVAL_MS 1000
+#define STRINGS_MAX 64
+#define MAX_TIME_STR 32
+#define MAX_NUM_STR 32
+#define MAX_HEADER_STR 512
+#define ROTATE_TRIES_MAX 100
+
+/* magic, payload length, base time in ms, fields count, then field ids */
+#define BLOCK_MAGIC "W3B1"
+#define BLOCK_HEADER_LEN 17
+#define BLOCK_PAYLOAD_MAX (1 << 24)
 
 #define DIR_VER "#Version: 1.0"
 #define DIR_DATE "#Date:"
 #define DIR_FIELDS "#Fields:"
 
-static char* field_identifier2str(w3c_log_field_t field)
+static char *field_names[] = {
+    [W3C_LOG_FIELD_CS_METHOD] = "cs-method",
+    [W3C_LOG_FIELD_CS_URI] = "cs-uri",
+    [W3C_LOG_FIELD_C_IP] = "c-ip",
+    [W3C_LOG_FIELD_SC_STATUS] = "sc-status",
+    [W3C_LOG_FIELD_DATE] = "date",
+    [W3C_LOG_FIELD_TIME] = "time",
+    [W3C_LOG_FIELD_TIME_TAKEN] = "time-taken",
+    [W3C_LOG_FIELD_CS_URI_STEM] = "cs-uri-stem",
+    [W3C_LOG_FIELD_CS_URI_QUERY] = "cs-uri-query",
+    [W3C_LOG_FIELD_CS_VERSION] = "cs-version",
+    [W3C_LOG_FIELD_CS_HOST] = "cs-host",
+    [W3C_LOG_FIELD_SC_BYTES] = "sc-bytes",
+    [W3C_LOG_FIELD_CS_USER_AGENT] = "cs(User-Agent)",
+    [W3C_LOG_FIELD_CS_REFERER] = "cs(Referer)"
+};
+
+typedef enum {
+    KIND_STRING,
+    KIND_QUOTED,
+    KIND_NUMBER,
+    KIND_TIME
+} field_kind_t;
+
+static field_kind_t field_kind(w3c_log_field_t field)
 {
-    switch(field)
+    switch (field)
     {
-	case W3C_LOG_FIELD_CS_METHOD:
-	    return "cs-method";
-	case W3C_LOG_FIELD_CS_URI:
-	    return "cs-uri";
-	case W3C_LOG_FIELD_C_IP:
-	    return "c-ip";
+	case W3C_LOG_FIELD_DATE:
+	case W3C_LOG_FIELD_TIME:
+	    return KIND_TIME;
 	case W3C_LOG_FIELD_SC_STATUS:
-	    return "sc-status";
+	case W3C_LOG_FIELD_SC_BYTES:
+	case W3C_LOG_FIELD_TIME_TAKEN:
+	    return KIND_NUMBER;
+	case W3C_LOG_FIELD_CS_USER_AGENT:
+	case W3C_LOG_FIELD_CS_REFERER:
+	    return KIND_QUOTED;
 	default:
 	    break;
     }
 
-    return "";
+    return KIND_STRING;
 }
 
 typedef struct {
-    FILE *fp;
+    char *str;
+    int len;
+    unsigned long long num;
+} value_t;
+
+/*
+ * Entries are batched per process and written whole with one append, so
+ * workers sharing the file never interleave. Binary blocks also dedup
+ * their strings: a keep-alive client sends the same ones every time.
+ */
+typedef struct {
+    int fd;
+    char path[PATH_MAX];
+    w3c_log_opts_t opts;
+    time_t opened;
+    int header_len;
+    char buf[BUF_SIZE];
+    int len;
+    long long first_ms;
+    long long base_ms;
+    value_t strings[STRINGS_MAX];
+    int strings_num;
 } w3c_logger_t;
 
-static w3c_logger_t logger;
+static w3c_logger_t logger = { .fd = -1 };
 
-static char* get_time_str(int date)
+static long long now_ms()
 {
-    static char time_str[MAX_TIME_STR];
-    char *format = date ? "%d-%m-%Y %H:%M:%S" : "%H:%M:%S";
-    struct tm *current_time;
-    time_t timer;
-
-    time(&timer);
-    current_time = localtime(&timer);
+    struct timespec ts;
 
-    strftime(time_str, MAX_TIME_STR, format, current_time);
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
 
-    return time_str;
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-#define W3C_FILE_HEADER_FMT "%s\n%s %s\n%s %s\n"
-int w3c_log_init(char *logpath, w3c_log_field_t fields[], int fields_num)
+/* W3C times are UTC, formatted once per second */
+static char* time_str(long long ms, int date)
 {
-    char fields_str[MAX_FIELD_STR] = {};
+    static time_t cached = -1;
+    static char date_str[MAX_TIME_STR], clock_str[MAX_TIME_STR];
+    time_t sec = ms / 1000;
+    struct tm tm;
 
-    if (!(logger.fp = fopen(logpath, "w")))
+    if (sec != cached)
     {
-	log_message(LOG_LEVEL_ERROR, "server_log_start fopen");
+	gmtime_r(&sec, &tm);
+	strftime(date_str, MAX_TIME_STR, "%Y-%m-%d", &tm);
+	strftime(clock_str, MAX_TIME_STR, "%H:%M:%S", &tm);
+	cached = sec;
+    }
+
+    return date ? date_str : clock_str;
+}
+
+static int put(char *out, int size, int *pos, char *str, int len)
+{
+    if (len > size - *pos)
+	return -1;
+
+    memcpy(out + *pos, str, len);
+    *pos += len;
+
+    return 0;
+}
+
+/* Unquoted fields can't hold spaces, quoted ones double their quotes */
+static int put_escaped(char *out, int size, int *pos, value_t *value,
+    int quoted)
+{
+    static char hex[] = "0123456789ABCDEF";
+    char escaped[3] = { '%' };
+    unsigned char c;
+
+    if (!value->str || (!quoted && !value->len))
+	return put(out, size, pos, "-", 1);
+
+    if (quoted && put(out, size, pos, "\"", 1))
 	return -1;
+
+    for (int i = 0; i < value->len; ++i)
+    {
+	c = value->str[i];
+
+	if (c < 0x20 || c == 0x7f || (!quoted && c == ' '))
+	{
+	    escaped[1] = hex[c >> 4];
+	    escaped[2] = hex[c & 0xf];
+
+	    if (put(out, size, pos, escaped, sizeof(escaped)))
+		return -1;
+	}
+	else if (put(out, size, pos, (char*)&c, 1) ||
+	    (quoted && c == '"' && put(out, size, pos, "\"", 1)))
+	{
+	    return -1;
+	}
     }
 
-    strcat(fields_str, "time ");
+    return quoted ? put(out, size, pos, "\"", 1) : 0;
+}
+
+static int format_line(char *out, int size, w3c_log_field_t fields[],
+    int fields_num, long long ms, value_t values[])
+{
+    char num[MAX_NUM_STR];
+    value_t *value;
+    int pos = 0, len;
 
     for (int i = 0; i < fields_num; ++i)
     {
-	strcat(fields_str, field_identifier2str(fields[i]));
-	strcat(fields_str, i == fields_num - 1 ? "" : " ");
+	value = &values[fields[i]];
+
+	if (i && put(out, size, &pos, " ", 1))
+	    return -1;
+
+	switch (field_kind(fields[i]))
+	{
+	    case KIND_TIME:
+		len = snprintf(num, MAX_NUM_STR, "%s",
+		    time_str(ms, fields[i] == W3C_LOG_FIELD_DATE));
+		break;
+	    case KIND_NUMBER:
+		/* Seconds, to the millisecond */
+		if (fields[i] == W3C_LOG_FIELD_TIME_TAKEN)
+		{
+		    len = snprintf(num, MAX_NUM_STR, "%llu.%03llu",
+			value->num / 1000000, value->num / 1000 % 1000);
+		}
+		else
+		    len = snprintf(num, MAX_NUM_STR, "%llu", value->num);
+		break;
+	    default:
+		if (put_escaped(out, size, &pos, value,
+		    field_kind(fields[i]) == KIND_QUOTED))
+		{
+		    return -1;
+		}
+		continue;
+	}
+
+	if (put(out, size, &pos, num, len))
+	    return -1;
     }
 
-    if (fprintf(logger.fp, W3C_FILE_HEADER_FMT, DIR_VER, DIR_DATE,
-	get_time_str(1), DIR_FIELDS, fields_str) < 0)
+    if (put(out, size, &pos, "\n", 1))
+	return -1;
+
+    return pos;
+}
+
+static int format_header(char *out, int size, w3c_log_field_t fields[],
+    int fields_num, long long ms)
+{
+    int len;
+
+    len = snprintf(out, size, "%s\n%s %s %s\n%s", DIR_VER, DIR_DATE,
+	time_str(ms, 1), time_str(ms, 0), DIR_FIELDS);
+
+    for (int i = 0; i < fields_num && len < size; ++i)
+	len += snprintf(out + len, size - len, " %s", field_names[fields[i]]);
+
+    if (len < size)
+	len += snprintf(out + len, size - len, "\n");
+
+    return len < size ? len : -1;
+}
+
+int w3c_log_parse_fields(char *fields_str, w3c_log_opts_t *opts)
+{
+    char *name, *saveptr = NULL;
+    int field;
+
+    opts->fields_num = 0;
+
+    for (name = strtok_r(fields_str, " ", &saveptr); name;
+	name = strtok_r(NULL, " ", &saveptr))
     {
-	log_message(LOG_LEVEL_ERROR, "server_log writing");
-	goto Error;
+	for (field = 0; field < W3C_LOG_FIELD_UNKNOWN; ++field)
+	{
+	    if (!strcasecmp(name, field_names[field]))
+		break;
+	}
+
+	if (field == W3C_LOG_FIELD_UNKNOWN)
+	{
+	    log_message(LOG_LEVEL_ERROR, "w3c_log: unknown field %s", name);
+	    return -1;
+	}
+
+	if (opts->fields_num == W3C_LOG_FIELDS_MAX)
+	{
+	    log_message(LOG_LEVEL_ERROR, "w3c_log: too many fields");
+	    return -1;
+	}
+
+	opts->fields[opts->fields_num++] = field;
     }
 
+    return opts->fields_num ? 0 : -1;
+}
+
+static void set_value(value_t *value, char *str, int len)
+{
+    value->str = str;
+    value->len = !str ? 0 : len == -1 ? strlen(str) : len;
+}
+
+static void entry_values(w3c_log_entry_t *entry, value_t values[])
+{
+    char *query = entry->uri ? strchr(entry->uri, '?') : NULL;
+
+    memset(values, 0, sizeof(value_t) * W3C_LOG_FIELD_UNKNOWN);
+
+    set_value(&values[W3C_LOG_FIELD_CS_METHOD], entry->method, -1);
+    set_value(&values[W3C_LOG_FIELD_CS_URI], entry->uri, -1);
+    set_value(&values[W3C_LOG_FIELD_C_IP], entry->client_ip, -1);
+    set_value(&values[W3C_LOG_FIELD_CS_URI_STEM], entry->uri_stem, -1);
+    set_value(&values[W3C_LOG_FIELD_CS_URI_QUERY], query ? query + 1 : NULL,
+	-1);
+    set_value(&values[W3C_LOG_FIELD_CS_VERSION], entry->version, -1);
+    set_value(&values[W3C_LOG_FIELD_CS_HOST], entry->host, entry->host_len);
+    set_value(&values[W3C_LOG_FIELD_CS_USER_AGENT], entry->user_agent,
+	entry->user_agent_len);
+    set_value(&values[W3C_LOG_FIELD_CS_REFERER], entry->referer,
+	entry->referer_len);
+
+    values[W3C_LOG_FIELD_SC_STATUS].num = entry->status;
+    values[W3C_LOG_FIELD_SC_BYTES].num = entry->bytes_sent;
+    values[W3C_LOG_FIELD_TIME_TAKEN].num = entry->time_taken_us;
+}
+
+static int put_varint(char *out, int size, int *pos, unsigned long long n)
+{
+    do {
+	if (*pos == size)
+	    return -1;
+
+	out[(*pos)++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+	n >>= 7;
+    } while (n);
+
     return 0;
+}
 
-Error:
-    fclose(logger.fp);
-    return -1;
+static int get_varint(unsigned char *in, int len, int *pos,
+    unsigned long long *n)
+{
+    int shift = 0;
+
+    *n = 0;
+
+    do {
+	if (*pos == len || shift > 63)
+	    return -1;
+
+	*n |= (unsigned long long)(in[*pos] & 0x7f) << shift;
+	shift += 7;
+    } while (in[(*pos)++] & 0x80);
+
+    return 0;
+}
+
+/*
+ * 0 is "-", odd is a literal of k >> 1 bytes which follow, even is a
+ * reference to literal (k >> 1) - 1 of the same block.
+ */
+static int put_string(char *out, int size, int *pos, value_t *value)
+{
+    value_t *string;
+
+    if (!value->str)
+	return put_varint(out, size, pos, 0);
+
+    for (int i = 0; i < logger.strings_num; ++i)
+    {
+	string = &logger.strings[i];
+
+	if (string->len == value->len &&
+	    !memcmp(string->str, value->str, value->len))
+	{
+	    return put_varint(out, size, pos, (i + 1ULL) << 1);
+	}
+    }
+
+    if (put_varint(out, size, pos, (unsigned long long)value->len << 1 | 1) ||
+	put(out, size, pos, value->str, value->len))
+    {
+	return -1;
+    }
+
+    if (logger.strings_num < STRINGS_MAX)
+    {
+	string = &logger.strings[logger.strings_num++];
+	string->str = out + *pos - value->len;
+	string->len = value->len;
+    }
+
+    return 0;
+}
+
+static int get_string(unsigned char *in, int len, int *pos, value_t *value,
+    value_t strings[], int *strings_num)
+{
+    unsigned long long k;
+
+    if (get_varint(in, len, pos, &k))
+	return -1;
+
+    if (!k)
+	return 0;
+
+    if (!(k & 1))
+    {
+	if ((k >> 1) > *strings_num)
+	    return -1;
+
+	*value = strings[(k >> 1) - 1];
+
+	return 0;
+    }
+
+    if ((k >> 1) > len - *pos)
+	return -1;
+
+    value->str = (char*)in + *pos;
+    value->len = k >> 1;
+    *pos += value->len;
+
+    if (*strings_num < STRINGS_MAX)
+	strings[(*strings_num)++] = *value;
+
+    return 0;
+}
+
+static void put_le(char *out, unsigned long long n, int bytes)
+{
+    for (int i = 0; i < bytes; ++i, n >>= 8)
+	out[i] = n & 0xff;
+}
+
+static unsigned long long get_le(unsigned char *in, int bytes)
+{
+    unsigned long long n = 0;
+
+    for (int i = bytes - 1; i >= 0; --i)
+	n = n << 8 | in[i];
+
+    return n;
+}
+
+/* Date and time come from the block's base plus a per-record delta */
+static int append_binary(long long ms, value_t values[])
+{
+    w3c_log_field_t field;
+    int pos = logger.len;
+
+    if (!pos)
+    {
+	memcpy(logger.buf, BLOCK_MAGIC, strlen(BLOCK_MAGIC));
+	put_le(logger.buf + 8, ms, 8);
+	logger.buf[16] = logger.opts.fields_num;
+
+	for (int i = 0; i < logger.opts.fields_num; ++i)
+	    logger.buf[BLOCK_HEADER_LEN + i] = logger.opts.fields[i];
+
+	pos = BLOCK_HEADER_LEN + logger.opts.fields_num;
+	logger.base_ms = ms;
+    }
+
+    if (put_varint(logger.buf, BUF_SIZE, &pos,
+	ms > logger.base_ms ? ms - logger.base_ms : 0))
+    {
+	return -1;
+    }
+
+    for (int i = 0; i < logger.opts.fields_num; ++i)
+    {
+	field = logger.opts.fields[i];
+
+	switch (field_kind(field))
+	{
+	    case KIND_TIME:
+		break;
+	    case KIND_NUMBER:
+		if (put_varint(logger.buf, BUF_SIZE, &pos, values[field].num))
+		    return -1;
+		break;
+	    default:
+		if (put_string(logger.buf, BUF_SIZE, &pos, &values[field]))
+		    return -1;
+		break;
+	}
+    }
+
+    return pos;
 }
 
-int w3c_log_message(int n, ...)
+/* New end of the buffer, -1 if the entry doesn't fit */
+static int append_entry(long long ms, value_t values[])
 {
-    char message[MAX_MESSAGE_STR] = {}, *entry;
-    va_list args;
+    int strings_num = logger.strings_num, len;
 
-    va_start(args, n);
+    if (!logger.len)
+	logger.first_ms = ms;
 
-    for (int i = 0; i < n; ++i)
+    if (logger.opts.binary)
     {
-	entry = va_arg(args, char*);
+	/* A partly written entry must not leave references behind */
+	if ((len = append_binary(ms, values)) == -1)
+	    logger.strings_num = strings_num;
 
-	if (!strcmp(entry, ""))
-	    strcat(message, "-");
-	else
-	    strcat(message, entry);
+	return len;
+    }
 
-	strcat(message, (i != (n - 1) ? " " : ""));
+    if ((len = format_line(logger.buf + logger.len, BUF_SIZE - logger.len,
+	logger.opts.fields, logger.opts.fields_num, ms, values)) == -1)
+    {
+	return -1;
     }
 
-    va_end(args);
+    return logger.len + len;
+}
+
+int w3c_log_flush()
+{
+    int sent = 0, len, rv = 0;
+
+    if (!logger.len || logger.fd == -1)
+	return 0;
 
-    if (fprintf(logger.fp, "%s %s\n", get_time_str(0), message) < 0)
+    if (logger.opts.binary)
     {
-	log_message(LOG_LEVEL_ERROR, "server_log writing");
+	put_le(logger.buf + strlen(BLOCK_MAGIC), logger.len -
+	    BLOCK_HEADER_LEN - logger.opts.fields_num, 4);
+    }
+
+    /* O_APPEND, a whole batch lands in one piece */
+    while (sent < logger.len)
+    {
+	if ((len = write(logger.fd, logger.buf + sent,
+	    logger.len - sent)) == -1)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    log_message(LOG_LEVEL_ERROR, "server_log writing");
+	    rv = -1;
+	    break;
+	}
+
+	sent += len;
+    }
+
+    logger.len = 0;
+    logger.strings_num = 0;
+
+    return rv;
+}
+
+int w3c_log_write(w3c_log_entry_t *entry)
+{
+    value_t values[W3C_LOG_FIELD_UNKNOWN];
+    long long ms = now_ms();
+    int len;
 
+    if (logger.fd == -1)
 	return -1;
+
+    entry_values(entry, values);
+
+    if ((len = append_entry(ms, values)) == -1)
+    {
+	if (!logger.len || w3c_log_flush() ||
+	    (len = append_entry(ms, values)) == -1)
+	{
+	    log_message(LOG_LEVEL_WARNING, "server_log entry too long");
+	    return -1;
+	}
     }
 
+    logger.len = len;
+
+    if (ms - logger.first_ms >= FLUSH_INTERVAL_MS)
+	return w3c_log_flush();
+
     return 0;
 }
 
+/* Never truncates, history survives restarts */
+static int open_log(char *log_path, w3c_log_opts_t *opts, int with_header)
+{
+    char header[MAX_HEADER_STR];
+    int fd, len = 0;
+
+    if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+	0644)) == -1)
+    {
+	log_message(LOG_LEVEL_ERROR, "server_log open %s", log_path);
+	return -1;
+    }
+
+    if (with_header && !opts->binary &&
+	((len = format_header(header, MAX_HEADER_STR, opts->fields,
+	opts->fields_num, now_ms())) == -1 || write(fd, header, len) != len))
+    {
+	log_message(LOG_LEVEL_ERROR, "server_log header writing");
+	close(fd);
+	return -1;
+    }
+
+    logger.header_len = len;
+
+    return fd;
+}
+
+/* Renamed aside with a UTC stamp, writers keep their descriptors */
+static int rotate_file(char *log_path)
+{
+    char rotated[PATH_MAX], stamp[MAX_TIME_STR];
+    time_t now = time(NULL);
+    struct tm tm;
+    int len;
+
+    gmtime_r(&now, &tm);
+    strftime(stamp, MAX_TIME_STR, "%Y%m%d-%H%M%S", &tm);
+
+    /* Never overwrite an earlier rotation from the same second */
+    for (int i = 0; i < ROTATE_TRIES_MAX; ++i)
+    {
+	len = i ? snprintf(rotated, PATH_MAX, "%s.%s-%d", log_path, stamp, i) :
+	    snprintf(rotated, PATH_MAX, "%s.%s", log_path, stamp);
+
+	if (len >= PATH_MAX)
+	    break;
+
+	if (!access(rotated, F_OK))
+	    continue;
+
+	if (rename(log_path, rotated))
+	    break;
+
+	log_message(LOG_LEVEL_DEBUG, "server_log rotated to %s", rotated);
+
+	return 0;
+    }
+
+    log_message(LOG_LEVEL_ERROR, "server_log rotation");
+
+    return -1;
+}
+
+int w3c_log_init(char *log_path, w3c_log_opts_t *opts)
+{
+    if ((logger.fd = open_log(log_path, opts, 1)) == -1)
+	return -1;
+
+    snprintf(logger.path, PATH_MAX, "%s", log_path);
+    logger.opts = *opts;
+    logger.opened = time(NULL);
+
+    return 0;
+}
+
+/* Same file and fields keep appending, a format change starts afresh */
+int w3c_log_reopen(char *log_path, w3c_log_opts_t *opts)
+{
+    int same_path = !strcmp(log_path, logger.path), same_fields, fd;
+    struct stat statbuf;
+
+    same_fields = opts->binary == logger.opts.binary &&
+	opts->fields_num == logger.opts.fields_num &&
+	!memcmp(opts->fields, logger.opts.fields,
+	opts->fields_num * sizeof(opts->fields[0]));
+
+    w3c_log_flush();
+
+    if (same_path && opts->binary != logger.opts.binary &&
+	!fstat(logger.fd, &statbuf) && statbuf.st_size &&
+	!rotate_file(log_path))
+    {
+	logger.opened = time(NULL);
+    }
+
+    if ((fd = open_log(log_path, opts, !same_path || !same_fields)) == -1)
+	return -1;
+
+    close(logger.fd);
+    logger.fd = fd;
+    logger.opts = *opts;
+
+    if (!same_path)
+    {
+	snprintf(logger.path, PATH_MAX, "%s", log_path);
+	logger.opened = time(NULL);
+    }
+
+    return 0;
+}
+
+/* Parent only. Size is the shared file's, intervals align to UTC */
+void w3c_log_check_rotate()
+{
+    w3c_log_opts_t *opts = &logger.opts;
+    time_t now = time(NULL);
+    struct stat statbuf;
+    int fd;
+
+    if (logger.fd == -1 || (!opts->rotate_size && !opts->rotate_interval) ||
+	fstat(logger.fd, &statbuf) || statbuf.st_size <= logger.header_len)
+    {
+	return;
+    }
+
+    if (!(opts->rotate_size && statbuf.st_size >= opts->rotate_size) &&
+	!(opts->rotate_interval && now / opts->rotate_interval !=
+	logger.opened / opts->rotate_interval))
+    {
+	return;
+    }
+
+    /* Failures wait for the next interval instead of retrying every tick */
+    logger.opened = now;
+
+    if (rotate_file(logger.path) ||
+	(fd = open_log(logger.path, opts, 1)) == -1)
+    {
+	return;
+    }
+
+    close(logger.fd);
+    logger.fd = fd;
+}
+
 void w3c_log_deinit()
 {
-    if (logger.fp)
-	fclose(logger.fp);
+    w3c_log_flush();
+
+    if (logger.fd != -1)
+	close(logger.fd);
+
+    logger.fd = -1;
 }
 
+int w3c_log_convert(FILE *in, FILE *out)
+{
+    unsigned char header[BLOCK_HEADER_LEN + W3C_LOG_FIELDS_MAX],
+	*block = NULL;
+    w3c_log_field_t fields[W3C_LOG_FIELDS_MAX], field;
+    value_t values[W3C_LOG_FIELD_UNKNOWN], strings[STRINGS_MAX];
+    unsigned long long delta;
+    char *line = NULL, text_header[MAX_HEADER_STR];
+    int fields_num = 0, last_fields_num = -1, payload_len, pos, len, n,
+	strings_num, changed, rv = -1;
+    long long base_ms;
+
+    if (!(line = malloc(LINE_SIZE)))
+    {
+	log_message(LOG_LEVEL_ERROR, "w3c_log_convert allocation");
+	return -1;
+    }
+
+    while ((n = fread(header, 1, BLOCK_HEADER_LEN, in)) == BLOCK_HEADER_LEN)
+    {
+	payload_len = get_le(header + strlen(BLOCK_MAGIC), 4);
+	base_ms = get_le(header + 8, 8);
+
+	if (memcmp(header, BLOCK_MAGIC, strlen(BLOCK_MAGIC)) ||
+	    payload_len > BLOCK_PAYLOAD_MAX ||
+	    header[16] > W3C_LOG_FIELDS_MAX ||
+	    fread(header + BLOCK_HEADER_LEN, 1, header[16], in) != header[16])
+	{
+	    goto Corrupt;
+	}
+
+	/* Fields may change between blocks after a reload */
+	changed = header[16] != last_fields_num;
+	fields_num = last_fields_num = header[16];
+
+	for (int i = 0; i < fields_num; ++i)
+	{
+	    if ((field = header[BLOCK_HEADER_LEN + i]) >= W3C_LOG_FIELD_UNKNOWN)
+		goto Corrupt;
+
+	    changed |= fields[i] != field;
+	    fields[i] = field;
+	}
+
+	if (changed && (len = format_header(text_header, MAX_HEADER_STR,
+	    fields, fields_num, base_ms)) != -1)
+	{
+	    fwrite(text_header, 1, len, out);
+	}
+
+	free(block);
+
+	if (!(block = malloc(payload_len + 1)) ||
+	    fread(block, 1, payload_len, in) != payload_len)
+	{
+	    goto Corrupt;
+	}
+
+	for (pos = 0, strings_num = 0; pos < payload_len;)
+	{
+	    memset(values, 0, sizeof(values));
+
+	    if (get_varint(block, payload_len, &pos, &delta))
+		goto Corrupt;
+
+	    for (int i = 0; i < fields_num; ++i)
+	    {
+		field = fields[i];
+
+		switch (field_kind(field))
+		{
+		    case KIND_TIME:
+			break;
+		    case KIND_NUMBER:
+			if (get_varint(block, payload_len, &pos,
+			    &values[field].num))
+			{
+			    goto Corrupt;
+			}
+			break;
+		    default:
+			if (get_string(block, payload_len, &pos,
+			    &values[field], strings, &strings_num))
+			{
+			    goto Corrupt;
+			}
+			break;
+		}
+	    }
+
+	    if ((len = format_line(line, LINE_SIZE, fields, fields_num,
+		base_ms + delta, values)) == -1)
+	    {
+		log_message(LOG_LEVEL_WARNING, "w3c_log_convert: long entry");
+		continue;
+	    }
+
+	    fwrite(line, 1, len, out);
+	}
+    }
+
+    /* A partial header is a log cut mid-block */
+    if (n)
+	goto Corrupt;
+
+    rv = 0;
+    goto Exit;
+
+Corrupt:
+    log_message(LOG_LEVEL_ERROR, "w3c_log_convert: corrupt input");
+
+Exit:
+    free(block);
+    free(line);
+
+    return rv;
+}
@@ -1,15 +1,62 @@
 #ifndef _SERVER_LOG_H_
 #define _SERVER_LOG_H_
 
+#include <stdio.h>
+
+#define W3C_LOG_FIELDS_MAX 16
+
+/* Ids are stored in binary logs, only ever append */
 typedef enum {
     W3C_LOG_FIELD_CS_METHOD = 0,
     W3C_LOG_FIELD_CS_URI = 1,
     W3C_LOG_FIELD_C_IP = 2,
-    W3C_LOG_FIELD_SC_STATUS = 3
+    W3C_LOG_FIELD_SC_STATUS = 3,
+    W3C_LOG_FIELD_DATE = 4,
+    W3C_LOG_FIELD_TIME = 5,
+    W3C_LOG_FIELD_TIME_TAKEN = 6,
+    W3C_LOG_FIELD_CS_URI_STEM = 7,
+    W3C_LOG_FIELD_CS_URI_QUERY = 8,
+    W3C_LOG_FIELD_CS_VERSION = 9,
+    W3C_LOG_FIELD_CS_HOST = 10,
+    W3C_LOG_FIELD_SC_BYTES = 11,
+    W3C_LOG_FIELD_CS_USER_AGENT = 12,
+    W3C_LOG_FIELD_CS_REFERER = 13,
+    W3C_LOG_FIELD_UNKNOWN = 14
 } w3c_log_field_t;
 
-int w3c_log_init(char *log_path, w3c_log_field_t fields[], int fields_num);
+typedef struct {
+    w3c_log_field_t fields[W3C_LOG_FIELDS_MAX];
+    int fields_num;
+    int binary;
+    long rotate_size;
+    int rotate_interval;
+} w3c_log_opts_t;
+
+/* Any string may be NULL, host/user_agent/referer aren't NUL-terminated */
+typedef struct {
+    char *client_ip;
+    char *method;
+    char *uri;
+    char *uri_stem;
+    char *version;
+    char *host;
+    int host_len;
+    char *user_agent;
+    int user_agent_len;
+    char *referer;
+    int referer_len;
+    int status;
+    long long bytes_sent;
+    long long time_taken_us;
+} w3c_log_entry_t;
+
+int w3c_log_parse_fields(char *fields_str, w3c_log_opts_t *opts);
+int w3c_log_init(char *log_path, w3c_log_opts_t *opts);
+int w3c_log_reopen(char *log_path, w3c_log_opts_t *opts);
+void w3c_log_check_rotate();
+int w3c_log_write(w3c_log_entry_t *entry);
+int w3c_log_flush();
 void w3c_log_deinit();
-int w3c_log_message(int n, ...);
+int w3c_log_convert(FILE *in, FILE *out);
 
 #endif
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include "w3c_log.h"
+#include "logger.h"
+
+/* Turns a binary W3C log back into the text format on stdout */
+int main(int argc, char *argv[])
+{
+    FILE *in = stdin;
+    int rv = 1;
+
+    log_init(stderr, LOG_LEVEL_WARNING);
+
+    if (argc > 2)
+    {
+	fprintf(stderr, "usage: %s [binary log]\n", argv[0]);
+	goto Exit;
+    }
+
+    if (argc == 2 && !(in = fopen(argv[1], "re")))
+    {
+	log_message(LOG_LEVEL_ERROR, "opening %s", argv[1]);
+	goto Exit;
+    }
+
+    rv = w3c_log_convert(in, stdout) ? 1 : 0;
+
+    if (in != stdin)
+	fclose(in);
+
+Exit:
+    log_deinit();
+
+    return rv;
+}